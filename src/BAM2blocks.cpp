@@ -25,10 +25,141 @@ SOFTWARE.  */
 // WARNING: code is little endian only!
 
 #include "BAM2blocks.h"
-#include <chrono>
+
+// ******************************* SpareReadArena ******************************
+
+SpareReadArena::SpareReadArena() {
+  cursor = 0; last_cap = 0; bytes_used = 0;
+}
+
+SpareReadArena::~SpareReadArena() {
+  clear();
+}
+
+char * SpareReadArena::alloc(const size_t n_bytes) {
+  if(blocks.size() == 0 || cursor + n_bytes > last_cap) {
+    last_cap = std::max(block_cap, n_bytes);
+    blocks.push_back((char*)malloc(last_cap));
+    cursor = 0;
+  }
+  char * ret = blocks.back() + cursor;
+  cursor += n_bytes;
+  bytes_used += n_bytes;
+  return(ret);
+}
+
+void SpareReadArena::clear() {
+  for(unsigned int i = 0; i < blocks.size(); i++) {
+    free(blocks.at(i));
+  }
+  blocks.resize(0);
+  cursor = 0; last_cap = 0; bytes_used = 0;
+}
+
+void SpareReadArena::swap(SpareReadArena & other) {
+  blocks.swap(other.blocks);
+  std::swap(cursor, other.cursor);
+  std::swap(last_cap, other.last_cap);
+  std::swap(bytes_used, other.bytes_used);
+}
+
+// ******************************* SpareReadTable ******************************
+
+SpareReadTable::SpareReadTable() {
+  n_entries = 0;
+  rehash(1024);
+}
+
+// FNV-1a hash of the read name (excluding the null terminator)
+uint64_t SpareReadTable::hash(const char * read_name, const uint8_t l_read_name) {
+  uint64_t h = 14695981039346656037ULL;
+  for(unsigned int i = 0; i + 1 < l_read_name; i++) {
+    h ^= (uint8_t)read_name[i];
+    h *= 1099511628211ULL;
+  }
+  if(h == 0) h = 1;
+  return(h);
+}
+
+// Compares the read names of two raw BAM records
+bool SpareReadTable::same_name(const char * data1, const char * data2) {
+  uint8_t l1 = *(uint8_t*)(data1 + 12);
+  uint8_t l2 = *(uint8_t*)(data2 + 12);
+  return(l1 == l2 && 0 == strncmp(data1 + 36, data2 + 36, l1));
+}
+
+void SpareReadTable::rehash(const size_t new_cap) {
+  std::vector<spare_read> old_slots;
+  old_slots.swap(slots);
+  spare_read empty_slot = {0, NULL, false};
+  slots.assign(new_cap, empty_slot);
+  mask = new_cap - 1;
+  n_entries = 0;
+  for(auto & entry : old_slots) {
+    if(entry.hash != 0) insert(entry.hash, entry.data, entry.real);
+  }
+}
+
+spare_read * SpareReadTable::find(const uint64_t h, const char * data) {
+  size_t i = h & mask;
+  while(slots[i].hash != 0) {
+    if(slots[i].hash == h && same_name(slots[i].data, data)) return(&slots[i]);
+    i = (i + 1) & mask;
+  }
+  return(NULL);
+}
+
+void SpareReadTable::insert(const uint64_t h, char * data, const bool real) {
+  // Keep load factor at or below 0.5
+  if(2 * (n_entries + 1) > slots.size()) rehash(2 * slots.size());
+  size_t i = h & mask;
+  while(slots[i].hash != 0) i = (i + 1) & mask;
+  slots[i].hash = h;
+  slots[i].data = data;
+  slots[i].real = real;
+  n_entries++;
+}
+
+void SpareReadTable::erase(spare_read * entry) {
+  size_t i = entry - &slots[0];
+  size_t j = i;
+  while(1) {
+    slots[i].hash = 0;
+    // Find the next entry that may be moved into the hole at i
+    while(1) {
+      j = (j + 1) & mask;
+      if(slots[j].hash == 0) {
+        n_entries--;
+        return;
+      }
+      size_t home = slots[j].hash & mask;
+      // Entry stays if its home slot lies cyclically within (i, j]
+      bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+      if(!stays) break;
+    }
+    slots[i] = slots[j];
+    i = j;
+  }
+}
+
+void SpareReadTable::clear() {
+  n_entries = 0;
+  std::vector<spare_read>().swap(slots);
+  rehash(1024);
+}
+
+// Shrinks the table if it is mostly empty, e.g. after many mates are paired
+void SpareReadTable::shrink_to_fit() {
+  size_t new_cap = slots.size();
+  while(new_cap > 1024 && 8 * n_entries < new_cap) new_cap /= 2;
+  if(new_cap < slots.size()) rehash(new_cap);
+}
+
+// ********************************* BAM2blocks ********************************
 
 BAM2blocks::BAM2blocks() {
-  oBlocks = FragmentBlocks(); //Right syntax to call the default constructor on an object variable, declared but not initialised?
+  block_batch.resize(1);
+  n_batch = 0;
 
   cReadsProcessed = 0;
   totalNucleotides = 0;
@@ -40,15 +171,21 @@ BAM2blocks::BAM2blocks() {
   cErrorReads = 0;
   cSkippedReads = 0;
   cChimericReads = 0;
+  cEvictedReads = 0;
+  cFragmentsCommitted = 0;
   
-  spare_reads = new std::map< std::string, pbam1_t* >;
+  spare_live_bytes = 0;
+  coord_sorted = false;
+  last_refID = -1;
+  last_pos = -1;
 }
 
 BAM2blocks::BAM2blocks(
     std::vector<std::string> & ref_names, 
     std::vector<uint32_t> & ref_lengths
 ) {
-  oBlocks = FragmentBlocks(); //Right syntax to call the default constructor on an object variable, declared but not initialised?
+  block_batch.resize(1);
+  n_batch = 0;
 
   cReadsProcessed = 0;
   totalNucleotides = 0;
@@ -60,21 +197,23 @@ BAM2blocks::BAM2blocks(
   cErrorReads = 0;
   cSkippedReads = 0;
   cChimericReads = 0;
+  cEvictedReads = 0;
+  cFragmentsCommitted = 0;
+  
+  spare_live_bytes = 0;
+  coord_sorted = false;
+  last_refID = -1;
+  last_pos = -1;
   
   if(ref_names.size() > 0) {
     for(unsigned int i = 0; i < ref_names.size(); i++) {
       chrs.push_back(chr_entry(i, ref_names.at(i), (int32_t)ref_lengths.at(i)));
     }
   }
-  
-  spare_reads = new std::map< std::string, pbam1_t* >;
 }
 
 BAM2blocks::~BAM2blocks() {
-  for(auto it = spare_reads->begin(); it != spare_reads->end(); it++) {
-    delete it->second;
-  }
-  delete spare_reads;
+  // Spare reads are released in bulk by spare_arena
 }
 
 unsigned int BAM2blocks::openFile(pbam_in * _IN) {
@@ -87,6 +226,7 @@ unsigned int BAM2blocks::openFile(pbam_in * _IN) {
   std::vector<std::string> s_chr_names;
   std::vector<uint32_t> u32_chr_lens;
   IN->obtainChrs(s_chr_names, u32_chr_lens);
+  coord_sorted = (IN->GetSortOrder() == "coordinate");
   if(chrs.size() == 0) {
     for(unsigned int i = 0; i < s_chr_names.size(); i++) {
       chrs.push_back(chr_entry(i, s_chr_names.at(i), (int32_t)u32_chr_lens.at(i)));
@@ -99,11 +239,11 @@ unsigned int BAM2blocks::openFile(pbam_in * _IN) {
   return(0);
 }
 
-void BAM2blocks::cigar2block(uint32_t * cigar, uint16_t n_cigar_op, std::vector<int> &starts, std::vector<int> &lens, int &ret_genome_len) {
+void BAM2blocks::cigar2block(uint32_t * cigar, uint16_t n_cigar_op, FragmentBlockList &starts, FragmentBlockList &lens, int &ret_genome_len) {
   bool inBlock = true;
   int relpos = 0;
   int curblock = 0;
-  starts.resize(1);  // Is this expensive or not -- does this call destroy on further items, or is it a single op, adjusting the end? If expensive we can revert to earlier behaviour where we keep track of how many blocks, just overwriting relevant parts of the vector.
+  starts.resize(1);  // Blocks are stored inline (see FragmentBlockList), so this does not allocate
   lens.resize(1);
   starts[curblock] = 0;
   lens[curblock] = 0;
@@ -154,6 +294,7 @@ unsigned int BAM2blocks::processPair(pbam1_t * read1, pbam1_t * read2) {
 
   pbam1_t * r1 = read1;
   pbam1_t * r2 = read2;
+  FragmentBlocks & oBlocks = block_batch[n_batch];
   
   // string debugstate;
 
@@ -267,8 +408,8 @@ unsigned int BAM2blocks::processPair(pbam1_t * read1, pbam1_t * read2) {
   oBlocks.chr_id = r1->refID();
   oBlocks.readStart[0] = r1->pos();
   oBlocks.readEnd[0] = r1->pos() + r1_genome_len;
-  oBlocks.readName.resize(r1->l_read_name() - 1);
-  oBlocks.readName.replace(0, r1->l_read_name() - 1, r1->read_name(), r1->l_read_name() - 1); // is this memory/speed efficient?
+  oBlocks.readName = r1->read_name();
+  oBlocks.readNameLen = r1->l_read_name() - 1;
 
   unsigned int totalBlockLen = 0;
   for (auto blockLen: oBlocks.rLens[0]) {
@@ -286,15 +427,14 @@ unsigned int BAM2blocks::processPair(pbam1_t * read1, pbam1_t * read2) {
   // oBlocks.readName.append(to_string(oBlocks.readCount));
 // TODO - restructure -- we could instead do the manipulation from 2 reads-> 1 synthetic in a non-const callback.
 //        not required until that future flexibility is needed if part of the framework is repurposed.
-  for (auto & callback : callbacksProcessBlocks ) {
-    callback(oBlocks);
-  }
+  commitBlocks();
   return totalBlockLen;
 }
 
 
 unsigned int BAM2blocks::processSingle(pbam1_t * read1, bool mappability_mode) {
   int r1_genome_len;
+  FragmentBlocks & oBlocks = block_batch[n_batch];
 
   // string debugstate;
 
@@ -310,8 +450,8 @@ unsigned int BAM2blocks::processSingle(pbam1_t * read1, bool mappability_mode) {
   oBlocks.chr_id = read1->refID();
   oBlocks.readStart[0] = read1->pos();
   oBlocks.readEnd[0] = read1->pos() + r1_genome_len;
-  oBlocks.readName.resize(read1->l_read_name() - 1);
-  oBlocks.readName.replace(0, read1->l_read_name() - 1, read1->read_name(), read1->l_read_name() - 1); // is this memory/speed efficient?
+  oBlocks.readName = read1->read_name();
+  oBlocks.readNameLen = read1->l_read_name() - 1;
   
   // Below block only run from Mappability - only process reads if they are
   // mapped to the exact position from which synthetic reads were
@@ -321,21 +461,26 @@ unsigned int BAM2blocks::processSingle(pbam1_t * read1, bool mappability_mode) {
     if(read1->n_cigar_op() != 1) return(0);
     if( (*(read1->cigar()) & 15) != 0) return(0);
     
-    std::istringstream iss;
-    std::string subline;
-    iss.str(oBlocks.readName);
-    std::getline(iss, subline, '!');  // ignore strand
-    std::getline(iss, subline, '!');  // this is chr name
-    if(0 != strncmp(
-        subline.c_str(), chrs.at(oBlocks.chr_id).chr_name.c_str(), 
-        subline.size()
-      ) || 
-      chrs.at(oBlocks.chr_id).chr_name.size() != subline.size()) 
-    {
-        return 0;
+    // Read names are "strand!chr!pos": parse them in place
+    const char * name = oBlocks.readName;
+    const char * name_end = name + oBlocks.readNameLen;
+    const char * chr_start = (const char *)memchr(name, '!', name_end - name);
+    if(!chr_start) return 0;
+    chr_start++;
+    const char * chr_end = (const char *)memchr(chr_start, '!', name_end - chr_start);
+    if(!chr_end) return 0;
+    const std::string & chr_name = chrs.at(oBlocks.chr_id).chr_name;
+    if(chr_name.size() != (size_t)(chr_end - chr_start) ||
+        0 != strncmp(chr_start, chr_name.data(), chr_name.size())) {
+      return 0;
     }
-    std::getline(iss, subline, '!');  // this is chr pos
-    if(stoul(subline) != oBlocks.readStart[0] + 1) {
+    const char * pos_str = chr_end + 1;
+    unsigned long name_pos = 0;
+    if(pos_str == name_end || *pos_str < '0' || *pos_str > '9') return 0;
+    for(; pos_str < name_end && *pos_str >= '0' && *pos_str <= '9'; pos_str++) {
+      name_pos = name_pos * 10 + (*pos_str - '0');
+    }
+    if(name_pos != oBlocks.readStart[0] + 1) {
       return 0;
     }
   }
@@ -344,20 +489,41 @@ unsigned int BAM2blocks::processSingle(pbam1_t * read1, bool mappability_mode) {
   // oBlocks.readName.append(debugstate);
   // oBlocks.readName.append(to_string(oBlocks.readCount));
   //cout << "process pair - callbacks" << endl;  
-  for (auto & callback : callbacksProcessBlocks ) {
-    callback(oBlocks);
-  }
   unsigned int totalBlockLen = 0;
   for (auto blockLen: oBlocks.rLens[0]) {
     totalBlockLen += blockLen;
   }
+  commitBlocks();
   return totalBlockLen;
 }
 
+// Passes the fragment just built to the per-fragment callbacks, and queues it
+//   for the batch callbacks
+void BAM2blocks::commitBlocks() {
+  cFragmentsCommitted++;
+  for (auto & callback : callbacksProcessBlocks ) {
+    callback(block_batch[n_batch]);
+  }
+  if(callbacksProcessBatch.size() > 0) {
+    n_batch++;
+    if(n_batch == block_batch.size()) flushBlocks();
+  }
+}
+
+// Runs each batch callback over all queued fragments in turn. Must be run
+//   before the reads that the fragments' names point to are released
+void BAM2blocks::flushBlocks() {
+  if(n_batch == 0) return;
+  for (auto & callback : callbacksProcessBatch ) {
+    callback(block_batch.data(), n_batch);
+  }
+  n_batch = 0;
+}
+
 // Prints statistics to file
 int BAM2blocks::WriteOutput(std::string& output) {
   std::ostringstream oss;
-  cErrorReads = spare_reads->size();
+  cErrorReads = spare_reads.size() + cEvictedReads;
   oss << "Total reads processed\t" << cReadsProcessed << '\n';
   oss << "Total nucleotides\t" << totalNucleotides << '\n';
   oss << "Total singles processed\t" << cSingleReads << '\n';
@@ -372,21 +538,7 @@ int BAM2blocks::WriteOutput(std::string& output) {
   return(0);
 }
 
-// Returns a spare read; deletes same from BB's storage
-pbam1_t *  BAM2blocks::SupplyRead(std::string& read_name) {
-  // Supplies the pointer to the last spare read
-  // When called, transfer ownership of read to the parent BB
-  if(spare_reads->size() == 0) return(NULL);
-  auto it = spare_reads->begin();
-  read_name = it->first;
-  pbam1_t * read = it->second;
-  spare_reads->erase(it);
-  return(read);
-}
-
-// Tries to match reads between other BB and self
-int BAM2blocks::processSpares(BAM2blocks& other) {
-  // Combines two BB's, and processes any matching paired reads
+void BAM2blocks::addStats(BAM2blocks & other) {
   cReadsProcessed += other.cReadsProcessed;
   totalNucleotides += other.totalNucleotides;
     
@@ -398,48 +550,166 @@ int BAM2blocks::processSpares(BAM2blocks& other) {
   cErrorReads += other.cErrorReads;
   cSkippedReads += other.cSkippedReads;
   cChimericReads += other.cChimericReads;
-  
-  pbam1_t * spare_read;
-  std::string read_name;
-  while(1) {
-    spare_read = other.SupplyRead(read_name);
-    
-    if(!spare_read) {
-      break;
+  cEvictedReads += other.cEvictedReads;
+}
+
+void BAM2blocks::resetStats() {
+  cReadsProcessed = 0;
+  totalNucleotides = 0;
+  cShortPairs = 0;
+  cIntersectPairs = 0;
+  cLongPairs = 0;
+  cSingleReads = 0;
+  cPairedReads = 0;
+  cErrorReads = 0;
+  cSkippedReads = 0;
+  cChimericReads = 0;
+  cEvictedReads = 0;
+}
+
+// Tries to match spare reads between all BB's
+int BAM2blocks::processSpares(std::vector<BAM2blocks*> & BBchild) {
+  unsigned int n_shards = BBchild.size();
+  if(n_shards == 0) return(0);
+
+  // Partition each BB's spare reads by shard, in parallel
+  std::vector< std::vector< std::vector<spare_read> > > parts(n_shards);
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_shards) schedule(static,1)
+  #endif
+  for(unsigned int t = 0; t < n_shards; t++) {
+    parts.at(t).resize(n_shards);
+    for(auto & entry : BBchild.at(t)->spare_reads.Slots()) {
+      if(entry.hash != 0) parts.at(t).at((entry.hash >> 32) % n_shards).push_back(entry);
     }
-    
-    auto it_read = spare_reads->find(read_name);
-    if(it_read != spare_reads->end()){
-      cPairedReads ++;
-      if (spare_read->refID() != it_read->second->refID()) {
-        cChimericReads += 1;
-      } else {
-        if (spare_read->pos() <= it_read->second->pos()) {    
-          totalNucleotides += processPair(&(*spare_read), &(*(it_read->second)));
-        } else{              
-          totalNucleotides += processPair(&(*(it_read->second)), &(*spare_read));
+  }
+
+  // Each shard is paired by one thread, in order of BB's, so that reads
+  //   from earlier BB's are paired first (as if BB's were merged in turn)
+  // In coordinate-sorted mode, reads whose mates lie before the last
+  //   position reached by any thread can no longer be paired
+  bool evict = BBchild.at(0)->coord_sorted;
+  int32_t frontier_refID = -1;
+  int32_t frontier_pos = -1;
+  for(unsigned int t = 0; t < n_shards; t++) {
+    BAM2blocks * BB = BBchild.at(t);
+    if(BB->last_refID > frontier_refID || 
+        (BB->last_refID == frontier_refID && BB->last_pos > frontier_pos)) {
+      frontier_refID = BB->last_refID;
+      frontier_pos = BB->last_pos;
+    }
+  }
+
+  std::vector< std::vector<spare_read> > unpaired(n_shards);
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_shards) schedule(static,1)
+  #endif
+  for(unsigned int s = 0; s < n_shards; s++) {
+    BAM2blocks * BB = BBchild.at(s);
+    SpareReadTable shard;
+    for(unsigned int t = 0; t < n_shards; t++) {
+      for(auto & entry : parts.at(t).at(s)) {
+        spare_read * match = shard.find(entry.hash, entry.data);
+        if(match) {
+          pbam1_t spare(entry.data, false);
+          pbam1_t mate(match->data, false);
+          BB->cPairedReads ++;
+          if (spare.refID() != mate.refID()) {
+            // As in processAll(), the mate is kept and counted as unpaired
+            BB->cChimericReads += 1;
+          } else {
+            if (spare.pos() <= mate.pos()) {
+              BB->totalNucleotides += BB->processPair(&spare, &mate);
+            } else{
+              BB->totalNucleotides += BB->processPair(&mate, &spare);
+            }
+            BB->cReadsProcessed+=2;
+            shard.erase(match);
+          }
+        } else {
+          shard.insert(entry.hash, entry.data, entry.real);
         }
-        cReadsProcessed+=2;
       }
-      delete (it_read->second);
-      spare_reads->erase(read_name);
-      delete spare_read;
-      cErrorReads-=2;
-    } else {
-      spare_reads->insert({read_name, spare_read});
+      std::vector<spare_read>().swap(parts.at(t).at(s));
+    }
+    BB->flushBlocks();
+    for(auto & entry : shard.Slots()) {
+      if(entry.hash == 0) continue;
+      if(evict && frontier_refID >= 0) {
+        // Raw record: flag at +18, next_refID at +24, next_pos at +28
+        uint16_t flag = *(uint16_t*)(entry.data + 18);
+        int32_t next_refID = *(int32_t*)(entry.data + 24);
+        int32_t next_pos = *(int32_t*)(entry.data + 28);
+        if((flag & 0x8) || next_refID < 0 || next_refID < frontier_refID ||
+            (next_refID == frontier_refID && next_pos < frontier_pos)) {
+          BB->cEvictedReads++;
+          continue;
+        }
+      }
+      unpaired.at(s).push_back(entry);
     }
   }
+
+  // Collect statistics
+  BAM2blocks * BB0 = BBchild.at(0);
+  for(unsigned int t = 1; t < n_shards; t++) {
+    BB0->addStats(*BBchild.at(t));
+    BBchild.at(t)->resetStats();
+  }
+
+  // Copy unpaired reads into BB0's storage; release all other storage
+  SpareReadArena new_arena;
+  SpareReadTable new_spares;
+  size_t live_bytes = 0;
+  for(unsigned int s = 0; s < n_shards; s++) {
+    for(auto & entry : unpaired.at(s)) {
+      size_t n_bytes = *(uint32_t*)(entry.data) + 4;
+      char * data = new_arena.alloc(n_bytes);
+      memcpy(data, entry.data, n_bytes);
+      new_spares.insert(entry.hash, data, true);
+      live_bytes += n_bytes;
+    }
+  }
+  BB0->spare_arena.swap(new_arena);
+  std::swap(BB0->spare_reads, new_spares);
+  BB0->spare_live_bytes = live_bytes;
+  BB0->cErrorReads = BB0->spare_reads.size() + BB0->cEvictedReads;
+  for(unsigned int t = 1; t < n_shards; t++) {
+    BBchild.at(t)->spare_reads.clear();
+    BBchild.at(t)->spare_arena.clear();
+    BBchild.at(t)->spare_live_bytes = 0;
+  }
   
   return(0);
 }
 
-// Saves pbam1_t spare reads to dedicated buffer space
+// Copies virtual spare reads (pointing to pbam_in's buffer) into the arena
 int BAM2blocks::realizeSpareReads() {
-  for (auto it = spare_reads->begin(); it != spare_reads->end(); it++) {
-    if(!it->second->isReal()) {
-      it->second->realize();
+  for(auto & entry : spare_reads.Slots()) {
+    if(entry.hash != 0 && !entry.real) {
+      size_t n_bytes = *(uint32_t*)(entry.data) + 4;
+      char * data = spare_arena.alloc(n_bytes);
+      memcpy(data, entry.data, n_bytes);
+      entry.data = data;
+      entry.real = true;
+      spare_live_bytes += n_bytes;
     }
   }
+  
+  // Compact arena when most of its contents belong to reads already paired
+  if(spare_arena.size() > 16777216 && spare_arena.size() > 4 * spare_live_bytes) {
+    SpareReadArena new_arena;
+    for(auto & entry : spare_reads.Slots()) {
+      if(entry.hash != 0) {
+        size_t n_bytes = *(uint32_t*)(entry.data) + 4;
+        char * data = new_arena.alloc(n_bytes);
+        memcpy(data, entry.data, n_bytes);
+        entry.data = data;
+      }
+    }
+    spare_arena.swap(new_arena);
+  }
+  spare_reads.shrink_to_fit();
   return(0);
 }
 
@@ -451,39 +721,29 @@ int BAM2blocks::processAll(unsigned int thread_number, bool mappability_mode) {
 
   bool any_reads_processed = false;
   
-  // Use map pointer spare_reads:
-  std::map< std::string, pbam1_t* > * new_spare_reads;  
   pbam1_t read;
-  std::string read_name_s;
-  pbam1_t * store_read;
+  uint64_t read_hash;
+  spare_read * match;
   
-  auto start = chrono::steady_clock::now();
-  auto check = start;
   while(1) {
-    check = chrono::steady_clock::now();
-    if(chrono::duration_cast<chrono::seconds>(check - start).count() > 15) {
-      cout << "Error: read processing appears very sluggish in thread " << thread_number
-        << ". Suggest sort the BAM file by read name and try again\n"
-        << "  e.g. use `samtools collate` or `sambamba sort -n`.\n"
-        << "Alternatively, try to run NxtIRF/IRFinder using `n_threads = 1`\n";
-      return(-1);
-    }
-    
     read = IN->supplyRead(thread_number);
     if(!read.validate()) {
-      if(idx == 1 && spare_reads->size() == 0) {
-        reads[0].read_name(read_name_s);
-        store_read = new pbam1_t;
-        *(store_read) = reads[0];
-        spare_reads->insert({read_name_s, store_read});
+      if(idx == 1 && spare_reads.size() == 0) {
+        read_hash = SpareReadTable::hash(reads[0].read_name(), reads[0].l_read_name());
+        spare_reads.insert(read_hash, reads[0].data(), false);
       }
-      cErrorReads = spare_reads->size();
+      cErrorReads = spare_reads.size();
+      flushBlocks();
       realizeSpareReads();
       if(!any_reads_processed) return(1);
       return(0);   // This will happen if read fails - i.e. end of loaded buffer
     } else {
       any_reads_processed = true;
     }
+    if(read.refID() >= 0) {
+      last_refID = read.refID();
+      last_pos = read.pos();
+    }
     reads[idx] = read;
 
     if (reads[idx].flag() & 0x904) {
@@ -496,10 +756,10 @@ int BAM2blocks::processAll(unsigned int thread_number, bool mappability_mode) {
       totalNucleotides += nucs_proc;
       if(nucs_proc > 0) cReadsProcessed++;
     }else{
-      if(idx == 0 && spare_reads->size() == 0) {
+      if(idx == 0 && spare_reads.size() == 0) {
         // If BAM is sorted by read name, then we don't need read size, simply use old system
         idx++;
-      } else if(idx == 1 && spare_reads->size() == 0 && 
+      } else if(idx == 1 && spare_reads.size() == 0 && 
           reads[0].l_read_name() == reads[1].l_read_name() &&
           (0 == strncmp(reads[0].read_name(), reads[1].read_name(), reads[1].l_read_name()))) {
         cPairedReads ++;
@@ -513,40 +773,31 @@ int BAM2blocks::processAll(unsigned int thread_number, bool mappability_mode) {
       } else {
         // Likely a coordinate sorted BAM file:
         for(unsigned int k = 0; k <= idx; k++) {
-          reads[k].read_name(read_name_s);
-          auto it_read = spare_reads->find(read_name_s);
+          read_hash = SpareReadTable::hash(reads[k].read_name(), reads[k].l_read_name());
+          match = spare_reads.find(read_hash, reads[k].data());
           
-          if(it_read != spare_reads->end()){
+          if(match){
+            pbam1_t mate(match->data, false);
             cPairedReads ++;
-            if (reads[k].refID() != it_read->second->refID()) {
+            if (reads[k].refID() != mate.refID()) {
               cChimericReads += 1;
             } else {
-              if (reads[k].pos() <= it_read->second->pos()) {    
-                totalNucleotides += processPair(&reads[k], &(*(it_read->second)));
+              if (reads[k].pos() <= mate.pos()) {    
+                totalNucleotides += processPair(&reads[k], &mate);
               }else{           
-                totalNucleotides += processPair(&(*(it_read->second)), &reads[k]);
+                totalNucleotides += processPair(&mate, &reads[k]);
               }
               cReadsProcessed+=2;
-              delete (it_read->second);
-              spare_reads->erase(read_name_s);
+              if(match->real) spare_live_bytes -= mate.block_size() + 4;
+              spare_reads.erase(match);
             }
           } else {
-            store_read = new pbam1_t;
-            *(store_read) = reads[k];
-            spare_reads->insert({read_name_s, store_read});
+            spare_reads.insert(read_hash, reads[k].data(), false);
           }
         }
         idx = 0;
       }
     }
-
-    if ( (cPairedReads + cSingleReads) % 1000000 == 0 ) {
-      // Clean map by swapping for a new one
-      new_spare_reads = new std::map< std::string, pbam1_t* >;
-      new_spare_reads->insert(spare_reads->begin(), spare_reads->end());
-      spare_reads->swap(*new_spare_reads);
-      delete new_spare_reads;
-    }
   }
 
   return(0);
@@ -559,3 +810,9 @@ void BAM2blocks::registerCallbackChrMappingChange( std::function<void(const std:
 void BAM2blocks::registerCallbackProcessBlocks( std::function<void(const FragmentBlocks &)> callback ) {  
   callbacksProcessBlocks.push_back(callback);
 }
+
+void BAM2blocks::registerCallbackProcessBatch( std::function<void(const FragmentBlocks *, unsigned int)> callback ) {
+  flushBlocks();
+  block_batch.resize(block_batch_size);
+  callbacksProcessBatch.push_back(callback);
+}
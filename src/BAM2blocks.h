@@ -33,14 +33,70 @@ SOFTWARE.  */
 
 /* Little Endian .. for big endian each group of 4 bytes needs to be reversed before individual members are accessed. */
 
+// A bump allocator for realized spare reads. Memory is only freed in bulk
+class SpareReadArena {
+    static const size_t block_cap = 4194304;   // 4 Mb blocks
+    std::vector<char*> blocks;
+    size_t cursor;          // Position in last block
+    size_t last_cap;        // Size of last block
+    size_t bytes_used;
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    SpareReadArena(const SpareReadArena &t);
+    SpareReadArena & operator = (const SpareReadArena &t);
+  public:
+    SpareReadArena();
+    ~SpareReadArena();
+    char * alloc(const size_t n_bytes);
+    void clear();
+    void swap(SpareReadArena & other);
+    size_t size() const { return(bytes_used); };
+};
+
+// An unpaired read, stored by its raw BAM record (starting at block_size)
+struct spare_read {
+  uint64_t hash;          // Hash of read name; 0 denotes an empty slot
+  char * data;            // Points to pbam_in's buffer, or the arena if real
+  bool real;
+};
+
+// Open-addressing (linear probing) hash table of spare reads,
+//   keyed by a precomputed hash of the read name
+class SpareReadTable {
+    std::vector<spare_read> slots;
+    size_t n_entries;
+    size_t mask;
+    void rehash(const size_t new_cap);
+  public:
+    SpareReadTable();
+    static uint64_t hash(const char * read_name, const uint8_t l_read_name);
+    static bool same_name(const char * data1, const char * data2);
+
+    spare_read * find(const uint64_t h, const char * data);
+    void insert(const uint64_t h, char * data, const bool real);
+    void erase(spare_read * entry);       // Backward-shift deletion, no tombstones
+    void clear();
+    void shrink_to_fit();
+
+    size_t size() const { return(n_entries); };
+    std::vector<spare_read> & Slots() { return(slots); };
+};
+
 
 class BAM2blocks {
-    FragmentBlocks oBlocks;
+    // Fragments are built in place in block_batch. If batch callbacks are
+    //   registered, they are passed on a batch at a time (see flushBlocks)
+    static const unsigned int block_batch_size = 2048;
+    std::vector<FragmentBlocks> block_batch;
+    unsigned int n_batch;
+    void commitBlocks();
+    void flushBlocks();
 
     std::vector< std::function<void(const std::vector<chr_entry> &)> > callbacksChrMappingChange;
     std::vector< std::function<void(const FragmentBlocks &)> > callbacksProcessBlocks;
+    std::vector< std::function<void(const FragmentBlocks *, unsigned int)> > callbacksProcessBatch;
 
-    void cigar2block(uint32_t * cigar, uint16_t n_cigar_op, std::vector<int> &starts, std::vector<int> &lens, int &ret_genome_len);
+    void cigar2block(uint32_t * cigar, uint16_t n_cigar_op, FragmentBlockList &starts, FragmentBlockList &lens, int &ret_genome_len);
 
     unsigned int processPair(pbam1_t * read1, pbam1_t * read2);
     unsigned int processSingle(pbam1_t * read1, bool mappability_mode = false);
@@ -56,15 +112,25 @@ class BAM2blocks {
     unsigned long cErrorReads;
     unsigned long cSkippedReads;
     unsigned long cChimericReads;
+    unsigned long cEvictedReads;    // Spare reads whose mates were passed
+    unsigned long cFragmentsCommitted;  // Fragments passed to callbacks by this BB (not combined)
 
     pbam1_t reads[2];
     pbam_in * IN;
     
     std::vector<chr_entry> chrs;
 
-    std::map< std::string, pbam1_t* > * spare_reads;
-    pbam1_t * SupplyRead(std::string& read_name);    
+    // Coordinate-sorted mode (from the @HD SO tag of the BAM header)
+    bool coord_sorted;
+    int32_t last_refID;   // Position of last mapped read supplied
+    int32_t last_pos;
+
+    SpareReadTable spare_reads;
+    SpareReadArena spare_arena;
+    size_t spare_live_bytes;      // Bytes in spare_arena belonging to stored reads
     int realizeSpareReads();
+    void addStats(BAM2blocks & other);
+    void resetStats();
 
 // Disable copy construction / assignment (doing so triggers compile errors)
     BAM2blocks(const BAM2blocks &t);
@@ -79,12 +145,31 @@ class BAM2blocks {
   	unsigned int openFile(pbam_in * _IN);
 
   	int processAll(unsigned int thread_number = 0, bool mappability_mode = false);
-  	int processSpares(BAM2blocks& other);
+  	
+  	// Pairs spare reads across all thread-specific BB's in parallel; each
+  	//   thread pairs the reads of one shard (by read name hash) and sends
+  	//   them to its own BB's callbacks. Statistics and unpaired reads are
+  	//   collected into BBchild.at(0)
+  	// In coordinate-sorted mode, this should be run after each fillReads()
+  	//   round; unpaired reads whose mate position has been passed are then
+  	//   dropped (and counted as unpaired), keeping spare reads bounded
+  	static int processSpares(std::vector<BAM2blocks*> & BBchild);
+  	
+  	bool isCoordinateSorted() { return(coord_sorted); };
 
   	int WriteOutput(std::string& output);
 
+    // Instrumentation: fragments passed to this BB's callbacks so far, and
+    //   the number / size of reads waiting for their mates
+    unsigned long GetFragmentCount() const { return(cFragmentsCommitted); };
+    size_t GetSpareReadCount() const { return(spare_reads.size()); };
+    size_t GetSpareReadBytes() const { return(spare_live_bytes); };
+
     void registerCallbackChrMappingChange( std::function<void(const std::vector<chr_entry> &)> callback );
     void registerCallbackProcessBlocks( std::function<void(const FragmentBlocks &)> callback );
+    // Batch callbacks receive up to block_batch_size fragments at a time. Read
+    //   names in these fragments remain valid until the callback returns
+    void registerCallbackProcessBatch( std::function<void(const FragmentBlocks *, unsigned int)> callback );
 };
 
 
@@ -0,0 +1,834 @@
+/* BenchTools.cpp Synthetic data and benchmarks for the NxtIRF pipeline
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#include "BenchTools.h"
+#include "IRFinder.h"
+
+#ifndef RNXTIRF
+#include <chrono>
+#include <random>
+#include <set>
+#include <tuple>
+#include <iomanip>
+#include <cstdio>
+
+// ############################## SYNTHETIC DATA ###############################
+
+static const unsigned int bench_n_chrs = 5;
+static const char * bench_chr_names[bench_n_chrs] =
+  {"chr1", "chr2", "chr3", "chr4", "chrM"};
+static const uint32_t bench_chr_lens[bench_n_chrs] =
+  {2000000, 1500000, 1000000, 500000, 16569};
+
+typedef std::vector< std::pair<unsigned int, unsigned int> > bench_blocks;   // [start, end)
+
+struct bench_gene {
+  unsigned int chr;
+  char strand;
+  bench_blocks exons;
+};
+
+// A BAM record in the record buffer
+struct bench_record {
+  int32_t refID;
+  int32_t pos;
+  size_t offset;
+  size_t length;
+};
+
+static uint16_t bench_reg2bin(uint32_t beg, uint32_t end) {
+  end--;
+  if(beg >> 14 == end >> 14) return(((1 << 15) - 1) / 7 + (beg >> 14));
+  if(beg >> 17 == end >> 17) return(((1 << 12) - 1) / 7 + (beg >> 17));
+  if(beg >> 20 == end >> 20) return(((1 << 9) - 1) / 7 + (beg >> 20));
+  if(beg >> 23 == end >> 23) return(((1 << 6) - 1) / 7 + (beg >> 23));
+  if(beg >> 26 == end >> 26) return(((1 << 3) - 1) / 7 + (beg >> 26));
+  return(0);
+}
+
+// Maps len bases of a transcript, starting at tx_start, to genomic blocks
+static bool bench_tx_blocks(const bench_gene &gene, unsigned int tx_start,
+    unsigned int len, bench_blocks &blocks) {
+  blocks.clear();
+  unsigned int offset = 0;
+  for(auto ex = gene.exons.begin(); ex != gene.exons.end(); ex++) {
+    unsigned int ex_len = ex->second - ex->first;
+    if(len > 0 && tx_start < offset + ex_len) {
+      unsigned int start = ex->first + (tx_start - offset);
+      unsigned int take = std::min(len, ex->second - start);
+      blocks.push_back(std::make_pair(start, start + take));
+      len -= take;
+      tx_start += take;
+    }
+    offset += ex_len;
+  }
+  return(len == 0);
+}
+
+static unsigned int bench_tx_len(const bench_gene &gene) {
+  unsigned int len = 0;
+  for(auto ex = gene.exons.begin(); ex != gene.exons.end(); ex++) {
+    len += ex->second - ex->first;
+  }
+  return(len);
+}
+
+static void bench_add_read(std::string &buf, std::vector<bench_record> &records,
+    const std::string &name, uint16_t flag, int32_t refID, const bench_blocks &blocks,
+    unsigned int read_len, int32_t mate_pos, int32_t tlen, std::mt19937 &rng
+) {
+  static const uint8_t bases[4] = {1, 2, 4, 8};   // A C G T
+  size_t offset = buf.size();
+  int32_t pos = (int32_t)blocks.front().first;
+  uint16_t n_cigar = (uint16_t)(2 * blocks.size() - 1);
+  int32_t block_size = 32 + name.size() + 1 + 4 * n_cigar +
+    (read_len + 1) / 2 + read_len + 4;
+
+  refBinaryWriter::Append(buf, block_size);
+  refBinaryWriter::Append(buf, refID);
+  refBinaryWriter::Append(buf, pos);
+  refBinaryWriter::Append(buf, (uint8_t)(name.size() + 1));
+  refBinaryWriter::Append(buf, (uint8_t)255);
+  refBinaryWriter::Append(buf, bench_reg2bin(blocks.front().first, blocks.back().second));
+  refBinaryWriter::Append(buf, n_cigar);
+  refBinaryWriter::Append(buf, flag);
+  refBinaryWriter::Append(buf, (uint32_t)read_len);
+  refBinaryWriter::Append(buf, refID);
+  refBinaryWriter::Append(buf, mate_pos);
+  refBinaryWriter::Append(buf, tlen);
+  buf.append(name);
+  buf.push_back('\0');
+  for(unsigned int i = 0; i < blocks.size(); i++) {
+    if(i > 0) {
+      uint32_t gap = blocks.at(i).first - blocks.at(i - 1).second;
+      refBinaryWriter::Append(buf, (uint32_t)((gap << 4) | 3));    // N
+    }
+    uint32_t len = blocks.at(i).second - blocks.at(i).first;
+    refBinaryWriter::Append(buf, (uint32_t)(len << 4));             // M
+  }
+  for(unsigned int i = 0; i < (read_len + 1) / 2; i++) {
+    buf.push_back((char)((bases[rng() % 4] << 4) | bases[rng() % 4]));
+  }
+  buf.append(read_len, (char)30);
+  buf.append("NHC\x01", 4);
+
+  bench_record rec = {refID, pos, offset, buf.size() - offset};
+  records.push_back(rec);
+}
+
+// Writes a pair of reads; read 1 is the left mate if r1_left
+static void bench_add_pair(std::string &buf, std::vector<bench_record> &records,
+    const std::string &name, int32_t refID, const bench_blocks &left,
+    const bench_blocks &right, bool r1_left, unsigned int read_len, std::mt19937 &rng
+) {
+  int32_t left_pos = (int32_t)left.front().first;
+  int32_t right_pos = (int32_t)right.front().first;
+  int32_t tlen = (int32_t)right.back().second - left_pos;
+  uint16_t left_flag = 0x1 | 0x2 | 0x20 | (r1_left ? 0x40 : 0x80);
+  uint16_t right_flag = 0x1 | 0x2 | 0x10 | (r1_left ? 0x80 : 0x40);
+  if(r1_left) {
+    bench_add_read(buf, records, name, left_flag, refID, left, read_len, right_pos, tlen, rng);
+    bench_add_read(buf, records, name, right_flag, refID, right, read_len, left_pos, -tlen, rng);
+  } else {
+    bench_add_read(buf, records, name, right_flag, refID, right, read_len, left_pos, -tlen, rng);
+    bench_add_read(buf, records, name, left_flag, refID, left, read_len, right_pos, tlen, rng);
+  }
+}
+
+// Writes records (in the given order) to a BAM file. Returns the file offset
+//   of each BGZF block, followed by that of the EOF block
+static int bench_write_bam(const std::string &filename, const std::string &header,
+    const std::string &buf, const std::vector<bench_record> &records,
+    const std::vector<size_t> &order, std::vector<uint64_t> &block_offsets
+) {
+  std::ofstream out;
+  out.open(filename, std::ofstream::binary);
+  if(!out.is_open()) {
+    cout << "Unable to write to " << filename << "\n";
+    return(-1);
+  }
+  BGZFWriter writer;
+
+  block_offsets.clear();
+  uint64_t file_pos = 0;
+  std::string pending = header;
+  std::string compressed;
+  size_t chunk_size = 64 * (size_t)BGZFWriter::block_size;
+  for(size_t i = 0; i <= order.size(); i++) {
+    if(i < order.size()) {
+      const bench_record &rec = records.at(order.at(i));
+      pending.append(buf, rec.offset, rec.length);
+      if(pending.size() < chunk_size) continue;
+    }
+    // Compress whole blocks only, except at the end
+    size_t n_write = (i < order.size()) ? chunk_size : pending.size();
+    compressed.clear();
+    if(writer.compress(pending.data(), n_write, compressed) != Z_OK) {
+      cout << "Error compressing " << filename << "\n";
+      return(-1);
+    }
+    pending.erase(0, n_write);
+    size_t pos = 0;
+    while(pos + 18 <= compressed.size()) {
+      uint16_t bsize;
+      memcpy(&bsize, compressed.data() + pos + 16, 2);
+      block_offsets.push_back(file_pos + pos);
+      pos += (size_t)bsize + 1;
+    }
+    out.write(compressed.data(), compressed.size());
+    file_pos += compressed.size();
+  }
+  block_offsets.push_back(file_pos);
+  out.write(bamEOF, bamEOFlength);
+  out.close();
+  if(out.fail()) {
+    cout << "Error writing " << filename << "\n";
+    return(-1);
+  }
+  return(0);
+}
+
+// Writes a BAI index holding each chromosome's range and read count only
+//   (the pseudo-bin), which is all that LoadIndex() uses
+static int bench_write_bai(const std::string &filename, size_t header_size,
+    const std::vector<bench_record> &records, const std::vector<size_t> &order,
+    const std::vector<uint64_t> &block_offsets
+) {
+  // Virtual file offset of uncompressed offset u
+  auto voffset = [&block_offsets](size_t u) {
+    size_t block = u / BGZFWriter::block_size;
+    uint64_t coffset = block_offsets.at(std::min(block, block_offsets.size() - 1));
+    return((coffset << 16) | (uint64_t)(u % BGZFWriter::block_size));
+  };
+
+  std::string bai("BAI\1", 4);
+  refBinaryWriter::Append(bai, (int32_t)bench_n_chrs);
+  size_t u = header_size;
+  size_t i = 0;
+  for(unsigned int chr = 0; chr < bench_n_chrs; chr++) {
+    uint64_t beg = voffset(u);
+    uint64_t n_mapped = 0;
+    while(i < order.size() && records.at(order.at(i)).refID == (int32_t)chr) {
+      u += records.at(order.at(i)).length;
+      n_mapped++;
+      i++;
+    }
+    uint64_t end = voffset(u);
+    if(n_mapped == 0) {
+      refBinaryWriter::Append(bai, (int32_t)0);   // n_bin
+    } else {
+      refBinaryWriter::Append(bai, (int32_t)2);
+      refBinaryWriter::Append(bai, (uint32_t)0);
+      refBinaryWriter::Append(bai, (int32_t)1);
+      refBinaryWriter::Append(bai, beg);
+      refBinaryWriter::Append(bai, end);
+      refBinaryWriter::Append(bai, (uint32_t)37450);
+      refBinaryWriter::Append(bai, (int32_t)2);
+      refBinaryWriter::Append(bai, beg);
+      refBinaryWriter::Append(bai, end);
+      refBinaryWriter::Append(bai, n_mapped);
+      refBinaryWriter::Append(bai, (uint64_t)0);
+    }
+    refBinaryWriter::Append(bai, (int32_t)0);     // n_intv
+  }
+  refBinaryWriter::Append(bai, (uint64_t)0);      // n_no_coor
+
+  std::ofstream out;
+  out.open(filename, std::ofstream::binary);
+  out.write(bai.data(), bai.size());
+  out.close();
+  if(out.fail()) {
+    cout << "Error writing " << filename << "\n";
+    return(-1);
+  }
+  return(0);
+}
+
+static int bench_write_ref(const std::string &filename, const std::vector<bench_gene> &genes) {
+  std::ostringstream ref;
+
+  ref << "# ref-cover.bed\n";
+  std::set< std::tuple<unsigned int, unsigned int, char> > read_continues;
+  std::vector< std::tuple<unsigned int, unsigned int, unsigned int, char, bool> > junctions;
+  for(unsigned int g = 0; g < genes.size(); g++) {
+    const bench_gene &gene = genes.at(g);
+    for(unsigned int k = 0; k + 1 < gene.exons.size(); k++) {
+      unsigned int start = gene.exons.at(k).second;
+      unsigned int end = gene.exons.at(k + 1).first;
+      // Some long introns have an excluded region in the middle
+      bench_blocks blocks(1, std::make_pair(start + 5, end - 5));
+      if(end - start > 1500 && g % 3 == 0) {
+        unsigned int mid = (start + end) / 2;
+        blocks.clear();
+        blocks.push_back(std::make_pair(start + 5, mid - 50));
+        blocks.push_back(std::make_pair(mid + 50, end - 5));
+      }
+      unsigned int covered = 0;
+      for(auto b = blocks.begin(); b != blocks.end(); b++) covered += b->second - b->first;
+      const char * clean_types[3] = {"clean", "known-exon", "anti-over"};
+      for(unsigned int dir = 0; dir < 2; dir++) {
+        ref << bench_chr_names[gene.chr] << "\t" << blocks.front().first << "\t"
+          << blocks.back().second << "\t"
+          << (dir == 0 ? "nd" : "dir") << "/G" << g << "/T" << g << "_Intron" << k + 1
+          << "/" << gene.strand << "/" << k + 1 << "/" << start << "/" << end << "/"
+          << end - start << "/" << (end - start) - covered << "/" << clean_types[(g + k) % 3]
+          << "\t0\t" << gene.strand << "\t" << blocks.front().first << "\t"
+          << blocks.back().second << "\t255,0,0\t" << blocks.size() << "\t";
+        for(unsigned int b = 0; b < blocks.size(); b++) {
+          ref << (b > 0 ? "," : "") << blocks.at(b).second - blocks.at(b).first;
+        }
+        ref << "\t";
+        for(unsigned int b = 0; b < blocks.size(); b++) {
+          ref << (b > 0 ? "," : "") << blocks.at(b).first - blocks.front().first;
+        }
+        ref << "\n";
+      }
+      read_continues.insert(std::make_tuple(gene.chr, start, gene.strand));
+      read_continues.insert(std::make_tuple(gene.chr, end, gene.strand));
+      junctions.push_back(std::make_tuple(gene.chr, start, end, gene.strand, g % 7 == 0));
+    }
+  }
+
+  ref << "# ref-read-continues.ref\n";
+  for(auto it = read_continues.begin(); it != read_continues.end(); it++) {
+    ref << bench_chr_names[std::get<0>(*it)] << "\t" << std::get<1>(*it) << "\t"
+      << std::get<2>(*it) << "\n";
+  }
+
+  // Genes end at least 25 kb before the end of each chromosome
+  ref << "# ref-ROI.bed\n"
+    << bench_chr_names[0] << "\t" << bench_chr_lens[0] - 20000 << "\t"
+      << bench_chr_lens[0] - 100 << "\tIntergenic/" << bench_chr_names[0] << "\n"
+    << bench_chr_names[1] << "\t" << bench_chr_lens[1] - 20000 << "\t"
+      << bench_chr_lens[1] - 100 << "\trRNA/" << bench_chr_names[1] << "/x\n";
+
+  ref << "# ref-sj.ref\n";
+  std::sort(junctions.begin(), junctions.end());
+  for(auto it = junctions.begin(); it != junctions.end(); it++) {
+    ref << bench_chr_names[std::get<0>(*it)] << "\t" << std::get<1>(*it) << "\t"
+      << std::get<2>(*it) << "\t" << std::get<3>(*it) << "\t"
+      << (std::get<4>(*it) ? "NMD" : "") << "\n";
+  }
+
+  ref << "# ref-chrs.ref\n";
+  for(unsigned int chr = 0; chr < bench_n_chrs; chr++) {
+    ref << bench_chr_names[chr] << "\t" << bench_chr_lens[chr] << "\t"
+      << bench_chr_names[chr] << "\n";
+  }
+  ref << "# EOF\n";
+
+  std::ofstream out;
+  out.open(filename, std::ofstream::binary);
+  if(!out.is_open()) {
+    cout << "Unable to write to " << filename << "\n";
+    return(-1);
+  }
+  BGZFWriter outGZ;
+  outGZ.SetOutputHandle(&out);
+  int ret = outGZ.writestring(ref.str());
+  if(ret == Z_OK) ret = outGZ.flush(true);
+  out.close();
+  if(ret != Z_OK || out.fail()) {
+    cout << "Error writing " << filename << "\n";
+    return(-1);
+  }
+  return(0);
+}
+
+int Benchmark_Generate(const std::string &out_dir,
+    size_t n_fragments, unsigned int read_len, double splice_rate,
+    const std::string &sort_order
+) {
+  if(read_len < 20 || read_len > 1000) {
+    cout << "Read length must be between 20 and 1000\n";
+    return(1);
+  }
+  if(splice_rate < 0 || splice_rate > 1) {
+    cout << "Splice rate must be between 0 and 1\n";
+    return(1);
+  }
+  if(sort_order != "coordinate" && sort_order != "queryname" && sort_order != "unsorted") {
+    cout << "Sort order must be one of coordinate, queryname or unsorted\n";
+    return(1);
+  }
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+  // Genes: 3-8 exons of 80-300 bases, separated by introns of 200-5000 bases
+  std::vector<bench_gene> genes;
+  for(unsigned int chr = 0; chr + 1 < bench_n_chrs; chr++) {
+    unsigned int pos = 5000;
+    while(true) {
+      bench_gene gene;
+      gene.chr = chr;
+      gene.strand = (rng() % 2 == 0) ? '+' : '-';
+      unsigned int n_exons = 3 + rng() % 6;
+      for(unsigned int k = 0; k < n_exons; k++) {
+        unsigned int ex_len = 80 + rng() % 221;
+        gene.exons.push_back(std::make_pair(pos, pos + ex_len));
+        pos += ex_len;
+        if(k + 1 < n_exons) pos += 200 + rng() % 4801;
+      }
+      if(pos + 25000 > bench_chr_lens[chr]) break;
+      genes.push_back(gene);
+      pos += 2000 + rng() % 8001;
+    }
+  }
+  std::exponential_distribution<double> gene_weight(1.0);
+  std::vector<double> weights(genes.size());
+  for(unsigned int g = 0; g < genes.size(); g++) weights[g] = gene_weight(rng);
+  std::discrete_distribution<unsigned int> pick_gene(weights.begin(), weights.end());
+  std::discrete_distribution<unsigned int> pick_chr(bench_chr_lens, bench_chr_lens + bench_n_chrs);
+  std::uniform_int_distribution<unsigned int> frag_len_dist(read_len, 3 * read_len);
+
+  std::string buf;
+  std::vector<bench_record> records;
+  records.reserve(2 * n_fragments);
+  bench_blocks left;
+  bench_blocks right;
+  char name[32];
+  for(size_t i = 0; i < n_fragments; i++) {
+    snprintf(name, sizeof(name), "BENCH%010lu", (unsigned long)i);
+    double r = unif(rng);
+    unsigned int frag_len = frag_len_dist(rng);
+    const bench_gene &gene = genes.at(pick_gene(rng));
+    unsigned int tx_len = bench_tx_len(gene);
+    unsigned int gene_start = gene.exons.front().first;
+    unsigned int gene_len = gene.exons.back().second - gene_start;
+
+    // Gene-derived fragments are stranded, with read 1 antisense to the gene
+    if(r < splice_rate && tx_len >= read_len) {
+      frag_len = std::min(frag_len, tx_len);
+      unsigned int tx_start = rng() % (tx_len - frag_len + 1);
+      bench_tx_blocks(gene, tx_start, read_len, left);
+      bench_tx_blocks(gene, tx_start + frag_len - read_len, read_len, right);
+      bench_add_pair(buf, records, name, gene.chr, left, right, gene.strand == '-', read_len, rng);
+    } else if(r < splice_rate + (1 - splice_rate) * 0.7 && gene_len >= read_len) {
+      frag_len = std::min(frag_len, gene_len);
+      unsigned int start = gene_start + rng() % (gene_len - frag_len + 1);
+      left.assign(1, std::make_pair(start, start + read_len));
+      right.assign(1, std::make_pair(start + frag_len - read_len, start + frag_len));
+      bench_add_pair(buf, records, name, gene.chr, left, right, gene.strand == '-', read_len, rng);
+    } else {
+      unsigned int chr = pick_chr(rng);
+      unsigned int start = rng() % (bench_chr_lens[chr] - frag_len + 1);
+      left.assign(1, std::make_pair(start, start + read_len));
+      right.assign(1, std::make_pair(start + frag_len - read_len, start + frag_len));
+      bench_add_pair(buf, records, name, chr, left, right, rng() % 2 == 0, read_len, rng);
+    }
+  }
+
+  std::vector<size_t> order(records.size());
+  for(size_t i = 0; i < order.size(); i++) order[i] = i;
+  if(sort_order == "coordinate") {
+    std::stable_sort(order.begin(), order.end(), [&records](const size_t a, const size_t b) {
+      return(records[a].refID < records[b].refID ||
+        (records[a].refID == records[b].refID && records[a].pos < records[b].pos));
+    });
+  } else if(sort_order == "unsorted") {
+    // Mates stay adjacent, as written by aligners
+    std::vector<size_t> pairs(order.size() / 2);
+    for(size_t i = 0; i < pairs.size(); i++) pairs[i] = i;
+    std::shuffle(pairs.begin(), pairs.end(), rng);
+    for(size_t i = 0; i < pairs.size(); i++) {
+      order[2 * i] = 2 * pairs[i];
+      order[2 * i + 1] = 2 * pairs[i] + 1;
+    }
+  }
+
+  std::string text = "@HD\tVN:1.6\tSO:" + sort_order + "\n";
+  for(unsigned int chr = 0; chr < bench_n_chrs; chr++) {
+    text += std::string("@SQ\tSN:") + bench_chr_names[chr] + "\tLN:" +
+      std::to_string(bench_chr_lens[chr]) + "\n";
+  }
+  text += "@PG\tID:nxtirf\tPN:nxtirf\tCL:bench_gen\n";
+  std::string header("BAM\1", 4);
+  refBinaryWriter::Append(header, (int32_t)text.size());
+  header.append(text);
+  refBinaryWriter::Append(header, (int32_t)bench_n_chrs);
+  for(unsigned int chr = 0; chr < bench_n_chrs; chr++) {
+    refBinaryWriter::Append(header, (int32_t)(strlen(bench_chr_names[chr]) + 1));
+    header.append(bench_chr_names[chr]);
+    header.push_back('\0');
+    refBinaryWriter::Append(header, (int32_t)bench_chr_lens[chr]);
+  }
+
+  std::string bam_file = out_dir + "/bench.bam";
+  std::vector<uint64_t> block_offsets;
+  if(bench_write_bam(bam_file, header, buf, records, order, block_offsets) != 0) return(1);
+  if(sort_order == "coordinate" &&
+      bench_write_bai(bam_file + ".bai", header.size(), records, order, block_offsets) != 0) {
+    return(1);
+  }
+  if(bench_write_ref(out_dir + "/IRFinder.ref.gz", genes) != 0) return(1);
+
+  cout << "Wrote " << n_fragments << " fragments (" << read_len << " bp reads, "
+    << genes.size() << " genes, " << sort_order << " order) to " << bam_file << "\n";
+  return(0);
+}
+
+// ################################ BENCHMARKS #################################
+
+// Upper limit on fragments recorded for the processor benchmarks
+static const size_t bench_max_fragments = 2000000;
+
+static double bench_elapsed_ms(const std::chrono::steady_clock::time_point &t0) {
+  return(std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - t0).count());
+}
+
+// Times of each benchmark, for each thread count, in order of first use
+class bench_results {
+  private:
+    std::vector<std::string> names;
+    std::map<std::string, std::vector< std::vector<double> > > times;
+    unsigned int n_thread_counts;
+  public:
+    bench_results(unsigned int _n_thread_counts) : n_thread_counts(_n_thread_counts) {};
+    void add(const std::string &name, unsigned int thread_index, double ms) {
+      auto it = times.find(name);
+      if(it == times.end()) {
+        names.push_back(name);
+        it = times.insert(std::make_pair(name,
+          std::vector< std::vector<double> >(n_thread_counts))).first;
+      }
+      it->second.at(thread_index).push_back(ms);
+    };
+    const std::vector<std::string> & GetNames() const { return(names); };
+    double mean(const std::string &name, unsigned int thread_index) const {
+      const std::vector<double> & t = times.at(name).at(thread_index);
+      double sum = 0;
+      for(auto it = t.begin(); it != t.end(); it++) sum += *it;
+      return(t.size() > 0 ? sum / t.size() : 0);
+    };
+    double min(const std::string &name, unsigned int thread_index) const {
+      const std::vector<double> & t = times.at(name).at(thread_index);
+      return(t.size() > 0 ? *std::min_element(t.begin(), t.end()) : 0);
+    };
+};
+
+static std::string bench_json_string(const std::string &s) {
+  std::string out = "\"";
+  for(auto c = s.begin(); c != s.end(); c++) {
+    if(*c == '"' || *c == '\\') out.push_back('\\');
+    out.push_back(*c);
+  }
+  out.push_back('"');
+  return(out);
+}
+
+// Runs recorded fragments through per-thread copies of a processor, each
+//   thread taking a contiguous slice of the fragments
+template <class Proc> static double bench_replay(std::vector<Proc*> &procs,
+    const Proc &proc_template, const std::vector<chr_entry> &chrs,
+    const std::vector<FragmentBlocks> &frags, unsigned int n_threads
+) {
+  for(unsigned int k = 0; k < n_threads; k++) {
+    procs.push_back(new Proc(proc_template));
+    procs.back()->ChrMapUpdate(chrs);
+  }
+  auto t0 = std::chrono::steady_clock::now();
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads) schedule(static,1)
+#endif
+  for(unsigned int k = 0; k < n_threads; k++) {
+    size_t i_end = frags.size() * (k + 1) / n_threads;
+    for(size_t i = frags.size() * k / n_threads; i < i_end; i++) {
+      procs.at(k)->Proc::ProcessBlocks(frags[i]);
+    }
+  }
+  return(bench_elapsed_ms(t0));
+}
+
+template <class Proc> static void bench_delete(std::vector<Proc*> &procs) {
+  for(unsigned int k = 0; k < procs.size(); k++) delete procs.at(k);
+  procs.clear();
+}
+
+int Benchmark_Pipeline(const std::string &bam_file, const std::string &reference_file,
+    const std::string &json_file, const std::vector<unsigned int> &thread_counts,
+    unsigned int n_reps
+) {
+  if(thread_counts.size() == 0) {
+    cout << "No thread counts given\n";
+    return(1);
+  }
+  if(n_reps < 1) n_reps = 1;
+
+  std::string s_ref = reference_file;
+  std::vector<std::string> ref_names;
+  std::vector<std::string> ref_alias;
+  std::vector<uint32_t> ref_lengths;
+  CoverageBlocksIRFinder CB_template;
+  SpansPoint SP_template;
+  FragmentsInROI ROI_template;
+  JunctionCount JC_template;
+  auto t0 = std::chrono::steady_clock::now();
+  if(IRF_ref(s_ref, ref_names, ref_alias, ref_lengths,
+      CB_template, SP_template, ROI_template, JC_template, false) != 0) {
+    cout << "Reading IRFinder reference failed. Exiting\n";
+    return(1);
+  }
+  double ref_ms = bench_elapsed_ms(t0);
+
+  std::vector<std::string> bam_chr_name;
+  std::vector<uint32_t> bam_chr_len;
+  size_t bam_size = 0;
+  {
+    pbam_in inbam((size_t)5e8, (size_t)1e9, 5, true, false);
+    std::vector<std::string> s_chr_names;
+    std::vector<uint32_t> u32_chr_lens;
+    if(inbam.openFile(bam_file, 1) != 0 || inbam.obtainChrs(s_chr_names, u32_chr_lens) < 1) {
+      cout << bam_file << " - contains no chromosomes mapped\n";
+      return(1);
+    }
+    bam_size = inbam.GetFileSize();
+    IRF_MatchChrs(s_chr_names, u32_chr_lens, ref_names, ref_alias, ref_lengths,
+      bam_chr_name, bam_chr_len);
+  }
+
+  // Record fragments (and the chromosome map) for the processor benchmarks
+  std::vector<FragmentBlocks> frags;
+  std::vector<chr_entry> chrs;
+  size_t n_fragments = 0;
+  bool coord_sorted = false;
+  {
+    pbam_in inbam((size_t)5e8, (size_t)1e9, 5, true, false);
+    inbam.openFile(bam_file, 1);
+    BAM2blocks BB(bam_chr_name, bam_chr_len);
+    BB.registerCallbackChrMappingChange( [&chrs](const std::vector<chr_entry> &chrmap) {
+      chrs = chrmap;
+    });
+    BB.registerCallbackProcessBatch( [&frags, &n_fragments](const FragmentBlocks * blocks, unsigned int n) {
+      for(unsigned int i = 0; i < n; i++) {
+        n_fragments++;
+        if(frags.size() >= bench_max_fragments) continue;
+        frags.push_back(blocks[i]);
+        frags.back().readName = NULL;   // not valid after the callback
+        frags.back().readNameLen = 0;
+      }
+    });
+    BB.openFile(&inbam);
+    std::vector<BAM2blocks*> BBchild(1, &BB);
+    while(0 == inbam.fillReads()) {
+      if(BB.processAll(0) == -1) {
+        cout << "Error reading " << bam_file << "\n";
+        return(1);
+      }
+      if(BB.isCoordinateSorted()) BAM2blocks::processSpares(BBchild);
+    }
+    coord_sorted = BB.isCoordinateSorted();
+  }
+
+  cout << "Benchmarking " << bam_file << " (" << n_fragments << " fragments), "
+    << n_reps << " repeats\n";
+
+  bench_results results(thread_counts.size());
+  std::vector<unsigned int> threads_used;
+  std::string tmp_txt = json_file + ".tmp.txt.gz";
+  std::string tmp_cov = json_file + ".tmp.cov";
+  for(unsigned int ti = 0; ti < thread_counts.size(); ti++) {
+    unsigned int n_threads = (unsigned int)Set_Threads(thread_counts.at(ti));
+    threads_used.push_back(n_threads);
+    cout << "Threads: " << n_threads << "\n";
+    for(unsigned int rep = 0; rep < n_reps; rep++) {
+      // Decompression, and dividing reads among threads
+      {
+        pbam_in inbam((size_t)5e8, (size_t)1e9, 5, true, false);
+        inbam.openFile(bam_file, n_threads);
+        if(n_threads > 1) inbam.SetDispatchChunkSize(bam_dispatch_chunk_size);
+        t0 = std::chrono::steady_clock::now();
+        while(0 == inbam.fillReads()) {
+#ifdef _OPENMP
+          #pragma omp parallel for num_threads(n_threads) schedule(static,1)
+#endif
+          for(unsigned int k = 0; k < n_threads; k++) {
+            while(inbam.supplyRead(k).validate()) {}
+          }
+        }
+        results.add("pbam_in::decompress", ti, bench_elapsed_ms(t0));
+      }
+
+      // Read pairing, excluding decompression
+      {
+        pbam_in inbam((size_t)5e8, (size_t)1e9, 5, true, false);
+        inbam.openFile(bam_file, n_threads);
+        if(n_threads > 1) inbam.SetDispatchChunkSize(bam_dispatch_chunk_size);
+        std::vector<BAM2blocks*> BBchild;
+        for(unsigned int k = 0; k < n_threads; k++) {
+          BBchild.push_back(new BAM2blocks(bam_chr_name, bam_chr_len));
+          BBchild.back()->registerCallbackProcessBatch(
+            [](const FragmentBlocks *, unsigned int) {} );
+          BBchild.back()->openFile(&inbam);
+        }
+        double ms = 0;
+        while(0 == inbam.fillReads()) {
+          t0 = std::chrono::steady_clock::now();
+#ifdef _OPENMP
+          #pragma omp parallel for num_threads(n_threads) schedule(static,1)
+#endif
+          for(unsigned int k = 0; k < n_threads; k++) {
+            BBchild.at(k)->processAll(k);
+          }
+          if(coord_sorted) BAM2blocks::processSpares(BBchild);
+          ms += bench_elapsed_ms(t0);
+        }
+        t0 = std::chrono::steady_clock::now();
+        if(n_threads > 1) BAM2blocks::processSpares(BBchild);
+        ms += bench_elapsed_ms(t0);
+        results.add("BAM2blocks::processAll", ti, ms);
+        bench_delete(BBchild);
+      }
+
+      // Processors, on the recorded fragments
+      std::vector<JunctionCount*> oJC;
+      std::vector<FragmentsInChr*> oChr;
+      std::vector<SpansPoint*> oSP;
+      std::vector<FragmentsInROI*> oROI;
+      std::vector<CoverageBlocksIRFinder*> oCB;
+      std::vector<FragmentsMap*> oFM;
+      FragmentsInChr Chr_template;
+      FragmentsMap FM_template;
+      results.add("JunctionCount::ProcessBlocks", ti,
+        bench_replay(oJC, JC_template, chrs, frags, n_threads));
+      results.add("FragmentsInChr::ProcessBlocks", ti,
+        bench_replay(oChr, Chr_template, chrs, frags, n_threads));
+      results.add("SpansPoint::ProcessBlocks", ti,
+        bench_replay(oSP, SP_template, chrs, frags, n_threads));
+      results.add("FragmentsInROI::ProcessBlocks", ti,
+        bench_replay(oROI, ROI_template, chrs, frags, n_threads));
+      results.add("CoverageBlocksIRFinder::ProcessBlocks", ti,
+        bench_replay(oCB, CB_template, chrs, frags, n_threads));
+      results.add("FragmentsMap::ProcessBlocks", ti,
+        bench_replay(oFM, FM_template, chrs, frags, n_threads));
+
+      t0 = std::chrono::steady_clock::now();
+      if(n_threads > 1) {
+        oJC.at(0)->Combine(oJC);
+        oFM.at(0)->Combine(oFM, n_threads);
+        for(unsigned int k = 1; k < n_threads; k++) {
+          oChr.at(0)->Combine(*oChr.at(k));
+          oSP.at(0)->Combine(*oSP.at(k));
+          oROI.at(0)->Combine(*oROI.at(k));
+          oCB.at(0)->Combine(*oCB.at(k));
+        }
+      }
+      results.add("Combine", ti, bench_elapsed_ms(t0));
+
+      t0 = std::chrono::steady_clock::now();
+      oJC.at(0)->sort_and_collapse_final();
+      results.add("JunctionCount::sort_and_collapse_final", ti, bench_elapsed_ms(t0));
+
+      t0 = std::chrono::steady_clock::now();
+      oFM.at(0)->sort_and_collapse_final(false);
+      results.add("FragmentsMap::sort_and_collapse_final", ti, bench_elapsed_ms(t0));
+
+      {
+        std::ostringstream os;
+        covWriter outCOV;
+        outCOV.SetOutputHandle(&os);
+        t0 = std::chrono::steady_clock::now();
+        oFM.at(0)->WriteBinary(&outCOV, false, n_threads);
+        results.add("covWriter", ti, bench_elapsed_ms(t0));
+      }
+      {
+        std::string output;
+        std::string QC;
+        t0 = std::chrono::steady_clock::now();
+        oCB.at(0)->WriteOutput(output, QC, *oJC.at(0), *oSP.at(0), *oFM.at(0), n_threads);
+        results.add("CoverageBlocksIRFinder::WriteOutput", ti, bench_elapsed_ms(t0));
+      }
+      bench_delete(oJC);
+      bench_delete(oChr);
+      bench_delete(oSP);
+      bench_delete(oROI);
+      bench_delete(oCB);
+      bench_delete(oFM);
+
+      // The whole pipeline, as run by IRF_main
+      t0 = std::chrono::steady_clock::now();
+      int ret = IRF_core(bam_file, tmp_txt, tmp_cov, ref_names, ref_alias, ref_lengths,
+        CB_template, SP_template, ROI_template, JC_template, false, n_threads);
+      results.add("IRF_core", ti, bench_elapsed_ms(t0));
+      std::remove(tmp_txt.c_str());
+      std::remove(tmp_cov.c_str());
+      if(ret != 0) {
+        cout << "Error running IRF_core on " << bam_file << "\n";
+        return(1);
+      }
+    }
+  }
+
+  std::ofstream out;
+  out.open(json_file);
+  if(!out.is_open()) {
+    cout << "Unable to write to " << json_file << "\n";
+    return(1);
+  }
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"bam\": " << bench_json_string(bam_file) << ",\n"
+    << "  \"reference\": " << bench_json_string(reference_file) << ",\n"
+    << "  \"bam_bytes\": " << bam_size << ",\n"
+    << "  \"coordinate_sorted\": " << (coord_sorted ? "true" : "false") << ",\n"
+    << "  \"fragments\": " << n_fragments << ",\n"
+    << "  \"fragments_replayed\": " << frags.size() << ",\n"
+    << "  \"inflate_backend\": "
+      << bench_json_string(pbam_inflate_backend_name(pbam_inflate_global().backend)) << ",\n"
+    << "  \"reference_load_ms\": " << ref_ms << ",\n"
+    << "  \"repeats\": " << n_reps << ",\n"
+    << "  \"threads\": [";
+  for(unsigned int ti = 0; ti < threads_used.size(); ti++) {
+    out << (ti > 0 ? ", " : "") << threads_used.at(ti);
+  }
+  out << "],\n  \"benchmarks\": [";
+
+  cout << "benchmark\tthreads\tmean ms\tmin ms\tspeedup\n";
+  const std::vector<std::string> & names = results.GetNames();
+  for(unsigned int b = 0; b < names.size(); b++) {
+    const std::string & name = names.at(b);
+    std::ostringstream mean_ms, min_ms, speedup;
+    mean_ms << std::fixed << std::setprecision(3);
+    min_ms << std::fixed << std::setprecision(3);
+    speedup << std::fixed << std::setprecision(3);
+    for(unsigned int ti = 0; ti < threads_used.size(); ti++) {
+      double ti_speedup = results.min(name, ti) > 0 ?
+        results.min(name, 0) / results.min(name, ti) : 0;
+      mean_ms << (ti > 0 ? ", " : "") << results.mean(name, ti);
+      min_ms << (ti > 0 ? ", " : "") << results.min(name, ti);
+      speedup << (ti > 0 ? ", " : "") << ti_speedup;
+      cout << name << "\t" << threads_used.at(ti) << "\t" << results.mean(name, ti)
+        << "\t" << results.min(name, ti) << "\t" << ti_speedup << "\n";
+    }
+    out << (b > 0 ? "," : "") << "\n    {\"name\": " << bench_json_string(name)
+      << ", \"mean_ms\": [" << mean_ms.str() << "], \"min_ms\": [" << min_ms.str()
+      << "], \"speedup\": [" << speedup.str() << "]}";
+  }
+  out << "\n  ]\n}\n";
+  out.close();
+  if(out.fail()) {
+    cout << "Error writing " << json_file << "\n";
+    return(1);
+  }
+  cout << "Results written to " << json_file << "\n";
+  return(0);
+}
+#endif
@@ -0,0 +1,60 @@
+/* BenchTools.h Synthetic data and benchmarks for the NxtIRF pipeline
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef CODE_BENCHTOOLS
+#define CODE_BENCHTOOLS
+
+#include "includedefine.h"
+
+#ifndef RNXTIRF
+// Standalone only
+
+/*
+  Writes a synthetic paired-end BAM (bench.bam) and matching IRFinder
+    reference (IRFinder.ref.gz) to out_dir, from a fixed seed.
+  splice_rate is the fraction of fragments drawn from spliced transcripts;
+    the rest are drawn from pre-mRNA (70%) or from anywhere in the genome.
+  sort_order is one of "coordinate", "queryname" or "unsorted" (aligner
+    output order: mates adjacent, pairs in random order).
+  Coordinate-sorted BAMs also get an index (bench.bam.bai).
+*/
+int Benchmark_Generate(const std::string &out_dir,
+    size_t n_fragments, unsigned int read_len, double splice_rate,
+    const std::string &sort_order
+);
+
+/*
+  Times each stage of the pipeline (decompression, BAM2blocks, each
+    processor's ProcessBlocks, combining threads, final sorts and writing
+    the outputs), as well as the whole of IRF_core, at each of the given
+    thread counts. Each is repeated n_reps times.
+  Results (mean / min times and speedup over the first thread count) are
+    written to json_file.
+*/
+int Benchmark_Pipeline(const std::string &bam_file, const std::string &reference_file,
+    const std::string &json_file, const std::vector<unsigned int> &thread_counts,
+    unsigned int n_reps
+);
+
+#endif
+
+#endif
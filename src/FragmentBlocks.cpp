@@ -31,11 +31,8 @@ SOFTWARE.  */
 // to the variety of callback watchers that require fragment blocks to update their stats.
 
 FragmentBlocks::FragmentBlocks() {
-	rStarts[0].reserve(initial_alloc);
-	rLens[0].reserve(initial_alloc);
-	rStarts[1].reserve(initial_alloc);
-	rLens[1].reserve(initial_alloc);
-	readName.reserve(max_read_name);
+	readName = NULL;
+	readNameLen = 0;
 	readCount = 0;
 }
 
@@ -27,6 +27,55 @@ SOFTWARE.  */
 
 #include "includedefine.h"
 
+/* Block starts (or lengths) of one read, with the vector operations that
+ * BAM2blocks and the processors use.
+ * The first inline_blocks values are stored inside the object, so that filling
+ * a FragmentBlocks does not allocate for ordinary reads. Reads with more blocks
+ * than this (rare, e.g. very long reads) spill over into a heap vector, whose
+ * capacity is kept for later reads.
+ */
+class FragmentBlockList {
+	private:
+		static const unsigned int inline_blocks = 16;
+		int inline_data[inline_blocks];
+		std::vector<int> overflow;
+		unsigned int n = 0;
+		bool spilled = false;
+	public:
+		unsigned int size() const { return(n); };
+		int & operator[](unsigned int i) { return(spilled ? overflow[i] : inline_data[i]); };
+		const int & operator[](unsigned int i) const { return(spilled ? overflow[i] : inline_data[i]); };
+		const int * begin() const { return(spilled ? overflow.data() : inline_data); };
+		const int * end() const { return(begin() + n); };
+
+		// As std::vector::resize: new values are zero
+		void resize(unsigned int new_n) {
+			if(new_n > inline_blocks) {
+				if(!spilled) {
+					overflow.assign(inline_data, inline_data + n);
+					spilled = true;
+				}
+				overflow.resize(new_n, 0);
+			} else {
+				if(spilled) {
+					for(unsigned int i = 0; i < new_n && i < n; i++) inline_data[i] = overflow[i];
+					overflow.clear();
+					spilled = false;
+				}
+				for(unsigned int i = n; i < new_n; i++) inline_data[i] = 0;
+			}
+			n = new_n;
+		};
+		void push_back(int val) {
+			if(!spilled && n < inline_blocks) {
+				inline_data[n++] = val;
+			} else {
+				resize(n + 1);
+				overflow[n - 1] = val;
+			}
+		};
+};
+
 /* A class to store up to 2 reads belonging to a single fragment.
  * It is a storage class, almost a struct, it does not perform processing itself.
  * Read1 is always valid.
@@ -39,17 +88,18 @@ SOFTWARE.  */
  */
 class FragmentBlocks {
 	private:
-		static const int initial_alloc = 100;
-		static const int max_read_name = 300;
 		std::vector<std::string> chr_names; //TODO - this is currently unused??
 	public:
 		FragmentBlocks();
 		const std::string chrName() const;
 		void ChrMapUpdate(const std::vector<std::string>& chrmap);
 
-		std::string readName;
-		std::vector<int> rStarts[2];
-		std::vector<int> rLens[2];
+		// Name of read 1. Points into the BAM record being processed (not
+		//   null-terminated), so it is only valid during the ProcessBlocks callbacks
+		const char * readName;
+		unsigned int readNameLen;
+		FragmentBlockList rStarts[2];
+		FragmentBlockList rLens[2];
 		unsigned int readStart[2];
 		unsigned int readEnd[2];
 		int readCount;
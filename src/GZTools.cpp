@@ -26,6 +26,7 @@ GZReader::GZReader() {
   bufferLen = 0;
   bufferPos = 0;
   buffer = NULL;
+  gz_in = NULL;
   
   loaded = false; lazy = false; streamed = false;
 }
@@ -109,11 +110,92 @@ int GZReader::GetBuffer() {
   }
 }
 
+// Reads a whole BGZF file into dest, inflating each block in one shot
+//   Returns 0 if success, 1 if the file is not BGZF (or not entirely so),
+//   or a zlib error code if a block is corrupt
+int GZReader::LoadBGZF(const std::string &s_filename, std::string &dest) {
+  std::ifstream in;
+  in.open(s_filename, std::ifstream::binary);
+  if(!in.is_open()) return(1);
+  char head[18];
+  in.read(head, 18);
+  if(in.fail() || memcmp(head, bamGzipHead, bamGzipHeadLength) != 0) return(1);
+  in.seekg(0, std::ios_base::beg);
+  std::ostringstream oss;
+  oss << in.rdbuf();
+  std::string raw = oss.str();
+
+  // Locate blocks and total uncompressed size before inflating
+  std::vector<size_t> block_pos;
+  size_t total = 0;
+  size_t pos = 0;
+  while(pos < raw.size()) {
+    if(raw.size() - pos < 18 + 8 || 
+        memcmp(raw.data() + pos, bamGzipHead, bamGzipHeadLength) != 0) {
+      return(1);
+    }
+    uint16_t bsize;
+    uint32_t isize;
+    memcpy(&bsize, raw.data() + pos + 16, 2);
+    if((size_t)bsize + 1 < 18 + 8 || pos + bsize + 1 > raw.size()) return(1);
+    memcpy(&isize, raw.data() + pos + bsize + 1 - 4, 4);
+    if(isize > 65536) return(1);
+    block_pos.push_back(pos);
+    total += isize;
+    pos += (size_t)bsize + 1;
+  }
+  
+  dest.resize(total);
+  pbam_inflater inflater;
+  size_t dest_pos = 0;
+  for(unsigned int i = 0; i < block_pos.size(); i++) {
+    const char * block = raw.data() + block_pos.at(i);
+    uint16_t bsize;
+    uint32_t crc;
+    uint32_t isize;
+    memcpy(&bsize, block + 16, 2);
+    memcpy(&crc, block + bsize + 1 - 8, 4);
+    memcpy(&isize, block + bsize + 1 - 4, 4);
+    if(isize == 0) continue;
+    int ret = inflater.inflate_raw(block + 18, (size_t)bsize + 1 - 18 - 8, 
+      &dest[dest_pos], isize, crc);
+    if(ret != Z_OK) {
+      cout << "Exception during zlib decompression: (" << ret << ") ";
+      dest.clear();
+      return(ret);
+    }
+    dest_pos += isize;
+  }
+  return(0);
+}
+
 // Loads a file
 //   Options:
 //   - lazy = FALSE: opens file as well as reads entire file into memory
 //   - asStream = TRUE: copies read data into istringstream object
+//   BGZF files read with lazy = FALSE are inflated using the selected inflate
+//   backend (see pbam_inflate.hpp); others are read using gzread
 int GZReader::LoadGZ(std::string s_filename, bool asStream, bool lazymode) {
+  if(lazymode == false) {
+    std::string bgzf_data;
+    int bgzf_ret = LoadBGZF(s_filename, bgzf_data);
+    if(bgzf_ret == 0) {
+      if(asStream) {
+        iss.str(bgzf_data);
+        loaded = true; streamed = true; lazy = false;
+      } else {
+        char *buffer_tmp;
+        buffer = (char*)realloc(buffer_tmp = buffer, bgzf_data.size());
+        memcpy(buffer, bgzf_data.data(), bgzf_data.size());
+        bufferLen = bgzf_data.size();
+        loaded = true; streamed = false; lazy = false;
+      }
+      return(0);
+    } else if(bgzf_ret != 1) {
+      return(bgzf_ret);
+    }
+  }
+
   gz_in = gzopen(s_filename.c_str(), "r");
   
   if(lazymode == false) {
@@ -147,7 +229,7 @@ int GZReader::LoadGZ(std::string s_filename, bool asStream, bool lazymode) {
       }
     }
     if(asStream) {
-      iss.str((char*)data);
+      iss.str(std::string((char*)data, curpos));
       loaded = true; streamed = true; lazy = false;
     } else {
       char *buffer_tmp;
@@ -157,6 +239,7 @@ int GZReader::LoadGZ(std::string s_filename, bool asStream, bool lazymode) {
       loaded = true; streamed = false; lazy = false;
     }
     gzclose(gz_in);
+    gz_in = NULL;
     free(data);
   } else {
     loaded = true; streamed = false; lazy = true;
@@ -175,12 +258,13 @@ void GZReader::ignore(const unsigned long len) {
 }
 
 bool GZReader::eof() {
-  return(gzeof(gz_in) && bufferPos == bufferLen);
+  return((gz_in == NULL || gzeof(gz_in)) && bufferPos == bufferLen);
 }
 
 // Only required for lazy mode
 int GZReader::closeGZ() {
-	gzclose(gz_in);
+  if(gz_in != NULL) gzclose(gz_in);
+  gz_in = NULL;
 	return(0);
 }
 
@@ -277,4 +361,394 @@ int GZWriter::flush(bool final) {
     bufferPos=0;
   }
   return(Z_OK);
-}
\ No newline at end of file
+}
+void BGZFWriter::SetOutputHandle(std::ostream *out_stream) {
+  OUT = out_stream;
+}
+
+void BGZFWriter::SetThreads(unsigned int threads) {
+  n_threads = threads > 0 ? threads : 1;
+}
+
+// Compresses len (<= 65280) bytes from src as one BGZF block, appended to dest.
+//   Runs on worker threads, so a failure is described in error, not printed
+int BGZFWriter::compressBlock(const char * src, unsigned int len, std::string &dest,
+    std::string &error) {
+  char comp_buffer[65536];
+  z_stream zs;
+  int level = Z_DEFAULT_COMPRESSION;
+  int ret;
+  
+  // Incompressible data may not fit in a block; if so, store it instead
+  for(int attempt = 0; attempt < 2; attempt++) {
+    zs.zalloc = Z_NULL; zs.zfree = Z_NULL; zs.opaque = Z_NULL;
+    zs.next_in = (Bytef*)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*)comp_buffer;
+    zs.avail_out = 65536 - 18 - 8;
+    
+    // -15 to disable zlib header/footer
+    ret = deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    if(ret != Z_OK) {
+      error = "Exception during zlib initialization: (" + std::to_string(ret) + ")\n";
+      return(ret);
+    }
+    ret = deflate(&zs, Z_FINISH);
+    deflateEnd(&zs);
+    if(ret == Z_STREAM_END) break;
+    if(ret != Z_OK && ret != Z_BUF_ERROR) {
+      error = "Exception during zlib deflate: (" + std::to_string(ret) + ")\n";
+      return(ret);
+    }
+    level = Z_NO_COMPRESSION;
+  }
+  if(ret != Z_STREAM_END) {
+    error = "Exception during zlib deflate: (" + std::to_string(ret) + ")\n";
+    return(Z_BUF_ERROR);
+  }
+  
+  uint16_t block_len = zs.total_out + 18 + 8 - 1;
+  uint32_t crc = crc32(crc32(0L, NULL, 0L), (Bytef*)src, len);
+  uint32_t isize = len;
+  dest.append(bamGzipHead, bamGzipHeadLength);
+  dest.append((char *)&block_len, 2);
+  dest.append(comp_buffer, zs.total_out);
+  dest.append((char *)&crc, 4);
+  dest.append((char *)&isize, 4);
+  return(Z_OK);
+}
+
+int BGZFWriter::compress(const std::string& src, std::string& dest) const {
+  return(compress(src.data(), src.size(), dest));
+}
+
+int BGZFWriter::compress(const char * src, size_t len, std::string& dest) const {
+  unsigned int n_blocks = (len + block_size - 1) / block_size;
+  std::vector<std::string> blocks(n_blocks);
+  std::vector<std::string> errors(n_blocks);
+  std::vector<int> rets(n_blocks, Z_OK);
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads) schedule(static,1)
+#endif
+  for(unsigned int i = 0; i < n_blocks; i++) {
+    size_t start = (size_t)i * block_size;
+    unsigned int block_len = (unsigned int)std::min((size_t)block_size, len - start);
+    rets.at(i) = compressBlock(src + start, block_len, blocks.at(i), errors.at(i));
+  }
+  
+  for(unsigned int i = 0; i < n_blocks; i++) {
+    if(rets.at(i) != Z_OK) {
+      if(msg_log) {
+        msg_log->append(errors.at(i));
+      } else {
+        cout << errors.at(i);
+      }
+      return(rets.at(i));
+    }
+    dest.append(blocks.at(i));
+    std::string().swap(blocks.at(i));
+  }
+  return(Z_OK);
+}
+
+int BGZFWriter::writecompressed(const std::string& src) {
+  OUT->write(src.data(), src.size());
+  if(OUT->fail()) return(Z_ERRNO);
+  return(Z_OK);
+}
+
+// Compresses a string as is, in BGZF blocks of up to 65280 bytes compressed
+//   in parallel, and writes them
+int BGZFWriter::writestring(const std::string& s_src) {
+  std::string compressed;
+  int ret = compress(s_src, compressed);
+  if(ret != Z_OK) return(ret);
+  return(writecompressed(compressed));
+}
+
+int BGZFWriter::flush(bool final) {
+  if(final) {
+    OUT->write(bamEOF, bamEOFlength);
+  }
+  OUT->flush();
+  if(OUT->fail()) return(Z_ERRNO);
+  return(Z_OK);
+}
+
+BGZFSink::BGZFSink(const BGZFWriter &gz, std::string &out) {
+  writer = &gz;
+  dest = &out;
+  // Enough blocks to keep each thread busy
+  batch_size = (size_t)BGZFWriter::block_size * 8 * gz.GetThreads();
+  pending.reserve(batch_size);
+}
+
+int BGZFSink::write(const char * src, size_t len) {
+  pending.append(src, len);
+  if(pending.size() >= batch_size && status == Z_OK) {
+    size_t n_full = pending.size() - pending.size() % BGZFWriter::block_size;
+    status = writer->compress(pending.data(), n_full, *dest);
+    pending.erase(0, n_full);
+  }
+  return(status);
+}
+
+int BGZFSink::close() {
+  if(pending.size() > 0 && status == Z_OK) {
+    status = writer->compress(pending, *dest);
+  }
+  std::string().swap(pending);
+  return(status);
+}
+
+// Stored (BTYPE 00) deflate block: header byte, LEN, NLEN, then the data
+int BGZFWriter::storeBlock(const char * src, unsigned int len, std::string &dest) {
+  if(len > block_size) return(Z_BUF_ERROR);
+  uint16_t block_len = len + 18 + 5 + 8 - 1;
+  uint16_t stored_len = len;
+  uint16_t stored_nlen = ~stored_len;
+  uint32_t crc = crc32(crc32(0L, NULL, 0L), (Bytef*)src, len);
+  uint32_t isize = len;
+  dest.append(bamGzipHead, bamGzipHeadLength);
+  dest.append((char *)&block_len, 2);
+  dest.push_back('\x01');     // BFINAL = 1, BTYPE = 00
+  dest.append((char *)&stored_len, 2);
+  dest.append((char *)&stored_nlen, 2);
+  dest.append(src, len);
+  dest.append((char *)&crc, 4);
+  dest.append((char *)&isize, 4);
+  return(Z_OK);
+}
+
+const char * BGZFSectionReader::index_header = "SectionIndex";
+
+int BGZFSectionReader::WriteIndex(const std::vector<BGZFSection> &sections, std::string &dest) {
+  std::ostringstream oss;
+  oss << index_header << "\tStart\tEnd\n";
+  for(auto const &sec : sections) {
+    oss << sec.name << "\t" << sec.start << "\t" << sec.end << "\n";
+  }
+  oss << "\n";
+  std::string index = oss.str();
+  if(index.size() > BGZFWriter::block_size) {
+    // Too many sections for one block: leave the file unindexed
+    return(Z_OK);
+  }
+  return(BGZFWriter::storeBlock(index.data(), (unsigned int)index.size(), dest));
+}
+
+int BGZFSectionReader::Open(const std::string &s_filename) {
+  Close();
+  in.open(s_filename, std::ifstream::binary);
+  if(!in.is_open()) return(-1);
+  in.seekg(0, std::ios_base::end);
+  file_size = (uint64_t)in.tellg();
+  
+  // EOF marker, preceded by the index block (at least 18 + 5 + 8 bytes)
+  if(file_size < (uint64_t)bamEOFlength + 31 + 4) return(-1);
+  char tail[bamEOFlength + 4];
+  in.seekg(file_size - bamEOFlength - 4);
+  in.read(tail, bamEOFlength + 4);
+  if(in.fail() || memcmp(tail + 4, bamEOF, bamEOFlength) != 0) return(-1);
+  uint32_t isize;
+  memcpy(&isize, tail, 4);
+  uint64_t block_len = (uint64_t)isize + 18 + 5 + 8;
+  if(isize > BGZFWriter::block_size || block_len + bamEOFlength > file_size) return(-1);
+  
+  std::string block(block_len, '\0');
+  uint64_t block_start = file_size - bamEOFlength - block_len;
+  in.seekg(block_start);
+  in.read(&block[0], block_len);
+  if(in.fail()) return(-1);
+  
+  uint16_t bsize, stored_len, stored_nlen;
+  uint32_t crc;
+  memcpy(&bsize, block.data() + 16, 2);
+  memcpy(&stored_len, block.data() + 19, 2);
+  memcpy(&stored_nlen, block.data() + 21, 2);
+  memcpy(&crc, block.data() + block_len - 8, 4);
+  if(memcmp(block.data(), bamGzipHead, bamGzipHeadLength) != 0 ||
+      (uint64_t)bsize + 1 != block_len || block[18] != '\x01' || 
+      stored_len != isize || (uint16_t)~stored_nlen != stored_len ||
+      crc != crc32(crc32(0L, NULL, 0L), (Bytef*)block.data() + 23, isize)) {
+    return(-1);
+  }
+
+  std::istringstream iss(block.substr(23, isize));
+  std::string myLine;
+  std::getline(iss, myLine);
+  if(myLine.compare(0, strlen(index_header), index_header) != 0) return(-1);
+  while(std::getline(iss, myLine) && myLine.size() > 0) {
+    std::istringstream line_iss(myLine);
+    BGZFSection sec;
+    std::getline(line_iss, sec.name, '\t');
+    line_iss >> sec.start >> sec.end;
+    if(line_iss.fail() || sec.start > sec.end || sec.end > block_start) {
+      sections.clear();
+      return(-1);
+    }
+    sections.push_back(sec);
+  }
+  return(0);
+}
+
+void BGZFSectionReader::Close() {
+  if(in.is_open()) in.close();
+  in.clear();
+  sections.clear();
+  file_size = 0;
+}
+
+int BGZFSectionReader::ReadSection(const std::string &header, std::string &dest, 
+    unsigned int n_threads) {
+  const BGZFSection * sec = NULL;
+  for(auto const &s : sections) {
+    if(s.name.compare(0, header.size(), header) == 0) {
+      sec = &s;
+      break;
+    }
+  }
+  if(!sec || !in.is_open()) return(-1);
+
+  std::string raw(sec->end - sec->start, '\0');
+  in.seekg(sec->start);
+  in.read(&raw[0], raw.size());
+  if(in.fail()) return(-1);
+
+  std::vector<size_t> block_pos;
+  std::vector<size_t> block_len;
+  size_t pos = 0;
+  while(pos + 18 + 8 <= raw.size()) {
+    uint16_t bsize;
+    memcpy(&bsize, raw.data() + pos + 16, 2);
+    if(memcmp(raw.data() + pos, bamGzipHead, bamGzipHeadLength) != 0 ||
+        pos + bsize + 1 > raw.size()) {
+      return(-1);
+    }
+    block_pos.push_back(pos);
+    block_len.push_back((size_t)bsize + 1);
+    pos += (size_t)bsize + 1;
+  }
+  if(pos != raw.size()) return(-1);
+
+  std::vector<std::string> blocks(block_pos.size());
+  std::vector<int> rets(block_pos.size(), Z_OK);
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads > 0 ? n_threads : 1)
+  {
+    pbam_inflater inflater;
+    #pragma omp for schedule(static,1)
+    for(unsigned int i = 0; i < blocks.size(); i++) {
+      rets.at(i) = inflater.inflate_block(raw.data() + block_pos.at(i), 
+        block_len.at(i), blocks.at(i));
+    }
+  }
+#else
+  pbam_inflater inflater;
+  for(unsigned int i = 0; i < blocks.size(); i++) {
+    rets.at(i) = inflater.inflate_block(raw.data() + block_pos.at(i), 
+      block_len.at(i), blocks.at(i));
+  }
+#endif
+
+  dest.clear();
+  for(unsigned int i = 0; i < blocks.size(); i++) {
+    if(rets.at(i) != Z_OK) return(-1);
+    dest.append(blocks.at(i));
+  }
+  return(0);
+}
+
+#ifndef RNXTIRF
+#include <chrono>
+
+int Benchmark_Inflate(const std::string &s_filename, unsigned int n_threads, unsigned int n_reps) {
+  std::ifstream in;
+  in.open(s_filename, std::ifstream::binary);
+  if(!in.is_open()) {
+    cout << "Unable to open " << s_filename << "\n";
+    return(1);
+  }
+  std::ostringstream oss;
+  oss << in.rdbuf();
+  std::string raw = oss.str();
+  in.close();
+  
+  std::vector<size_t> block_pos;
+  std::vector<size_t> block_len;
+  size_t total = 0;
+  size_t pos = 0;
+  while(pos + 18 + 8 <= raw.size() && 
+      memcmp(raw.data() + pos, bamGzipHead, bamGzipHeadLength) == 0) {
+    uint16_t bsize;
+    uint32_t isize;
+    memcpy(&bsize, raw.data() + pos + 16, 2);
+    if((size_t)bsize + 1 < 18 + 8 || pos + bsize + 1 > raw.size()) break;
+    memcpy(&isize, raw.data() + pos + bsize + 1 - 4, 4);
+    block_pos.push_back(pos);
+    block_len.push_back((size_t)bsize + 1);
+    total += isize;
+    pos += (size_t)bsize + 1;
+  }
+  if(pos != raw.size() || block_pos.size() == 0) {
+    cout << s_filename << " is not a BGZF file\n";
+    return(1);
+  }
+
+  unsigned int n_threads_to_use = 1;
+#ifdef _OPENMP
+  if(n_threads > 1) n_threads_to_use = n_threads;
+#endif
+  if(n_reps < 1) n_reps = 1;
+  
+  cout << "Inflating " << block_pos.size() << " BGZF blocks (" 
+    << (double)total / 1048576 << " Mb), " << n_threads_to_use << " threads, "
+    << n_reps << " repeats\n"
+    << "backend\tCRC\tMB/s\tMB/s per core\n";
+  
+  bool any_error = false;
+  for(int backend = 0; backend < pbam_inflate_n_backends; backend++) {
+    if(!pbam_inflate_available(backend)) {
+      cout << pbam_inflate_backend_name(backend) << "\tnot compiled\n";
+      continue;
+    }
+    for(int crc_mode = 1; crc_mode >= 0; crc_mode--) {
+      bool error = false;
+      auto t0 = std::chrono::steady_clock::now();
+      for(unsigned int r = 0; r < n_reps; r++) {
+#ifdef _OPENMP
+        #pragma omp parallel num_threads(n_threads_to_use)
+#endif
+        {
+          pbam_inflater inflater(backend, crc_mode == 1);
+          std::string dest;
+#ifdef _OPENMP
+          #pragma omp for schedule(static)
+#endif
+          for(unsigned int i = 0; i < block_pos.size(); i++) {
+            if(inflater.inflate_block(raw.data() + block_pos.at(i), block_len.at(i), dest) != Z_OK) {
+#ifdef _OPENMP
+              #pragma omp critical
+#endif
+              error = true;
+            }
+          }
+        }
+      }
+      auto t1 = std::chrono::steady_clock::now();
+      double secs = std::chrono::duration<double>(t1 - t0).count();
+      double mb_per_sec = (double)total * n_reps / 1048576 / secs;
+      cout << pbam_inflate_backend_name(backend) << "\t" 
+        << (crc_mode == 1 ? "on" : "off") << "\t" << mb_per_sec << "\t" 
+        << mb_per_sec / n_threads_to_use << "\n";
+      if(error) {
+        cout << "Error: " << pbam_inflate_backend_name(backend) 
+          << " failed to inflate " << s_filename << "\n";
+        any_error = true;
+      }
+    }
+  }
+  return(any_error ? 1 : 0);
+}
+#endif
@@ -29,12 +29,20 @@ SOFTWARE.  */
 #include <zlib.h>
 #include <zconf.h>
 
+#include "pbam_defs.hpp"
+#include "pbam_inflate.hpp"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #define CHUNK_gz 262144
 
 class GZReader {
   private:
     gzFile gz_in;
     int GetBuffer();
+    int LoadBGZF(const std::string &s_filename, std::string &dest);
 
     char * buffer;            // stores data
     unsigned long bufferLen;  // amount read from file
@@ -74,4 +82,185 @@ public:
   int flush(bool final = false);
 };
 
+// Writes gzip output as a series of BGZF blocks (independent gzip members),
+//   which are compressed in parallel. Readable by zcat / GZReader as one file.
+// Text can be compressed ahead of time with compress(), then written in file order.
+class BGZFWriter {
+private:
+  ostream * OUT;
+  unsigned int n_threads = 1;
+  std::string * msg_log = NULL;
+  
+  static int compressBlock(const char * src, unsigned int len, std::string &dest,
+    std::string &error);
+public:
+  // Appends len (<= 65280) bytes from src as one uncompressed BGZF block to dest.
+  //   Its block size follows from ISIZE, so it can be found from the end of the file.
+  static int storeBlock(const char * src, unsigned int len, std::string &dest);
+
+  static const unsigned int block_size = 65280;   // uncompressed bytes per BGZF block
+
+  void SetOutputHandle(std::ostream *out_stream);
+  void SetThreads(unsigned int threads);
+  unsigned int GetThreads() const { return(n_threads); };
+  // Error messages are appended to s_log if given (eg: writers used off the
+  //   main thread), otherwise printed by the thread that called compress()
+  void SetMessageLog(std::string * s_log) { msg_log = s_log; };
+
+  // Appends BGZF-compressed src to dest
+  int compress(const char * src, size_t len, std::string& dest) const;
+  int compress(const std::string& src, std::string& dest) const;
+  int writecompressed(const std::string& src);
+  int writestring(const std::string& s_src);
+  int flush(bool final = false);   // final adds the BGZF EOF marker
+};
+
+/*
+  Index of a BGZF text file made of blank-line-terminated sections (eg: IRFinder
+    output), each of which starts on a BGZF block boundary.
+  The index is a section itself:
+    SectionIndex  Start  End
+    <first field of the section's header>  <compressed start offset>  <end offset>
+  stored in a single uncompressed block just before the BGZF EOF marker, so that
+    it is read without inflating the rest of the file.
+*/
+struct BGZFSection {
+  std::string name;
+  uint64_t start;
+  uint64_t end;
+};
+
+class BGZFSectionReader {
+private:
+  std::ifstream in;
+  uint64_t file_size = 0;
+  std::vector<BGZFSection> sections;
+public:
+  static const char * index_header;
+
+  // Appends the index of sections as a stored block to dest
+  static int WriteIndex(const std::vector<BGZFSection> &sections, std::string &dest);
+
+  // Returns 0 if the file has a section index; -1 otherwise (eg: older files)
+  int Open(const std::string &s_filename);
+  void Close();
+  const std::vector<BGZFSection> & GetSections() const { return(sections); };
+
+  // Inflates the first section whose name begins with header into dest,
+  //   header line included. Returns -1 if there is no such section
+  int ReadSection(const std::string &header, std::string &dest, unsigned int n_threads = 1);
+};
+
+// Destination of text output, eg: WriteOutput() of the ReadBlockProcessors
+class TextSink {
+public:
+  virtual ~TextSink() {};
+  virtual int write(const char * src, size_t len) = 0;
+  int write(const std::string& src) { return(write(src.data(), src.size())); };
+};
+
+// Appends text to a string
+class StringSink : public TextSink {
+private:
+  std::string * dest;
+public:
+  StringSink(std::string &out) : dest(&out) {};
+  using TextSink::write;
+  int write(const char * src, size_t len) { dest->append(src, len); return(0); };
+};
+
+// Writes text straight to an ostream
+class OStreamSink : public TextSink {
+private:
+  std::ostream * dest;
+public:
+  OStreamSink(std::ostream &out) : dest(&out) {};
+  using TextSink::write;
+  int write(const char * src, size_t len) { 
+    dest->write(src, len); 
+    return(dest->fail() ? -1 : 0); 
+  };
+};
+
+// Compresses text as it arrives, a batch of BGZF blocks at a time, appending to dest.
+//   close() compresses the remainder.
+class BGZFSink : public TextSink {
+private:
+  const BGZFWriter * writer;
+  std::string * dest;
+  std::string pending;
+  size_t batch_size;
+  int status = Z_OK;
+public:
+  BGZFSink(const BGZFWriter &gz, std::string &out);
+  using TextSink::write;
+  int write(const char * src, size_t len);
+  int close();
+};
+
+// Formats text into a reusable buffer that is passed to a TextSink in chunks.
+//   Numbers are formatted as std::ostream does by default.
+class TextBuffer {
+private:
+  TextSink * sink;
+  std::string buf;
+  size_t chunk_size;
+  
+  void check() { if(buf.size() >= chunk_size) flush(); };
+  void append_uint(unsigned long long val) {
+    char tmp[24];
+    char * p = tmp + 24;
+    do {
+      *--p = '0' + (char)(val % 10);
+      val /= 10;
+    } while(val > 0);
+    buf.append(p, tmp + 24 - p);
+    check();
+  };
+  void append_int(long long val) {
+    if(val < 0) {
+      buf.push_back('-');
+      append_uint(0ULL - (unsigned long long)val);
+    } else {
+      append_uint((unsigned long long)val);
+    }
+  };
+public:
+  TextBuffer(TextSink &out, size_t chunk = 65536) : sink(&out), chunk_size(chunk) {
+    buf.reserve(chunk + 256);
+  };
+  ~TextBuffer() { flush(); };
+  int flush() {
+    int ret = 0;
+    if(buf.size() > 0) ret = sink->write(buf.data(), buf.size());
+    buf.clear();
+    return(ret);
+  };
+
+  TextBuffer & write(const char * s, size_t len) { buf.append(s, len); check(); return(*this); };
+  TextBuffer & operator<<(const std::string &s) { buf.append(s); check(); return(*this); };
+  TextBuffer & operator<<(const char * s) { buf.append(s); check(); return(*this); };
+  TextBuffer & operator<<(char c) { buf.push_back(c); check(); return(*this); };
+  TextBuffer & operator<<(int val) { append_int(val); return(*this); };
+  TextBuffer & operator<<(long val) { append_int(val); return(*this); };
+  TextBuffer & operator<<(long long val) { append_int(val); return(*this); };
+  TextBuffer & operator<<(unsigned int val) { append_uint(val); return(*this); };
+  TextBuffer & operator<<(unsigned long val) { append_uint(val); return(*this); };
+  TextBuffer & operator<<(unsigned long long val) { append_uint(val); return(*this); };
+  TextBuffer & operator<<(double val) {
+    // Same as std::ostream default (precision 6, %g)
+    char tmp[32];
+    int n = snprintf(tmp, sizeof(tmp), "%g", val);
+    if(n > 0) buf.append(tmp, std::min(n, (int)sizeof(tmp) - 1));
+    check();
+    return(*this);
+  };
+};
+
+#ifndef RNXTIRF
+// Inflates every BGZF block of a file (e.g. a BAM or COV file) with each inflate
+//   backend compiled in, with and without CRC checks, and reports MB/s per core
+int Benchmark_Inflate(const std::string &s_filename, unsigned int n_threads, unsigned int n_reps);
+#endif
+
 #endif
\ No newline at end of file
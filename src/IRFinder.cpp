@@ -23,6 +23,8 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.  */
 
 #include "IRFinder.h"
+#include <chrono>
+#include <iomanip>
 
 // [[Rcpp::export]]
 int Has_OpenMP() {
@@ -57,6 +59,16 @@ int Test_OpenMP_For() {
 #endif
 }
 
+// Selects how BGZF blocks of BAM, COV and gzipped text files are inflated:
+//   backend 0 = zlib, 1 = libdeflate, 2 = ISA-L (if compiled in; otherwise the
+//   default: libdeflate, or zlib). verify_crc = false skips CRC32 checks of
+//   inflated data.
+//   Returns the backend that will be used.
+// [[Rcpp::export]]
+int Set_Inflate_Backend(int backend, bool verify_crc) {
+  return(pbam_set_inflate_backend(backend, verify_crc));
+}
+
 int Set_Threads(int n_threads) {
 #ifdef _OPENMP
   int use_threads = 1;
@@ -91,155 +103,110 @@ inline bool see_if_file_exists(const std::string& name) {
 bool IRF_Check_Cov(std::string s_in) {
 	// Checks if given file is a valid COV file
 	
-  std::ifstream inCov_stream;
-  inCov_stream.open(s_in, std::ifstream::binary);	
-
   covReader inCov;
-  inCov.SetInputHandle(&inCov_stream);
+  inCov.SetInputFile(s_in);
 
   if(inCov.fail()){
-		inCov_stream.close();
     return(false);
   }
 
   int ret = inCov.ReadHeader();
   if(ret == -1){
-		inCov_stream.close();	
     return(false);
   }	
 	
-  inCov_stream.close();	
 	return(true);
 }
 
 // ########################### MAPPABILITY INTERNAL FN #########################
 
-std::string GenerateReadError(
-    char * input_read, 
+// Lookup tables for mappability read generation, indexed by base
+struct dna_lookup_tables {
+  unsigned char is_acgt[256];   // 1 for ACGTacgt
+  char complement[256];         // 'N' for anything else
+  char error_nuc[3][256];       // substitution by (error_seed % 3); 'N' for anything else
+
+  dna_lookup_tables() {
+    const char bases[] = "ACGTacgt";
+    const char comps[] = "TGCAtgca";
+    // Copy https://github.com/williamritchie/IRFinder/blob/master/bin/util/generateReadsError.pl
+    const char errors[3][9] = {"GATCgatc", "TGCAtgca", "CTAGctag"};
+    for(unsigned int i = 0; i < 256; i++) {
+      is_acgt[i] = 0;
+      complement[i] = 'N';
+      for(unsigned int j = 0; j < 3; j++) error_nuc[j][i] = 'N';
+    }
+    for(unsigned int k = 0; k < 8; k++) {
+      unsigned char c = (unsigned char)bases[k];
+      is_acgt[c] = 1;
+      complement[c] = comps[k];
+      for(unsigned int j = 0; j < 3; j++) error_nuc[j][c] = errors[j][k];
+    }
+  }
+};
+static const dna_lookup_tables dna_lookup;
+
+// Writes read_len bases of input_read into dest, with the base at error_pos (1-based)
+//   substituted, then reverse-complemented in place if direction != 0
+void GenerateReadError(
+    char * dest,
+    const char * input_read, 
     const unsigned int read_len, 
     const unsigned int error_pos,
     const unsigned int direction, 
     const size_t error_seed
 ) {
-  
-  // Copy https://github.com/williamritchie/IRFinder/blob/master/bin/util/generateReadsError.pl
-
-  char * new_read_inter = new char[read_len + 1];
-  new_read_inter[read_len] = '\0';
-  memcpy(&new_read_inter[0], input_read, read_len);  
-
-  char error_nuc = '\0';  // set this as something to avoid warning at compile
-  if(error_seed % 3 == 0) {
-    switch(new_read_inter[error_pos - 1]) {
-      case 'A':
-        error_nuc = 'G'; break;
-      case 'C':
-        error_nuc = 'A'; break;
-      case 'G':
-        error_nuc = 'T'; break;
-      case 'T':
-        error_nuc = 'C'; break;
-      case 'a':
-        error_nuc = 'g'; break;
-      case 'c':
-        error_nuc = 'a'; break;
-      case 'g':
-        error_nuc = 't'; break;
-      case 't':
-        error_nuc = 'c'; break;
-      default:
-        error_nuc = 'N';
-    }
-  } else if(error_seed % 3 == 1) {
-    switch(new_read_inter[error_pos - 1]) {
-      case 'A':
-        error_nuc = 'T'; break;
-      case 'C':
-        error_nuc = 'G'; break;
-      case 'G':
-        error_nuc = 'C'; break;
-      case 'T':
-        error_nuc = 'A'; break;
-      case 'a':
-        error_nuc = 't'; break;
-      case 'c':
-        error_nuc = 'g'; break;
-      case 'g':
-        error_nuc = 'c'; break;
-      case 't':
-        error_nuc = 'a'; break;
-      default:
-        error_nuc = 'N';
+  memcpy(dest, input_read, read_len);
+  dest[error_pos - 1] = dna_lookup.error_nuc[error_seed % 3][(unsigned char)dest[error_pos - 1]];
+  if(direction != 0) {
+    unsigned int i = 0;
+    unsigned int j = read_len;
+    while(i + 1 < j) {
+      j--;
+      char tmp = dna_lookup.complement[(unsigned char)dest[i]];
+      dest[i] = dna_lookup.complement[(unsigned char)dest[j]];
+      dest[j] = tmp;
+      i++;
     }
-  } else {
-    switch(new_read_inter[error_pos - 1]) {
-      case 'A':
-        error_nuc = 'C'; break;
-      case 'C':
-        error_nuc = 'T'; break;
-      case 'G':
-        error_nuc = 'A'; break;
-      case 'T':
-        error_nuc = 'G'; break;
-      case 'a':
-        error_nuc = 'c'; break;
-      case 'c':
-        error_nuc = 't'; break;
-      case 'g':
-        error_nuc = 'a'; break;
-      case 't':
-        error_nuc = 'g'; break;
-      default:
-        error_nuc = 'N';
-    }
-  }
-  
-  memcpy(&new_read_inter[error_pos - 1], &error_nuc, 1);
-  
-  char * new_read = new char[read_len + 1];
-  new_read[read_len] = '\0';
-  if(direction == 0) {
-    memcpy(&new_read[0], new_read_inter, read_len);  
-  } else {
-    for(unsigned int i = 0; i < read_len; i++) {
-      switch(new_read_inter[i]) {   
-        case 'A':
-          new_read[read_len - i - 1] = 'T'; break;
-        case 'T':
-          new_read[read_len - i - 1] = 'A'; break;
-        case 'G':
-          new_read[read_len - i - 1] = 'C'; break;
-        case 'C':
-          new_read[read_len - i - 1] = 'G'; break;
-        case 'a':
-          new_read[read_len - i - 1] = 't'; break;
-        case 't':
-          new_read[read_len - i - 1] = 'a'; break;
-        case 'g':
-          new_read[read_len - i - 1] = 'c'; break;
-        case 'c':
-          new_read[read_len - i - 1] = 'g'; break;
-        default :
-          new_read[read_len - i - 1] = 'N';
-      }         
-    }
-  }
-
-  string return_str = string(new_read);
-  delete[] new_read;
-  return(return_str);
+    if(i + 1 == j) dest[i] = dna_lookup.complement[(unsigned char)dest[i]];
+  }
 }
 
-// Replicate old PERL script; return true if N's constitute less than half of length
-bool checkDNA(char * input_read, unsigned int read_len) {
-  unsigned int numN = 0;
-  for(unsigned int i = 0; i < read_len; i++) {
-    if(input_read[i]!='A' && input_read[i]!='T' && input_read[i]!='G' && input_read[i]!='C' &&
-      input_read[i]!='a' && input_read[i]!='t' && input_read[i]!='g' && input_read[i]!='c') {
-      numN++;
+// Checks every read window of a chromosome in one pass. As the old PERL script,
+//   a window passes if N's constitute less than half of its length.
+//   Window k starts at offset k * read_stride; n_windows are those that
+//   IRF_GenerateMappabilityReads emits. Sets bit k of valid if the window passes
+void checkDNAWindows(
+    const char * seq, const size_t seq_len,
+    const unsigned int read_len, const unsigned int read_stride,
+    size_t &n_windows, std::vector<uint64_t> &valid
+) {
+  n_windows = (seq_len > read_len && read_stride > 0) ? 
+    (seq_len - read_len - 1) / read_stride + 1 : 0;
+  valid.assign((n_windows + 63) / 64, 0);
+
+  // Running count of ACGT bases in [win_start, win_end)
+  size_t win_start = 0;
+  size_t win_end = 0;
+  unsigned int numACGT = 0;
+  for(size_t k = 0; k < n_windows; k++) {
+    size_t start = k * read_stride;
+    size_t end = start + read_len;
+    if(start >= win_end) {
+      win_start = start;
+      win_end = start;
+      numACGT = 0;
+    }
+    for(; win_start < start; win_start++) {
+      numACGT -= dna_lookup.is_acgt[(unsigned char)seq[win_start]];
+    }
+    for(; win_end < end; win_end++) {
+      numACGT += dna_lookup.is_acgt[(unsigned char)seq[win_end]];
+    }
+    if(read_len - numACGT < read_len / 2) {
+      valid[k >> 6] |= (uint64_t)1 << (k & 63);
     }
   }
-  return(numN < read_len / 2);
 }
 
 #ifdef RNXTIRF
@@ -265,21 +232,16 @@ List IRF_RLE_From_Cov(std::string s_in, std::string seqname, int start, int end,
     return(NULL_RLE);
   }
 
-  std::ifstream inCov_stream;
-  inCov_stream.open(s_in, std::ifstream::binary);
-  
   covReader inCov;
-  inCov.SetInputHandle(&inCov_stream);
+  inCov.SetInputFile(s_in);
 
   if(inCov.fail()){
-		inCov_stream.close();
     return(NULL_RLE);
   }
 	
   int ret = inCov.ReadHeader();
   if(ret < 0){
 		cout << s_in << " appears to not be valid COV file... exiting\n";
-		inCov_stream.close();	
     return(NULL_RLE);
   }
   
@@ -292,7 +254,6 @@ List IRF_RLE_From_Cov(std::string s_in, std::string seqname, int start, int end,
     ref_index++;
   }
   if(ref_index == chrs.size()) {
-    inCov_stream.close();	
     return(NULL_RLE);
   }
   
@@ -311,7 +272,6 @@ List IRF_RLE_From_Cov(std::string s_in, std::string seqname, int start, int end,
   
   inCov.FetchRLE(seqname, (uint32_t)start, (uint32_t)eff_end, strand, &values, &lengths);
 
-  inCov_stream.close();
   // Push last value
   if((uint32_t)eff_end < (uint32_t)chrs.at(ref_index).chr_len) {
     values.push_back(0);
@@ -338,23 +298,18 @@ StringVector IRF_Cov_Seqnames(
     return(s_out);
   }
 
-  std::ifstream inCov_stream;
-  inCov_stream.open(s_in, std::ifstream::binary);
-  
   covReader inCov;
-  inCov.SetInputHandle(&inCov_stream);
+  inCov.SetInputFile(s_in);
 
 
   if(inCov.fail()){
     cout << "File " << s_in << " reading failed!\n";
-		inCov_stream.close();
     return(s_out);
   }
   
   int ret = inCov.ReadHeader();
   if(ret == -1){
 		cout << s_in << " appears to not be valid COV file... exiting";
-		inCov_stream.close();	
     return(s_out);
   }
   
@@ -368,6 +323,51 @@ StringVector IRF_Cov_Seqnames(
   return(s_out);
 }
 
+// [[Rcpp::export]]
+List IRF_Cov_Zoom(std::string s_in, std::string seqname, 
+    int start, int end, int strand, int resolution) {
+  // Returns the zoom bins overlapping [start, end), at the coarsest zoom level
+  //   of the COV file whose bin size is at most resolution
+  // bin_size is 0 if the file has no such zoom level (use the RLE instead)
+  // strand: 0 = -, 1 = +, 2 = *
+  
+  std::vector<float> means;
+  std::vector<int> maxes;
+  uint32_t bin_size = 0;
+  
+  List NULL_ZOOM = List::create(
+    _["bin_size"] = 0,
+    _["means"] = NumericVector(0),
+    _["maxes"] = IntegerVector(0)
+  );
+
+  if(!see_if_file_exists(s_in)) {
+    cout << "File " << s_in << " does not exist!\n";
+    return(NULL_ZOOM);
+  }
+  if(start < 0 || end < start || resolution < 1) return(NULL_ZOOM);
+
+  covReader inCov;
+  inCov.SetInputFile(s_in);
+  if(inCov.fail()) return(NULL_ZOOM);
+  if(inCov.ReadHeader() == -1) {
+		cout << s_in << " appears to not be valid COV file... exiting";
+    return(NULL_ZOOM);
+  }
+  
+  if(inCov.FetchZoom(seqname, (uint32_t)start, (uint32_t)end, strand,
+      (uint32_t)resolution, &bin_size, &means, &maxes) != 0) {
+    return(NULL_ZOOM);
+  }
+  
+  List ZOOM = List::create(
+    _["bin_size"] = (int)bin_size,
+    _["means"] = NumericVector(means.begin(), means.end()),
+    _["maxes"] = IntegerVector(maxes.begin(), maxes.end())
+  );
+  return(ZOOM);
+}
+
 // [[Rcpp::export]]
 List IRF_RLEList_From_Cov(std::string s_in, int strand) {
   // Returns an RLEList
@@ -386,48 +386,115 @@ List IRF_RLEList_From_Cov(std::string s_in, int strand) {
 
   List RLEList;
   
-  std::ifstream inCov_stream;
-  inCov_stream.open(s_in, std::ifstream::binary);
-  
   covReader inCov;
-  inCov.SetInputHandle(&inCov_stream);
+  inCov.SetInputFile(s_in);
 
   if(inCov.fail()){
-		inCov_stream.close();
     return(NULL_RLE);
   }
   
   int ret = inCov.ReadHeader();
   if(ret == -1){
 		cout << s_in << " appears to not be valid COV file... exiting";
-		inCov_stream.close();	
     return(NULL_RLE);
   }
   
   std::vector<chr_entry> chrs;
   inCov.GetChrs(chrs);
 
+  // Fetch all chromosomes in one pass over the COV body
+  std::vector<cov_region> regions;
   for (unsigned int i = 0; i < chrs.size(); i++) {
-    uint32_t eff_end = chrs.at(i).chr_len;
-    uint32_t start = 0;
-    
-    std::vector<int> values;
-    std::vector<unsigned int> lengths;
+    regions.push_back(cov_region(chrs.at(i).chr_name, 0, (uint32_t)chrs.at(i).chr_len, strand));
+  }
+  std::vector< std::vector<int> > values;
+  std::vector< std::vector<unsigned int> > lengths;
+  inCov.FetchRLEBatch(regions, values, lengths);
 
-    inCov.FetchRLE(chrs.at(i).chr_name, (uint32_t)start, (uint32_t)eff_end, strand, &values, &lengths);
-    
+  for (unsigned int i = 0; i < chrs.size(); i++) {
     List RLE = List::create(
-      _["values"] = values,
-      _["lengths"] = lengths 
+      _["values"] = values.at(i),
+      _["lengths"] = lengths.at(i) 
     );
     RLEList.push_back(RLE, chrs.at(i).chr_name);
   }
 
-  inCov_stream.close();
   
   return(RLEList);
 }
 
+// [[Rcpp::export]]
+List IRF_RLEList_From_Cov_Regions(std::string s_in, 
+    StringVector seqnames, IntegerVector starts, IntegerVector ends, 
+    IntegerVector strands, int n_threads) {
+  // Returns a list of RLEs, one per region, each covering exactly [start, end)
+  // s_in: The coverage file
+  // strands: 0 = -, 1 = +, 2 = *
+  // Regions that are invalid (unknown seqname, end beyond chromosome) return an empty RLE
+  
+  List RLEList;
+  
+  if(!see_if_file_exists(s_in)) {
+    cout << "File " << s_in << " does not exist!\n";
+    return(RLEList);
+  }
+  if(starts.size() != seqnames.size() || ends.size() != seqnames.size() ||
+      strands.size() != seqnames.size()) {
+    cout << "seqnames, starts, ends and strands must be of equal length\n";
+    return(RLEList);
+  }
+
+  covReader inCov;
+  inCov.SetInputFile(s_in);
+
+  if(inCov.fail()){
+    return(RLEList);
+  }
+  
+  int ret = inCov.ReadHeader();
+  if(ret == -1){
+		cout << s_in << " appears to not be valid COV file... exiting";
+    return(RLEList);
+  }
+  
+  std::vector<cov_region> regions;
+  std::vector<bool> is_valid(seqnames.size(), true);
+  for(int i = 0; i < seqnames.size(); i++) {
+    if(starts[i] < 0 || starts[i] > ends[i]) {
+      is_valid.at(i) = false;
+      regions.push_back(cov_region("", 0, 0, 0));
+    } else {
+      regions.push_back(cov_region(string(seqnames(i)), 
+        (uint32_t)starts[i], (uint32_t)ends[i], strands[i]));
+    }
+  }
+  
+  unsigned int n_threads_to_use = (unsigned int)n_threads;
+#ifdef _OPENMP
+  if(n_threads_to_use > (unsigned int)omp_get_max_threads()) {
+    n_threads_to_use = omp_get_max_threads();
+  }
+#endif
+  if(n_threads_to_use < 1) n_threads_to_use = 1;
+
+  std::vector< std::vector<int> > values;
+  std::vector< std::vector<unsigned int> > lengths;
+  inCov.FetchRLEBatch(regions, values, lengths, n_threads_to_use);
+
+  for(int i = 0; i < seqnames.size(); i++) {
+    if(!is_valid.at(i)) {
+      values.at(i).clear();
+      lengths.at(i).clear();
+    }
+    List RLE = List::create(
+      _["values"] = values.at(i),
+      _["lengths"] = lengths.at(i) 
+    );
+    RLEList.push_back(RLE);
+  }
+  return(RLEList);
+}
+
 // [[Rcpp::export]]
 List IRF_gunzip_DF(std::string s_in, StringVector s_header_begin) {
   List Final_final_list;
@@ -517,6 +584,200 @@ List IRF_gunzip_DF(std::string s_in, StringVector s_header_begin) {
   return(Final_final_list);
 }
 
+// A column of an IRFinder output section
+struct IRF_text_column {
+  std::string name;
+  bool is_numeric;
+  std::vector<double> num;
+  std::vector<std::string> str;
+};
+
+// Finds the text of each section from s_in, whose first lines begin with the given
+//   headers. Uses the section index if the file has one; otherwise inflates the
+//   whole file. Sections that are not found are left empty
+static int IRF_ReadSectionText(std::string const &s_in, 
+    std::vector<std::string> const &headers, std::vector<std::string> &texts,
+    unsigned int n_threads
+) {
+  texts.assign(headers.size(), "");
+  BGZFSectionReader reader;
+  if(reader.Open(s_in) == 0) {
+    for(unsigned int z = 0; z < headers.size(); z++) {
+      reader.ReadSection(headers.at(z), texts.at(z), n_threads);
+    }
+    reader.Close();
+    return(0);
+  }
+  
+  GZReader gz_in;
+  int ret = gz_in.LoadGZ(s_in, true);
+  if(ret != 0) return(-1);
+  std::string data = gz_in.iss.str();
+  gz_in.iss.str("");
+
+  // Sections begin at the start of the file or after an empty line
+  size_t pos = 0;
+  for(unsigned int z = 0; z < headers.size(); z++) {
+    while(pos < data.size() && 
+        data.compare(pos, headers.at(z).size(), headers.at(z)) != 0) {
+      size_t next = data.find("\n\n", pos);
+      pos = (next == std::string::npos) ? data.size() : next + 2;
+    }
+    if(pos >= data.size()) break;
+    size_t end = data.find("\n\n", pos);
+    end = (end == std::string::npos) ? data.size() : end + 2;
+    texts.at(z) = data.substr(pos, end - pos);
+    pos = end;
+  }
+  return(0);
+}
+
+// Splits a section (header line, rows, then an empty line) into columns.
+//   Columns where every entry is a number or "NA" are parsed as numbers.
+//   Messages about malformed rows are appended to log
+static void IRF_ParseSection(std::string &text, std::vector<IRF_text_column> &columns,
+    std::string &log
+) {
+  columns.clear();
+  text.erase( std::remove(text.begin(), text.end(), '\r'), text.end() ); // remove \r 
+
+  // Column names
+  size_t pos = 0;
+  size_t line_end = text.find('\n');
+  if(line_end == std::string::npos) line_end = text.size();
+  while(true) {
+    size_t tab = text.find('\t', pos);
+    size_t field_end = (tab == std::string::npos || tab > line_end) ? line_end : tab;
+    IRF_text_column col;
+    col.name = text.substr(pos, field_end - pos);
+    columns.push_back(col);
+    if(field_end == line_end) break;
+    pos = field_end + 1;
+  }
+  
+  // Entries are kept as (start, length) into text until the column's type is known
+  std::vector< std::vector< std::pair<size_t, size_t> > > fields(columns.size());
+  unsigned int q = 1;
+  pos = line_end + 1;
+  while(pos < text.size() && text[pos] != '\n') {
+    line_end = text.find('\n', pos);
+    if(line_end == std::string::npos) line_end = text.size();
+    q++;
+    unsigned int j = 0;
+    while(j < columns.size()) {
+      size_t tab = text.find('\t', pos);
+      size_t field_end = (tab == std::string::npos || tab > line_end) ? line_end : tab;
+      fields.at(j).push_back(std::make_pair(pos, field_end - pos));
+      j++;
+      pos = field_end + 1;
+      if(field_end == line_end) break;
+    }
+    if(j != columns.size()) {
+      log += "Missing entries detected at line " + std::to_string(q) + 
+        " of " + columns.at(0).name + "\n";
+      // attempt to repair by putting blank entries
+      for(unsigned int k = j; k < columns.size(); k++) {
+        fields.at(k).push_back(std::make_pair(line_end, 0));
+      }
+    }
+    pos = line_end + 1;
+  }
+
+  for(unsigned int j = 0; j < columns.size(); j++) {
+    IRF_text_column &col = columns.at(j);
+    std::vector< std::pair<size_t, size_t> > &col_fields = fields.at(j);
+    col.is_numeric = true;
+    col.num.resize(col_fields.size());
+    for(unsigned int i = 0; i < col_fields.size(); i++) {
+      const char * field = text.data() + col_fields.at(i).first;
+      size_t len = col_fields.at(i).second;
+      if(len == 2 && field[0] == 'N' && field[1] == 'A') {
+        col.num.at(i) = NA_REAL;
+        continue;
+      }
+      char * parse_end;
+      col.num.at(i) = strtod(field, &parse_end);
+      if(len == 0 || parse_end != field + len) {
+        col.is_numeric = false;
+        break;
+      }
+    }
+    if(!col.is_numeric) {
+      std::vector<double>().swap(col.num);
+      col.str.reserve(col_fields.size());
+      for(unsigned int i = 0; i < col_fields.size(); i++) {
+        col.str.push_back(text.substr(col_fields.at(i).first, col_fields.at(i).second));
+      }
+    }
+    std::vector< std::pair<size_t, size_t> >().swap(col_fields);
+  }
+}
+
+// Reads the given sections of several IRFinder output files, in parallel.
+//   Returns a list (per file) of lists (per header) of named columns, where
+//   numeric columns are returned as numeric vectors and all others as strings
+// [[Rcpp::export]]
+List IRF_ReadSections(StringVector s_in, StringVector s_header_begin, int n_threads) {
+  std::vector<std::string> files;
+  std::vector<std::string> headers;
+  for(int i = 0; i < s_in.size(); i++) files.push_back(string(s_in(i)));
+  for(int z = 0; z < s_header_begin.size(); z++) headers.push_back(string(s_header_begin(z)));
+
+  unsigned int n_threads_to_use = (unsigned int)Set_Threads(n_threads);
+  if(n_threads_to_use > files.size()) n_threads_to_use = files.size();
+  if(n_threads_to_use < 1) n_threads_to_use = 1;
+  
+  std::vector< std::vector< std::vector<IRF_text_column> > > tables(files.size());
+  std::vector<std::string> logs(files.size());
+  std::vector<int> rets(files.size(), 0);
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads_to_use) schedule(dynamic,1)
+#endif
+  for(unsigned int i = 0; i < files.size(); i++) {
+    if(!see_if_file_exists(files.at(i))) {
+      rets.at(i) = -1;
+      continue;
+    }
+    std::vector<std::string> texts;
+    rets.at(i) = IRF_ReadSectionText(files.at(i), headers, texts, 1);
+    if(rets.at(i) != 0) continue;
+    tables.at(i).resize(headers.size());
+    for(unsigned int z = 0; z < headers.size(); z++) {
+      if(texts.at(z).size() > 0) {
+        IRF_ParseSection(texts.at(z), tables.at(i).at(z), logs.at(i));
+      }
+      std::string().swap(texts.at(z));
+    }
+  }
+
+  List Final_list;
+  for(unsigned int i = 0; i < files.size(); i++) {
+    List file_list;
+    if(rets.at(i) != 0) {
+      cout << "Unable to read " << files.at(i) << "\n";
+      Final_list.push_back(file_list);
+      continue;
+    }
+    if(logs.at(i).size() > 0) cout << files.at(i) << ": " << logs.at(i);
+    for(unsigned int z = 0; z < headers.size(); z++) {
+      List final_list;
+      for(auto &col : tables.at(i).at(z)) {
+        if(col.is_numeric) {
+          final_list.push_back(NumericVector(col.num.begin(), col.num.end()), col.name);
+        } else {
+          final_list.push_back(col.str, col.name);
+        }
+        std::vector<double>().swap(col.num);
+        std::vector<std::string>().swap(col.str);
+      }
+      file_list.push_back(final_list, headers.at(z));
+    }
+    Final_list.push_back(file_list);
+  }
+  return(Final_list);
+}
+
 #endif
 // End Rcpp-only functions
 
@@ -589,6 +850,48 @@ int ReadChrAlias(std::istringstream &IN,
   return(0);
 }
 
+// Compiled IRFinder reference reader (see RefTools.h):
+static int IRF_ref_binary(std::string &reference_file, 
+    std::vector<std::string> &ref_names, 
+    std::vector<std::string> &ref_alias,
+    std::vector<uint32_t> &ref_lengths,
+    CoverageBlocksIRFinder &CB_template, 
+    SpansPoint &SP_template, 
+    FragmentsInROI &ROI_template,
+    JunctionCount &JC_template
+) {
+  refBinaryReader ref_in;
+  if(ref_in.Open(reference_file) != 0) return(-1);
+  
+  if(!ref_in.HasSection(REF_COVER) || !ref_in.HasSection(REF_SPANS) ||
+      !ref_in.HasSection(REF_ROI) || !ref_in.HasSection(REF_SJ)) {
+    cout << "Error: Incomplete IRFinder reference detected\n";
+    return(-1);
+  }
+  SP_template.setSpanLength(5,4);
+  if(CB_template.LoadRefBinary(ref_in) != 0 || SP_template.LoadRefBinary(ref_in) != 0 ||
+      ROI_template.LoadRefBinary(ref_in) != 0 || JC_template.LoadRefBinary(ref_in) != 0) {
+    cout << "Error: Invalid IRFinder reference block detected\n";
+    return(-1);
+  }
+  if(ref_in.HasSection(REF_CHRS)) {
+    refBinarySection sec = ref_in.GetSection(REF_CHRS);
+    ref_names.clear();
+    ref_alias.clear();
+    uint64_t n_chrs = sec.Read<uint64_t>();
+    for(uint64_t i = 0; i < n_chrs && !sec.fail(); i++) {
+      ref_names.push_back(ref_in.GetString(sec.Read<uint32_t>()));
+      ref_lengths.push_back(sec.Read<uint32_t>());
+      ref_alias.push_back(ref_in.GetString(sec.Read<uint32_t>()));
+    }
+    if(sec.fail()) {
+      cout << "Error: Invalid IRFinder reference block detected\n";
+      return(-1);
+    }
+  }
+  return(0);
+}
+
 // IRFinder reference reader:
 int IRF_ref(std::string &reference_file, 
     std::vector<std::string> &ref_names, 
@@ -607,6 +910,11 @@ int IRF_ref(std::string &reference_file,
     return(-1);
   }
 
+  if(refBinaryReader::IsBinaryRef(reference_file)) {
+    return(IRF_ref_binary(reference_file, ref_names, ref_alias, ref_lengths,
+      CB_template, SP_template, ROI_template, JC_template));
+  }
+
   GZReader * gz_in = new GZReader;
   int ret = gz_in->LoadGZ(reference_file, true);   // streamed mode
   if(ret != 0) return(-1);
@@ -683,6 +991,272 @@ int IRF_ref(std::string &reference_file,
   return(0);
 }
 
+// Writes the reference as a compiled binary, which IRF_ref loads without text parsing
+// [[Rcpp::export]]
+int IRF_compileRef(std::string reference_file, std::string output_file) {
+  std::vector<std::string> ref_names;
+  std::vector<std::string> ref_alias;
+  std::vector<uint32_t> ref_lengths;
+  CoverageBlocksIRFinder CB_template;
+  SpansPoint SP_template;
+  FragmentsInROI ROI_template;
+  JunctionCount JC_template;
+  
+  int ret = IRF_ref(reference_file, ref_names, ref_alias, ref_lengths,
+    CB_template, SP_template, ROI_template, JC_template, false);
+  if(ret != 0) {
+    cout << "Reading IRFinder reference failed. Exiting\n";
+    return(ret);
+  }
+  
+  refBinaryWriter ref_out;
+  CB_template.WriteRefBinary(ref_out);
+  SP_template.WriteRefBinary(ref_out);
+  ROI_template.WriteRefBinary(ref_out);
+  JC_template.WriteRefBinary(ref_out);
+  if(ref_names.size() > 0) {
+    std::string & buf = ref_out.NewSection(REF_CHRS);
+    refBinaryWriter::Append(buf, (uint64_t)ref_names.size());
+    for(unsigned int i = 0; i < ref_names.size(); i++) {
+      refBinaryWriter::Append(buf, ref_out.AddString(ref_names.at(i)));
+      refBinaryWriter::Append(buf, (uint32_t)ref_lengths.at(i));
+      refBinaryWriter::Append(buf, ref_out.AddString(ref_alias.at(i)));
+    }
+  }
+  return(ref_out.WriteToFile(output_file));
+}
+
+// Compiles the list of chromosomes given to BAM2blocks; uses BAM chromosomes
+//   for order (named as in the reference where aliased), and adds
+//   reference-only chromosomes at the end
+void IRF_MatchChrs(
+    const std::vector<std::string> &s_chr_names, 
+    const std::vector<uint32_t> &u32_chr_lens,
+    const std::vector<std::string> &ref_names, 
+    const std::vector<std::string> &ref_alias,
+    const std::vector<uint32_t> &ref_lengths,
+    std::vector<std::string> &bam_chr_name, 
+    std::vector<uint32_t> &bam_chr_len
+) {
+  bam_chr_name.clear();
+  bam_chr_len.clear();
+  for(unsigned int i = 0; i < s_chr_names.size(); i++) {
+    for(unsigned int j = 0; j < ref_alias.size(); j++) {
+      if( 0==strncmp(
+            ref_alias.at(j).c_str(), 
+            s_chr_names.at(i).c_str(), 
+            s_chr_names.at(i).size()
+          ) && s_chr_names.at(i).size() == ref_alias.at(j).size()
+      ) {
+        bam_chr_name.push_back(ref_names.at(j));
+        bam_chr_len.push_back(u32_chr_lens.at(i));
+        break;
+      }
+    }
+    if(i == bam_chr_name.size()) {
+      bam_chr_name.push_back(s_chr_names.at(i));
+      bam_chr_len.push_back(u32_chr_lens.at(i));
+    }
+  }
+  // Now fill in reference chromosomes not in BAM:
+  for(unsigned int i = 0; i < ref_names.size(); i++) {
+    auto it = std::find(bam_chr_name.begin(), bam_chr_name.end(), ref_names.at(i));
+    if(it == bam_chr_name.end()) {
+      bam_chr_name.push_back(ref_names.at(i));
+      bam_chr_len.push_back(ref_lengths.at(i));      
+    }
+  }
+}
+
+// Error messages of a job: printed, or kept in dest for jobs run off the main
+//   thread, where the R console must not be used. The caller prints dest later
+class IRF_message_log {
+  private:
+    std::string * dest;
+    std::ostringstream buffer;
+  public:
+    IRF_message_log(std::string * s_dest) : dest(s_dest) {};
+    ~IRF_message_log() { if(dest) dest->append(buffer.str()); };
+    std::ostream & out() {
+      if(dest) return(buffer);
+      return(cout);
+    };
+};
+
+// Seconds elapsed since t0
+static double IRF_elapsed(const std::chrono::steady_clock::time_point &t0) {
+  return(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+}
+
+// Writes one "name\tvalue" line per reported stat (or per stat, if all).
+//   Whole numbers are written as such
+int IRF_run_stats::WriteOutput(std::string &output, bool all) const {
+  std::ostringstream oss;
+  oss << std::fixed;
+  for(unsigned int i = 0; i < names.size(); i++) {
+    if(!all && !reported.at(i)) continue;
+    double value = values.at(i);
+    oss << names.at(i) << "\t";
+    if(value == floor(value) && fabs(value) < 1e15) {
+      oss << (long long)value << "\n";
+    } else {
+      oss << std::setprecision(4) << value << "\n";
+    }
+  }
+  output = oss.str();
+  return(0);
+}
+
+// Size of a file in bytes, or 0 if it cannot be opened
+static size_t IRF_file_size(const std::string &s_filename) {
+  std::ifstream in(s_filename, std::ifstream::binary | std::ifstream::ate);
+  if(!in.is_open()) return(0);
+  return((size_t)in.tellg());
+}
+
+void IRF_memory_plan::Plan(size_t bam_size, int memory_budget_mb, unsigned int n_threads, 
+    bool pipeline, size_t max_file_buffer_cap) {
+  // Each of the chunks of a file buffer must be over 1 Mb (see pbam_in)
+  const size_t min_chunk = 4194304;
+  const size_t bytes_per_fragment = 64;   // events added to FragmentsMap by a fragment
+  if(n_threads < 1) n_threads = 1;
+  pipelined = pipeline;
+  budget_bytes = memory_budget_mb > 0 ? (size_t)memory_budget_mb << 20 : 0;
+
+  // No bigger than the BAM file, rounded up to the next Mb
+  file_buffer_cap = std::min(max_file_buffer_cap, ((bam_size >> 20) + 1) << 20);
+  file_buffer_cap = std::max(file_buffer_cap, min_chunk);
+  if(budget_bytes == 0) {
+    // As without a plan, a BAM that fits in the file buffer is read in one go
+    data_buffer_cap = std::max(file_buffer_cap, max_file_buffer_cap * 2);
+    chunks_per_file_buffer = (file_buffer_cap < max_file_buffer_cap) ? 1 : 5;
+  } else {
+    file_buffer_cap = std::min(file_buffer_cap, budget_bytes / 2 / (pipelined ? 6 : 4));
+    file_buffer_cap = std::max(file_buffer_cap, min_chunk);
+    data_buffer_cap = 2 * file_buffer_cap;
+    chunks_per_file_buffer = (unsigned int)std::max((size_t)1, 
+      std::min((size_t)5, file_buffer_cap / min_chunk));
+  }
+
+  collapse_interval = 1000000;
+  if(budget_bytes > BufferBytes()) {
+    // A quarter of what is left, for the unsorted events of each thread's 
+    //   FragmentsMap, as vectors grow to twice what they hold
+    size_t frags = (budget_bytes - BufferBytes()) / 4 / n_threads / bytes_per_fragment;
+    collapse_interval = (unsigned int)std::max((size_t)10000, std::min((size_t)1000000, frags));
+  } else if(budget_bytes > 0) {
+    collapse_interval = 10000;
+  }
+}
+
+// Sections of the IRFinder output, compressed before the report sections
+//   (BAM_report, Performance_report, Directionality and QC) that precede them
+struct IRF_output_sections {
+  std::string QC;
+  std::string Dir;
+  int directionality = 0;
+  std::string gz_ROI;
+  std::string gz_JC;
+  std::string gz_SP;
+  std::string gz_Chr;
+  std::string gz_ND;
+  std::string gz_Dir;
+};
+
+// Generates the output sections from the processors (JC must have been
+//   sorted), streaming each into the compressor as it is made.
+//   ROI and ChrCoverage are given as text, with their QC lines
+static int IRF_CompressSections(BGZFWriter &outGZ, IRF_output_sections &out,
+    std::string const &ROI_text, std::string const &ROI_QC, 
+    std::string const &Chr_text, std::string const &Chr_QC,
+    JunctionCount const &JC, SpansPoint const &SP,
+    CoverageBlocksIRFinder const &CB, FragmentsMap const &FM, 
+    unsigned int n_threads_to_use
+) {
+  out.directionality = JC.Directional(out.Dir);
+
+  int outret = outGZ.compress("ROIname\ttotal_hits\tpositive_strand_hits\tnegative_strand_hits\n" + 
+    ROI_text + "\n", out.gz_ROI);
+  out.QC.append(ROI_QC);
+  if(outret == Z_OK) {
+    BGZFSink sink(outGZ, out.gz_JC);
+    sink.write("JC_seqname\tstart\tend\tstrand\ttotal\tpos\tneg\n");
+    JC.WriteOutput(sink, out.QC);
+    sink.write("\n");
+    outret = sink.close();
+  }
+  if(outret == Z_OK) {
+    BGZFSink sink(outGZ, out.gz_SP);
+    sink.write("SP_seqname\tcoord\ttotal\tpos\tneg\n");
+    SP.WriteOutput(sink, out.QC);
+    sink.write("\n");
+    outret = sink.close();
+  }
+  if(outret == Z_OK) {
+    outret = outGZ.compress("ChrCoverage_seqname\ttotal\tpos\tneg\n" + Chr_text + "\n", out.gz_Chr);
+    out.QC.append(Chr_QC);
+  }
+  if(outret == Z_OK) {
+    BGZFSink sink(outGZ, out.gz_ND);
+    CB.WriteOutput(sink, out.QC, JC, SP, FM, n_threads_to_use);
+    sink.write("\n");
+    outret = sink.close();
+  }
+  if (outret == Z_OK && out.directionality != 0) {
+    BGZFSink sink(outGZ, out.gz_Dir);
+    CB.WriteOutput(sink, out.QC, JC, SP, FM, n_threads_to_use, out.directionality); // Directional.
+    sink.write("\n");
+    outret = sink.close();
+	}
+  return(outret);
+}
+
+// Writes the report sections, then the compressed sections, and finishes the file
+static int IRF_WriteSections(BGZFWriter &outGZ, IRF_output_sections const &out,
+    std::string const &BAM_text, std::string const &Stats_text
+) {
+  // Sections are written in order, recording where each starts for the section index
+  std::vector<BGZFSection> index;
+  uint64_t offset = 0;
+  auto write_section = [&](std::string const &name, std::string const &compressed) {
+    int ret = outGZ.writecompressed(compressed);
+    BGZFSection sec = {name, offset, offset + compressed.size()};
+    index.push_back(sec);
+    offset += compressed.size();
+    return(ret);
+  };
+  std::string gz_BAM, gz_Stats, gz_Dir, gz_QC;
+  int outret = outGZ.compress("BAM_report\tValue\n" + BAM_text + "\n", gz_BAM);
+  if(outret == Z_OK) {
+    outret = outGZ.compress("Performance_report\tValue\n" + Stats_text + "\n", gz_Stats);
+  }
+  if(outret == Z_OK) {
+    outret = outGZ.compress("Directionality\tValue\n" + out.Dir + "\n", gz_Dir);
+  }
+  if(outret == Z_OK) {
+    outret = outGZ.compress("QC\tValue\n" + out.QC + "\n", gz_QC);
+  }
+  if(outret != Z_OK) return(outret);
+
+  outret = write_section("BAM_report", gz_BAM);
+  if(outret != Z_OK) return(outret);
+  write_section("Performance_report", gz_Stats);
+  write_section("Directionality", gz_Dir);
+  write_section("QC", gz_QC);
+  write_section("ROIname", out.gz_ROI);
+  write_section("JC_seqname", out.gz_JC);
+  write_section("SP_seqname", out.gz_SP);
+  write_section("ChrCoverage_seqname", out.gz_Chr);
+  write_section("Nondir_Chr", out.gz_ND);
+  if (out.directionality != 0) {
+    write_section("Dir_Chr", out.gz_Dir);
+  }
+  std::string gz_index;
+  BGZFSectionReader::WriteIndex(index, gz_index);
+  outGZ.writecompressed(gz_index);
+  return(outGZ.flush(true));
+}
+
 // IRFinder core:
 int IRF_core(std::string const &bam_file, 
     std::string const &s_output_txt, std::string const &s_output_cov,
@@ -694,12 +1268,23 @@ int IRF_core(std::string const &bam_file,
     FragmentsInROI const &ROI_template,
     JunctionCount const &JC_template,
     bool const verbose,
-    int n_threads
+    int n_threads,
+    bool const concurrent,
+    IRF_run_stats * run_stats,
+    std::string const &s_output_sidecar,
+    int memory_budget_mb,
+    bool const write_zoom,
+    std::string * messages
 ) {
   unsigned int n_threads_to_use = (unsigned int)n_threads;   // Should be sorted out in calling function
+  auto t_start = std::chrono::steady_clock::now();
+  IRF_message_log msgs(messages);
+#ifndef RNXTIRF
+  (void)(concurrent);   // only changes how RcppProgress is used
+#endif
  
   if(!see_if_file_exists(bam_file)) {
-    cout << "File " << bam_file << " does not exist!\n";
+    msgs.out() << "File " << bam_file << " does not exist!\n";
     return(-1);
   } 
  
@@ -707,49 +1292,27 @@ int IRF_core(std::string const &bam_file,
 	if(verbose) cout << "Processing BAM file " << bam_file << "\n";
   
   
-  pbam_in inbam((size_t)5e8, (size_t)1e9, 5);
+  IRF_memory_plan plan;
+  plan.Plan(IRF_file_size(bam_file), memory_budget_mb, n_threads_to_use, n_threads_to_use > 1);
+  pbam_in inbam(plan.file_buffer_cap, plan.data_buffer_cap, plan.chunks_per_file_buffer, 
+    true, plan.pipelined);
 
   inbam.openFile(bam_file, n_threads_to_use);
+  if(n_threads_to_use > 1) inbam.SetDispatchChunkSize(bam_dispatch_chunk_size);
   
   // Abort here if BAM corrupt
   std::vector<std::string> s_chr_names;
   std::vector<uint32_t> u32_chr_lens;
   int chrcount = inbam.obtainChrs(s_chr_names, u32_chr_lens);
   if(chrcount < 1) {
-    cout << bam_file << " - contains no chromosomes mapped\n";
+    msgs.out() << bam_file << " - contains no chromosomes mapped\n";
     return(-1);
   }
   
-  // Compile here a list of chromosomes; use BAM chromosomes for order
-  // Add reference-only chromosomes at the end
   std::vector<std::string> bam_chr_name;
   std::vector<uint32_t> bam_chr_len;
-  for(unsigned int i = 0; i < s_chr_names.size(); i++) {
-    for(unsigned int j = 0; j < ref_alias.size(); j++) {
-      if( 0==strncmp(
-            ref_alias.at(j).c_str(), 
-            s_chr_names.at(i).c_str(), 
-            s_chr_names.at(i).size()
-          ) && s_chr_names.at(i).size() == ref_alias.at(j).size()
-      ) {
-        bam_chr_name.push_back(ref_names.at(j));
-        bam_chr_len.push_back(u32_chr_lens.at(i));
-        break;
-      }
-    }
-    if(i == bam_chr_name.size()) {
-      bam_chr_name.push_back(s_chr_names.at(i));
-      bam_chr_len.push_back(u32_chr_lens.at(i));
-    }
-  }
-  // Now fill in reference chromosomes not in BAM:
-  for(unsigned int i = 0; i < ref_names.size(); i++) {
-    auto it = std::find(bam_chr_name.begin(), bam_chr_name.end(), ref_names.at(i));
-    if(it == bam_chr_name.end()) {
-      bam_chr_name.push_back(ref_names.at(i));
-      bam_chr_len.push_back(ref_lengths.at(i));      
-    }
-  }
+  IRF_MatchChrs(s_chr_names, u32_chr_lens, ref_names, ref_alias, ref_lengths,
+    bam_chr_name, bam_chr_len);
   
   std::vector<CoverageBlocksIRFinder*> oCB;
   std::vector<SpansPoint*> oSP;
@@ -757,7 +1320,9 @@ int IRF_core(std::string const &bam_file,
   std::vector<FragmentsInChr*> oChr;
   std::vector<JunctionCount*> oJC;
   std::vector<FragmentsMap*> oFM;
+  std::vector<SpanDepthMap*> oSM;    // Only if a sidecar is saved
   std::vector<BAM2blocks*> BBchild;
+  bool save_sidecar = (s_output_sidecar.size() > 0);
 
   for(unsigned int i = 0; i < n_threads_to_use; i++) {
     oCB.push_back(new CoverageBlocksIRFinder(CB_template));
@@ -766,45 +1331,87 @@ int IRF_core(std::string const &bam_file,
     oChr.push_back(new FragmentsInChr);
     oJC.push_back(new JunctionCount(JC_template));
     oFM.push_back(new FragmentsMap);
+    oFM.at(i)->SetCollapseInterval(plan.collapse_interval);
     BBchild.push_back(new BAM2blocks(bam_chr_name, bam_chr_len));
 
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&JunctionCount::ChrMapUpdate, &(*oJC.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&JunctionCount::ProcessBlocks, &(*oJC.at(i)), std::placeholders::_1) );
-    
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsInChr::ChrMapUpdate, &(*oChr.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&FragmentsInChr::ProcessBlocks, &(*oChr.at(i)), std::placeholders::_1) );
-    
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&SpansPoint::ChrMapUpdate, &(*oSP.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&SpansPoint::ProcessBlocks, &(*oSP.at(i)), std::placeholders::_1) );
-        
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsInROI::ChrMapUpdate, &(*oROI.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&FragmentsInROI::ProcessBlocks, &(*oROI.at(i)), std::placeholders::_1) );
-    
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&CoverageBlocks::ChrMapUpdate, &(*oCB.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&CoverageBlocks::ProcessBlocks, &(*oCB.at(i)), std::placeholders::_1) );
-
     BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&FragmentsMap::ProcessBlocks, &(*oFM.at(i)), std::placeholders::_1) );
 
-    BBchild.at(i)->openFile(&inbam);
+    // Each processor is run over a batch of fragments at a time
+    BBchild.at(i)->registerCallbackProcessBatch( MakeBlockProcessorPipeline(
+      oJC.at(i), oChr.at(i), oSP.at(i), oROI.at(i), oCB.at(i), oFM.at(i)
+    ));
+    if(save_sidecar) {
+      oSM.push_back(new SpanDepthMap);
+      oSM.at(i)->SetCollapseInterval(plan.collapse_interval);
+      oSM.at(i)->setSpanLength(SP_template.getOverhangLeft(), SP_template.getOverhangRight());
+      BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&SpanDepthMap::ChrMapUpdate, &(*oSM.at(i)), std::placeholders::_1) );
+      BBchild.at(i)->registerCallbackProcessBatch( MakeBlockProcessorPipeline(oSM.at(i)) );
+    }
+
+    BBchild.at(i)->openFile(&inbam);
   }
   
   // BAM processing loop
+  // Instrumentation: time spent by each thread in each round (processing
+  //   reads and decompressing the next buffer), and in processAll by each BB
+  std::vector<double> thread_busy(n_threads_to_use);
+  std::vector<double> proc_secs(n_threads_to_use, 0);
+  std::vector<unsigned long> proc_frags(n_threads_to_use, 0);
+  double fill_secs = 0;
+  double wait_secs = 0;
+  double spare_secs = 0;
+  size_t peak_spare_reads = 0;
+  size_t peak_spare_bytes = 0;
+  size_t peak_proc_bytes = 0;     // coverage events and spare reads
+  size_t peak_round_bytes = 0;    // data inflated into a buffer in one round
+  size_t bytes_inflated = 0;
+  unsigned int n_rounds = 0;
+  auto t_read = std::chrono::steady_clock::now();
+  auto t_mark = t_read;
+
   bool error_detected = false;
 #ifdef RNXTIRF
-  Progress p(inbam.GetFileSize(), verbose);
-  while(0 == inbam.fillReads() && !p.check_abort()) {
-    p.increment(inbam.IncProgress());
+  // RcppProgress keeps a single global monitor, so samples running
+  //   concurrently leave progress and interrupts to the scheduler
+  Progress * p = concurrent ? NULL : new Progress(inbam.GetFileSize(), verbose);
+  while(0 == inbam.fillReads() && !(p && p->check_abort())) {
+    if(p) p->increment(inbam.IncProgress());
     
 #else
   while(0 == inbam.fillReads()) {
 #endif
+    fill_secs += IRF_elapsed(t_mark);
+    n_rounds++;
+    thread_busy.assign(n_threads_to_use, 0);
+    auto t_round = std::chrono::steady_clock::now();
     
+    // Threads that finish processing their reads go on to decompress
+    //   the next buffer (pipelined mode)
     #ifdef _OPENMP
-    #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
+    #pragma omp parallel for num_threads(n_threads_to_use) schedule(dynamic,1)
     #endif
-    for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    for(unsigned int i = 0; i < 2 * n_threads_to_use; i++) {
+      unsigned int thread_id = 0;
+      #ifdef _OPENMP
+      thread_id = omp_get_thread_num();
+      #endif
+      auto t_task = std::chrono::steady_clock::now();
+      if(i >= n_threads_to_use) {
+        inbam.decompressNext(i - n_threads_to_use);
+        thread_busy.at(thread_id) += IRF_elapsed(t_task);
+        continue;
+      }
+      unsigned long frags_before = BBchild.at(i)->GetFragmentCount();
       int pa_ret = BBchild.at(i)->processAll(i);
+      double task_secs = IRF_elapsed(t_task);
+      thread_busy.at(thread_id) += task_secs;
+      proc_secs.at(i) += task_secs;
+      proc_frags.at(i) += BBchild.at(i)->GetFragmentCount() - frags_before;
       if(pa_ret == -1) {
         
         #ifdef _OPENMP
@@ -814,11 +1421,44 @@ int IRF_core(std::string const &bam_file,
       }
     }
     
+    // Barrier wait: time threads spent idle, waiting for the slowest thread
+    double round_secs = IRF_elapsed(t_round);
+    for(unsigned int k = 0; k < n_threads_to_use; k++) {
+      wait_secs += std::max(0.0, round_secs - thread_busy.at(k));
+    }
+    
+    size_t spare_reads = 0;
+    size_t spare_bytes = 0;
+    for(unsigned int k = 0; k < n_threads_to_use; k++) {
+      spare_reads += BBchild.at(k)->GetSpareReadCount();
+      spare_bytes += BBchild.at(k)->GetSpareReadBytes();
+    }
+    peak_spare_reads = std::max(peak_spare_reads, spare_reads);
+    peak_spare_bytes = std::max(peak_spare_bytes, spare_bytes);
+    size_t proc_bytes = spare_bytes;
+    for(unsigned int k = 0; k < n_threads_to_use; k++) {
+      proc_bytes += oFM.at(k)->MemoryUsage();
+      if(save_sidecar) proc_bytes += oSM.at(k)->MemoryUsage();
+    }
+    peak_proc_bytes = std::max(peak_proc_bytes, proc_bytes);
+    peak_round_bytes = std::max(peak_round_bytes, inbam.GetBytesInflated() - bytes_inflated);
+    bytes_inflated = inbam.GetBytesInflated();
+    
+    // Coordinate-sorted BAMs: pair spare reads between threads, and drop
+    //   those whose mates have been passed, to keep spare reads bounded
+    auto t_spare = std::chrono::steady_clock::now();
+    if(BBchild.at(0)->isCoordinateSorted()) BAM2blocks::processSpares(BBchild);
+    spare_secs += IRF_elapsed(t_spare);
+    
     if(error_detected) break;
+    t_mark = std::chrono::steady_clock::now();
   }
+  double read_secs = IRF_elapsed(t_read);
 
 #ifdef RNXTIRF
-  if(p.check_abort() || error_detected) {
+  bool user_abort = (p && p->check_abort());
+  delete p;
+  if(user_abort || error_detected) {
     // interrupted:
 #else
   if(error_detected) {
@@ -833,25 +1473,34 @@ int IRF_core(std::string const &bam_file,
       delete oFM.at(i);
       delete BBchild.at(i);
     }
+    for(auto SM : oSM) delete SM;
     return(-1);
   }
 
 
+  double combine_secs = 0;
   if(n_threads_to_use > 1) {
     if(verbose) cout << "Compiling data from threads\n";
   // Combine BB's and process spares
+    auto t_spare = std::chrono::steady_clock::now();
+    BAM2blocks::processSpares(BBchild);
+    spare_secs += IRF_elapsed(t_spare);
     for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      BBchild.at(0)->processSpares(*BBchild.at(i));
       delete BBchild.at(i);
     }
   // Combine objects:
+    auto t_combine = std::chrono::steady_clock::now();
+    oJC.at(0)->Combine(oJC);
+    oFM.at(0)->Combine(oFM, n_threads_to_use);
+    if(save_sidecar) {
+      std::vector<FragmentsMap*> SM_list(oSM.begin(), oSM.end());
+      oSM.at(0)->Combine(SM_list, n_threads_to_use);
+    }
     for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      oJC.at(0)->Combine(*oJC.at(i));
       oChr.at(0)->Combine(*oChr.at(i));
       oSP.at(0)->Combine(*oSP.at(i));
       oROI.at(0)->Combine(*oROI.at(i));
       oCB.at(0)->Combine(*oCB.at(i));
-      oFM.at(0)->Combine(*oFM.at(i));
       
       delete oJC.at(i);
       delete oChr.at(i);
@@ -859,77 +1508,145 @@ int IRF_core(std::string const &bam_file,
       delete oROI.at(i);
       delete oCB.at(i);
       delete oFM.at(i);
+      if(save_sidecar) delete oSM.at(i);
     }
+    combine_secs = IRF_elapsed(t_combine);
   }
+  auto t_sort = std::chrono::steady_clock::now();
+  oJC.at(0)->sort_and_collapse_final();
+  double jc_sort_secs = IRF_elapsed(t_sort);
+  
+  size_t fm_bytes_unsorted = oFM.at(0)->MemoryUsage();
+  peak_proc_bytes = std::max(peak_proc_bytes, 
+    fm_bytes_unsorted + (save_sidecar ? oSM.at(0)->MemoryUsage() : 0));
+  t_sort = std::chrono::steady_clock::now();
+  oFM.at(0)->sort_and_collapse_final(verbose);
+  double fm_sort_secs = IRF_elapsed(t_sort);
+  size_t fm_bytes_sorted = oFM.at(0)->MemoryUsage();
 
   // Write Coverage Binary file:
+  auto t_cov = std::chrono::steady_clock::now();
   std::ofstream ofCOV;
   ofCOV.open(s_output_cov, std::ofstream::binary);
   covWriter outCOV;
   outCOV.SetOutputHandle(&ofCOV);
+  if(write_zoom) {
+    outCOV.SetZoomLevels(std::vector<uint32_t>(
+      cov_zoom_default_bins, cov_zoom_default_bins + 3));
+  }
   oFM.at(0)->WriteBinary(&outCOV, verbose, n_threads_to_use);     
   ofCOV.close();
+  double cov_secs = IRF_elapsed(t_cov);
 
 // Write output to file:  
 	if(verbose) cout << "Writing output file\n";
+  auto t_txt = std::chrono::steady_clock::now();
 
   std::ofstream out;                            
   out.open(s_output_txt, std::ios::binary);  // Open binary file
-  GZWriter outGZ;                               
-  outGZ.SetOutputHandle(&out); // GZ compression
+  // If output file cannot be opened, then output error and fail early
+  if(!out.is_open()) {
+    msgs.out() << "Error writing gzip-compressed output file\n";
+    return(-1);
+  }
+  BGZFWriter outGZ;                               
+  outGZ.SetOutputHandle(&out); // GZ compression, in parallel BGZF blocks
+  outGZ.SetThreads(n_threads_to_use);
+  outGZ.SetMessageLog(messages);
 
-// Write stats here:
-  BBchild.at(0)->WriteOutput(myLine);
-  // If first write failed, then output error and fail early
-  int outret = outGZ.writeline("BAM_report\tValue"); 
+  std::string myLine_BAM;
+  BBchild.at(0)->WriteOutput(myLine_BAM);
+  std::string myLine_ROI;
+  std::string myLine_ROI_QC;
+  oROI.at(0)->WriteOutput(myLine_ROI, myLine_ROI_QC);
+  std::string myLine_Chr;
+  std::string myLine_Chr_QC;
+  oChr.at(0)->WriteOutput(myLine_Chr, myLine_Chr_QC);
+
+  // BAM_report, Performance_report and QC are only complete once all 
+  //   sections are generated, but are written before them
+  IRF_output_sections sections;
+  int outret = IRF_CompressSections(outGZ, sections, myLine_ROI, myLine_ROI_QC,
+    myLine_Chr, myLine_Chr_QC, *oJC.at(0), *oSP.at(0), *oCB.at(0), *oFM.at(0), n_threads_to_use);
   if(outret != Z_OK) {
-    cout << "Error writing gzip-compressed output file\n";
+    msgs.out() << "Error writing gzip-compressed output file\n";
     out.close();
     return(-1);
   }
-  outGZ.writestring(myLine); outGZ.writeline("");
 
-  int directionality = oJC.at(0)->Directional(myLine);
-  outGZ.writeline("Directionality\tValue"); outGZ.writestring(myLine); outGZ.writeline("");
+  double txt_secs = IRF_elapsed(t_txt);
+
+  // Sidecar: what IRF_requantify needs besides the COV file to recompute the
+  //   output for another reference
+  double sidecar_secs = 0;
+  if(save_sidecar) {
+    if(verbose) cout << "Writing sidecar file\n";
+    auto t_sidecar = std::chrono::steady_clock::now();
+    oSM.at(0)->sort_and_collapse_final(false);
+    refBinaryWriter sidecar;
+    std::string & buf = sidecar.NewSection(REF_SIDECAR_TEXT);
+    refBinaryWriter::Append(buf, sidecar.AddString(myLine_BAM));
+    refBinaryWriter::Append(buf, sidecar.AddString(myLine_ROI));
+    refBinaryWriter::Append(buf, sidecar.AddString(myLine_ROI_QC));
+    refBinaryWriter::Append(buf, sidecar.AddString(myLine_Chr));
+    refBinaryWriter::Append(buf, sidecar.AddString(myLine_Chr_QC));
+    oJC.at(0)->WriteCountsBinary(sidecar);
+    oSM.at(0)->WriteSidecar(sidecar);
+    delete oSM.at(0);
+    oSM.clear();
+    if(sidecar.WriteToFile(s_output_sidecar) != 0) {
+      out.close();
+      return(-1);
+    }
+    sidecar_secs = IRF_elapsed(t_sidecar);
+  }
 
-  // Generate output but save this to strings:
-  std::string myLine_ROI;
-  std::string myLine_JC;
-  std::string myLine_SP;
-  std::string myLine_Chr;
-  std::string myLine_ND;
-  std::string myLine_Dir;
-  std::string myLine_QC;
-  
-  oROI.at(0)->WriteOutput(myLine_ROI, myLine_QC);
-	oJC.at(0)->WriteOutput(myLine_JC, myLine_QC);
-	oSP.at(0)->WriteOutput(myLine_SP, myLine_QC);
-	oChr.at(0)->WriteOutput(myLine_Chr, myLine_QC);
-	oCB.at(0)->WriteOutput(myLine_ND, myLine_QC, *oJC.at(0), *oSP.at(0), *oFM.at(0), n_threads_to_use);
-  if (directionality != 0) {
-    oCB.at(0)->WriteOutput(myLine_Dir, myLine_QC, *oJC.at(0), *oSP.at(0), *oFM.at(0), n_threads_to_use, directionality); // Directional.
-	}
+  // Stage timings and counters
+  IRF_run_stats stats;
+  stats.add("Threads", n_threads_to_use);
+  stats.add("Total time (s)", IRF_elapsed(t_start));
+  stats.add("BAM processing time (s)", read_secs);
+  stats.add("fillReads rounds", n_rounds);
+  stats.add("fillReads time (s)", fill_secs);
+  stats.add("Barrier wait time (s)", wait_secs);
+  stats.add("Bytes inflated", inbam.GetBytesInflated(), true);
+  stats.add("Inflate thread time (s)", inbam.GetInflateTime());
+  stats.add("Inflate throughput per thread (MB/s)", inbam.GetInflateTime() > 0 ?
+    inbam.GetBytesInflated() / inbam.GetInflateTime() / 1e6 : 0);
+  stats.add("Spare pairing time (s)", spare_secs);
+  stats.add("Peak spare reads", peak_spare_reads);
+  stats.add("Peak spare read bytes", peak_spare_bytes);
+  stats.add("Combine time (s)", combine_secs);
+  stats.add("JunctionCount sort time (s)", jc_sort_secs);
+  stats.add("FragmentsMap sort time (s)", fm_sort_secs);
+  stats.add("FragmentsMap bytes before sort", fm_bytes_unsorted);
+  stats.add("FragmentsMap bytes after sort", fm_bytes_sorted);
+  stats.add("Memory budget (MB)", std::max(memory_budget_mb, 0));
+  stats.add("BAM buffer cap (MB)", plan.BufferBytes() / 1048576.0);
+  stats.add("FragmentsMap collapse interval", plan.collapse_interval);
+  // File buffers, the data buffer(s) as far as they were filled, and processors
+  size_t buffer_bytes = 2 * plan.file_buffer_cap + (plan.pipelined ? 2 : 1) * 
+    std::min(plan.data_buffer_cap, peak_round_bytes);
+  stats.add("Peak tracked memory (MB)", (buffer_bytes + peak_proc_bytes) / 1048576.0);
+  stats.add("COV write time (s)", cov_secs);
+  stats.add("Text output time (s)", txt_secs);
+  if(save_sidecar) stats.add("Sidecar write time (s)", sidecar_secs);
+  for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    std::string thread_name = "Thread " + std::to_string(i);
+    stats.add(thread_name + " fragments", proc_frags.at(i));
+    stats.add(thread_name + " fragments/s", proc_secs.at(i) > 0 ? 
+      proc_frags.at(i) / proc_secs.at(i) : 0);
+  }
+  std::string myLine_Stats;
+  stats.WriteOutput(myLine_Stats);
+  if(run_stats) *run_stats = stats;
 
-  outGZ.writeline("QC\tValue"); outGZ.writestring(myLine_QC); outGZ.writeline("");
-	
-  outGZ.writeline("ROIname\ttotal_hits\tpositive_strand_hits\tnegative_strand_hits");
-  outGZ.writestring(myLine_ROI); outGZ.writeline("");
-  
-  outGZ.writeline("JC_seqname\tstart\tend\tstrand\ttotal\tpos\tneg");
-  outGZ.writestring(myLine_JC); outGZ.writeline("");
-  
-  outGZ.writeline("SP_seqname\tcoord\ttotal\tpos\tneg");
-  outGZ.writestring(myLine_SP); outGZ.writeline("");
-  
-  outGZ.writeline("ChrCoverage_seqname\ttotal\tpos\tneg");
-  outGZ.writestring(myLine_Chr); outGZ.writeline("");
-  
-  outGZ.writestring(myLine_ND); outGZ.writeline("");
-  
-  if (directionality != 0) {
-    outGZ.writestring(myLine_Dir); outGZ.writeline("");
+  outret = IRF_WriteSections(outGZ, sections, myLine_BAM, myLine_Stats);
+  if(outret != Z_OK) {
+    msgs.out() << "Error writing gzip-compressed output file\n";
+    out.close();
+    return(-1);
   }
-  outGZ.flush(true);
   out.flush(); out.close();
   
   // destroy objects:
@@ -947,24 +1664,13 @@ int IRF_core(std::string const &bam_file,
 
 
 
-#ifdef RNXTIRF
-// [[Rcpp::export]]
-int IRF_main(
-    std::string bam_file, std::string reference_file, std::string output_file,
-    bool verbose, int n_threads
-) {
-  
-  std::string s_output_txt = output_file + ".txt.gz";
-  std::string s_output_cov = output_file + ".cov";
-#else
-int IRF_main(
+// Reads the reference, then runs IRF_core on one sample
+static int IRF_main_run(
     std::string bam_file, std::string reference_file, std::string s_output_txt,
-    std::string s_output_cov, int n_threads
-){
-	
-  bool verbose = true;
-#endif
-  
+    std::string s_output_cov, std::string s_output_sidecar,
+    bool verbose, int n_threads, IRF_run_stats * run_stats, int memory_budget_mb,
+    bool write_zoom
+) {
   int use_threads = Set_Threads(n_threads);
   
   std::string s_bam = bam_file;
@@ -984,8 +1690,9 @@ int IRF_main(
     if(Has_OpenMP() != 0) cout << " with OpenMP ";
     cout << "using " << use_threads << " threads"
       << "\n" << "Reference: " << s_ref << "\n"
-      << "Output file: " << s_output_txt << "\t" << s_output_cov << "\n\n"
-      << "Reading reference file\n";
+      << "Output file: " << s_output_txt << "\t" << s_output_cov;
+    if(s_output_sidecar.size() > 0) cout << "\t" << s_output_sidecar;
+    cout << "\n\n" << "Reading reference file\n";
   }
 
   CoverageBlocksIRFinder * CB_template = new CoverageBlocksIRFinder;
@@ -1009,7 +1716,8 @@ int IRF_main(
   // main:
   ret = IRF_core(s_bam, s_output_txt, s_output_cov,
     ref_names, ref_alias, ref_lengths,
-    *CB_template, *SP_template, *ROI_template, *JC_template, verbose, use_threads);
+    *CB_template, *SP_template, *ROI_template, *JC_template, verbose, use_threads,
+    false, run_stats, s_output_sidecar, memory_budget_mb, write_zoom);
     
   if(ret != 0) cout << "Process interrupted running IRFinder on " << s_bam << '\n';
   
@@ -1021,25 +1729,65 @@ int IRF_main(
 }
 
 #ifdef RNXTIRF
+// Returns the exit code (ret), and the stats of the run (timings included;
+//   only the thread-independent ones are written to Performance_report)
+//   If save_sidecar, also writes output_file.sj for IRF_requantify
+//   memory_budget_mb (0 for none) sizes the buffers, see IRF_memory_plan
+//   If write_zoom, the COV file also holds 1 / 10 / 100 kb zoom levels
 // [[Rcpp::export]]
-int IRF_main_multi(
-    std::string reference_file, StringVector bam_files, StringVector output_files,
-    int max_threads, bool verbose
+List IRF_main(
+    std::string bam_file, std::string reference_file, std::string output_file,
+    bool verbose, int n_threads, bool save_sidecar, int memory_budget_mb,
+    bool write_zoom
+) {
+  IRF_run_stats run_stats;
+  int ret = IRF_main_run(bam_file, reference_file, 
+    output_file + ".txt.gz", output_file + ".cov", 
+    save_sidecar ? output_file + ".sj" : "", verbose, n_threads, &run_stats,
+    memory_budget_mb, write_zoom);
+  
+  List stats = List::create(
+    _["Stat"] = run_stats.names,
+    _["Value"] = run_stats.values
+  );
+  List result = List::create(
+    _["ret"] = ret,
+    _["stats"] = stats
+  );
+  return(result);
+}
+#else
+int IRF_main(
+    std::string bam_file, std::string reference_file, std::string s_output_txt,
+    std::string s_output_cov, int n_threads, std::string s_output_sidecar,
+    int memory_budget_mb, bool write_zoom
 ){
-	
-	int use_threads = Set_Threads(max_threads);
+  IRF_run_stats run_stats;
+  int ret = IRF_main_run(bam_file, reference_file, s_output_txt, s_output_cov, 
+    s_output_sidecar, true, n_threads, &run_stats, memory_budget_mb, write_zoom);
+  if(ret == 0) {
+    std::string myLine_Stats;
+    run_stats.WriteOutput(myLine_Stats, true);
+    cout << "\nPerformance report:\n" << myLine_Stats;
+  }
+  return(ret);
+}
+#endif
 
-	if(bam_files.size() != output_files.size() || bam_files.size() < 1) {
+// Reads the reference, then runs IRF_core on each sample
+//   sample_stats receives the stats of each sample (empty if it was not run)
+static int IRF_main_multi_run(
+    std::string reference_file, std::vector<std::string> v_bam, std::vector<std::string> v_out,
+    int max_threads, bool verbose, int n_samples_parallel, bool save_sidecar,
+    int memory_budget_mb, bool write_zoom, std::vector<IRF_run_stats> &sample_stats
+){
+	sample_stats.assign(v_bam.size(), IRF_run_stats());
+	if(v_bam.size() != v_out.size() || v_bam.size() < 1) {
 		cout << "bam_files and output_files are of different sizes\n";
 		return(1);	
 	}
 	
-	std::vector< std::string > v_bam;
-	std::vector< std::string > v_out;
-  for(int z = 0; z < bam_files.size(); z++) {
-		v_bam.push_back(string(bam_files(z)));
-		v_out.push_back(string(output_files(z)));
-	}
+	int use_threads = Set_Threads(max_threads);
 
   std::string s_ref = reference_file;
   cout << "Reading reference file\n";
@@ -1062,43 +1810,369 @@ int IRF_main_multi(
     return(ret);
   }
 
-	cout << "Running IRFinder with OpenMP using " << use_threads << " threads\n";
+  // Divide threads between samples run at the same time
+  unsigned int n_parallel = (n_samples_parallel > 1) ? (unsigned int)n_samples_parallel : 1;
+  if(n_parallel > v_bam.size()) n_parallel = v_bam.size();
+  if(n_parallel > (unsigned int)use_threads) n_parallel = use_threads;
+  // The memory budget is shared by the samples running at the same time
+  if(memory_budget_mb > 0) {
+    unsigned int max_parallel = std::max(1, memory_budget_mb / IRF_memory_plan::min_budget_mb);
+    if(n_parallel > max_parallel) n_parallel = max_parallel;
+  }
+#ifndef _OPENMP
+  n_parallel = 1;
+#endif
+  int threads_per_sample = use_threads / n_parallel;
+  int budget_per_sample = memory_budget_mb > 0 ? memory_budget_mb / n_parallel : 0;
+  if(budget_per_sample > 0) {
+    cout << "Memory budget of " << budget_per_sample << " MB per sample\n";
+  }
+  
+  if(n_parallel == 1) {
+    cout << "Running IRFinder with OpenMP using " << use_threads << " threads\n";
 
-  for(unsigned int z = 0; z < v_bam.size(); z++) {
-    std::string s_bam = v_bam.at(z);
-		std::string s_output_txt = v_out.at(z) + ".txt.gz";
-		std::string s_output_cov = v_out.at(z) + ".cov";
+    for(unsigned int z = 0; z < v_bam.size(); z++) {
+      std::string s_bam = v_bam.at(z);
+      std::string s_output_txt = v_out.at(z) + ".txt.gz";
+      std::string s_output_cov = v_out.at(z) + ".cov";
+      std::string s_output_sidecar = save_sidecar ? v_out.at(z) + ".sj" : "";
+      
+      int ret2 = IRF_core(s_bam, s_output_txt, s_output_cov,
+        ref_names, ref_alias, ref_lengths,
+        *CB_template, *SP_template, *ROI_template, *JC_template, verbose, use_threads,
+        false, &sample_stats.at(z), s_output_sidecar, budget_per_sample, write_zoom);
+      if(ret2 != 0) {
+        cout << "Process interrupted running IRFinder on " << s_bam << '\n';
+        ret = ret2;
+        break;
+      } else {
+        cout << s_bam << " processed (peak tracked memory " 
+          << (long)sample_stats.at(z).get("Peak tracked memory (MB)") << " MB)\n";
+      }
+    }
+  } else {
+    cout << "Running IRFinder with OpenMP on " << n_parallel << " samples at a time, using "
+      << threads_per_sample << " threads per sample\n";
     
-    int ret2 = IRF_core(s_bam, s_output_txt, s_output_cov,
-      ref_names, ref_alias, ref_lengths,
-      *CB_template, *SP_template, *ROI_template, *JC_template, verbose, use_threads);
-    if(ret2 != 0) {
-      cout << "Process interrupted running IRFinder on " << s_bam << '\n';
-      delete CB_template;
-      delete SP_template;
-      delete ROI_template;
-      delete JC_template;
-      return(ret);
-    } else {
-      cout << s_bam << " processed\n";
+    // Reference templates are only read (copied per thread) by IRF_core, so are shared by all samples
+    std::vector<int> sample_ret(v_bam.size(), 0);
+    std::vector<char> sample_run(v_bam.size(), 0);
+    // Samples run off the main thread, so their messages are printed after the loop
+    std::vector<std::string> sample_messages(v_bam.size());
+#ifdef _OPENMP
+    int prev_max_levels = omp_get_max_active_levels();
+    omp_set_max_active_levels(2);
+#endif
+#ifdef RNXTIRF
+    Progress p(v_bam.size(), verbose);
+#endif
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_parallel) schedule(dynamic,1)
+#endif
+    for(unsigned int z = 0; z < v_bam.size(); z++) {
+#ifdef RNXTIRF
+      if(p.check_abort()) continue;
+#endif
+#ifdef _OPENMP
+      omp_set_num_threads(threads_per_sample);  // for this sample's nested regions
+#endif
+      sample_ret.at(z) = IRF_core(v_bam.at(z), v_out.at(z) + ".txt.gz", v_out.at(z) + ".cov",
+        ref_names, ref_alias, ref_lengths,
+        *CB_template, *SP_template, *ROI_template, *JC_template, false, threads_per_sample, true,
+        &sample_stats.at(z), save_sidecar ? v_out.at(z) + ".sj" : "", budget_per_sample,
+        write_zoom, &sample_messages.at(z));
+      sample_run.at(z) = 1;
+#ifdef RNXTIRF
+      p.increment(1);
+#endif
     }
-	}
+#ifdef _OPENMP
+    omp_set_max_active_levels(prev_max_levels);
+    omp_set_num_threads(use_threads);
+#endif
+
+    for(unsigned int z = 0; z < v_bam.size(); z++) {
+      cout << sample_messages.at(z);
+      if(!sample_run.at(z) || sample_ret.at(z) != 0) {
+        cout << "Process interrupted running IRFinder on " << v_bam.at(z) << '\n';
+        if(ret == 0) ret = (sample_ret.at(z) != 0) ? sample_ret.at(z) : -1;
+      } else {
+        cout << v_bam.at(z) << " processed (peak tracked memory " 
+          << (long)sample_stats.at(z).get("Peak tracked memory (MB)") << " MB)\n";
+      }
+    }
+  }
 
   delete CB_template;
   delete SP_template;
   delete ROI_template;
   delete JC_template;
+  return(ret);
+}
+
+#ifdef RNXTIRF
+// Returns the exit code (ret), and a list of the stats of each sample, as
+//   returned by IRF_main (with no stats for samples that were not run)
+// [[Rcpp::export]]
+List IRF_main_multi(
+    std::string reference_file, StringVector bam_files, StringVector output_files,
+    int max_threads, bool verbose, int n_samples_parallel, bool save_sidecar,
+    int memory_budget_mb, bool write_zoom
+){
+	std::vector< std::string > v_bam;
+	std::vector< std::string > v_out;
+  for(int z = 0; z < bam_files.size(); z++) v_bam.push_back(string(bam_files(z)));
+  for(int z = 0; z < output_files.size(); z++) v_out.push_back(string(output_files(z)));
+
+  std::vector<IRF_run_stats> sample_stats;
+  int ret = IRF_main_multi_run(reference_file, v_bam, v_out, max_threads, verbose,
+    n_samples_parallel, save_sidecar, memory_budget_mb, write_zoom, sample_stats);
+
+  List stats;
+  for(unsigned int z = 0; z < sample_stats.size(); z++) {
+    stats.push_back(List::create(
+      _["Stat"] = sample_stats.at(z).names,
+      _["Value"] = sample_stats.at(z).values
+    ));
+  }
+  List result = List::create(
+    _["ret"] = ret,
+    _["stats"] = stats
+  );
+  return(result);
+}
+#else
+int IRF_main_multi(
+    std::string reference_file, std::vector<std::string> v_bam, std::vector<std::string> v_out,
+    int max_threads, int n_samples_parallel, bool save_sidecar,
+    int memory_budget_mb, bool write_zoom
+){
+  std::vector<IRF_run_stats> sample_stats;
+  return(IRF_main_multi_run(reference_file, v_bam, v_out, max_threads, true,
+    n_samples_parallel, save_sidecar, memory_budget_mb, write_zoom, sample_stats));
+}
+#endif
+
+// ############################ REQUANTIFY ######################################
+
+// Recomputes the IRFinder output of a sample for a (new) reference, from the
+//   COV file and sidecar saved by IRF_core, without reading the BAM file.
+// The ROIname and ChrCoverage sections, and the BAM_report, are those of the
+//   original run: ROI counts need the reads, and are not updated
+static int IRF_requantify_run(
+    std::string cov_file, std::string sidecar_file, std::string reference_file, 
+    std::string s_output_txt, bool verbose, int n_threads
+) {
+  auto t_start = std::chrono::steady_clock::now();
+  unsigned int n_threads_to_use = (unsigned int)Set_Threads(n_threads);
+
+  if(!see_if_file_exists(cov_file)) {
+    cout << "File " << cov_file << " does not exist!\n";
+    return(-1);
+  } 
+  if(!see_if_file_exists(sidecar_file)) {
+    cout << "File " << sidecar_file << " does not exist!\n";
+    return(-1);
+  } 
+  if(verbose) {
+    cout << "Requantifying " << cov_file << " using " << n_threads_to_use << " threads"
+      << "\n" << "Reference: " << reference_file << "\n"
+      << "Output file: " << s_output_txt << "\n\n"
+      << "Reading reference file\n";
+  }
+
+  CoverageBlocksIRFinder CB;
+  SpansPoint SP;
+  FragmentsInROI ROI;
+  JunctionCount JC;
+  std::vector<std::string> ref_names;
+  std::vector<std::string> ref_alias;
+  std::vector<uint32_t> ref_lengths;
+  int ret = IRF_ref(reference_file, ref_names, ref_alias, ref_lengths,
+    CB, SP, ROI, JC, verbose);
+  if(ret != 0) {
+    cout << "Reading Reference file failed. Check if IRFinder.ref.gz exists and is a valid NxtIRF-generated IRFinder reference\n";
+    return(ret);
+  }
+
+  refBinaryReader sidecar;
+  if(sidecar.Open(sidecar_file) != 0 || !sidecar.HasSection(REF_SIDECAR_TEXT) ||
+      !sidecar.HasSection(REF_SIDECAR_JUNC) || !sidecar.HasSection(REF_SIDECAR_SPANS)) {
+    cout << sidecar_file << " is not a valid NxtIRF sidecar file\n";
+    return(-1);
+  }
+  covReader inCov;
+  if(inCov.SetInputFile(cov_file) != 0 || inCov.ReadHeader() < 0) {
+    cout << cov_file << " appears to not be valid COV file... exiting\n";
+    return(-1);
+  }
+
+  // COV chromosomes first, in order, as IRF_core gives them to BAM2blocks
+  std::vector<chr_entry> cov_chrs;
+  inCov.GetChrs(cov_chrs);
+  std::vector<std::string> s_chr_names;
+  std::vector<uint32_t> u32_chr_lens;
+  for(auto & chr : cov_chrs) {
+    s_chr_names.push_back(chr.chr_name);
+    u32_chr_lens.push_back(chr.chr_len);
+  }
+  std::vector<std::string> chr_name;
+  std::vector<uint32_t> chr_len;
+  IRF_MatchChrs(s_chr_names, u32_chr_lens, ref_names, ref_alias, ref_lengths,
+    chr_name, chr_len);
+  std::vector<chr_entry> chrmap;
+  for(unsigned int i = 0; i < chr_name.size(); i++) {
+    chrmap.push_back(chr_entry(i, chr_name.at(i), chr_len.at(i)));
+  }
+
+  FragmentsMap FM;
+  JC.ChrMapUpdate(chrmap);
+  SP.ChrMapUpdate(chrmap);
+  CB.ChrMapUpdate(chrmap);
+  FM.ChrMapUpdate(chrmap);
+
+  if(verbose) cout << "Reading COV file\n";
+  auto t_cov = std::chrono::steady_clock::now();
+  if(FM.LoadBinary(&inCov, n_threads_to_use) != 0) {
+    cout << "Error reading " << cov_file << "\n";
+    return(-1);
+  }
+  double cov_secs = IRF_elapsed(t_cov);
+
+  if(verbose) cout << "Reading sidecar file\n";
+  auto t_sidecar = std::chrono::steady_clock::now();
+  if(JC.LoadCountsBinary(sidecar) != 0 || SpanDepthMap::LoadSidecar(sidecar, SP) != 0) {
+    cout << "Error reading " << sidecar_file << "\n";
+    return(-1);
+  }
+  JC.sort_and_collapse_final();
+  refBinarySection sec = sidecar.GetSection(REF_SIDECAR_TEXT);
+  std::string myLine_BAM = sidecar.GetString(sec.Read<uint32_t>());
+  std::string myLine_ROI = sidecar.GetString(sec.Read<uint32_t>());
+  std::string myLine_ROI_QC = sidecar.GetString(sec.Read<uint32_t>());
+  std::string myLine_Chr = sidecar.GetString(sec.Read<uint32_t>());
+  std::string myLine_Chr_QC = sidecar.GetString(sec.Read<uint32_t>());
+  if(sec.fail()) {
+    cout << "Error reading " << sidecar_file << "\n";
+    return(-1);
+  }
+  double sidecar_secs = IRF_elapsed(t_sidecar);
+
+  if(verbose) cout << "Writing output file\n";
+  auto t_txt = std::chrono::steady_clock::now();
+  std::ofstream out;
+  out.open(s_output_txt, std::ios::binary);
+  if(!out.is_open()) {
+    cout << "Error writing gzip-compressed output file\n";
+    return(-1);
+  }
+  BGZFWriter outGZ;
+  outGZ.SetOutputHandle(&out);
+  outGZ.SetThreads(n_threads_to_use);
+
+  IRF_output_sections sections;
+  int outret = IRF_CompressSections(outGZ, sections, myLine_ROI, myLine_ROI_QC,
+    myLine_Chr, myLine_Chr_QC, JC, SP, CB, FM, n_threads_to_use);
+  double txt_secs = IRF_elapsed(t_txt);
+
+  IRF_run_stats stats;
+  stats.add("Threads", n_threads_to_use);
+  stats.add("Total time (s)", IRF_elapsed(t_start));
+  stats.add("COV read time (s)", cov_secs);
+  stats.add("Sidecar read time (s)", sidecar_secs);
+  stats.add("Text output time (s)", txt_secs);
+  std::string myLine_Stats;
+  stats.WriteOutput(myLine_Stats);
+
+  if(outret == Z_OK) outret = IRF_WriteSections(outGZ, sections, myLine_BAM, myLine_Stats);
+  if(outret != Z_OK) {
+    cout << "Error writing gzip-compressed output file\n";
+    out.close();
+    return(-1);
+  }
+  out.flush(); out.close();
+  if(verbose) {
+    // The timings are not reported in the output file
+    stats.WriteOutput(myLine_Stats, true);
+    cout << "\nPerformance report:\n" << myLine_Stats;
+  }
   return(0);
 }
 
+#ifdef RNXTIRF
+// Writes output_file.txt.gz
+// [[Rcpp::export]]
+int IRF_requantify(
+    std::string cov_file, std::string sidecar_file, std::string reference_file,
+    std::string output_file, bool verbose, int n_threads
+) {
+  return(IRF_requantify_run(cov_file, sidecar_file, reference_file,
+    output_file + ".txt.gz", verbose, n_threads));
+}
+#else
+int IRF_requantify(
+    std::string cov_file, std::string sidecar_file, std::string reference_file,
+    std::string s_output_txt, int n_threads
+) {
+  return(IRF_requantify_run(cov_file, sidecar_file, reference_file,
+    s_output_txt, true, n_threads));
+}
 #endif
 
 // ############################ MAPPABILITY READS AND REGIONS ##################
 
+// Formats the reads of windows [k_start, k_end) of a chromosome into out.
+//   num_reads is the (global) number of windows before k_start, and
+//   direction the strand of the first valid read in the tile
+static void FormatMappabilityTile(
+    const char * seq, const std::string &chr,
+    const std::vector<uint64_t> &valid, size_t k_start, size_t k_end,
+    const unsigned int read_len, const unsigned int read_stride, 
+    const unsigned int error_pos, size_t num_reads, unsigned int direction,
+    std::string &out
+) {
+  StringSink sink(out);
+  TextBuffer fa_out(sink, 1048576);
+  char * read = new char[read_len + 1];
+  for(size_t k = k_start; k < k_end; k++) {
+    size_t bufferPos = 1 + k * read_stride;
+    num_reads += 1;
+    if((valid[k >> 6] >> (k & 63)) & 1) {
+      GenerateReadError(
+        read, &seq[bufferPos - 1], read_len, error_pos, direction, num_reads
+      );
+      fa_out << (direction == 0 ? ">RF!" : ">RR!") << chr << '!' 
+        << bufferPos << '\n';
+      fa_out.write(read, read_len) << '\n';
+      direction = (direction == 0 ? 1 : 0);
+    }
+  }
+  fa_out.flush();
+  delete[] read;
+}
+
+// Number of set bits of valid in windows [k_start, k_end)
+static size_t CountValidWindows(
+    const std::vector<uint64_t> &valid, size_t k_start, size_t k_end
+) {
+  size_t count = 0;
+  for(size_t k = k_start; k < k_end; ) {
+    if((k & 63) == 0 && k + 64 <= k_end) {
+      uint64_t word = valid[k >> 6];
+      while(word) { word &= word - 1; count++; }
+      k += 64;
+    } else {
+      count += (valid[k >> 6] >> (k & 63)) & 1;
+      k++;
+    }
+  }
+  return(count);
+}
+
 // [[Rcpp::export]]
 int IRF_GenerateMappabilityReads(
   std::string genome_file, std::string out_fa,
-	int read_len, int read_stride, int error_pos
+	int read_len, int read_stride, int error_pos, int n_threads
 ) {
 
   if(!see_if_file_exists(genome_file)) {
@@ -1120,16 +2194,37 @@ int IRF_GenerateMappabilityReads(
   } else {
     outFA.open(out_fa, std::ios::binary);    
   }
+  std::ostream &fa_dest = (is_stdout == 1 ? (std::ostream &)cout : (std::ostream &)outFA);
 #else
   outFA.open(out_fa, std::ios::binary);    
+  std::ostream &fa_dest = outFA;
 #endif
-      
+
+  // Output file names ending in .gz are written as BGZF-compressed FASTA
+  bool use_gz = out_fa.size() > 3 && out_fa.substr(out_fa.size() - 3) == ".gz";
+  BGZFWriter outGZ;
+  outGZ.SetOutputHandle(&fa_dest);
+  
+  unsigned int n_threads_to_use = 1;
+#ifdef _OPENMP
+  if(n_threads > 1) n_threads_to_use = (unsigned int)n_threads;
+#endif
+
+  // Windows are processed in tiles of about 4 Mb of FASTA output each,
+  //   n_threads_to_use * 2 tiles at a time, then written in order
+  size_t tile_windows = 4194304 / (read_len + 32) + 1;
+  size_t batch_tiles = 2 * n_threads_to_use;
+  std::vector<std::string> tile_out(batch_tiles);
+  std::vector<size_t> tile_start(batch_tiles + 1);
+  std::vector<size_t> tile_reads(batch_tiles);
+  std::vector<unsigned int> tile_dir(batch_tiles);
+  std::vector<int> tile_ret(batch_tiles);
+
   unsigned int direction = 0;
-  char * read = new char[read_len + 1];
   size_t num_reads = 0;
-  
-  string chr;
-  string sequence;
+  std::vector<uint64_t> valid_windows;
+  size_t n_windows = 0;
+  int ret = 0;
 
   FastaReader inFA;
   inFA.SetInputHandle(&inGenome);
@@ -1139,73 +2234,92 @@ int IRF_GenerateMappabilityReads(
   Progress p(inFA.total_size);
 #endif
 
-  while(!inGenome.eof() && !inGenome.fail()) {
-
+  while(!inGenome.eof() && !inGenome.fail() && ret == 0) {
     inFA.ReadSeq();
-    sequence = inFA.sequence;
-    chr = inFA.seqname;
-    char * buffer = new char[sequence.length() + 1];
-    std::strcpy (buffer, sequence.c_str());
+    const std::string &chr = inFA.seqname;
+    const char * seq = inFA.sequence.data();
 #ifdef RNXTIRF
     size_t seq_progress = 0;
 #endif
-    for(
-        unsigned int bufferPos = 1; 
-        bufferPos < sequence.length() - read_len + 1; 
-        bufferPos += read_stride
-    ) {
-      memcpy(read, &buffer[bufferPos - 1], read_len);
-      num_reads += 1;
-      if(checkDNA(read, read_len)) {       
-        std::string write_seq = GenerateReadError(
-          read, read_len, error_pos, direction, num_reads
-        ) ;
-
-#ifndef RNXTIRF
-        if(is_stdout == 1) {
-          cout << (direction == 0 ? ">RF!" : ">RR!") << chr << "!" 
-            << std::to_string(bufferPos)
-            << '\n' << write_seq << '\n';  
-        } else {
-          outFA << (direction == 0 ? ">RF!" : ">RR!") << chr << "!" 
-            << std::to_string(bufferPos)
-            << '\n' << write_seq << '\n'; 
+    // Screen all windows of this chromosome for N's at once
+    checkDNAWindows(seq, inFA.sequence.length(), read_len, read_stride, 
+      n_windows, valid_windows);
+
+    for(size_t k = 0; k < n_windows && ret == 0; ) {
+      // Assigns read numbers and strands to each tile of this batch
+      unsigned int n_tiles = 0;
+      tile_start.at(0) = k;
+      while(n_tiles < batch_tiles && k < n_windows) {
+        size_t k_end = std::min(n_windows, k + tile_windows);
+        tile_reads.at(n_tiles) = num_reads;
+        tile_dir.at(n_tiles) = direction;
+        if(CountValidWindows(valid_windows, k, k_end) % 2 == 1) {
+          direction = (direction == 0 ? 1 : 0);
         }
-#else
-        outFA << (direction == 0 ? ">RF!" : ">RR!") << chr << "!" 
-          << std::to_string(bufferPos)
-          << '\n' << write_seq << '\n'; 
+        num_reads += k_end - k;
+        k = k_end;
+        n_tiles++;
+        tile_start.at(n_tiles) = k;
+      }
+
+#ifdef _OPENMP
+      #pragma omp parallel for num_threads(n_threads_to_use) schedule(dynamic,1)
 #endif
+      for(unsigned int i = 0; i < n_tiles; i++) {
+        std::string &out = tile_out.at(i);
+        out.clear();
+        FormatMappabilityTile(seq, chr, valid_windows, 
+          tile_start.at(i), tile_start.at(i + 1), read_len, read_stride, 
+          error_pos, tile_reads.at(i), tile_dir.at(i), out);
+        tile_ret.at(i) = Z_OK;
+        if(use_gz) {
+          // Compresses each tile on its own thread
+          std::string compressed;
+          BGZFWriter tileGZ;
+          tile_ret.at(i) = tileGZ.compress(out, compressed);
+          out.swap(compressed);
+        }
+      }
 
-        direction = (direction == 0 ? 1 : 0);
-        
-        // update progress bar
-#ifdef RNXTIRF
-        if(num_reads % 100000 == 0) {
-          p.increment(bufferPos - seq_progress);
-          seq_progress = bufferPos;
+      for(unsigned int i = 0; i < n_tiles; i++) {
+        if(tile_ret.at(i) == Z_OK) {
+          fa_dest.write(tile_out.at(i).data(), tile_out.at(i).size());
+        }
+        if(tile_ret.at(i) != Z_OK || fa_dest.fail()) {
+          cout << "Error writing " << out_fa << "\n";
+          ret = -1;
+          break;
         }
-#endif
       }
+      
+      // update progress bar
+#ifdef RNXTIRF
+      size_t bufferPos = 1 + (k - 1) * read_stride;
+      p.increment(bufferPos - seq_progress);
+      seq_progress = bufferPos;
+#endif
     }
 #ifdef RNXTIRF
-    p.increment(sequence.length() - seq_progress);
+    p.increment(inFA.sequence.length() - seq_progress);
 #endif
-    delete[] buffer;
   }
-  delete[] read;
-  
+  if(use_gz && ret == 0) {
+    if(outGZ.flush(true) != Z_OK) ret = -1;
+  }
   inGenome.close();
 
 #ifndef RNXTIRF
   if(is_stdout == 0) {
     outFA.flush();
     outFA.close();
+  } else {
+    cout.flush();
   }
 #else  
   outFA.flush();
   outFA.close();
 #endif
+  if(ret != 0) return(ret);
   
   cout << num_reads << " synthetic reads generated\n";
   return(0);
@@ -1217,7 +2331,7 @@ int IRF_GenerateMappabilityReads(
 int IRF_GenerateMappabilityRegions(
     std::string bam_file, std::string output_file, 
     int threshold, int includeCov, bool verbose,
-    int n_threads
+    int n_threads, int memory_budget_mb
 ){
   
   std::string s_output_txt = output_file + ".txt";
@@ -1225,7 +2339,8 @@ int IRF_GenerateMappabilityRegions(
 #else
 int IRF_GenerateMappabilityRegions(
     std::string bam_file, std::string s_output_txt, 
-    int threshold, int n_threads, std::string s_output_cov
+    int threshold, int n_threads, std::string s_output_cov,
+    int memory_budget_mb
 ){	
 	bool verbose = true;
 #endif
@@ -1241,22 +2356,48 @@ int IRF_GenerateMappabilityRegions(
   std::string myLine;
 	if(verbose) cout << "Calculating Mappability Exclusions from aligned synthetic reads in BAM file " << bam_file << "\n";
 
-  pbam_in inbam((size_t)5e8, (size_t)1e9, 5);
+  IRF_memory_plan plan;
+  plan.Plan(IRF_file_size(bam_file), memory_budget_mb, n_threads_to_use, n_threads_to_use > 1);
+  pbam_in inbam(plan.file_buffer_cap, plan.data_buffer_cap, plan.chunks_per_file_buffer, 
+    true, plan.pipelined);
   inbam.openFile(bam_file, n_threads_to_use);
+  if(n_threads_to_use > 1) inbam.SetDispatchChunkSize(bam_dispatch_chunk_size);
+
+  // Without a COV file, only the unstranded depth up to the threshold is
+  //   needed, which one MappabilityDepthMap shared by all threads can count
+#ifdef RNXTIRF
+  bool use_dense = (includeCov != 1);
+#else
+  bool use_dense = s_output_cov.empty();
+#endif
+  if(threshold > MappabilityDepthMap::max_threshold) use_dense = false;
 
   // Assign children:
+  MappabilityDepthMap * oMD = NULL;
   std::vector<FragmentsMap*> oFM;
   std::vector<BAM2blocks*> BBchild;
 
+  if(use_dense) {
+    oMD = new MappabilityDepthMap;
+    oMD->SetThreshold(threshold);
+  }
   for(unsigned int i = 0; i < n_threads_to_use; i++) {
-    oFM.push_back(new FragmentsMap);
     BBchild.push_back(new BAM2blocks);
-
-    BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&FragmentsMap::ProcessBlocks, &(*oFM.at(i)), std::placeholders::_1) );
+    if(use_dense) {
+      BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&MappabilityDepthMap::ChrMapUpdate, oMD, std::placeholders::_1) );
+      BBchild.at(i)->registerCallbackProcessBatch( MakeBlockProcessorPipeline(oMD) );
+    } else {
+      oFM.push_back(new FragmentsMap);
+      oFM.at(i)->SetCollapseInterval(plan.collapse_interval);
+      BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
+      BBchild.at(i)->registerCallbackProcessBatch( MakeBlockProcessorPipeline(oFM.at(i)) );
+    }
 
     BBchild.at(i)->openFile(&inbam);
   }
+  if(use_dense && verbose) {
+    cout << "Counting depth in " << (oMD->MemoryUsage() + 999999) / 1000000 << " Mb of dense counters\n";
+  }
   
   // BAM processing loop
 #ifdef RNXTIRF
@@ -1269,9 +2410,13 @@ int IRF_GenerateMappabilityRegions(
 #endif
   
     #ifdef _OPENMP
-    #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
+    #pragma omp parallel for num_threads(n_threads_to_use) schedule(dynamic,1)
     #endif
-    for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    for(unsigned int i = 0; i < 2 * n_threads_to_use; i++) {
+      if(i >= n_threads_to_use) {
+        inbam.decompressNext(i - n_threads_to_use);
+        continue;
+      }
       BBchild.at(i)->processAll(i, true);
     }
   }
@@ -1280,26 +2425,42 @@ int IRF_GenerateMappabilityRegions(
   if(p.check_abort()) {
     // interrupted:
     for(unsigned int i = 0; i < n_threads_to_use; i++) {
-      delete oFM.at(i);
+      if(!use_dense) delete oFM.at(i);
       delete BBchild.at(i);
     }
+    delete oMD;
     return(-1);
   }
 #endif
   
   inbam.closeFile();
 
+  if(use_dense) {
+    // Counts are already shared: no combining or sorting needed
+    if(n_threads_to_use > 1) BAM2blocks::processSpares(BBchild);
+    for(unsigned int i = 0; i < n_threads_to_use; i++) {
+      delete BBchild.at(i);
+    }
+
+    std::ofstream outFragsMap;
+    outFragsMap.open(s_output_txt, std::ifstream::out);
+    oMD->WriteOutput(&outFragsMap, verbose);
+    outFragsMap.flush(); outFragsMap.close();
+
+    delete oMD;
+    return(0);
+  }
+
   if(n_threads_to_use > 1) {
     if(verbose) cout << "Compiling data from threads\n";
   // Combine BB's and process spares
+    BAM2blocks::processSpares(BBchild);
     for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      BBchild.at(0)->processSpares(*BBchild.at(i));
       delete BBchild.at(i);
     }
   // Combine objects:
+    oFM.at(0)->Combine(oFM, n_threads_to_use);
     for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      oFM.at(0)->Combine(*oFM.at(i));
-
       delete oFM.at(i);
     }
   }
@@ -1331,16 +2492,108 @@ int IRF_GenerateMappabilityRegions(
 }
 
 
+// Per-chromosome mode for coordinate-sorted, indexed BAMs: each thread reads
+//   a share of the chromosomes using its own pbam_in, seeking to them via the
+//   index, so that threads do not wait for each other between buffers.
+//   Chromosomes are assigned, largest first, to the thread with the least
+//   compressed data to read. oFM must contain one FragmentsMap per thread
+//   Returns -1 if this mode cannot be used (the BAM must then be read
+//   using a shared pbam_in), -2 if interrupted, or 0 if success
+static int BAM2COV_ByChromosome(
+    const std::string &bam_file, pbam_in &inbam,
+    const std::vector<unsigned int> &refIDs, std::vector<FragmentsMap*> &oFM,
+    unsigned int n_threads_to_use, bool verbose, int memory_budget_mb
+) {
+  std::vector<unsigned int> order(refIDs);
+  std::stable_sort(order.begin(), order.end(), 
+    [&inbam](const unsigned int a, const unsigned int b) {
+      return(inbam.GetIndexedSize(a) > inbam.GetIndexedSize(b));
+    }
+  );
+  std::vector< std::vector<unsigned int> > thread_refIDs(n_threads_to_use);
+  std::vector<size_t> thread_size(n_threads_to_use, 0);
+  size_t total_size = 0;
+  for(auto refID : order) {
+    unsigned int k = std::min_element(thread_size.begin(), thread_size.end()) - thread_size.begin();
+    thread_refIDs.at(k).push_back(refID);
+    thread_size.at(k) += inbam.GetIndexedSize(refID);
+    total_size += inbam.GetIndexedSize(refID);
+  }
+  // Not worth it if one chromosome holds most of the reads
+  size_t max_size = *std::max_element(thread_size.begin(), thread_size.end());
+  if(total_size == 0 || max_size > 2 * (total_size / n_threads_to_use)) return(-1);
+  for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    std::sort(thread_refIDs.at(i).begin(), thread_refIDs.at(i).end());
+  }
+  if(verbose) cout << "Reading chromosomes in parallel using the BAM index\n";
+
+  // Each thread gets its share of the budget (and at most 50 Mb file buffers)
+  IRF_memory_plan thread_plan;
+  thread_plan.Plan(max_size, memory_budget_mb / (int)n_threads_to_use, 1, false, (size_t)5e7);
+
+  std::vector<int> thread_ret(n_threads_to_use, 0);
+#ifdef RNXTIRF
+  Progress p(total_size, verbose);
+#endif
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
+#endif
+  for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    pbam_in thread_bam(thread_plan.file_buffer_cap, thread_plan.data_buffer_cap, 
+      thread_plan.chunks_per_file_buffer, false, false);
+    if(thread_bam.openFile(bam_file, 1) != 0 || thread_bam.LoadIndex() != 0 ||
+        thread_bam.SetRegions(thread_refIDs.at(i)) != 0) {
+      thread_ret.at(i) = -1;
+      continue;
+    }
+    BAM2blocks BB;
+    BB.registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
+    BB.registerCallbackProcessBatch( MakeBlockProcessorPipeline(oFM.at(i)) );
+    BB.openFile(&thread_bam);
+    
+    std::vector<BAM2blocks*> BBthread(1, &BB);
+    int ret = 0;
+    while(0 == (ret = thread_bam.fillReads())) {
+      BB.processAll(0);
+      BAM2blocks::processSpares(BBthread);
+#ifdef RNXTIRF
+      p.increment(thread_bam.IncProgress());
+      if(p.check_abort()) break;
+#endif
+    }
+    BAM2blocks::processSpares(BBthread);
+    if(ret < 0) thread_ret.at(i) = -1;
+    thread_bam.closeFile();
+  }
+
+#ifdef RNXTIRF
+  if(p.check_abort()) return(-2);
+#endif
+  for(unsigned int i = 0; i < n_threads_to_use; i++) {
+    if(thread_ret.at(i) != 0) {
+      cout << "Error reading " << bam_file << " using its index\n";
+      return(-2);
+    }
+  }
+  return(0);
+}
+
 #ifdef RNXTIRF
 // [[Rcpp::export]]
 int IRF_BAM2COV(
     std::string bam_file, std::string output_file, 
-    bool verbose, int n_threads
+    bool verbose, int n_threads, StringVector seqnames, int memory_budget_mb,
+    bool write_zoom
 ){
-  
+  std::vector<std::string> v_seqnames;
+  for(int z = 0; z < seqnames.size(); z++) {
+    v_seqnames.push_back(string(seqnames(z)));
+  }
 #else
 int IRF_BAM2COV(
-    std::string bam_file, std::string output_file, int n_threads
+    std::string bam_file, std::string output_file, int n_threads,
+    bool write_zoom, std::vector<std::string> v_seqnames, int memory_budget_mb
 ){	
 	bool verbose = true;
 #endif
@@ -1358,8 +2611,38 @@ int IRF_BAM2COV(
   std::string myLine;
 	if(verbose) cout << "Creating COV file from " << bam_file << "\n";
 
-  pbam_in inbam((size_t)5e8, (size_t)1e9, 5);
-  inbam.openFile(bam_file, n_threads_to_use);
+  IRF_memory_plan plan;
+  plan.Plan(IRF_file_size(bam_file), memory_budget_mb, n_threads_to_use, n_threads_to_use > 1);
+  pbam_in inbam(plan.file_buffer_cap, plan.data_buffer_cap, plan.chunks_per_file_buffer, 
+    true, plan.pipelined);
+  if(inbam.openFile(bam_file, n_threads_to_use) != 0) return(-1);
+  if(n_threads_to_use > 1) inbam.SetDispatchChunkSize(bam_dispatch_chunk_size);
+
+  // Coordinate-sorted BAMs with an index (.bai / .csi) can be restricted to 
+  //   the given chromosomes, and read one chromosome per thread
+  bool use_index = (inbam.GetSortOrder() == "coordinate" && inbam.LoadIndex() == 0);
+  std::vector<std::string> s_chr_names;
+  std::vector<uint32_t> u32_chr_lens;
+  inbam.obtainChrs(s_chr_names, u32_chr_lens);
+  std::vector<unsigned int> refIDs;
+  if(v_seqnames.size() > 0) {
+    if(!use_index) {
+      cout << "Restricting to chromosomes requires a coordinate-sorted BAM "
+        << "with an index (.bai or .csi)\n";
+      return(-1);
+    }
+    for(unsigned int i = 0; i < s_chr_names.size(); i++) {
+      if(std::find(v_seqnames.begin(), v_seqnames.end(), s_chr_names.at(i)) 
+          != v_seqnames.end()) {
+        refIDs.push_back(i);
+      }
+    }
+    if(refIDs.size() < v_seqnames.size()) {
+      cout << "Some chromosomes were not found in " << bam_file << "\n";
+    }
+  } else {
+    for(unsigned int i = 0; i < s_chr_names.size(); i++) refIDs.push_back(i);
+  }
 
   // Assign children:
   std::vector<FragmentsMap*> oFM;
@@ -1367,56 +2650,90 @@ int IRF_BAM2COV(
 
   for(unsigned int i = 0; i < n_threads_to_use; i++) {
     oFM.push_back(new FragmentsMap);
-    BBchild.push_back(new BAM2blocks);
-
-    BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
-    BBchild.at(i)->registerCallbackProcessBlocks( std::bind(&FragmentsMap::ProcessBlocks, &(*oFM.at(i)), std::placeholders::_1) );
+    oFM.at(i)->SetCollapseInterval(plan.collapse_interval);
+  }
 
-    BBchild.at(i)->openFile(&inbam);
+  int by_chr_ret = -1;
+  if(use_index && n_threads_to_use > 1) {
+    by_chr_ret = BAM2COV_ByChromosome(bam_file, inbam, refIDs, oFM, n_threads_to_use, verbose,
+      memory_budget_mb);
+    if(by_chr_ret == -2) {
+      for(unsigned int i = 0; i < n_threads_to_use; i++) {
+        delete oFM.at(i);
+      }
+      return(-1);
+    }
   }
   
-  // BAM processing loop
+  if(by_chr_ret != 0) {
+    if(v_seqnames.size() > 0 && inbam.SetRegions(refIDs) != 0) {
+      for(unsigned int i = 0; i < n_threads_to_use; i++) {
+        delete oFM.at(i);
+      }
+      return(-1);
+    }
+    
+    for(unsigned int i = 0; i < n_threads_to_use; i++) {
+      BBchild.push_back(new BAM2blocks);
+
+      BBchild.at(i)->registerCallbackChrMappingChange( std::bind(&FragmentsMap::ChrMapUpdate, &(*oFM.at(i)), std::placeholders::_1) );
+      BBchild.at(i)->registerCallbackProcessBatch( MakeBlockProcessorPipeline(oFM.at(i)) );
+
+      BBchild.at(i)->openFile(&inbam);
+    }
+    
+    // BAM processing loop
 #ifdef RNXTIRF
-  Progress p(inbam.GetFileSize(), verbose);
-  while(0 == inbam.fillReads() && !p.check_abort()) {
-    p.increment(inbam.IncProgress());
-  
+    Progress p(inbam.GetReadSize(), verbose);
+    while(0 == inbam.fillReads() && !p.check_abort()) {
+      p.increment(inbam.IncProgress());
+    
 #else
-  while(0 == inbam.fillReads()) {
+    while(0 == inbam.fillReads()) {
 #endif
-  
-    #ifdef _OPENMP
-    #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
-    #endif
-    for(unsigned int i = 0; i < n_threads_to_use; i++) {
-      BBchild.at(i)->processAll(i);
+    
+      #ifdef _OPENMP
+      #pragma omp parallel for num_threads(n_threads_to_use) schedule(dynamic,1)
+      #endif
+      for(unsigned int i = 0; i < 2 * n_threads_to_use; i++) {
+        if(i >= n_threads_to_use) {
+          inbam.decompressNext(i - n_threads_to_use);
+          continue;
+        }
+        BBchild.at(i)->processAll(i);
+      }
+      
+      // Coordinate-sorted BAMs: pair spare reads between threads, and drop
+      //   those whose mates have been passed, to keep spare reads bounded
+      if(BBchild.at(0)->isCoordinateSorted()) BAM2blocks::processSpares(BBchild);
     }
-  }
 
 #ifdef RNXTIRF
-  if(p.check_abort()) {
-    // interrupted:
-    for(unsigned int i = 0; i < n_threads_to_use; i++) {
-      delete oFM.at(i);
-      delete BBchild.at(i);
+    if(p.check_abort()) {
+      // interrupted:
+      for(unsigned int i = 0; i < n_threads_to_use; i++) {
+        delete oFM.at(i);
+        delete BBchild.at(i);
+      }
+      return(-1);
     }
-    return(-1);
-  }
 #endif
+  }
   
   inbam.closeFile();
 
   if(n_threads_to_use > 1) {
     if(verbose) cout << "Compiling data from threads\n";
   // Combine BB's and process spares
-    for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      BBchild.at(0)->processSpares(*BBchild.at(i));
-      delete BBchild.at(i);
+    if(BBchild.size() > 0) {
+      BAM2blocks::processSpares(BBchild);
+      for(unsigned int i = 1; i < n_threads_to_use; i++) {
+        delete BBchild.at(i);
+      }
     }
   // Combine objects:
+    oFM.at(0)->Combine(oFM, n_threads_to_use);
     for(unsigned int i = 1; i < n_threads_to_use; i++) {
-      oFM.at(0)->Combine(*oFM.at(i));
-
       delete oFM.at(i);
     }
   }
@@ -1426,11 +2743,15 @@ int IRF_BAM2COV(
   ofCOV.open(s_output_cov, std::ofstream::binary);  
   covWriter outCOV;
   outCOV.SetOutputHandle(&ofCOV);
+  if(write_zoom) {
+    outCOV.SetZoomLevels(std::vector<uint32_t>(
+      cov_zoom_default_bins, cov_zoom_default_bins + 3));
+  }
   oFM.at(0)->WriteBinary(&outCOV, verbose, n_threads_to_use);
   ofCOV.close();
 
   delete oFM.at(0);
-  delete BBchild.at(0);
+  if(BBchild.size() > 0) delete BBchild.at(0);
 
   return(0);
 }
@@ -1443,20 +2764,45 @@ int IRF_BAM2COV(
 void print_usage(std::string exec) {
   cout << "Usage:\n\t"
     << exec << " about\n\t\tDisplays version and OpenMP status\n\t"
-    << exec <<  " main (-t 4) in.bam IRFinder.ref.gz out.txt.gz out.cov\n\t\t"
-    << "(runs NxtIRF - optionally using 4 threads)\n\t"
-    << exec <<  " bam2cov (-t 4) in.bam out.cov"
-    << "(runs NxtIRF's Bam to Cov utility - optionally using 4 threads)\n\t"
-    << exec <<  " gen_map_reads genome.fa reads_out.fa 70 10\n\t\t"
-    << "(where synthetic read length = 70, and read stride = 10)\n\t"
-    << exec <<  " gen_map_regions (-t 4) aligned_reads.bam 4 map.bed {map.cov}\n\t\t"   
-    << "(where threshold for low mappability = 4, - optionally using 4 threads\n";
+    << exec <<  " main (-t 4) (-m 4000) (-z) in.bam IRFinder.ref.gz out.txt.gz out.cov {out.sj}\n\t\t"
+    << "(runs NxtIRF - optionally using 4 threads, and saving the sidecar used by requant;\n\t\t"
+    << " -m sizes the buffers to fit a memory budget of 4000 Mb, -z appends zoom levels to out.cov)\n\t"
+    << exec <<  " requant (-t 4) in.cov in.sj IRFinder.ref.gz out.txt.gz\n\t\t"
+    << "(recomputes the NxtIRF output for another reference from the COV and sidecar files of\n\t\t"
+    << " a sample, without the BAM file; ROI and chromosome counts are those of the original run)\n\t"
+    << exec <<  " compile_ref IRFinder.ref.gz IRFinder.ref.bin\n\t\t"
+    << "(writes a compiled reference, which can be used in place of IRFinder.ref.gz)\n\t"
+    << exec <<  " main_multi (-t 8) (-p 2) (-m 8000) (-s) (-z) IRFinder.ref.gz in1.bam out1 in2.bam out2 ...\n\t\t"
+    << "(runs NxtIRF on several BAMs, optionally 2 samples at a time sharing 8 threads\n\t\t"
+    << " and a memory budget of 8000 Mb; writes out1.txt.gz, out1.cov, etc, with -s,\n\t\t"
+    << " the sidecar out1.sj, and with -z, zoom levels in out1.cov)\n\t"
+    << exec <<  " bam2cov (-t 4) (-m 4000) (-z) (-r chr1,chr2) in.bam out.cov\n\t\t"
+    << "(runs NxtIRF's Bam to Cov utility - optionally using 4 threads,\n\t\t"
+    << "-z appends 1 / 10 / 100 kb zoom levels, and -r only reads the given chromosomes\n\t\t"
+    << " of a coordinate-sorted BAM with an index (.bai / .csi))\n\t"
+    << exec <<  " gen_map_reads (-t 4) genome.fa reads_out.fa 70 10\n\t\t"
+    << "(where synthetic read length = 70, and read stride = 10 - optionally using 4 threads;\n\t\t"
+    << " writes BGZF-compressed FASTA if the output file name ends with .gz)\n\t"
+    << exec <<  " gen_map_regions (-t 4) (-m 4000) aligned_reads.bam 4 map.bed {map.cov}\n\t\t"   
+    << "(where threshold for low mappability = 4, - optionally using 4 threads\n\t"
+    << exec <<  " bench_sort 10000000 5\n\t\t"
+    << "(benchmarks event sorting with 10 million events, repeated 5 times)\n\t"
+    << exec <<  " bench_inflate (-t 4) file.bam 5\n\t\t"
+    << "(benchmarks each BGZF inflate backend on a BAM / COV / BGZF file - optionally using 4 threads,\n\t\t"
+    << " repeated 5 times)\n\t"
+    << exec <<  " bench_gen (-n 200000) (-l 100) (-s 0.3) (-o coordinate) out_dir\n\t\t"
+    << "(writes a synthetic paired-end bench.bam and IRFinder.ref.gz to out_dir, with 200000 fragments\n\t\t"
+    << " of 100 bp reads, 30% from spliced transcripts, sorted by coordinate / queryname / unsorted)\n\t"
+    << exec <<  " bench (-t 1,2,4) (-r 3) in.bam IRFinder.ref.gz results.json\n\t\t"
+    << "(times each stage of NxtIRF using 1, 2 and 4 threads, repeated 3 times, and writes\n\t\t"
+    << " the results as JSON)\n";
 }
 
 // main
 int main(int argc, char * argv[]) {
 	// Command line usage:
     // nxtirf main -t N sample.bam IRFinder.ref.gz Output.txt.gz 
+    // nxtirf requant -t N sample.cov sample.sj IRFinder.ref.gz Output.txt.gz
     // nxtirf bam2cov -t N sample.bam sample.cov
     // nxtirf gen_map_reads genome.fa reads_to_map.fa 70 10
     // nxtirf gen_map_regions mappedreads.bam mappability.bed
@@ -1472,23 +2818,28 @@ int main(int argc, char * argv[]) {
       }
       std::string s_genome,s_output;
       int read_len,read_stride,read_error;
+      int arg_pos = 2;
+      if(std::string(argv[2]) == "-t" && argc > 5) {
+        n_thr = atoi(argv[3]);
+        arg_pos = 4;
+      }
 
-      s_genome = argv[2];
-      s_output = argv[3];
+      s_genome = argv[arg_pos];
+      s_output = argv[arg_pos + 1];
 
-      if(argc > 4) {
-        read_len = atoi(argv[4]);
+      if(argc > arg_pos + 2) {
+        read_len = atoi(argv[arg_pos + 2]);
       } else {
         read_len = 70;
       }
-      if(argc > 5) {
-        read_stride = atoi(argv[5]);
+      if(argc > arg_pos + 3) {
+        read_stride = atoi(argv[arg_pos + 3]);
       } else {
         read_stride = 10;
       }
       read_error = 1 + (read_len / 2);
       ret = IRF_GenerateMappabilityReads(
-        s_genome, s_output, read_len, read_stride, read_error
+        s_genome, s_output, read_len, read_stride, read_error, n_thr
       );
       if(ret == 0) exit(0);
       exit(1);
@@ -1499,29 +2850,105 @@ int main(int argc, char * argv[]) {
       }
       
       std::string s_bam,s_output,s_cov;
-      if(std::string(argv[2]) == "-t") {
+      int memory_mb = 0;
+      int arg = 2;
+      while(arg + 3 < argc && (std::string(argv[arg]) == "-t" || std::string(argv[arg]) == "-m")) {
+        if(std::string(argv[arg]) == "-t") n_thr = atoi(argv[arg + 1]);
+        if(std::string(argv[arg]) == "-m") memory_mb = atoi(argv[arg + 1]);
+        arg += 2;
+      }
+      if(argc - arg < 3) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      s_bam = argv[arg];
+      int threshold = atoi(argv[arg + 1]);
+      s_output = argv[arg + 2];
+      if(argc > arg + 3) s_cov = argv[arg + 3];
+      ret = IRF_GenerateMappabilityRegions(s_bam, s_output, threshold, n_thr, s_cov, memory_mb);
+      exit(ret);;      
+  } else if(std::string(argv[1]) == "compile_ref") {
+      if(argc < 4){
+        print_usage(argv[0]);
+        exit(1);
+      }
+      ret = IRF_compileRef(argv[2], argv[3]);
+      exit(ret);
+  } else if(std::string(argv[1]) == "bench_sort") {
+      size_t n_events = 10000000;
+      unsigned int n_reps = 5;
+      if(argc > 2) n_events = atol(argv[2]);
+      if(argc > 3) n_reps = atoi(argv[3]);
+      ret = Benchmark_Sort(n_events, n_reps);
+      exit(ret);
+  } else if(std::string(argv[1]) == "bench_inflate") {
+      int arg_pos = 2;
+      if(argc > 4 && std::string(argv[2]) == "-t") {
         n_thr = atoi(argv[3]);
-        s_bam = argv[4];
-        int threshold = atoi(argv[5]);
-        s_output = argv[6];
-        if(argc > 7) {
-          s_cov = argv[7];
-          ret = IRF_GenerateMappabilityRegions(s_bam, s_output, threshold, n_thr, s_cov);
+        arg_pos = 4;
+      }
+      if(argc <= arg_pos) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      unsigned int n_reps = 5;
+      if(argc > arg_pos + 1) n_reps = atoi(argv[arg_pos + 1]);
+      ret = Benchmark_Inflate(argv[arg_pos], n_thr, n_reps);
+      exit(ret);
+  } else if(std::string(argv[1]) == "bench_gen") {
+      size_t n_fragments = 200000;
+      unsigned int read_len = 100;
+      double splice_rate = 0.3;
+      std::string sort_order = "coordinate";
+      int arg = 2;
+      while(arg + 2 < argc) {
+        std::string opt = argv[arg];
+        if(opt == "-n") {
+          n_fragments = atol(argv[arg + 1]);
+        } else if(opt == "-l") {
+          read_len = atoi(argv[arg + 1]);
+        } else if(opt == "-s") {
+          splice_rate = atof(argv[arg + 1]);
+        } else if(opt == "-o") {
+          sort_order = argv[arg + 1];
         } else {
-          ret = IRF_GenerateMappabilityRegions(s_bam, s_output, threshold, n_thr);
+          break;
         }
-      } else {
-        s_bam = argv[2];
-        s_output = argv[3];
-        int threshold = atoi(argv[4]);
-        if(argc > 5) {
-          s_cov = argv[5];
-          ret = IRF_GenerateMappabilityRegions(s_bam, s_output, threshold, n_thr,s_cov);
+        arg += 2;
+      }
+      if(argc - arg != 1) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      ret = Benchmark_Generate(argv[arg], n_fragments, read_len, splice_rate, sort_order);
+      exit(ret);
+  } else if(std::string(argv[1]) == "bench") {
+      std::vector<unsigned int> thread_counts;
+      unsigned int n_reps = 3;
+      int arg = 2;
+      while(arg + 4 < argc) {
+        std::string opt = argv[arg];
+        if(opt == "-t") {
+          // Comma-separated thread counts
+          std::istringstream counts(argv[arg + 1]);
+          std::string count;
+          while(std::getline(counts, count, ',')) {
+            if(atoi(count.c_str()) > 0) thread_counts.push_back(atoi(count.c_str()));
+          }
+        } else if(opt == "-r") {
+          n_reps = atoi(argv[arg + 1]);
         } else {
-          ret = IRF_GenerateMappabilityRegions(s_bam, s_output, threshold, n_thr);
+          break;
         }
+        arg += 2;
       }
-      exit(ret);;      
+      if(argc - arg != 3) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      if(thread_counts.size() == 0) thread_counts.push_back(1);
+      ret = Benchmark_Pipeline(argv[arg], argv[arg + 1], argv[arg + 2], thread_counts, n_reps);
+      exit(ret);
   } else if(std::string(argv[1]) == "about") {
       std::string version = "0.99.0";
       cout << "NxtIRF version " << version << "\t";
@@ -1542,21 +2969,82 @@ int main(int argc, char * argv[]) {
         exit(1);
       }
       
-      int n_thr = 1; std::string s_bam,s_ref,s_output_txt,s_output_cov;
-      
-      if(std::string(argv[2]) == "-t") {
+      int n_thr = 1; std::string s_bam,s_ref,s_output_txt,s_output_cov,s_output_sidecar;
+      int memory_mb = 0;
+      bool write_zoom = false;
+      int arg = 2;
+      while(arg + 1 < argc && (std::string(argv[arg]) == "-t" || std::string(argv[arg]) == "-m" ||
+          std::string(argv[arg]) == "-z")) {
+        if(std::string(argv[arg]) == "-z") {
+          write_zoom = true;
+          arg += 1;
+          continue;
+        }
+        if(std::string(argv[arg]) == "-t") n_thr = atoi(argv[arg + 1]);
+        if(std::string(argv[arg]) == "-m") memory_mb = atoi(argv[arg + 1]);
+        arg += 2;
+      }
+      if(argc - arg < 4) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      s_bam = argv[arg];
+      s_ref = argv[arg + 1];
+      s_output_txt = argv[arg + 2];		
+      s_output_cov = argv[arg + 3];
+      if(argc > arg + 4) s_output_sidecar = argv[arg + 4];
+      ret = IRF_main(s_bam, s_ref, s_output_txt, s_output_cov, n_thr, s_output_sidecar, memory_mb,
+        write_zoom);
+      exit(ret);
+  } else if(std::string(argv[1]) == "requant") {
+      int n_thr = 1; int arg = 2;
+      if(argc > 3 && std::string(argv[2]) == "-t") {
         n_thr = atoi(argv[3]);
-        s_bam = argv[4];
-        s_ref = argv[5];
-        s_output_txt = argv[6];		
-        s_output_cov = argv[7];
-      } else {
-        s_bam = argv[2];
-        s_ref = argv[3];
-        s_output_txt = argv[4];		
-        s_output_cov = argv[5];
+        arg = 4;
+      }
+      if(argc - arg != 4) {
+        print_usage(argv[0]);
+        exit(1);
       }
-      ret = IRF_main(s_bam, s_ref, s_output_txt, s_output_cov, n_thr);
+      ret = IRF_requantify(argv[arg], argv[arg + 1], argv[arg + 2], argv[arg + 3], n_thr);
+      exit(ret);
+  } else if(std::string(argv[1]) == "main_multi") {
+      // main_multi (-t 8) (-p 2) (-m 8000) (-s) (-z) IRFinder.ref.gz in1.bam out1 in2.bam out2 ...
+      int n_thr = 1; int n_parallel = 1; int arg = 2;
+      int memory_mb = 0;
+      bool save_sidecar = false;
+      bool write_zoom = false;
+      while(arg + 1 < argc && (std::string(argv[arg]) == "-t" || std::string(argv[arg]) == "-p" ||
+          std::string(argv[arg]) == "-m" || std::string(argv[arg]) == "-s" || 
+          std::string(argv[arg]) == "-z")) {
+        if(std::string(argv[arg]) == "-s") {
+          save_sidecar = true;
+          arg += 1;
+          continue;
+        }
+        if(std::string(argv[arg]) == "-z") {
+          write_zoom = true;
+          arg += 1;
+          continue;
+        }
+        if(std::string(argv[arg]) == "-t") n_thr = atoi(argv[arg + 1]);
+        if(std::string(argv[arg]) == "-p") n_parallel = atoi(argv[arg + 1]);
+        if(std::string(argv[arg]) == "-m") memory_mb = atoi(argv[arg + 1]);
+        arg += 2;
+      }
+      if(argc - arg < 3 || (argc - arg - 1) % 2 != 0) {
+        print_usage(argv[0]);
+        exit(1);
+      }
+      std::string s_ref = argv[arg];
+      std::vector<std::string> v_bam;
+      std::vector<std::string> v_out;
+      for(int k = arg + 1; k + 1 < argc; k += 2) {
+        v_bam.push_back(argv[k]);
+        v_out.push_back(argv[k + 1]);
+      }
+      ret = IRF_main_multi(s_ref, v_bam, v_out, n_thr, n_parallel, save_sidecar, memory_mb,
+        write_zoom);
       exit(ret);
   } else if(std::string(argv[1]) == "bam2cov") {
       if(argc < 4){
@@ -1565,19 +3053,41 @@ int main(int argc, char * argv[]) {
       }
       
       int n_thr = 1; std::string s_bam,s_output_cov;
+      int memory_mb = 0;
+      bool write_zoom = false;
+      std::vector<std::string> v_seqnames;
       
-      if(std::string(argv[2]) == "-t" && argc == 6) {
-        n_thr = atoi(argv[3]);
-        s_bam = argv[4];
-        s_output_cov = argv[5];
-      } else if(argc == 4){
-        s_bam = argv[2];
-        s_output_cov = argv[3];
+      int arg = 2;
+      while(arg < argc - 2) {
+        if(std::string(argv[arg]) == "-t") {
+          n_thr = atoi(argv[arg + 1]);
+          arg += 2;
+        } else if(std::string(argv[arg]) == "-m") {
+          memory_mb = atoi(argv[arg + 1]);
+          arg += 2;
+        } else if(std::string(argv[arg]) == "-z") {
+          write_zoom = true;
+          arg++;
+        } else if(std::string(argv[arg]) == "-r") {
+          // Comma-separated chromosome names
+          std::istringstream seqnames(argv[arg + 1]);
+          std::string seqname;
+          while(std::getline(seqnames, seqname, ',')) {
+            if(seqname.size() > 0) v_seqnames.push_back(seqname);
+          }
+          arg += 2;
+        } else {
+          break;
+        }
+      }
+      if(argc - arg == 2) {
+        s_bam = argv[arg];
+        s_output_cov = argv[arg + 1];
       } else {
         print_usage(argv[0]);
         exit(1);
       }
-      ret = IRF_BAM2COV(s_bam, s_output_cov, n_thr);
+      ret = IRF_BAM2COV(s_bam, s_output_cov, n_thr, write_zoom, v_seqnames, memory_mb);
       exit(ret);
   } else {
     print_usage(argv[0]);
@@ -13,18 +13,31 @@
 #include "FastaReader.h"
 #include "GZTools.h"          // For gzip I/O
 #include "ReadBlockProcessor_CoverageBlocks.h"  // includes FragmentsMap and others
+#include "SortTools.h"         // For sort benchmark
+#include "RefTools.h"          // For compiled reference
+#include "BenchTools.h"        // For pipeline benchmarks
+
+// Multi-threaded BAM processing: size of the chunks of reads that threads
+//   claim from pbam_in as they go (see pbam_in::SetDispatchChunkSize)
+static const size_t bam_dispatch_chunk_size = 4194304;
 
 int Has_OpenMP();
+int Set_Inflate_Backend(int backend, bool verify_crc);
 int Set_Threads(int n_threads);
 bool IRF_Check_Cov(std::string s_in);
-std::string GenerateReadError(
-    char * input_read, 
+void GenerateReadError(
+    char * dest,
+    const char * input_read, 
     const unsigned int read_len, 
     const unsigned int error_pos,
     const unsigned int direction, 
-    const unsigned int error_seed
+    const size_t error_seed
+);
+void checkDNAWindows(
+    const char * seq, const size_t seq_len,
+    const unsigned int read_len, const unsigned int read_stride,
+    size_t &n_windows, std::vector<uint64_t> &valid
 );
-bool checkDNA(char * input_read, unsigned int read_len);
 
 #ifdef RNXTIRF
 // Rcpp-only functions
@@ -37,7 +50,15 @@ bool checkDNA(char * input_read, unsigned int read_len);
 
   List IRF_RLEList_From_Cov(std::string s_in, int strand);
 
+  List IRF_RLEList_From_Cov_Regions(std::string s_in, 
+    StringVector seqnames, IntegerVector starts, IntegerVector ends, 
+    IntegerVector strands, int n_threads);
+
+  List IRF_Cov_Zoom(std::string s_in, std::string seqname, 
+    int start, int end, int strand, int resolution);
+
   List IRF_gunzip_DF(std::string s_in, StringVector s_header_begin);
+  List IRF_ReadSections(StringVector s_in, StringVector s_header_begin, int n_threads);
   
 #endif
 
@@ -60,6 +81,73 @@ int IRF_ref(std::string &reference_file,
     bool verbose
 );
 
+int IRF_compileRef(std::string reference_file, std::string output_file);
+
+void IRF_MatchChrs(
+    const std::vector<std::string> &s_chr_names, 
+    const std::vector<uint32_t> &u32_chr_lens,
+    const std::vector<std::string> &ref_names, 
+    const std::vector<std::string> &ref_alias,
+    const std::vector<uint32_t> &ref_lengths,
+    std::vector<std::string> &bam_chr_name, 
+    std::vector<uint32_t> &bam_chr_len
+);
+
+// Stage timings and counters of an IRF_core run, in the order they were added
+//   Only the stats added as reported are written to the Performance_report
+//   section of the output. These must only depend on the input files, not
+//   on the thread count, run options or timing, so that the output file is
+//   reproducible; the rest (timings, rates, per-thread counts, memory 
+//   settings) are only returned to the caller
+class IRF_run_stats {
+  public:
+    std::vector<std::string> names;
+    std::vector<double> values;
+    std::vector<bool> reported;
+    void add(const std::string &name, double value, bool report = false) {
+      names.push_back(name);
+      values.push_back(value);
+      reported.push_back(report);
+    };
+    // Returns the value of the named stat, or 0 if there is none
+    double get(const std::string &name) const {
+      for(unsigned int i = 0; i < names.size(); i++) {
+        if(names.at(i) == name) return(values.at(i));
+      }
+      return(0);
+    };
+    // all: also writes the stats that are not reported
+    int WriteOutput(std::string &output, bool all = false) const;
+};
+
+/*
+  Memory used by a BAM job, planned from a memory budget (in Mb; 0 for none)
+    and the size of the BAM file:
+  - pbam_in file buffers are no bigger than needed to hold the whole BAM
+  - with a budget, pbam_in buffers take up to half of it (2 file buffers, and
+    1 data buffer - 2 if pipelined - each twice the size of a file buffer).
+    The rest is shared by the processors of each thread: FragmentsMap 
+    collapses its events more often if they would not fit
+*/
+class IRF_memory_plan {
+  public:
+    static const int min_budget_mb = 64;    // Smallest budget per BAM job
+    
+    size_t budget_bytes = 0;
+    size_t file_buffer_cap = 5e8;
+    size_t data_buffer_cap = 1e9;
+    unsigned int chunks_per_file_buffer = 5;
+    bool pipelined = false;
+    unsigned int collapse_interval = 1000000;   // fragments between FragmentsMap collapses
+    
+    void Plan(size_t bam_size, int memory_budget_mb, unsigned int n_threads, 
+      bool pipeline, size_t max_file_buffer_cap = 5e8);
+    // Most that the pbam_in buffers hold
+    size_t BufferBytes() const {
+      return(2 * file_buffer_cap + data_buffer_cap * (pipelined ? 2 : 1));
+    };
+};
+
 int IRF_core(std::string const &bam_file, 
     std::string const &s_output_txt, std::string const &s_output_cov,
     std::vector<std::string> &ref_names, 
@@ -70,54 +158,85 @@ int IRF_core(std::string const &bam_file,
     FragmentsInROI const &ROI_template,
     JunctionCount const &JC_template,
     bool const verbose,
-    int n_threads = 1
+    int n_threads = 1,
+    bool const concurrent = false,  // true if run alongside other samples by IRF_main_multi
+    IRF_run_stats * run_stats = NULL,  // if given, receives the Performance_report stats
+    std::string const &s_output_sidecar = "",   // if given, saves the sidecar for IRF_requantify
+    int memory_budget_mb = 0,   // see IRF_memory_plan
+    bool const write_zoom = false,  // append 1 / 10 / 100 kb zoom levels to the COV file
+    std::string * messages = NULL   // if given, error messages are appended here, not printed
 );
 
 #ifdef RNXTIRF
-  int IRF_main(
+  List IRF_main(
       std::string bam_file, std::string reference_file, std::string output_file, 
-      bool verbose = true, int n_threads = 1
+      bool verbose = true, int n_threads = 1, bool save_sidecar = false,
+      int memory_budget_mb = 0, bool write_zoom = false
   );
 
-  int IRF_main_multi(
+  List IRF_main_multi(
       std::string reference_file, StringVector bam_files, StringVector output_files,
-      int max_threads = 1, bool verbose = true
+      int max_threads = 1, bool verbose = true, int n_samples_parallel = 1,
+      bool save_sidecar = false, int memory_budget_mb = 0, bool write_zoom = false
+  );
+
+  int IRF_requantify(
+      std::string cov_file, std::string sidecar_file, std::string reference_file,
+      std::string output_file, bool verbose = true, int n_threads = 1
   );
 
   int IRF_GenerateMappabilityReads(
     std::string genome_file, std::string out_fa,
-    int read_len, int read_stride, int error_pos
+    int read_len, int read_stride, int error_pos, int n_threads = 1
   );
 
   int IRF_GenerateMappabilityRegions(
     std::string bam_file, std::string output_file, 
     int threshold, int includeCov = 0, bool verbose = true,
-    int n_threads = 1
+    int n_threads = 1, int memory_budget_mb = 0
   );
 
   int IRF_BAM2COV(
     std::string bam_file, std::string output_file, 
-    bool verbose = true, int n_threads = 1
+    bool verbose, int n_threads, StringVector seqnames, int memory_budget_mb = 0,
+    bool write_zoom = false
   );
 
 #else
   int IRF_main(
       std::string bam_file, std::string reference_file, std::string s_output_txt,
-      std::string s_output_cov, int n_threads = 1
+      std::string s_output_cov, int n_threads = 1, std::string s_output_sidecar = "",
+      int memory_budget_mb = 0, bool write_zoom = false
+  );
+
+  int IRF_main_multi(
+      std::string reference_file, std::vector<std::string> v_bam, std::vector<std::string> v_out,
+      int max_threads = 1, int n_samples_parallel = 1, bool save_sidecar = false,
+      int memory_budget_mb = 0, bool write_zoom = false
+  );
+
+  int IRF_requantify(
+      std::string cov_file, std::string sidecar_file, std::string reference_file,
+      std::string s_output_txt, int n_threads = 1
   );
 
   int IRF_GenerateMappabilityReads(
     std::string genome_file, std::string out_fa,
-    int read_len, int read_stride, int error_pos
+    int read_len, int read_stride, int error_pos, int n_threads = 1
   );
 
   int IRF_GenerateMappabilityRegions(
     std::string bam_file, std::string s_output_txt, 
-    int threshold, int n_threads = 1, std::string s_output_cov = ""
+    int threshold, int n_threads = 1, std::string s_output_cov = "",
+    int memory_budget_mb = 0
   );	
 
   int IRF_BAM2COV(
-    std::string bam_file, std::string output_file, int n_threads = 1
+    std::string bam_file, std::string output_file, int n_threads = 1,
+    bool write_zoom = false,  // append 1 / 10 / 100 kb zoom levels
+    std::vector<std::string> v_seqnames = std::vector<std::string>(),
+                              // restrict to chromosomes (requires BAM index)
+    int memory_budget_mb = 0
   );
 
   int main(int argc, char * argv[]);
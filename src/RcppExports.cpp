@@ -30,6 +30,18 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// Set_Inflate_Backend
+int Set_Inflate_Backend(int backend, bool verify_crc);
+RcppExport SEXP _NxtIRFcore_Set_Inflate_Backend(SEXP backendSEXP, SEXP verify_crcSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< int >::type backend(backendSEXP);
+    Rcpp::traits::input_parameter< bool >::type verify_crc(verify_crcSEXP);
+    rcpp_result_gen = Rcpp::wrap(Set_Inflate_Backend(backend, verify_crc));
+    return rcpp_result_gen;
+END_RCPP
+}
 // IRF_Check_Cov
 bool IRF_Check_Cov(std::string s_in);
 RcppExport SEXP _NxtIRFcore_IRF_Check_Cov(SEXP s_inSEXP) {
@@ -67,6 +79,22 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// IRF_Cov_Zoom
+List IRF_Cov_Zoom(std::string s_in, std::string seqname, int start, int end, int strand, int resolution);
+RcppExport SEXP _NxtIRFcore_IRF_Cov_Zoom(SEXP s_inSEXP, SEXP seqnameSEXP, SEXP startSEXP, SEXP endSEXP, SEXP strandSEXP, SEXP resolutionSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type s_in(s_inSEXP);
+    Rcpp::traits::input_parameter< std::string >::type seqname(seqnameSEXP);
+    Rcpp::traits::input_parameter< int >::type start(startSEXP);
+    Rcpp::traits::input_parameter< int >::type end(endSEXP);
+    Rcpp::traits::input_parameter< int >::type strand(strandSEXP);
+    Rcpp::traits::input_parameter< int >::type resolution(resolutionSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_Cov_Zoom(s_in, seqname, start, end, strand, resolution));
+    return rcpp_result_gen;
+END_RCPP
+}
 // IRF_RLEList_From_Cov
 List IRF_RLEList_From_Cov(std::string s_in, int strand);
 RcppExport SEXP _NxtIRFcore_IRF_RLEList_From_Cov(SEXP s_inSEXP, SEXP strandSEXP) {
@@ -79,6 +107,22 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// IRF_RLEList_From_Cov_Regions
+List IRF_RLEList_From_Cov_Regions(std::string s_in, StringVector seqnames, IntegerVector starts, IntegerVector ends, IntegerVector strands, int n_threads);
+RcppExport SEXP _NxtIRFcore_IRF_RLEList_From_Cov_Regions(SEXP s_inSEXP, SEXP seqnamesSEXP, SEXP startsSEXP, SEXP endsSEXP, SEXP strandsSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type s_in(s_inSEXP);
+    Rcpp::traits::input_parameter< StringVector >::type seqnames(seqnamesSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type starts(startsSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type ends(endsSEXP);
+    Rcpp::traits::input_parameter< IntegerVector >::type strands(strandsSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_RLEList_From_Cov_Regions(s_in, seqnames, starts, ends, strands, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // IRF_gunzip_DF
 List IRF_gunzip_DF(std::string s_in, StringVector s_header_begin);
 RcppExport SEXP _NxtIRFcore_IRF_gunzip_DF(SEXP s_inSEXP, SEXP s_header_beginSEXP) {
@@ -91,6 +135,19 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// IRF_ReadSections
+List IRF_ReadSections(StringVector s_in, StringVector s_header_begin, int n_threads);
+RcppExport SEXP _NxtIRFcore_IRF_ReadSections(SEXP s_inSEXP, SEXP s_header_beginSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< StringVector >::type s_in(s_inSEXP);
+    Rcpp::traits::input_parameter< StringVector >::type s_header_begin(s_header_beginSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_ReadSections(s_in, s_header_begin, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // IRF_gunzip
 int IRF_gunzip(std::string s_in, std::string s_out);
 RcppExport SEXP _NxtIRFcore_IRF_gunzip(SEXP s_inSEXP, SEXP s_outSEXP) {
@@ -103,9 +160,21 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// IRF_compileRef
+int IRF_compileRef(std::string reference_file, std::string output_file);
+RcppExport SEXP _NxtIRFcore_IRF_compileRef(SEXP reference_fileSEXP, SEXP output_fileSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type reference_file(reference_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type output_file(output_fileSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_compileRef(reference_file, output_file));
+    return rcpp_result_gen;
+END_RCPP
+}
 // IRF_main
-int IRF_main(std::string bam_file, std::string reference_file, std::string output_file, bool verbose, int n_threads);
-RcppExport SEXP _NxtIRFcore_IRF_main(SEXP bam_fileSEXP, SEXP reference_fileSEXP, SEXP output_fileSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP) {
+List IRF_main(std::string bam_file, std::string reference_file, std::string output_file, bool verbose, int n_threads, bool save_sidecar, int memory_budget_mb, bool write_zoom);
+RcppExport SEXP _NxtIRFcore_IRF_main(SEXP bam_fileSEXP, SEXP reference_fileSEXP, SEXP output_fileSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP, SEXP save_sidecarSEXP, SEXP memory_budget_mbSEXP, SEXP write_zoomSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -114,13 +183,16 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< std::string >::type output_file(output_fileSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
     Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
-    rcpp_result_gen = Rcpp::wrap(IRF_main(bam_file, reference_file, output_file, verbose, n_threads));
+    Rcpp::traits::input_parameter< bool >::type save_sidecar(save_sidecarSEXP);
+    Rcpp::traits::input_parameter< int >::type memory_budget_mb(memory_budget_mbSEXP);
+    Rcpp::traits::input_parameter< bool >::type write_zoom(write_zoomSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_main(bam_file, reference_file, output_file, verbose, n_threads, save_sidecar, memory_budget_mb, write_zoom));
     return rcpp_result_gen;
 END_RCPP
 }
 // IRF_main_multi
-int IRF_main_multi(std::string reference_file, StringVector bam_files, StringVector output_files, int max_threads, bool verbose);
-RcppExport SEXP _NxtIRFcore_IRF_main_multi(SEXP reference_fileSEXP, SEXP bam_filesSEXP, SEXP output_filesSEXP, SEXP max_threadsSEXP, SEXP verboseSEXP) {
+List IRF_main_multi(std::string reference_file, StringVector bam_files, StringVector output_files, int max_threads, bool verbose, int n_samples_parallel, bool save_sidecar, int memory_budget_mb, bool write_zoom);
+RcppExport SEXP _NxtIRFcore_IRF_main_multi(SEXP reference_fileSEXP, SEXP bam_filesSEXP, SEXP output_filesSEXP, SEXP max_threadsSEXP, SEXP verboseSEXP, SEXP n_samples_parallelSEXP, SEXP save_sidecarSEXP, SEXP memory_budget_mbSEXP, SEXP write_zoomSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -129,13 +201,33 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< StringVector >::type output_files(output_filesSEXP);
     Rcpp::traits::input_parameter< int >::type max_threads(max_threadsSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
-    rcpp_result_gen = Rcpp::wrap(IRF_main_multi(reference_file, bam_files, output_files, max_threads, verbose));
+    Rcpp::traits::input_parameter< int >::type n_samples_parallel(n_samples_parallelSEXP);
+    Rcpp::traits::input_parameter< bool >::type save_sidecar(save_sidecarSEXP);
+    Rcpp::traits::input_parameter< int >::type memory_budget_mb(memory_budget_mbSEXP);
+    Rcpp::traits::input_parameter< bool >::type write_zoom(write_zoomSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_main_multi(reference_file, bam_files, output_files, max_threads, verbose, n_samples_parallel, save_sidecar, memory_budget_mb, write_zoom));
+    return rcpp_result_gen;
+END_RCPP
+}
+// IRF_requantify
+int IRF_requantify(std::string cov_file, std::string sidecar_file, std::string reference_file, std::string output_file, bool verbose, int n_threads);
+RcppExport SEXP _NxtIRFcore_IRF_requantify(SEXP cov_fileSEXP, SEXP sidecar_fileSEXP, SEXP reference_fileSEXP, SEXP output_fileSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type cov_file(cov_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type sidecar_file(sidecar_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type reference_file(reference_fileSEXP);
+    Rcpp::traits::input_parameter< std::string >::type output_file(output_fileSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_requantify(cov_file, sidecar_file, reference_file, output_file, verbose, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
 // IRF_GenerateMappabilityReads
-int IRF_GenerateMappabilityReads(std::string genome_file, std::string out_fa, int read_len, int read_stride, int error_pos);
-RcppExport SEXP _NxtIRFcore_IRF_GenerateMappabilityReads(SEXP genome_fileSEXP, SEXP out_faSEXP, SEXP read_lenSEXP, SEXP read_strideSEXP, SEXP error_posSEXP) {
+int IRF_GenerateMappabilityReads(std::string genome_file, std::string out_fa, int read_len, int read_stride, int error_pos, int n_threads);
+RcppExport SEXP _NxtIRFcore_IRF_GenerateMappabilityReads(SEXP genome_fileSEXP, SEXP out_faSEXP, SEXP read_lenSEXP, SEXP read_strideSEXP, SEXP error_posSEXP, SEXP n_threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -144,13 +236,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type read_len(read_lenSEXP);
     Rcpp::traits::input_parameter< int >::type read_stride(read_strideSEXP);
     Rcpp::traits::input_parameter< int >::type error_pos(error_posSEXP);
-    rcpp_result_gen = Rcpp::wrap(IRF_GenerateMappabilityReads(genome_file, out_fa, read_len, read_stride, error_pos));
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_GenerateMappabilityReads(genome_file, out_fa, read_len, read_stride, error_pos, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
 // IRF_GenerateMappabilityRegions
-int IRF_GenerateMappabilityRegions(std::string bam_file, std::string output_file, int threshold, int includeCov, bool verbose, int n_threads);
-RcppExport SEXP _NxtIRFcore_IRF_GenerateMappabilityRegions(SEXP bam_fileSEXP, SEXP output_fileSEXP, SEXP thresholdSEXP, SEXP includeCovSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP) {
+int IRF_GenerateMappabilityRegions(std::string bam_file, std::string output_file, int threshold, int includeCov, bool verbose, int n_threads, int memory_budget_mb);
+RcppExport SEXP _NxtIRFcore_IRF_GenerateMappabilityRegions(SEXP bam_fileSEXP, SEXP output_fileSEXP, SEXP thresholdSEXP, SEXP includeCovSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP, SEXP memory_budget_mbSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -160,13 +253,14 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type includeCov(includeCovSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
     Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
-    rcpp_result_gen = Rcpp::wrap(IRF_GenerateMappabilityRegions(bam_file, output_file, threshold, includeCov, verbose, n_threads));
+    Rcpp::traits::input_parameter< int >::type memory_budget_mb(memory_budget_mbSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_GenerateMappabilityRegions(bam_file, output_file, threshold, includeCov, verbose, n_threads, memory_budget_mb));
     return rcpp_result_gen;
 END_RCPP
 }
 // IRF_BAM2COV
-int IRF_BAM2COV(std::string bam_file, std::string output_file, bool verbose, int n_threads);
-RcppExport SEXP _NxtIRFcore_IRF_BAM2COV(SEXP bam_fileSEXP, SEXP output_fileSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP) {
+int IRF_BAM2COV(std::string bam_file, std::string output_file, bool verbose, int n_threads, StringVector seqnames, int memory_budget_mb, bool write_zoom);
+RcppExport SEXP _NxtIRFcore_IRF_BAM2COV(SEXP bam_fileSEXP, SEXP output_fileSEXP, SEXP verboseSEXP, SEXP n_threadsSEXP, SEXP seqnamesSEXP, SEXP memory_budget_mbSEXP, SEXP write_zoomSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -174,7 +268,10 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< std::string >::type output_file(output_fileSEXP);
     Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
     Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
-    rcpp_result_gen = Rcpp::wrap(IRF_BAM2COV(bam_file, output_file, verbose, n_threads));
+    Rcpp::traits::input_parameter< StringVector >::type seqnames(seqnamesSEXP);
+    Rcpp::traits::input_parameter< int >::type memory_budget_mb(memory_budget_mbSEXP);
+    Rcpp::traits::input_parameter< bool >::type write_zoom(write_zoomSEXP);
+    rcpp_result_gen = Rcpp::wrap(IRF_BAM2COV(bam_file, output_file, verbose, n_threads, seqnames, memory_budget_mb, write_zoom));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -182,17 +279,23 @@ END_RCPP
 static const R_CallMethodDef CallEntries[] = {
     {"_NxtIRFcore_Has_OpenMP", (DL_FUNC) &_NxtIRFcore_Has_OpenMP, 0},
     {"_NxtIRFcore_Test_OpenMP_For", (DL_FUNC) &_NxtIRFcore_Test_OpenMP_For, 0},
+    {"_NxtIRFcore_Set_Inflate_Backend", (DL_FUNC) &_NxtIRFcore_Set_Inflate_Backend, 2},
     {"_NxtIRFcore_IRF_Check_Cov", (DL_FUNC) &_NxtIRFcore_IRF_Check_Cov, 1},
     {"_NxtIRFcore_IRF_RLE_From_Cov", (DL_FUNC) &_NxtIRFcore_IRF_RLE_From_Cov, 5},
     {"_NxtIRFcore_IRF_Cov_Seqnames", (DL_FUNC) &_NxtIRFcore_IRF_Cov_Seqnames, 1},
+    {"_NxtIRFcore_IRF_Cov_Zoom", (DL_FUNC) &_NxtIRFcore_IRF_Cov_Zoom, 6},
     {"_NxtIRFcore_IRF_RLEList_From_Cov", (DL_FUNC) &_NxtIRFcore_IRF_RLEList_From_Cov, 2},
+    {"_NxtIRFcore_IRF_RLEList_From_Cov_Regions", (DL_FUNC) &_NxtIRFcore_IRF_RLEList_From_Cov_Regions, 6},
     {"_NxtIRFcore_IRF_gunzip_DF", (DL_FUNC) &_NxtIRFcore_IRF_gunzip_DF, 2},
+    {"_NxtIRFcore_IRF_ReadSections", (DL_FUNC) &_NxtIRFcore_IRF_ReadSections, 3},
     {"_NxtIRFcore_IRF_gunzip", (DL_FUNC) &_NxtIRFcore_IRF_gunzip, 2},
-    {"_NxtIRFcore_IRF_main", (DL_FUNC) &_NxtIRFcore_IRF_main, 5},
-    {"_NxtIRFcore_IRF_main_multi", (DL_FUNC) &_NxtIRFcore_IRF_main_multi, 5},
-    {"_NxtIRFcore_IRF_GenerateMappabilityReads", (DL_FUNC) &_NxtIRFcore_IRF_GenerateMappabilityReads, 5},
-    {"_NxtIRFcore_IRF_GenerateMappabilityRegions", (DL_FUNC) &_NxtIRFcore_IRF_GenerateMappabilityRegions, 6},
-    {"_NxtIRFcore_IRF_BAM2COV", (DL_FUNC) &_NxtIRFcore_IRF_BAM2COV, 4},
+    {"_NxtIRFcore_IRF_compileRef", (DL_FUNC) &_NxtIRFcore_IRF_compileRef, 2},
+    {"_NxtIRFcore_IRF_main", (DL_FUNC) &_NxtIRFcore_IRF_main, 8},
+    {"_NxtIRFcore_IRF_main_multi", (DL_FUNC) &_NxtIRFcore_IRF_main_multi, 9},
+    {"_NxtIRFcore_IRF_requantify", (DL_FUNC) &_NxtIRFcore_IRF_requantify, 6},
+    {"_NxtIRFcore_IRF_GenerateMappabilityReads", (DL_FUNC) &_NxtIRFcore_IRF_GenerateMappabilityReads, 6},
+    {"_NxtIRFcore_IRF_GenerateMappabilityRegions", (DL_FUNC) &_NxtIRFcore_IRF_GenerateMappabilityRegions, 7},
+    {"_NxtIRFcore_IRF_BAM2COV", (DL_FUNC) &_NxtIRFcore_IRF_BAM2COV, 7},
     {NULL, NULL, 0}
 };
 
@@ -23,20 +23,85 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.  */
 
 #include "ReadBlockProcessor.h"
+#include "SortTools.h"
+#include <queue>
+
+// Linear k-way merge of sorted junction_count arrays, summing counts of equal keys
+static void merge_junction_counts(
+    const std::vector<const std::vector<junction_count>*> &sources, std::vector<junction_count> &dest
+) {
+  size_t total = 0;
+  for(auto src : sources) total += src->size();
+  dest.resize(0);
+  dest.reserve(total);
+
+  typedef std::pair<uint64_t, unsigned int> heap_entry;   // key, source
+  std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry>> heap;
+  std::vector<size_t> cursors(sources.size(), 0);
+  for(unsigned int k = 0; k < sources.size(); k++) {
+    if(sources.at(k)->size() > 0) heap.push(std::make_pair(sources.at(k)->at(0).key, k));
+  }
+  while(!heap.empty()) {
+    unsigned int k = heap.top().second;
+    heap.pop();
+    const junction_count & junc = sources.at(k)->at(cursors.at(k));
+    if(dest.size() > 0 && dest.back().key == junc.key) {
+      dest.back().count[0] += junc.count[0];
+      dest.back().count[1] += junc.count[1];
+      dest.back().count[2] |= junc.count[2];
+    } else {
+      dest.push_back(junc);
+    }
+    cursors.at(k)++;
+    if(cursors.at(k) < sources.at(k)->size()) {
+      heap.push(std::make_pair(sources.at(k)->at(cursors.at(k)).key, k));
+    }
+  }
+}
+
+// Binary search of a chromosome's sorted junction_count array
+static const junction_count * find_junction_count(
+    const std::vector<junction_count> &counts, const uint64_t key
+) {
+  auto it = std::lower_bound(counts.begin(), counts.end(), key,
+    [](const junction_count &a, const uint64_t b) { return(a.key < b); }
+  );
+  if(it == counts.end() || it->key != key) return(NULL);
+  return(&(*it));
+}
+
+static const junction_count * find_junction_count(
+    const std::map<string, std::vector<junction_count>> &chrName_count,
+    const std::string &ChrName, const uint64_t key
+) {
+  auto itChr = chrName_count.find(ChrName);
+  if(itChr == chrName_count.end()) return(NULL);
+  return(find_junction_count(itChr->second, key));
+}
+
+template <typename T> static const junction_count * find_junction_count(
+    const std::vector<T*> &chrID_count, const unsigned int refID, const uint64_t key
+) {
+  if(refID >= chrID_count.size()) return(NULL);
+  return(find_junction_count(*chrID_count[refID], key));
+}
 
 //chrName_junc_count holds the data structure -- ChrName(string) -> Junc Start/End -> count.
 //chrID_junc_count holds the ChrID -> ...
 //  where the ChrID is the ChrID relating to the appropriate ChrName, as understood by the currently processed BAM file.
 void JunctionCount::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
   chrID_junc_count.resize(0);
+  chrID_junc_events.resize(0);
+  chrID_name.resize(0);
   chrID_juncLeft_count.resize(0);
   chrID_juncRight_count.resize(0);
+  n_events = 0;
   // Below could be done with an iterator - i is not used except for element access of the single collection.
   for (unsigned int i = 0; i < chrmap.size(); i++) {
     chrID_junc_count.push_back( &(chrName_junc_count)[chrmap.at(i).chr_name] );
-    chrID_juncLeft_count.push_back( &(chrName_juncLeft_count)[chrmap.at(i).chr_name] );
-    chrID_juncRight_count.push_back( &(chrName_juncRight_count)[chrmap.at(i).chr_name] );
+    chrID_name.push_back(chrmap.at(i).chr_name);
   }
+  chrID_junc_events.resize(chrmap.size());
 }
 
 void JunctionCount::loadRef(std::istringstream &IN) {
@@ -51,6 +116,8 @@ void JunctionCount::loadRef(std::istringstream &IN) {
   s_chr.reserve(30);
   string direction;
   string NMD_flag = "";
+  uint64_t key;
+  std::map<string, std::map<uint64_t, unsigned int>> ref_direction;
   
   while(!IN.eof() && !IN.fail()) {
     getline(IN, myLine, '\n');
@@ -79,15 +146,126 @@ void JunctionCount::loadRef(std::istringstream &IN) {
       getline(lineStream, NMD_flag, '\t');
     }
     
+    key = ((uint64_t)start << 32) | end;
     if (direction == "-")  {
-      (chrName_junc_count)[s_chr][make_pair(start,end)][2] += 1;
+      ref_direction[s_chr][key] += 1;
     }  else if (direction == "+") {
-      (chrName_junc_count)[s_chr][make_pair(start,end)][2] += 2;
+      ref_direction[s_chr][key] += 2;
     }
     if(!NMD_flag.empty() && !(0 == NMD_flag.compare(0, 2, "\"\""))) {
-      (chrName_junc_count)[s_chr][make_pair(start,end)][2] += 4;
+      ref_direction[s_chr][key] += 4;
     }
   }
+  
+  // Flatten into sorted arrays, shared by copies of this object and added to the counts by sort_and_collapse_final()
+  std::map<string, std::vector<junction_count>> junc_ref(*chrName_junc_ref);
+  for(auto itChr = ref_direction.begin(); itChr != ref_direction.end(); itChr++) {
+    std::vector<junction_count> & dest = junc_ref[itChr->first];
+    std::vector<junction_count> ref_juncs;
+    for(auto itJunc = itChr->second.begin(); itJunc != itChr->second.end(); itJunc++) {
+      junction_count junc = {itJunc->first, {0, 0, itJunc->second}};
+      ref_juncs.push_back(junc);
+    }
+    std::vector<const std::vector<junction_count>*> sources = {&dest, &ref_juncs};
+    std::vector<junction_count> merged;
+    merge_junction_counts(sources, merged);
+    dest.swap(merged);
+  }
+  chrName_junc_ref = std::make_shared<const std::map<string, std::vector<junction_count>>>(std::move(junc_ref));
+}
+
+// Per chromosome: name, number of junctions, keys, direction flags
+void JunctionCount::WriteRefBinary(refBinaryWriter &out) const {
+  std::string & buf = out.NewSection(REF_SJ);
+  refBinaryWriter::Append(buf, (uint64_t)chrName_junc_ref->size());
+  for(auto itChr = chrName_junc_ref->begin(); itChr != chrName_junc_ref->end(); itChr++) {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> flags;
+    for(auto itJunc = itChr->second.begin(); itJunc != itChr->second.end(); itJunc++) {
+      keys.push_back(itJunc->key);
+      flags.push_back(itJunc->count[2]);
+    }
+    refBinaryWriter::Append(buf, out.AddString(itChr->first));
+    refBinaryWriter::Append(buf, (uint64_t)keys.size());
+    refBinaryWriter::AppendArray(buf, keys);
+    refBinaryWriter::AppendArray(buf, flags);
+  }
+}
+
+int JunctionCount::LoadRefBinary(const refBinaryReader &in) {
+  refBinarySection sec = in.GetSection(REF_SJ);
+  std::map<string, std::vector<junction_count>> junc_ref;
+  uint64_t n_chr = sec.Read<uint64_t>();
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> flags;
+  for(uint64_t i = 0; i < n_chr && !sec.fail(); i++) {
+    std::vector<junction_count> & dest = junc_ref[in.GetString(sec.Read<uint32_t>())];
+    uint64_t n = sec.Read<uint64_t>();
+    sec.ReadArray(keys, n);
+    sec.ReadArray(flags, n);
+    if(sec.fail()) break;
+    dest.resize(n);
+    for(uint64_t j = 0; j < n; j++) {
+      dest[j].key = keys[j];
+      dest[j].count[0] = 0;
+      dest[j].count[1] = 0;
+      dest[j].count[2] = flags[j];
+    }
+  }
+  if(sec.fail()) return(-1);
+  chrName_junc_ref = std::make_shared<const std::map<string, std::vector<junction_count>>>(std::move(junc_ref));
+  return(0);
+}
+
+// Per chromosome: name, number of junctions, keys, negative and positive strand counts
+void JunctionCount::WriteCountsBinary(refBinaryWriter &out) const {
+  std::string & buf = out.NewSection(REF_SIDECAR_JUNC);
+  refBinaryWriter::Append(buf, (uint64_t)chrName_junc_count.size());
+  for(auto itChr = chrName_junc_count.begin(); itChr != chrName_junc_count.end(); itChr++) {
+    std::vector<uint64_t> keys;
+    std::vector<uint32_t> counts[2];
+    for(auto itJunc = itChr->second.begin(); itJunc != itChr->second.end(); itJunc++) {
+      // Reference junctions that were not seen are added back from the new reference
+      if(itJunc->count[0] == 0 && itJunc->count[1] == 0) continue;
+      keys.push_back(itJunc->key);
+      counts[0].push_back(itJunc->count[0]);
+      counts[1].push_back(itJunc->count[1]);
+    }
+    refBinaryWriter::Append(buf, out.AddString(itChr->first));
+    refBinaryWriter::Append(buf, (uint64_t)keys.size());
+    refBinaryWriter::AppendArray(buf, keys);
+    refBinaryWriter::AppendArray(buf, counts[0]);
+    refBinaryWriter::AppendArray(buf, counts[1]);
+  }
+}
+
+int JunctionCount::LoadCountsBinary(const refBinaryReader &in) {
+  refBinarySection sec = in.GetSection(REF_SIDECAR_JUNC);
+  uint64_t n_chr = sec.Read<uint64_t>();
+  std::vector<uint64_t> keys;
+  std::vector<uint32_t> counts[2];
+  std::vector<junction_count> loaded;
+  for(uint64_t i = 0; i < n_chr && !sec.fail(); i++) {
+    std::vector<junction_count> & dest = chrName_junc_count[in.GetString(sec.Read<uint32_t>())];
+    uint64_t n = sec.Read<uint64_t>();
+    sec.ReadArray(keys, n);
+    sec.ReadArray(counts[0], n);
+    sec.ReadArray(counts[1], n);
+    if(sec.fail()) break;
+    loaded.resize(n);
+    for(uint64_t j = 0; j < n; j++) {
+      loaded[j].key = keys[j];
+      loaded[j].count[0] = counts[0][j];
+      loaded[j].count[1] = counts[1][j];
+      loaded[j].count[2] = 0;
+    }
+    std::vector<const std::vector<junction_count>*> sources = {&dest, &loaded};
+    std::vector<junction_count> merged;
+    merge_junction_counts(sources, merged);
+    dest.swap(merged);
+  }
+  if(sec.fail()) return(-1);
+  return(0);
 }
 
 void JunctionCount::ProcessBlocks(const FragmentBlocks &blocks) {
@@ -95,75 +273,169 @@ void JunctionCount::ProcessBlocks(const FragmentBlocks &blocks) {
     //Walk each *pair* of blocks. ie: ignore a read that is just a single block.
     for (unsigned int j = 1; j < blocks.rLens[index].size(); j++) {
       if ((blocks.rLens[index][j-1] >= 5) && (blocks.rLens[index][j] >= 5)) {
-        (*chrID_junc_count[blocks.chr_id])[
-          make_pair(
-            blocks.readStart[index] + blocks.rStarts[index][j-1] + blocks.rLens[index][j-1],
-            blocks.readStart[index] + blocks.rStarts[index][j])
-          ][blocks.direction]++;
-        (*chrID_juncLeft_count[blocks.chr_id])[
-            blocks.readStart[index] + blocks.rStarts[index][j-1] + blocks.rLens[index][j-1]
-          ][blocks.direction]++;
-        (*chrID_juncRight_count[blocks.chr_id])[
-            blocks.readStart[index] + blocks.rStarts[index][j]
-          ][blocks.direction]++;
+        uint64_t left = blocks.readStart[index] + blocks.rStarts[index][j-1] + blocks.rLens[index][j-1];
+        uint64_t right = blocks.readStart[index] + blocks.rStarts[index][j];
+        chrID_junc_events[blocks.chr_id].push_back(
+          (left << 33) | (right << 1) | (uint64_t)blocks.direction
+        );
+        n_events++;
       }
     }
   }
+  if(n_events >= 1000000) {
+    sort_and_collapse_temp();
+  }
 }
 
-void JunctionCount::Combine(const JunctionCount &child) {
-  for(unsigned int j = 0; j < 2; j++) {
-    for(unsigned int i = 0; i < chrName_junc_count.size(); i++) {
-      auto itChr1=child.chrName_junc_count.begin();
-      for(unsigned int k = 0; k < i; k++) itChr1++;
-        for (auto itPos = itChr1->second.begin(); itPos != itChr1->second.end(); itPos++) {
-          // Insert missing entries from child:
-          chrName_junc_count.at(itChr1->first)[
-            make_pair(itPos->first.first, itPos->first.second)
-          ][j] += itPos->second[j];
-        }
-      auto itChr2=child.chrName_juncLeft_count.begin();
-      for(unsigned int k = 0; k < i; k++) itChr2++;
-        for (auto itPos = itChr2->second.begin(); itPos != itChr2->second.end(); itPos++) {
-          chrName_juncLeft_count.at(itChr2->first)[itPos->first][j] += itPos->second[j];
-        }
-      auto itChr3=child.chrName_juncRight_count.begin();
-      for(unsigned int k = 0; k < i; k++) itChr3++;
-        for (auto itPos = itChr3->second.begin(); itPos != itChr3->second.end(); itPos++) {
-          chrName_juncRight_count.at(itChr3->first)[itPos->first][j] += itPos->second[j];
-        }
+int JunctionCount::sort_and_collapse_temp() {
+  for(unsigned int i = 0; i < chrID_junc_events.size(); i++) {
+    std::vector<uint64_t> & events = chrID_junc_events.at(i);
+    if(events.size() == 0) continue;
+    
+    radix_sort_u64(events);
+    
+    // Collapse identical events into counts
+    std::vector<junction_count> new_juncs;
+    junction_count junc = {events.at(0) >> 1, {0, 0, 0}};
+    for(auto it = events.begin(); it != events.end(); it++) {
+      if((*it >> 1) != junc.key) {
+        new_juncs.push_back(junc);
+        junc.key = *it >> 1;
+        junc.count[0] = 0; junc.count[1] = 0;
+      }
+      junc.count[*it & 1]++;
+    }
+    new_juncs.push_back(junc);
+    
+    // Clear temporary vector by swap trick
+    std::vector<uint64_t>().swap(events);
+
+    std::vector<const std::vector<junction_count>*> sources = {chrID_junc_count.at(i), &new_juncs};
+    std::vector<junction_count> merged;
+    merge_junction_counts(sources, merged);
+    chrID_junc_count.at(i)->swap(merged);
+  }
+  n_events = 0;
+  return(0);
+}
+
+void JunctionCount::Combine(JunctionCount &child) {
+  std::vector<JunctionCount*> JC_list = {&child};
+  Combine(JC_list);
+}
+
+void JunctionCount::Combine(std::vector<JunctionCount*> &JC_list) {
+  sort_and_collapse_temp();
+  std::vector<JunctionCount*> children;
+  for(auto JC : JC_list) {
+    if(JC == this) continue;
+    JC->sort_and_collapse_temp();
+    children.push_back(JC);
+  }
+  if(children.size() == 0) return;
+
+  // Chromosome names from all children
+  for(auto JC : children) {
+    for(auto itChr = JC->chrName_junc_count.begin(); itChr != JC->chrName_junc_count.end(); itChr++) {
+      chrName_junc_count[itChr->first];
+    }
+  }
+  for(auto itChr = chrName_junc_count.begin(); itChr != chrName_junc_count.end(); itChr++) {
+    std::vector<const std::vector<junction_count>*> sources = {&(itChr->second)};
+    for(auto JC : children) {
+      auto itChild = JC->chrName_junc_count.find(itChr->first);
+      if(itChild != JC->chrName_junc_count.end()) sources.push_back(&(itChild->second));
     }
+    std::vector<junction_count> merged;
+    merge_junction_counts(sources, merged);
+    itChr->second.swap(merged);
   }
 }
 
+// Collapses any remaining events, adds the reference junctions, then derives junction end counts
+int JunctionCount::sort_and_collapse_final() {
+  sort_and_collapse_temp();
+  for(auto itRef = chrName_junc_ref->begin(); itRef != chrName_junc_ref->end(); itRef++) {
+    // Reference junctions have zero counts, so merging more than once only re-applies direction flags
+    std::vector<junction_count> & dest = chrName_junc_count[itRef->first];
+    std::vector<const std::vector<junction_count>*> sources = {&dest, &(itRef->second)};
+    std::vector<junction_count> merged;
+    merge_junction_counts(sources, merged);
+    dest.swap(merged);
+  }
+  chrName_juncLeft_count.clear();
+  chrName_juncRight_count.clear();
+  for(auto itChr = chrName_junc_count.begin(); itChr != chrName_junc_count.end(); itChr++) {
+    std::vector<junction_count> & left = chrName_juncLeft_count[itChr->first];
+    std::vector<junction_count> right_unsorted;
+    for(auto itJunc = itChr->second.begin(); itJunc != itChr->second.end(); itJunc++) {
+      if(itJunc->count[0] == 0 && itJunc->count[1] == 0) continue;
+      // Junctions are sorted by left position
+      uint64_t left_pos = itJunc->key >> 32;
+      if(left.size() == 0 || left.back().key != left_pos) {
+        junction_count junc = {left_pos, {0, 0, 0}};
+        left.push_back(junc);
+      }
+      left.back().count[0] += itJunc->count[0];
+      left.back().count[1] += itJunc->count[1];
+
+      junction_count junc = {itJunc->key & 0xFFFFFFFF, {itJunc->count[0], itJunc->count[1], 0}};
+      right_unsorted.push_back(junc);
+    }
+    std::sort(right_unsorted.begin(), right_unsorted.end(), 
+      [](const junction_count &a, const junction_count &b) { return(a.key < b.key); }
+    );
+    std::vector<const std::vector<junction_count>*> sources = {&right_unsorted};
+    merge_junction_counts(sources, chrName_juncRight_count[itChr->first]);
+  }
+
+  // Chromosome ID access for the lookups by refID
+  static const std::vector<junction_count> no_counts;
+  chrID_juncLeft_count.resize(0);
+  chrID_juncRight_count.resize(0);
+  for(unsigned int i = 0; i < chrID_name.size(); i++) {
+    auto itLeft = chrName_juncLeft_count.find(chrID_name.at(i));
+    auto itRight = chrName_juncRight_count.find(chrID_name.at(i));
+    chrID_juncLeft_count.push_back(itLeft == chrName_juncLeft_count.end() ? &no_counts : &(itLeft->second));
+    chrID_juncRight_count.push_back(itRight == chrName_juncRight_count.end() ? &no_counts : &(itRight->second));
+  }
+  return(0);
+}
+
 int JunctionCount::WriteOutput(std::string& output, std::string& QC) const {
-  std::ostringstream oss; std::ostringstream oss_qc; 
+  output.clear();
+  StringSink sink(output);
+  return(WriteOutput(sink, QC));
+}
+
+int JunctionCount::WriteOutput(TextSink& output, std::string& QC) const {
+  TextBuffer oss(output); std::ostringstream oss_qc; 
   int junc_anno = 0;
   int junc_unanno = 0;
   int junc_NMD = 0;
   for (auto itChr=chrName_junc_count.begin(); itChr!=chrName_junc_count.end(); itChr++) {
     string chr = itChr->first;
     for (auto itJuncs=itChr->second.begin(); itJuncs!=itChr->second.end(); ++itJuncs) {
-      if((itJuncs->second)[2] != 0) {
-        junc_anno += ((itJuncs->second)[1] + (itJuncs->second)[0]);
-        if((itJuncs->second)[2] & 4) {
-          junc_NMD += ((itJuncs->second)[1] + (itJuncs->second)[0]);
+      if(itJuncs->count[2] != 0) {
+        junc_anno += (itJuncs->count[1] + itJuncs->count[0]);
+        if(itJuncs->count[2] & 4) {
+          junc_NMD += (itJuncs->count[1] + itJuncs->count[0]);
         }
       } else {
-        junc_unanno += ((itJuncs->second)[1] + (itJuncs->second)[0]);
+        junc_unanno += (itJuncs->count[1] + itJuncs->count[0]);
       }
-      oss << chr << "\t" << itJuncs->first.first << "\t" << itJuncs->first.second
-        << "\t" << ( (itJuncs->second)[2] & 1 ? "-" : (itJuncs->second)[2] & 2 ? "+" : "." )
-        << "\t" << ((itJuncs->second)[1] + (itJuncs->second)[0])
-        << "\t" << (itJuncs->second)[1]
-        << "\t" << (itJuncs->second)[0] << "\n";
+      oss << chr << "\t" << (itJuncs->key >> 32) << "\t" << (itJuncs->key & 0xFFFFFFFF)
+        << "\t" << ( itJuncs->count[2] & 1 ? "-" : itJuncs->count[2] & 2 ? "+" : "." )
+        << "\t" << (itJuncs->count[1] + itJuncs->count[0])
+        << "\t" << itJuncs->count[1]
+        << "\t" << itJuncs->count[0] << "\n";
     }
   }
   oss_qc   << "Annotated Junctions" << "\t" << junc_anno << "\n"
           << "Unannotated Junctions" << "\t" << junc_unanno << "\n"
           << "NMD Junctions" << "\t" << junc_NMD << "\n";
   
-  output = oss.str();
+  oss.flush();
   QC.append(oss_qc.str());
   return 0;
 }
@@ -181,24 +453,24 @@ int JunctionCount::Directional(std::string& output) const {
 
   for (auto itChr=chrName_junc_count.begin(); itChr!=chrName_junc_count.end(); itChr++) {
     for (auto itJuncs=itChr->second.begin(); itJuncs!=itChr->second.end(); ++itJuncs) {
-      if (((itJuncs->second)[1] + (itJuncs->second)[0]) > 8) {
-        if ((itJuncs->second)[0] > (itJuncs->second)[1] * 4) {
+      if ((itJuncs->count[1] + itJuncs->count[0]) > 8) {
+        if (itJuncs->count[0] > itJuncs->count[1] * 4) {
           dir_evidence++;
-          if ((itJuncs->second)[2] & 1) { //Ref is "-"
+          if (itJuncs->count[2] & 1) { //Ref is "-"
             dir_same++;
-          }else if ((itJuncs->second)[2] & 2) {
+          }else if (itJuncs->count[2] & 2) {
             dir_diff++;
           }
-        }else if ((itJuncs->second)[1] > (itJuncs->second)[0] * 4) {
+        }else if (itJuncs->count[1] > itJuncs->count[0] * 4) {
           dir_evidence++;
-          if ((itJuncs->second)[2] & 2) { //Ref is "+"
+          if (itJuncs->count[2] & 2) { //Ref is "+"
             dir_same++;
-          }else if ((itJuncs->second)[2] & 1) {
+          }else if (itJuncs->count[2] & 1) {
             dir_diff++;
           }        
         }else{
           nondir_evidence++;
-          if ((itJuncs->second)[2] > 0) {
+          if (itJuncs->count[2] > 0) {
             nondir_evidence_known++;
           }
         }
@@ -232,54 +504,68 @@ int JunctionCount::Directional(std::string& output) const {
 }
 
 unsigned int JunctionCount::lookup(std::string ChrName, unsigned int left, unsigned int right, bool direction) const {
-  try {
-    return chrName_junc_count.at(ChrName).at(make_pair(left, right))[direction];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_junc_count, ChrName, ((uint64_t)left << 32) | right);
+  return junc ? junc->count[direction] : 0;
 }
 unsigned int JunctionCount::lookup(std::string ChrName, unsigned int left, unsigned int right) const {
-  try {
-    return chrName_junc_count.at(ChrName).at(make_pair(left, right))[0] + chrName_junc_count.at(ChrName).at(make_pair(left, right))[1];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_junc_count, ChrName, ((uint64_t)left << 32) | right);
+  return junc ? junc->count[0] + junc->count[1] : 0;
 }
 unsigned int JunctionCount::lookupLeft(std::string ChrName, unsigned int left, bool direction) const {
-  try {
-    return chrName_juncLeft_count.at(ChrName).at(left)[direction];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_juncLeft_count, ChrName, left);
+  return junc ? junc->count[direction] : 0;
 }
 unsigned int JunctionCount::lookupLeft(std::string ChrName, unsigned int left) const {
-  try {
-    return chrName_juncLeft_count.at(ChrName).at(left)[0] + chrName_juncLeft_count.at(ChrName).at(left)[1];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_juncLeft_count, ChrName, left);
+  return junc ? junc->count[0] + junc->count[1] : 0;
 }
 unsigned int JunctionCount::lookupRight(std::string ChrName, unsigned int right, bool direction) const {
-  try {
-    return chrName_juncRight_count.at(ChrName).at(right)[direction];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_juncRight_count, ChrName, right);
+  return junc ? junc->count[direction] : 0;
 }
 unsigned int JunctionCount::lookupRight(std::string ChrName, unsigned int right) const {
-  try {
-    return chrName_juncRight_count.at(ChrName).at(right)[0] + chrName_juncRight_count.at(ChrName).at(right)[1];
-  }catch (const std::out_of_range& e) {
-  }
-  return 0;
+  const junction_count * junc = find_junction_count(chrName_juncRight_count, ChrName, right);
+  return junc ? junc->count[0] + junc->count[1] : 0;
+}
+
+unsigned int JunctionCount::lookup(unsigned int refID, unsigned int left, unsigned int right, bool direction) const {
+  const junction_count * junc = find_junction_count(chrID_junc_count, refID, ((uint64_t)left << 32) | right);
+  return junc ? junc->count[direction] : 0;
+}
+unsigned int JunctionCount::lookup(unsigned int refID, unsigned int left, unsigned int right) const {
+  const junction_count * junc = find_junction_count(chrID_junc_count, refID, ((uint64_t)left << 32) | right);
+  return junc ? junc->count[0] + junc->count[1] : 0;
+}
+unsigned int JunctionCount::lookupLeft(unsigned int refID, unsigned int left, bool direction) const {
+  const junction_count * junc = find_junction_count(chrID_juncLeft_count, refID, left);
+  return junc ? junc->count[direction] : 0;
+}
+unsigned int JunctionCount::lookupLeft(unsigned int refID, unsigned int left) const {
+  const junction_count * junc = find_junction_count(chrID_juncLeft_count, refID, left);
+  return junc ? junc->count[0] + junc->count[1] : 0;
+}
+unsigned int JunctionCount::lookupRight(unsigned int refID, unsigned int right, bool direction) const {
+  const junction_count * junc = find_junction_count(chrID_juncRight_count, refID, right);
+  return junc ? junc->count[direction] : 0;
+}
+unsigned int JunctionCount::lookupRight(unsigned int refID, unsigned int right) const {
+  const junction_count * junc = find_junction_count(chrID_juncRight_count, refID, right);
+  return junc ? junc->count[0] + junc->count[1] : 0;
 }
 
 int SpansPoint::WriteOutput(std::string& output, std::string& QC) const {
-  std::ostringstream oss; std::ostringstream oss_qc; 
+  output.clear();
+  StringSink sink(output);
+  return(WriteOutput(sink, QC));
+}
+
+int SpansPoint::WriteOutput(TextSink& output, std::string& QC) const {
+  TextBuffer oss(output); std::ostringstream oss_qc; 
   int spans_reads = 0;  
-  for (auto itChrPos=chrName_pos.begin(); itChrPos!=chrName_pos.end(); itChrPos++) {
+  for (auto itChrPos=chrName_pos->begin(); itChrPos!=chrName_pos->end(); itChrPos++) {
     string chr = itChrPos->first;
 
+    // Counters for all reference chromosomes are created by ChrMapUpdate
     auto itCountPos=chrName_count[1].at(chr).begin();
     auto itCountNeg=chrName_count[0].at(chr).begin();
 
@@ -292,39 +578,60 @@ int SpansPoint::WriteOutput(std::string& output, std::string& QC) const {
     }
   }
   oss_qc << "Spans Reads\t" << spans_reads << "\n";
-    output = oss.str();
+    oss.flush();
     QC.append(oss_qc.str());
   return 0;
 }
 
 unsigned int SpansPoint::lookup(std::string chrName, unsigned int pos, bool direction) const {
-  auto it_pos = std::lower_bound(chrName_pos.at(chrName).begin(), chrName_pos.at(chrName).end(), pos);
-  if (it_pos == chrName_pos.at(chrName).end() || *it_pos != pos) {
+  const std::vector<unsigned int> & positions = chrName_pos->at(chrName);
+  auto it_pos = std::lower_bound(positions.begin(), positions.end(), pos);
+  if (it_pos == positions.end() || *it_pos != pos) {
     // throw not-found/out-of-bounds exception?
     throw std::out_of_range("Pos not found - SpansPoint::lookup");
     return 0;
   }else{
     // Then use that offset into the other vectors.
-    return chrName_count[direction].at(chrName).at(it_pos - chrName_pos.at(chrName).begin());
+    return chrName_count[direction].at(chrName).at(it_pos - positions.begin());
   }
 }
 
 unsigned int SpansPoint::lookup(std::string chrName, unsigned int pos) const {
   //  std::map<string, std::vector<int>> chrName_pos;
-  auto it_pos = std::lower_bound(chrName_pos.at(chrName).begin(), chrName_pos.at(chrName).end(), pos);
-  if (it_pos == chrName_pos.at(chrName).end() || *it_pos != pos) {
+  const std::vector<unsigned int> & positions = chrName_pos->at(chrName);
+  auto it_pos = std::lower_bound(positions.begin(), positions.end(), pos);
+  if (it_pos == positions.end() || *it_pos != pos) {
     // throw not-found/out-of-bounds exception?
     throw std::out_of_range("Pos not found - SpansPoint::lookup");
     return 0;
   }else{
     // Then use that offset into the other vectors.
     return (
-      chrName_count[0].at(chrName).at(it_pos - chrName_pos.at(chrName).begin())
-      + chrName_count[1].at(chrName).at(it_pos - chrName_pos.at(chrName).begin())
+      chrName_count[0].at(chrName).at(it_pos - positions.begin())
+      + chrName_count[1].at(chrName).at(it_pos - positions.begin())
       );
   }
 }
 
+// Throws std::out_of_range if pos is not a reference position, as above.
+//   Chromosomes missing from the BAM (refID past the BAM's chromosomes) have no
+//   spans, so return 0
+unsigned int SpansPoint::lookup(unsigned int refID, unsigned int pos, bool direction) const {
+  if(refID >= chrID_pos.size()) return 0;
+  const std::vector<unsigned int> & positions = *chrID_pos[refID];
+  unsigned int i = chrID_index[refID]->lower_bound(pos);
+  if(i == positions.size() || positions[i] != pos) throw std::out_of_range("Pos not found - SpansPoint::lookup");
+  return (*chrID_count[direction][refID])[i];
+}
+
+unsigned int SpansPoint::lookup(unsigned int refID, unsigned int pos) const {
+  if(refID >= chrID_pos.size()) return 0;
+  const std::vector<unsigned int> & positions = *chrID_pos[refID];
+  unsigned int i = chrID_index[refID]->lower_bound(pos);
+  if(i == positions.size() || positions[i] != pos) throw std::out_of_range("Pos not found - SpansPoint::lookup");
+  return (*chrID_count[0][refID])[i] + (*chrID_count[1][refID])[i];
+}
+
 void SpansPoint::setSpanLength(unsigned int overhang_left, unsigned int overhang_right) {
   overhangLeft = overhang_left;
   overhangRight = overhang_right;
@@ -332,23 +639,24 @@ void SpansPoint::setSpanLength(unsigned int overhang_left, unsigned int overhang
 }
 
 void SpansPoint::ProcessBlocks(const FragmentBlocks &blocks) {
-  std::vector<unsigned int>::iterator it_position;
+  const std::vector<unsigned int> & positions = *chrID_pos.at(blocks.chr_id);
+  const PositionIndex & index = *chrID_index.at(blocks.chr_id);
+  std::vector<unsigned int> & counts = *chrID_count[blocks.direction].at(blocks.chr_id);
 
   //Walk each read within the fragment (1 or 2).
-  for (int index = 0; index < blocks.readCount; index ++) {
+  for (int index_read = 0; index_read < blocks.readCount; index_read ++) {
     //Walk each block within each read.
-    for (unsigned int j = 0; j < blocks.rLens[index].size(); j++) {
-      if ( blocks.rLens[index][j] > overhangTotal ) {
+    for (unsigned int j = 0; j < blocks.rLens[index_read].size(); j++) {
+      if ( blocks.rLens[index_read][j] > overhangTotal ) {
         //Block is long enough it may sufficiently overhang a point of interest.
-        it_position = std::upper_bound(
-            (*chrID_pos.at(blocks.chr_id)).begin(),
-            (*chrID_pos.at(blocks.chr_id)).end(),
-            blocks.readStart[index] + blocks.rStarts[index][j] + overhangLeft - 1
-        );  // -1 --- as the test is > rather than >=.
-        while (it_position != (*chrID_pos.at(blocks.chr_id)).end() && *it_position < (blocks.readStart[index] + blocks.rStarts[index][j] + blocks.rLens[index][j] )) {
+        unsigned int block_start = blocks.readStart[index_read] + blocks.rStarts[index_read][j];
+        unsigned int block_end = block_start + blocks.rLens[index_read][j];
+        unsigned int i = index.upper_bound(block_start + overhangLeft - 1, hint_index);  // -1 --- as the test is > rather than >=.
+        hint_index = i;
+        while (i < positions.size() && positions[i] < block_end) {
           //increment corresponding counter.
-          (*chrID_count[blocks.direction].at(blocks.chr_id)).at(it_position - (*chrID_pos.at(blocks.chr_id)).begin())++;
-          it_position++;
+          counts[i]++;
+          i++;
         }
       }
     }
@@ -357,9 +665,11 @@ void SpansPoint::ProcessBlocks(const FragmentBlocks &blocks) {
 
 void SpansPoint::Combine(const SpansPoint &child) {
   for(unsigned int j = 0; j < 2; j++) {
-    for (auto itChr=chrName_count[j].begin(); itChr!=chrName_count[j].end(); itChr++) {
+    for (auto itChr=child.chrName_count[j].begin(); itChr!=child.chrName_count[j].end(); itChr++) {
+      std::vector<unsigned int> & dest = chrName_count[j][itChr->first];
+      if(dest.size() < itChr->second.size()) dest.resize(itChr->second.size(), 0);
       for(unsigned int i = 0; i < itChr->second.size(); i++) {
-        itChr->second.at(i) += child.chrName_count[j].at(itChr->first).at(i);
+        dest.at(i) += itChr->second.at(i);
       }
     }
   }
@@ -375,6 +685,7 @@ void SpansPoint::loadRef(std::istringstream &IN) {
   string s_chr;
   s_chr.reserve(30);
   string direction;
+  std::map<string, std::vector<unsigned int>> positions(*chrName_pos);
 
   while ( !IN.eof() && !IN.fail() ) {
     getline(IN, myLine, '\n');
@@ -399,45 +710,151 @@ void SpansPoint::loadRef(std::istringstream &IN) {
     
     getline(lineStream, direction, '\t');
     
-    chrName_pos[s_chr].push_back(pos);
+    positions[s_chr].push_back(pos);
   }
   
-  for (std::map<string, std::vector<unsigned int>>::iterator it_chr=chrName_pos.begin(); it_chr!=chrName_pos.end(); it_chr++) {  
-    std::sort( it_chr->second.begin(), it_chr->second.end() );
-    // We now have chrName_pos sorted by position.
-    chrName_count[0][it_chr->first].resize(it_chr->second.size(), 0);
-    chrName_count[1][it_chr->first].resize(it_chr->second.size(), 0);
-    // Just created a vector of the same size as the position one to store the counter.
-    // initialise the count vector to the same length, with zero start.
+  for (std::map<string, std::vector<unsigned int>>::iterator it_chr=positions.begin(); it_chr!=positions.end(); it_chr++) {  
+    radix_sort_u32(it_chr->second);
+    // We now have the positions sorted.
   }
+  // Copies of this object share the positions, and allocate their own counters in ChrMapUpdate
+  chrName_pos = std::make_shared<const std::map<string, std::vector<unsigned int>>>(std::move(positions));
+  BuildIndex();
+}
+
+void SpansPoint::BuildIndex() {
+  std::map<string, PositionIndex> index;
+  for(auto itChr = chrName_pos->begin(); itChr != chrName_pos->end(); itChr++) {
+    index[itChr->first].Build(itChr->second);
+  }
+  chrName_index = std::make_shared<const std::map<string, PositionIndex>>(std::move(index));
+}
+
+// Per chromosome: name, number of positions, sorted positions
+void SpansPoint::WriteRefBinary(refBinaryWriter &out) const {
+  std::string & buf = out.NewSection(REF_SPANS);
+  refBinaryWriter::Append(buf, (uint64_t)chrName_pos->size());
+  for(auto itChr = chrName_pos->begin(); itChr != chrName_pos->end(); itChr++) {
+    refBinaryWriter::Append(buf, out.AddString(itChr->first));
+    refBinaryWriter::Append(buf, (uint64_t)itChr->second.size());
+    refBinaryWriter::AppendArray(buf, itChr->second);
+  }
+}
+
+int SpansPoint::LoadRefBinary(const refBinaryReader &in) {
+  refBinarySection sec = in.GetSection(REF_SPANS);
+  std::map<string, std::vector<unsigned int>> positions;
+  uint64_t n_chr = sec.Read<uint64_t>();
+  for(uint64_t i = 0; i < n_chr && !sec.fail(); i++) {
+    std::vector<unsigned int> & dest = positions[in.GetString(sec.Read<uint32_t>())];
+    sec.ReadArray(dest, sec.Read<uint64_t>());
+  }
+  if(sec.fail()) return(-1);
+  chrName_pos = std::make_shared<const std::map<string, std::vector<unsigned int>>>(std::move(positions));
+  BuildIndex();
+  return(0);
 }
 
 void SpansPoint::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
+  static const std::vector<unsigned int> no_positions;
+  // Create the count vectors of the same size as the position ones, with zero start (existing counts are kept)
+  for (auto it_chr=chrName_pos->begin(); it_chr!=chrName_pos->end(); it_chr++) {
+    for(unsigned int j = 0; j < 2; j++) {
+      std::vector<unsigned int> & counts = chrName_count[j][it_chr->first];
+      if(counts.size() < it_chr->second.size()) counts.resize(it_chr->second.size(), 0);
+    }
+  }
+  static const PositionIndex no_index;
   chrID_pos.resize(0);
+  chrID_index.resize(0);
   chrID_count[0].resize(0);
   chrID_count[1].resize(0);
   for (unsigned int i = 0; i < chrmap.size(); i++) {
-    chrID_pos.push_back( &chrName_pos[chrmap.at(i).chr_name] );
+    auto it_chr = chrName_pos->find(chrmap.at(i).chr_name);
+    chrID_pos.push_back( it_chr == chrName_pos->end() ? &no_positions : &(it_chr->second) );
+    auto it_index = chrName_index->find(chrmap.at(i).chr_name);
+    chrID_index.push_back( it_index == chrName_index->end() ? &no_index : &(it_index->second) );
     chrID_count[0].push_back( &chrName_count[0][chrmap.at(i).chr_name] );
     chrID_count[1].push_back( &chrName_count[1][chrmap.at(i).chr_name] );
   }
 }
 
+void SpansPoint::SetCountsFromDepth(const std::string &chrName, bool direction, 
+    const std::vector< std::pair<unsigned int, int> > &depth_runs) {
+  auto it_chr = chrName_pos->find(chrName);
+  if(it_chr == chrName_pos->end()) return;
+  const std::vector<unsigned int> & positions = it_chr->second;
+  std::vector<unsigned int> & counts = chrName_count[direction][chrName];
+  counts.assign(positions.size(), 0);
+  // Both are sorted by position: the depth at each position is that of the last run starting at or before it
+  auto it_run = depth_runs.begin();
+  int depth = 0;
+  for(unsigned int i = 0; i < positions.size(); i++) {
+    while(it_run != depth_runs.end() && it_run->first <= positions[i]) {
+      depth = it_run->second;
+      it_run++;
+    }
+    counts[i] = depth > 0 ? (unsigned int)depth : 0;
+  }
+}
+
+
+void ROI_reference::BuildIndex() {
+  chrName_ROI_end.clear();
+  chrName_ROI_index.clear();
+  for(auto itChr = chrName_ROI.begin(); itChr != chrName_ROI.end(); itChr++) {
+    std::vector<unsigned int> & ends = chrName_ROI_end[itChr->first];
+    for(auto & region : itChr->second) ends.push_back(region.first);
+    chrName_ROI_index[itChr->first].Build(ends);
+  }
+}
 
 void FragmentsInROI::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
+  static const std::vector<std::pair<unsigned int,unsigned int>> no_ROI;
+  // Allocate this object's counters, one per ROI (existing counts are kept)
+  for(auto itChr = ref->chrName_ROI.begin(); itChr != ref->chrName_ROI.end(); itChr++) {
+    for(unsigned int j = 0; j < 2; j++) {
+      std::vector<unsigned long> & counts = chrName_count[j][itChr->first];
+      if(counts.size() < itChr->second.size()) counts.resize(itChr->second.size(), 0);
+    }
+  }
+
+  static const PositionIndex no_index;
   chrID_ROI.resize(0);
+  chrID_ROI_index.resize(0);
   chrID_count[0].resize(0);
   chrID_count[1].resize(0);
   for (unsigned int i = 0; i < chrmap.size(); i++) {
-    chrID_ROI.push_back( &chrName_ROI[chrmap.at(i).chr_name] );
+    auto itChr = ref->chrName_ROI.find(chrmap.at(i).chr_name);
+    chrID_ROI.push_back( itChr == ref->chrName_ROI.end() ? &no_ROI : &(itChr->second) );
+    auto it_index = ref->chrName_ROI_index.find(chrmap.at(i).chr_name);
+    chrID_ROI_index.push_back( it_index == ref->chrName_ROI_index.end() ? &no_index : &(it_index->second) );
     chrID_count[0].push_back( &chrName_count[0][chrmap.at(i).chr_name] );
     chrID_count[1].push_back( &chrName_count[1][chrmap.at(i).chr_name] );
   }
 }
 
 int FragmentsInROI::WriteOutput(std::string& output, std::string& QC) const {
-  std::ostringstream oss; std::ostringstream oss_QC;
+  output.clear();
+  StringSink sink(output);
+  return(WriteOutput(sink, QC));
+}
+
+int FragmentsInROI::WriteOutput(TextSink& output, std::string& QC) const {
+  TextBuffer oss(output); std::ostringstream oss_QC;
   int count_Intergenic = 0; int count_rRNA = 0; int count_NonPolyA = 0;
+
+  // Sum the per-ROI counters by region name
+  std::map<string, unsigned long> RegionID_counter[2];
+  for(auto itChr = ref->chrName_ROI_text.begin(); itChr != ref->chrName_ROI_text.end(); itChr++) {
+    for(unsigned int j = 0; j < 2; j++) {
+      const std::vector<unsigned long> & counts = chrName_count[j].at(itChr->first);
+      for(unsigned int i = 0; i < itChr->second.size(); i++) {
+        RegionID_counter[j][itChr->second.at(i)] += counts.at(i);
+      }
+    }
+  }
+
   for (std::map<string, unsigned long>::const_iterator itID=RegionID_counter[1].begin(); 
       itID!=RegionID_counter[1].end(); ++itID) {
     std::istringstream iss;
@@ -457,7 +874,7 @@ int FragmentsInROI::WriteOutput(std::string& output, std::string& QC) const {
       << RegionID_counter[0].at(itID->first) << "\n";
     //Outputs tab separated: ROIname, total hits, positive-strand hits, negative-strand hits.
   }
-    output = oss.str();
+    oss.flush();
     
     oss_QC << "Intergenic Reads\t" << count_Intergenic << "\n"
       << "rRNA Reads\t" << count_rRNA << "\n"
@@ -468,8 +885,12 @@ int FragmentsInROI::WriteOutput(std::string& output, std::string& QC) const {
 
 void FragmentsInROI::Combine(const FragmentsInROI &child) {
   for(unsigned int j = 0; j < 2; j++) {
-    for (auto itChr=RegionID_counter[j].begin(); itChr!=RegionID_counter[j].end(); itChr++) {
-      itChr->second += child.RegionID_counter[j].at(itChr->first);
+    for (auto itChr=child.chrName_count[j].begin(); itChr!=child.chrName_count[j].end(); itChr++) {
+      std::vector<unsigned long> & dest = chrName_count[j][itChr->first];
+      if(dest.size() < itChr->second.size()) dest.resize(itChr->second.size(), 0);
+      for(unsigned int i = 0; i < itChr->second.size(); i++) {
+        dest.at(i) += itChr->second.at(i);
+      }
     }
   }
 }
@@ -486,6 +907,7 @@ void FragmentsInROI::loadRef(std::istringstream &IN) {
   s_chr.reserve(30);
   string s_name;
   s_name.reserve(200);
+  ROI_reference regions(*ref);
 
   while ( !IN.eof() && !IN.fail() ) {
     // Input ref:  chr - start - end - name - dir(?). (name\tdir could be considered a single variable)
@@ -513,15 +935,68 @@ void FragmentsInROI::loadRef(std::istringstream &IN) {
 
     getline(lineStream, s_name, '\t');
 
-    chrName_ROI[s_chr].push_back(std::make_pair(end, start));
-    chrName_count[0][s_chr].push_back(&RegionID_counter[0][s_name]);
-    chrName_count[1][s_chr].push_back(&RegionID_counter[1][s_name]);
+    regions.chrName_ROI[s_chr].push_back(std::make_pair(end, start));
+    regions.chrName_ROI_text[s_chr].push_back(s_name);
+  }
+  // Copies of this object share the regions, and allocate their own counters in ChrMapUpdate
+  std::shared_ptr<ROI_reference> new_ref = std::make_shared<ROI_reference>(std::move(regions));
+  new_ref->BuildIndex();
+  ref = new_ref;
+}
 
+// Per chromosome: name, number of regions, region ends, region starts, region names
+void FragmentsInROI::WriteRefBinary(refBinaryWriter &out) const {
+  std::string & buf = out.NewSection(REF_ROI);
+  refBinaryWriter::Append(buf, (uint64_t)ref->chrName_ROI.size());
+  for(auto itChr = ref->chrName_ROI.begin(); itChr != ref->chrName_ROI.end(); itChr++) {
+    const std::vector<string> & names = ref->chrName_ROI_text.at(itChr->first);
+    std::vector<uint32_t> ends;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> name_ids;
+    for(unsigned int i = 0; i < itChr->second.size(); i++) {
+      ends.push_back(itChr->second.at(i).first);
+      starts.push_back(itChr->second.at(i).second);
+      name_ids.push_back(out.AddString(names.at(i)));
+    }
+    refBinaryWriter::Append(buf, out.AddString(itChr->first));
+    refBinaryWriter::Append(buf, (uint64_t)ends.size());
+    refBinaryWriter::AppendArray(buf, ends);
+    refBinaryWriter::AppendArray(buf, starts);
+    refBinaryWriter::AppendArray(buf, name_ids);
+  }
+}
+
+int FragmentsInROI::LoadRefBinary(const refBinaryReader &in) {
+  refBinarySection sec = in.GetSection(REF_ROI);
+  ROI_reference regions;
+  uint64_t n_chr = sec.Read<uint64_t>();
+  std::vector<uint32_t> ends;
+  std::vector<uint32_t> starts;
+  std::vector<uint32_t> name_ids;
+  for(uint64_t i = 0; i < n_chr && !sec.fail(); i++) {
+    std::string s_chr = in.GetString(sec.Read<uint32_t>());
+    uint64_t n = sec.Read<uint64_t>();
+    sec.ReadArray(ends, n);
+    sec.ReadArray(starts, n);
+    sec.ReadArray(name_ids, n);
+    if(sec.fail()) break;
+    std::vector<std::pair<unsigned int,unsigned int>> & dest = regions.chrName_ROI[s_chr];
+    std::vector<string> & dest_names = regions.chrName_ROI_text[s_chr];
+    for(uint64_t j = 0; j < n; j++) {
+      dest.push_back(std::make_pair(ends[j], starts[j]));
+      dest_names.push_back(in.GetString(name_ids[j]));
+    }
   }
+  if(sec.fail()) return(-1);
+  std::shared_ptr<ROI_reference> new_ref = std::make_shared<ROI_reference>(std::move(regions));
+  new_ref->BuildIndex();
+  ref = new_ref;
+  return(0);
 }
 
 void FragmentsInROI::ProcessBlocks(const FragmentBlocks &blocks) {
-  std::vector<std::pair<unsigned int,unsigned int>>::iterator it_ROI;
+  const std::vector<std::pair<unsigned int,unsigned int>> & ROI = *chrID_ROI.at(blocks.chr_id);
+  const PositionIndex & index = *chrID_ROI_index.at(blocks.chr_id);
 
   unsigned int frag_start = blocks.readStart[0];
   unsigned int frag_end = blocks.readEnd[0];
@@ -531,16 +1006,19 @@ void FragmentsInROI::ProcessBlocks(const FragmentBlocks &blocks) {
   
   // Frag start, Frag end.
   // See if this is fully inside one of the ref-regions.
-
-  it_ROI = std::lower_bound(
-      (*chrID_ROI.at(blocks.chr_id)).begin(),
-      (*chrID_ROI.at(blocks.chr_id)).end(),
-      std::make_pair(frag_end, frag_end)
-  );
+  unsigned int i;
+  if(index.sorted()) {
+    // First region not less than (frag_end, frag_end), as (end, start) pairs
+    i = index.lower_bound(frag_end, hint_index);
+    hint_index = i;
+    while (i < ROI.size() && ROI[i].first == frag_end && ROI[i].second < frag_end) i++;
+  } else {
+    i = std::lower_bound(ROI.begin(), ROI.end(), std::make_pair(frag_end, frag_end)) - ROI.begin();
+  }
   
-  if (it_ROI != (*chrID_ROI.at(blocks.chr_id)).end() ) {
-    if (frag_start >= it_ROI->second && frag_end <= it_ROI->first) {
-      (*(*chrID_count[blocks.direction].at(blocks.chr_id)).at(it_ROI - (*chrID_ROI.at(blocks.chr_id)).begin()))++;      
+  if (i < ROI.size()) {
+    if (frag_start >= ROI[i].second && frag_end <= ROI[i].first) {
+      (*chrID_count[blocks.direction].at(blocks.chr_id)).at(i)++;
     }
   }
 }
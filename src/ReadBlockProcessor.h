@@ -27,6 +27,9 @@ SOFTWARE.  */
 
 #include "includedefine.h"
 #include "FragmentBlocks.h"
+#include "RefTools.h"
+#include "GZTools.h"
+#include "SearchTools.h"
 
 /*
 The code can be finished faster if we force a requirement that all input files are coordinate sorted by the start of each block.
@@ -43,24 +46,87 @@ class ReadBlockProcessor {
 		virtual void ChrMapUpdate(const std::vector<chr_entry> &chrmap) = 0; //Maybe some of these funcs shouldn't be pure virtual - overloadable if needed, but default often ok.
 };
 
-class JunctionCount : public ReadBlockProcessor {
+/*
+Statically dispatched pipeline of processors, registered with
+BAM2blocks::registerCallbackProcessBatch. Each batch of fragments is run
+through each processor in turn, so that one processor's data structures stay
+in cache for the whole batch, and ProcessBlocks is called directly rather than
+through a std::function per fragment.
+Processors must not depend on each other's state.
+*/
+template <typename... Procs> class BlockProcessorPipeline;
+
+template <> class BlockProcessorPipeline<> {
+	public:
+		void operator()(const FragmentBlocks *, unsigned int) const {}
+};
+
+template <typename Proc, typename... Rest> class BlockProcessorPipeline<Proc, Rest...> {
 	private:
-		std::map<string, std::map<std::pair<unsigned int,unsigned int>,unsigned int[3]>> chrName_junc_count;
-		std::vector<std::map<std::pair<unsigned int,unsigned int>,unsigned int[3]>*> chrID_junc_count;
-		//unsigned int[3] - 0, neg strand count; 1, pos strand count; 2 = expected direction from ref: 0=unknown, 1=neg, 2=pos.
+		Proc * proc;
+		BlockProcessorPipeline<Rest...> rest;
+	public:
+		BlockProcessorPipeline(Proc * _proc, Rest *... _rest) : proc(_proc), rest(_rest...) {};
+		void operator()(const FragmentBlocks * blocks, unsigned int n_blocks) const {
+			for(unsigned int i = 0; i < n_blocks; i++) {
+				proc->Proc::ProcessBlocks(blocks[i]);
+			}
+			rest(blocks, n_blocks);
+		};
+};
 
-		std::map<string, std::map<unsigned int,unsigned int[2]>> chrName_juncLeft_count;
-		std::vector<std::map<unsigned int,unsigned int[2]>*> chrID_juncLeft_count;
+template <typename... Procs> BlockProcessorPipeline<Procs...> MakeBlockProcessorPipeline(Procs *... procs) {
+	return(BlockProcessorPipeline<Procs...>(procs...));
+}
+
+// Counts of a junction, or of a junction end, keyed by genomic position
+struct junction_count {
+	uint64_t key;           // Junctions: (left << 32) | right; junction ends: position
+	unsigned int count[3];
+	//unsigned int[3] - 0, neg strand count; 1, pos strand count; 2 = expected direction from ref: 0=unknown, 1=neg, 2=pos.
+};
 
-		std::map<string, std::map<unsigned int,unsigned int[2]>> chrName_juncRight_count;
-		std::vector<std::map<unsigned int,unsigned int[2]>*> chrID_juncRight_count;
+class JunctionCount : public ReadBlockProcessor {
+	private:
+		// Reference junctions (zero counts, direction flags), shared between copies
+		std::shared_ptr<const std::map<string, std::vector<junction_count>>> chrName_junc_ref = 
+			std::make_shared<const std::map<string, std::vector<junction_count>>>();
+
+		// Flat arrays of counts, sorted by key, for each chromosome
+		std::map<string, std::vector<junction_count>> chrName_junc_count;
+		std::vector<std::vector<junction_count>*> chrID_junc_count;
+
+		// Derived from chrName_junc_count by sort_and_collapse_final()
+		std::map<string, std::vector<junction_count>> chrName_juncLeft_count;
+		std::map<string, std::vector<junction_count>> chrName_juncRight_count;
+		std::vector<string> chrID_name;
+		std::vector<const std::vector<junction_count>*> chrID_juncLeft_count;
+		std::vector<const std::vector<junction_count>*> chrID_juncRight_count;
 		  //chrID_... stores a fast access pointer to the appropriate structure in chrName_... 
+
+		// Append-only junction events: (left << 33) | (right << 1) | direction
+		std::vector<std::vector<uint64_t>> chrID_junc_events;
+		unsigned long n_events = 0;
+		
+		// Sorts events and adds them to chrName_junc_count; occurs every 1M events
+		int sort_and_collapse_temp();
 	public:
-		void Combine(const JunctionCount &child);
+		void Combine(JunctionCount &child);
+		// k-way merge of all JunctionCount's in JC_list (which may include this) into this
+		void Combine(std::vector<JunctionCount*> &JC_list);
+		// Must be run after processing / combining, before output or lookups. Adds the reference junctions.
+		int sort_and_collapse_final();
 		void ProcessBlocks(const FragmentBlocks &fragblock);
 		void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
 		int WriteOutput(std::string& output, std::string& QC) const;
+		int WriteOutput(TextSink& output, std::string& QC) const;
 		void loadRef(std::istringstream &IN); //loadRef is optional, it allows directional detection to determine not just non-dir vs dir, but also which direction.
+		void WriteRefBinary(refBinaryWriter &out) const;
+		int LoadRefBinary(const refBinaryReader &in);
+		// Observed junction counts (without reference flags), for the IRF_core sidecar.
+		//   Load after ChrMapUpdate, then run sort_and_collapse_final to add the reference junctions
+		void WriteCountsBinary(refBinaryWriter &out) const;
+		int LoadCountsBinary(const refBinaryReader &in);
 
 		int Directional(std::string& output) const;
 		
@@ -70,6 +136,13 @@ class JunctionCount : public ReadBlockProcessor {
 		unsigned int lookupLeft(std::string ChrName, unsigned int left) const;
 		unsigned int lookupRight(std::string ChrName, unsigned int right, bool direction) const;
 		unsigned int lookupRight(std::string ChrName, unsigned int right) const;
+		// As above, by chromosome ID (as passed to ChrMapUpdate); valid after sort_and_collapse_final()
+		unsigned int lookup(unsigned int refID, unsigned int left, unsigned int right, bool direction) const;
+		unsigned int lookup(unsigned int refID, unsigned int left, unsigned int right) const;
+		unsigned int lookupLeft(unsigned int refID, unsigned int left, bool direction) const;
+		unsigned int lookupLeft(unsigned int refID, unsigned int left) const;
+		unsigned int lookupRight(unsigned int refID, unsigned int right, bool direction) const;
+		unsigned int lookupRight(unsigned int refID, unsigned int right) const;
 
 // Ideally we would read the XS junction strand attribute from the BAM if we want to count junctions from non-directional sequencing.
 //   that will require BAM2blocks to be informed it should read the optional attributes looking for that attrib in that case.
@@ -79,10 +152,18 @@ class JunctionCount : public ReadBlockProcessor {
 
 class SpansPoint : public ReadBlockProcessor {
 	private:
-		std::map<string, std::vector<unsigned int>> chrName_pos;
+		// Read-only reference positions, shared between copies; counters are per copy, sized by ChrMapUpdate
+		std::shared_ptr<const std::map<string, std::vector<unsigned int>>> chrName_pos = 
+			std::make_shared<const std::map<string, std::vector<unsigned int>>>();
 		std::map<string, std::vector<unsigned int>> chrName_count[2];
-		std::vector<std::vector<unsigned int>*> chrID_pos;
+		std::vector<const std::vector<unsigned int>*> chrID_pos;
 		std::vector<std::vector<unsigned int>*> chrID_count[2];
+		// Search indexes over chrName_pos, also shared between copies
+		std::shared_ptr<const std::map<string, PositionIndex>> chrName_index = 
+			std::make_shared<const std::map<string, PositionIndex>>();
+		std::vector<const PositionIndex*> chrID_index;
+		unsigned int hint_index = 0;    // Result of the last search
+		void BuildIndex();
 		char overhangLeft;
 		char overhangRight;
 		char overhangTotal;
@@ -91,12 +172,24 @@ class SpansPoint : public ReadBlockProcessor {
 		void Combine(const SpansPoint &child);
 		void setSpanLength(unsigned int overhang_left, unsigned int overhang_right);
 		void loadRef(std::istringstream &IN);
+		void WriteRefBinary(refBinaryWriter &out) const;
+		int LoadRefBinary(const refBinaryReader &in);
 		void ProcessBlocks(const FragmentBlocks &fragblock);
 		void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
+		unsigned int getOverhangLeft() const { return(overhangLeft); };
+		unsigned int getOverhangRight() const { return(overhangRight); };
+		// Sets the counts of a chromosome and strand from the depth runs (position, depth) of
+		//   read blocks trimmed by the overhangs (see SpanDepthMap). Run after ChrMapUpdate
+		void SetCountsFromDepth(const std::string &chrName, bool direction, 
+			const std::vector< std::pair<unsigned int, int> > &depth_runs);
 		//void SetOutputStream(std::ostream *os);
 		int WriteOutput(std::string& output, std::string& QC) const;
+		int WriteOutput(TextSink& output, std::string& QC) const;
 		unsigned int lookup(std::string ChrName, unsigned int pos, bool direction) const;
 		unsigned int lookup(std::string ChrName, unsigned int pos) const;
+		// As above, by chromosome ID (as passed to ChrMapUpdate)
+		unsigned int lookup(unsigned int refID, unsigned int pos, bool direction) const;
+		unsigned int lookup(unsigned int refID, unsigned int pos) const;
 };
 
 class FragmentsInChr : public ReadBlockProcessor {
@@ -112,27 +205,43 @@ class FragmentsInChr : public ReadBlockProcessor {
 };
 
 
+// Read-only regions of interest, shared between copies of FragmentsInROI
+struct ROI_reference {
+	std::map<string, std::vector<std::pair<unsigned int,unsigned int>>> chrName_ROI;
+
+	// Perhaps we want to store some text relating to each record too? Easy to do if the input is pre-sorted (at least within each Chr).
+	//   if pre-sorted, it may be easier to check for no overlapping blocks on read .. or can do this immediately after read with a single nested-walk.
+	std::map<string, std::vector<string>> chrName_ROI_text;
+
+	// Region ends, and search indexes over them; built by BuildIndex once the
+	//   regions are in place, as the indexes point into chrName_ROI_end
+	std::map<string, std::vector<unsigned int>> chrName_ROI_end;
+	std::map<string, PositionIndex> chrName_ROI_index;
+	void BuildIndex();
+};
+
 class FragmentsInROI : public ReadBlockProcessor {
 	// Counts the number of fragments fully contained within a ROI.
 	//   the ROIs may not overlap. Direction ignored for overlap detect.
 	private:
-		std::map<string, unsigned long> RegionID_counter[2];
- 
-		std::map<string, std::vector<std::pair<unsigned int,unsigned int>>> chrName_ROI;
-		std::map<string, std::vector<unsigned long*>> chrName_count[2];
+		std::shared_ptr<const ROI_reference> ref = std::make_shared<const ROI_reference>();
 
-		std::vector<std::vector<std::pair<unsigned int,unsigned int>>*> chrID_ROI;
-		std::vector<std::vector<unsigned long*>*> chrID_count[2];
+		// Counters parallel to ref->chrName_ROI; summed by region name on output
+		std::map<string, std::vector<unsigned long>> chrName_count[2];
 
-		// Perhaps we want to store some text relating to each record too? Easy to do if the input is pre-sorted (at least within each Chr).
-		//   if pre-sorted, it may be easier to check for no overlapping blocks on read .. or can do this immediately after read with a single nested-walk.
-		std::map<string, std::vector<string>> chrName_ROI_text;
+		std::vector<const std::vector<std::pair<unsigned int,unsigned int>>*> chrID_ROI;
+		std::vector<std::vector<unsigned long>*> chrID_count[2];
+		std::vector<const PositionIndex*> chrID_ROI_index;
+		unsigned int hint_index = 0;    // Result of the last search
 	public:
 		void Combine(const FragmentsInROI &child);
 		void ProcessBlocks(const FragmentBlocks &blocks);
 		void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
 		void loadRef(std::istringstream &IN);
-		int WriteOutput(std::string& output, std::string& QC) const;		
+		void WriteRefBinary(refBinaryWriter &out) const;
+		int LoadRefBinary(const refBinaryReader &in);
+		int WriteOutput(std::string& output, std::string& QC) const;
+		int WriteOutput(TextSink& output, std::string& QC) const;
 };
 
 
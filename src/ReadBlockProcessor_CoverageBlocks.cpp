@@ -23,6 +23,90 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.  */
 
 #include "ReadBlockProcessor_CoverageBlocks.h"
+#include "SortTools.h"
+
+// Adds depths of [start, end) to hist, where it_pos is the first depth run beginning after start
+static void walkDepthRuns(
+    CoverageHist &hist, 
+    const std::vector< std::pair<unsigned int, int> > &runs,
+    std::vector< std::pair<unsigned int, int> >::const_iterator it_pos,
+    unsigned int start, unsigned int end
+) {
+  if(it_pos == runs.end()) {
+    // No coverage data
+    hist.add(0, end - start);
+    return;
+  }
+  while(it_pos->first > start && it_pos != runs.begin()) {
+    it_pos--; // shouldn't matter as the first vector pair should be at coord zero
+  }
+  int depth = it_pos->second;
+  unsigned int cursor = start;
+  while(cursor < end) {
+    while(it_pos->first <= cursor && it_pos != runs.end()) {
+      it_pos++;
+    }
+    if(it_pos == runs.end()) {
+      hist.add((unsigned int)depth, end - cursor);
+      break;
+    }
+    hist.add((unsigned int)depth, min(it_pos->first, end) - cursor);
+    cursor = it_pos->first;
+    depth = it_pos->second;
+  }
+}
+
+// Sweep all intron queries on one chromosome / strand in coordinate order.
+// A single cursor into the depth runs replaces the per-block binary search;
+// histograms are only held for queries that are still open.
+static void sweepDepthQueries(
+    const std::vector< std::pair<unsigned int, int> > * runs,
+    std::vector<depth_query_block> &queries,
+    std::vector<unsigned int> &remaining,
+    std::function<void(unsigned int, const CoverageHist &)> on_complete
+) {
+  std::sort(queries.begin(), queries.end(), 
+    [](const depth_query_block &a, const depth_query_block &b) { return(a.start < b.start); }
+  );
+
+  std::vector<CoverageHist> pool;
+  std::vector<unsigned int> pool_free;
+  std::vector<int> query_hist(remaining.size(), -1);
+
+  // Queries with no blocks
+  CoverageHist empty_hist;
+  for(unsigned int q = 0; q < remaining.size(); q++) {
+    if(remaining.at(q) == 0) on_complete(q, empty_hist);
+  }
+
+  auto it_pos = runs ? runs->begin() : std::vector< std::pair<unsigned int, int> >::const_iterator();
+  for(auto it_q = queries.begin(); it_q != queries.end(); it_q++) {
+    int h = query_hist.at(it_q->query);
+    if(h < 0) {
+      if(pool_free.size() > 0) {
+        h = pool_free.back();
+        pool_free.pop_back();
+      } else {
+        h = pool.size();
+        pool.resize(pool.size() + 1);
+      }
+      query_hist.at(it_q->query) = h;
+    }
+    CoverageHist & hist = pool.at(h);
+    if(!runs) {
+      hist.add(0, 0);
+    } else {
+      while(it_pos != runs->end() && it_pos->first <= it_q->start) it_pos++;
+      walkDepthRuns(hist, *runs, it_pos, it_q->start, it_q->end);
+    }
+    if(--remaining.at(it_q->query) == 0) {
+      hist.finalize();
+      on_complete(it_q->query, hist);
+      hist.clear();
+      pool_free.push_back(h);
+    }
+  }
+}
 
 void CoverageBlocks::loadRef(std::istringstream &IN) {
 	std::string myLine;
@@ -42,6 +126,7 @@ void CoverageBlocks::loadRef(std::istringstream &IN) {
 	string s_dir;
 	//s_keydata.reserve(400);
 	BEDrecord BEDrec;
+	std::vector<BEDrecord> records(*BEDrecords);
 
 	// std::map<string, std::vector<std::pair<unsigned int, unsigned int>> > temp_segments;
 
@@ -92,10 +177,54 @@ void CoverageBlocks::loadRef(std::istringstream &IN) {
 			BEDrec.blocks.push_back(std::make_pair( i_block_start, i_block_end ));
 			// temp_segments[BEDrec.chrName].push_back(std::make_pair( i_block_start, i_block_end ) ); 
 		}		
-		BEDrecords.push_back(BEDrec);
+		records.push_back(BEDrec);
 	}
 	// Read from file complete.
+	// The records are read-only from here, and shared by all copies of this object
+	BEDrecords = std::make_shared<const std::vector<BEDrecord>>(std::move(records));
+
+}
 
+// Per record: chromosome, name, start, end, direction, number of blocks, block (start, end) pairs
+void CoverageBlocks::WriteRefBinary(refBinaryWriter &out) const {
+	std::string & buf = out.NewSection(REF_COVER);
+	refBinaryWriter::Append(buf, (uint64_t)BEDrecords->size());
+	for(auto it_BED = BEDrecords->begin(); it_BED != BEDrecords->end(); it_BED++) {
+		refBinaryWriter::Append(buf, out.AddString(it_BED->chrName));
+		refBinaryWriter::Append(buf, out.AddString(it_BED->name));
+		refBinaryWriter::Append(buf, (uint32_t)it_BED->start);
+		refBinaryWriter::Append(buf, (uint32_t)it_BED->end);
+		refBinaryWriter::Append(buf, (uint32_t)it_BED->direction);
+		refBinaryWriter::Append(buf, (uint32_t)it_BED->blocks.size());
+		for(auto it_blocks = it_BED->blocks.begin(); it_blocks != it_BED->blocks.end(); it_blocks++) {
+			refBinaryWriter::Append(buf, (uint32_t)it_blocks->first);
+			refBinaryWriter::Append(buf, (uint32_t)it_blocks->second);
+		}
+	}
+}
+
+int CoverageBlocks::LoadRefBinary(const refBinaryReader &in) {
+	refBinarySection sec = in.GetSection(REF_COVER);
+	std::vector<BEDrecord> records;
+	uint64_t n_records = sec.Read<uint64_t>();
+	std::vector<uint32_t> coords;
+	BEDrecord BEDrec;
+	for(uint64_t j = 0; j < n_records && !sec.fail(); j++) {
+		BEDrec.chrName = in.GetString(sec.Read<uint32_t>());
+		BEDrec.name = in.GetString(sec.Read<uint32_t>());
+		BEDrec.start = sec.Read<uint32_t>();
+		BEDrec.end = sec.Read<uint32_t>();
+		BEDrec.direction = (sec.Read<uint32_t>() != 0);
+		sec.ReadArray(coords, 2 * (uint64_t)sec.Read<uint32_t>());
+		BEDrec.blocks.resize(coords.size() / 2);
+		for(unsigned int i = 0; i < BEDrec.blocks.size(); i++) {
+			BEDrec.blocks[i] = std::make_pair(coords[2 * i], coords[2 * i + 1]);
+		}
+		records.push_back(BEDrec);
+	}
+	if(sec.fail()) return(-1);
+	BEDrecords = std::make_shared<const std::vector<BEDrecord>>(std::move(records));
+	return(0);
 }
 
 void CoverageBlocks::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
@@ -110,76 +239,78 @@ void CoverageBlocks::ProcessBlocks(const FragmentBlocks &blocks) {
   (void)(blocks);
 }
 
-// Using FragmentsMap
-void CoverageBlocks::fillHist(
-    std::map<unsigned int,unsigned int> &hist, 
-    const unsigned int &refID, 
-    const std::vector<std::pair<unsigned int,unsigned int>> &blocks, 
-    const FragmentsMap &FM, 
-    bool debug
-) const{
-      
-	for (auto it_blocks=blocks.begin(); it_blocks!=blocks.end(); it_blocks++) {
-		FM.updateCoverageHist(hist, it_blocks->first, it_blocks->second, 2, refID, debug);
-	}
+void CoverageHist::clear() {
+  for(auto depth : dense_touched) {
+    dense_count[depth] = 0;
+    dense_present[depth] = 0;
+  }
+  dense_touched.resize(0);
+  overflow.resize(0);
+  bins.resize(0);
+  size = 0;
+  finalized = true;
 }
 
-void CoverageBlocks::fillHist(
-    std::map<unsigned int,unsigned int> &hist, 
-    const unsigned int &refID, 
-    const std::vector<std::pair<unsigned int,unsigned int>> &blocks, 
-    bool direction, 
-    const FragmentsMap &FM,
-    bool debug
-) const{
-      
-	for (auto it_blocks=blocks.begin(); it_blocks!=blocks.end(); it_blocks++) {
-		FM.updateCoverageHist(hist, it_blocks->first, it_blocks->second, direction ? 1 : 0, refID, debug);
-	}
+// Equivalent to hist[depth] += count
+void CoverageHist::add(unsigned int depth, unsigned int count) {
+  if(depth < dense_size) {
+    if(!dense_present[depth]) {
+      dense_present[depth] = 1;
+      dense_touched.push_back(depth);
+    }
+    dense_count[depth] += count;
+  } else {
+    overflow.push_back(std::make_pair(depth, count));
+  }
+  finalized = false;
 }
 
+void CoverageHist::finalize() {
+  if(finalized) return;
+  bins.resize(0);
+  std::sort(dense_touched.begin(), dense_touched.end());
+  for(auto depth : dense_touched) {
+    bins.push_back(std::make_pair(depth, dense_count[depth]));
+  }
+  if(overflow.size() > 0) {
+    std::sort(overflow.begin(), overflow.end());
+    for(auto h : overflow) {
+      if(bins.size() > 0 && bins.back().first == h.first) {
+        bins.back().second += h.second;
+      } else {
+        bins.push_back(h);
+      }
+    }
+  }
+  size = 0;
+  for(auto h : bins) {
+    size += h.second;
+  }
+  finalized = true;
+}
 
-double CoverageBlocks::meanFromHist(
-    const std::map<unsigned int,unsigned int> &hist
-) const {
+double CoverageHist::mean() const {
 	unsigned long long total = 0;
-	unsigned int count = 0;
-	
-	for (auto h : hist) {
+	for (auto h : bins) {
 		total += h.first * h.second;
-		count += h.second;
 	}
-	return (total/(double)count);
+	return (total/(double)size);
 }
 
-double CoverageBlocks::coverageFromHist(
-    const std::map<unsigned int,unsigned int> &hist
-) const {
-	if (hist.find(0) == hist.end()) {
+double CoverageHist::coverage() const {
+	if (bins.size() == 0 || bins.begin()->first != 0) {
 		return 1.0; //No bases are at zero cover.
 	}
-	unsigned int count = 0;
-	for (auto h : hist) {
-		count += h.second;
-	}
-	return ((count - hist.at(0))/(double)count);
+	return ((size - bins.begin()->second)/(double)size);
 }
 
-
-double CoverageBlocks::percentileFromHist(
-    const std::map<unsigned int,unsigned int> &hist, 
-    unsigned int percentile
-) const {
-	unsigned int size = 0;
-	for (auto h : hist) {
-		size += h.second;
-	}
+double CoverageHist::percentile(unsigned int percentile) const {
 	double percentile_frac = (size + 1)*(double)percentile/100;
 	unsigned int percentile_index = percentile_frac;  //round down
 	percentile_frac = percentile_frac - percentile_index;
 
 	unsigned int count = 0;
-	for (auto h = hist.begin(); h != hist.end(); h++) {
+	for (auto h = bins.begin(); h != bins.end(); h++) {
 		count += h->second;
 		if (count >= percentile_index) {
 			if (count > percentile_index || percentile_frac == 0) {
@@ -187,6 +318,7 @@ double CoverageBlocks::percentileFromHist(
 			}else{
 				double ret = h->first - (percentile_frac * h->first);
 				h++;
+				if(h == bins.end()) return std::numeric_limits<double>::quiet_NaN();
 				ret += (percentile_frac * h->first);
 				return ret;
 			}
@@ -195,23 +327,17 @@ double CoverageBlocks::percentileFromHist(
 	return std::numeric_limits<double>::quiet_NaN();
 }
 
-double CoverageBlocks::trimmedMeanFromHist(
-    const std::map<unsigned int,unsigned int> &hist, 
-    unsigned int centerPercent, 
-    bool debug
-) const {
-	unsigned int size = 0;
-	for (auto h : hist) {
-		size += h.second;
-    if(debug) cout << h.first << '\t' << h.second << '\n';
-	}
+double CoverageHist::trimmedMean(unsigned int centerPercent, bool debug) const {
+  if(debug) {
+    for (auto h : bins) cout << h.first << '\t' << h.second << '\n';
+  }
 	double skip_d = (double)size * ((100.0 - (double)centerPercent)/2.0) / 100.0; 
 	unsigned int skip = floor(skip_d);
 	
 	unsigned long long total = 0;
 	unsigned int count = 0;
 	
-	for (auto h : hist) {
+	for (auto h : bins) {
 		if (count + h.second > size - skip) {
 			// This bar will enter the max skip section.
 			if (count > skip) {
@@ -235,6 +361,52 @@ double CoverageBlocks::trimmedMeanFromHist(
 	return ((double)total/(size-2*skip));
 }
 
+// Using FragmentsMap
+void CoverageBlocks::fillHist(
+    CoverageHist &hist, 
+    const unsigned int &refID, 
+    const std::vector<std::pair<unsigned int,unsigned int>> &blocks, 
+    const FragmentsMap &FM, 
+    bool debug
+) const{
+      
+	for (auto it_blocks=blocks.begin(); it_blocks!=blocks.end(); it_blocks++) {
+		FM.updateCoverageHist(hist, it_blocks->first, it_blocks->second, 2, refID, debug);
+	}
+	hist.finalize();
+}
+
+void CoverageBlocks::fillHist(
+    CoverageHist &hist, 
+    const unsigned int &refID, 
+    const std::vector<std::pair<unsigned int,unsigned int>> &blocks, 
+    bool direction, 
+    const FragmentsMap &FM,
+    bool debug
+) const{
+      
+	for (auto it_blocks=blocks.begin(); it_blocks!=blocks.end(); it_blocks++) {
+		FM.updateCoverageHist(hist, it_blocks->first, it_blocks->second, direction ? 1 : 0, refID, debug);
+	}
+	hist.finalize();
+}
+
+double CoverageBlocks::meanFromHist(const CoverageHist &hist) const {
+  return hist.mean();
+}
+
+double CoverageBlocks::coverageFromHist(const CoverageHist &hist) const {
+  return hist.coverage();
+}
+
+double CoverageBlocks::percentileFromHist(const CoverageHist &hist, unsigned int percentile) const {
+  return hist.percentile(percentile);
+}
+
+double CoverageBlocks::trimmedMeanFromHist(const CoverageHist &hist, unsigned int centerPercent, bool debug) const {
+  return hist.trimmedMean(centerPercent, debug);
+}
+
 
 // Not used
 int CoverageBlocks::WriteOutput(std::string& output, const FragmentsMap &FM) const {
@@ -243,23 +415,23 @@ int CoverageBlocks::WriteOutput(std::string& output, const FragmentsMap &FM) con
 // The output we need will be in the extended class.
     std::ostringstream oss;
   unsigned int refID = 0;
-	for (std::vector<BEDrecord>::const_iterator it_BED=BEDrecords.begin(); it_BED!=BEDrecords.end(); it_BED++) {
+	for (std::vector<BEDrecord>::const_iterator it_BED=BEDrecords->begin(); it_BED!=BEDrecords->end(); it_BED++) {
 		unsigned int len=0;
 		for (std::vector<std::pair<unsigned int,unsigned int>>::const_iterator it_blocks=it_BED->blocks.begin(); it_blocks!= it_BED->blocks.end(); it_blocks++) {
 			len += (it_blocks->second - it_blocks->first);
 		}
-		std::map<unsigned int,unsigned int> hist;
+		CoverageHist hist;
 		fillHist(hist, refID, it_BED->blocks, FM);
 
 		unsigned int histPositions = 0;
-		for (auto h : hist) {
+		for (auto h : hist.Bins()) {
 			histPositions += h.second;
 			//DEBUGGING
 			oss << h.first << "\t" << h.second << "\n";
 		}
 
 		//oss << "\n";
-		oss << it_BED->chrName << "\t" << it_BED->start << "\t" << it_BED->end << "\t" << (it_BED->end - it_BED->start) << "\t" << histPositions << "\t" << hist.size() << "\t" << trimmedMeanFromHist(hist, 50)  << "\t" << trimmedMeanFromHist(hist, 20) << "\t" << coverageFromHist(hist) << "\t" << meanFromHist(hist) << "\t" << it_BED->direction << "\t" << it_BED->name << "\n";
+		oss << it_BED->chrName << "\t" << it_BED->start << "\t" << it_BED->end << "\t" << (it_BED->end - it_BED->start) << "\t" << histPositions << "\t" << hist.Bins().size() << "\t" << trimmedMeanFromHist(hist, 50)  << "\t" << trimmedMeanFromHist(hist, 20) << "\t" << coverageFromHist(hist) << "\t" << meanFromHist(hist) << "\t" << it_BED->direction << "\t" << it_BED->name << "\n";
 		oss << percentileFromHist(hist, 25) << "\t" << percentileFromHist(hist, 50) << "\t" << percentileFromHist(hist, 75) << "\t" << "\n";
 	}
 	output = oss.str();
@@ -271,14 +443,138 @@ void CoverageBlocksIRFinder::Combine(CoverageBlocksIRFinder &child) {
   (void)(child);
 }
 
+// Parses IRFinder intron name, eg: nd/PHF13/ENSG00000116273/+/3/6676918/6679862/2944/10/clean
+static void parseIntronName(const std::string &name,
+    std::string &s_name, std::string &s_ID, std::string &s_clean,
+    unsigned int &intronStart, unsigned int &intronEnd, unsigned int &exclBases
+) {
+  std::string s_buffer;
+  std::istringstream lineStream;
+  lineStream.str(name);
+  lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
+  getline(lineStream, s_name, '/');
+  getline(lineStream, s_ID, '/');
+  lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
+  lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
+  getline(lineStream, s_buffer, '/');
+  intronStart = stol(s_buffer);
+  getline(lineStream, s_buffer, '/');
+  intronEnd = stol(s_buffer);
+  lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
+  getline(lineStream, s_buffer, '/');
+  exclBases = stol(s_buffer);
+  getline(lineStream, s_clean, '/');
+}
+
+// Computes depth statistics of all introns of interest, one sweep per chromosome / strand
+int CoverageBlocksIRFinder::sweepIntronStats(std::vector<intron_depth_stats> &stats,
+    const FragmentsMap &FM, int n_threads, int directionality) const {
+  
+  stats.resize(0);
+  stats.resize(BEDrecords->size());
+
+  std::map<std::string, unsigned int> chr_refID;
+  for(auto it = chrs.rbegin(); it != chrs.rend(); it++) {
+    chr_refID[it->chr_name] = it->refID;
+  }
+  
+  // Group records by (refID, strand)
+  std::map< std::pair<unsigned int, unsigned int>, std::vector<unsigned int> > groups;
+  std::vector<unsigned int> rec_start(BEDrecords->size());
+  std::vector<unsigned int> rec_end(BEDrecords->size());
+  for(unsigned int j = 0; j < BEDrecords->size(); j++) {
+    auto BEDrec = BEDrecords->begin() + j;
+    if (!((directionality != 0 && (0 == BEDrec->name.compare(0, 4, "dir/"))) || (directionality == 0 && (0 == BEDrec->name.compare(0, 3, "nd/"))))) {
+      continue;
+    }
+    std::string s_name; std::string s_ID; std::string s_clean;
+    unsigned int exclBases;
+    try {
+      parseIntronName(BEDrec->name, s_name, s_ID, s_clean, rec_start.at(j), rec_end.at(j), exclBases);
+    } catch (const std::exception& e) {
+      continue;   // reported by WriteOutput
+    }
+    auto it_chr = chr_refID.find(BEDrec->chrName);
+    unsigned int refID = (it_chr != chr_refID.end()) ? it_chr->second : chrs.size();
+    bool measureDir = BEDrec->direction;
+    if (directionality == -1) {
+      measureDir = !BEDrec->direction;
+    }
+    unsigned int dir = (directionality == 0) ? 2 : (measureDir ? 1 : 0);
+    groups[std::make_pair(refID, dir)].push_back(j);
+    stats.at(j).valid = true;
+  }
+  
+  std::vector< std::pair< std::pair<unsigned int, unsigned int>, std::vector<unsigned int> * > > tasks;
+  for(auto it = groups.begin(); it != groups.end(); it++) {
+    tasks.push_back(std::make_pair(it->first, &(it->second)));
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+#endif
+  for(unsigned int t = 0; t < tasks.size(); t++) {
+    const std::vector<unsigned int> & recs = *(tasks.at(t).second);
+    // Three queries per record: intron blocks, first 50bp, last 50bp
+    std::vector<depth_query_block> queries;
+    std::vector<unsigned int> remaining(3 * recs.size(), 0);
+    for(unsigned int k = 0; k < recs.size(); k++) {
+      unsigned int j = recs.at(k);
+      for(auto it_blocks = BEDrecords->at(j).blocks.begin(); it_blocks != BEDrecords->at(j).blocks.end(); it_blocks++) {
+        depth_query_block block = {it_blocks->first, it_blocks->second, 3 * k};
+        queries.push_back(block);
+      }
+      remaining.at(3 * k) = BEDrecords->at(j).blocks.size();
+      depth_query_block first50 = {rec_start.at(j) + 5, rec_start.at(j) + 55, 3 * k + 1};
+      depth_query_block last50 = {rec_end.at(j) - 55, rec_end.at(j) - 5, 3 * k + 2};
+      queries.push_back(first50);
+      queries.push_back(last50);
+      remaining.at(3 * k + 1) = 1;
+      remaining.at(3 * k + 2) = 1;
+    }
+    sweepDepthQueries(
+      FM.getDepthRuns(tasks.at(t).first.second, tasks.at(t).first.first), 
+      queries, remaining,
+      [&](unsigned int q, const CoverageHist &hist) {
+        intron_depth_stats & stat = stats.at(recs.at(q / 3));
+        if(q % 3 == 0) {
+          stat.depth = trimmedMeanFromHist(hist, 40);
+          stat.coverage = coverageFromHist(hist);
+          stat.depth25 = percentileFromHist(hist, 25);
+          stat.depth50 = percentileFromHist(hist, 50);
+          stat.depth75 = percentileFromHist(hist, 75);
+        } else if(q % 3 == 1) {
+          stat.depthFirst50 = trimmedMeanFromHist(hist, 40);
+        } else {
+          stat.depthLast50 = trimmedMeanFromHist(hist, 40);
+        }
+      }
+    );
+  }
+  return(0);
+}
+
 int CoverageBlocksIRFinder::WriteOutput(std::string& output, std::string& QC, 
     const JunctionCount &JC, const SpansPoint &SP, const FragmentsMap &FM, 
-     int n_threads, int directionality) const {
+     int n_threads, int directionality, bool use_sweep) const {
+  StringSink sink(output);
+  return(WriteOutput(sink, QC, JC, SP, FM, n_threads, directionality, use_sweep));
+}
+
+int CoverageBlocksIRFinder::WriteOutput(TextSink& output, std::string& QC, 
+    const JunctionCount &JC, const SpansPoint &SP, const FragmentsMap &FM, 
+     int n_threads, int directionality, bool use_sweep) const {
   
   if(n_threads < 1) return(-1);
+
+  std::vector<intron_depth_stats> sweep_stats;
+  if(use_sweep) sweepIntronStats(sweep_stats, FM, n_threads, directionality);
   
   std::ostringstream oss_title; std::ostringstream oss_qc; 
-  std::vector<std::ostringstream> oss(n_threads);
+  // Records are formatted in batches, each thread formatting a contiguous part of
+  //   each batch, so that only one batch of text is held at a time
+  std::vector<std::string> thread_text(n_threads);
+  const size_t batch_size = 4096 * (size_t)n_threads;
   
 	// Custom output function - related to the IRFinder needs
   if(directionality == 0) {
@@ -293,201 +589,224 @@ int CoverageBlocksIRFinder::WriteOutput(std::string& output, std::string& QC,
 	double ID_AS = 0.0;
 	std::string KE = "known-exon";
 	
-  unsigned int n_jobs = 1 + (BEDrecords.size() / n_threads);
+  output.write(oss_title.str());
+  for(size_t batch_start = 0; batch_start < BEDrecords->size(); batch_start += batch_size) {
+    size_t batch_end = std::min(batch_start + batch_size, BEDrecords->size());
+    unsigned int n_jobs = 1 + ((batch_end - batch_start) / n_threads);
 
 #ifdef _OPENMP
   #pragma omp parallel for
 #endif  
-  for(unsigned int i = 0; i < (unsigned int)n_threads; i++) {
-    unsigned int refID = 0;
-    std::string cur_chr = "";
-    
-    for(unsigned int j = i * n_jobs; j < (i+1) * n_jobs && j < BEDrecords.size(); j++) {
-      auto BEDrec = BEDrecords.begin() + j;
-
-      if ((directionality != 0 && (0 == BEDrec->name.compare(0, 4, "dir/"))) || (directionality == 0 && (0 == BEDrec->name.compare(0, 3, "nd/")))) {
-        try {
-          unsigned int intronStart;
-          unsigned int intronEnd;
-          unsigned int exclBases;
-          double intronTrimmedMean;
-          double coverage;
-          bool measureDir;
-          unsigned int JCleft;
-          unsigned int JCright;
-          unsigned int JCexact;
-          unsigned int SPleft;
-          unsigned int SPright;
-
-          std::string s_buffer;
-          std::string s_name;
-          std::string s_ID;
-          std::string s_clean;
-
-          std::istringstream lineStream;
-          lineStream.str(BEDrec->name);
-          lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
-          getline(lineStream, s_name, '/');
-          getline(lineStream, s_ID, '/');
-          lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
-          lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
-          getline(lineStream, s_buffer, '/');
-          intronStart = stol(s_buffer);
-          getline(lineStream, s_buffer, '/');
-          intronEnd = stol(s_buffer);
-          lineStream.ignore( numeric_limits<streamsize>::max(), '/' );
-          getline(lineStream, s_buffer, '/');
-          exclBases = stol(s_buffer);
-          getline(lineStream, s_clean, '/');
-
-    //1       860574  861258  nd/SAMD11/ENSG00000187634/+/2/860569/861301/732/121/anti-over   0       +       860574  861258  255,0,0 2       538,73  0,611
-    //1       860574  861296  dir/SAMD11/ENSG00000187634/+/2/860569/861301/732/83/clean       0       +       860574  861296  255,0,0 2       538,111 0,611
-
-          if(0 != BEDrec->chrName.compare(0, BEDrec->chrName.size(), cur_chr)) {
-            cur_chr = BEDrec->chrName;
-            auto it = find_if(chrs.begin(), chrs.end(), 
-              [&cur_chr](const chr_entry& obj) {return obj.chr_name == cur_chr;});
-            if(it != chrs.end()) {
-              refID = it->refID;
-            } else {
-              refID = chrs.size();
+    for(unsigned int i = 0; i < (unsigned int)n_threads; i++) {
+      unsigned int refID = 0;
+      std::string cur_chr = "";
+      CoverageHist hist;
+      thread_text.at(i).clear();
+      StringSink thread_sink(thread_text.at(i));
+      TextBuffer oss(thread_sink);
+      
+      for(unsigned int j = batch_start + i * n_jobs; j < batch_start + (i+1) * n_jobs && j < batch_end; j++) {
+        auto BEDrec = BEDrecords->begin() + j;
+
+        if ((directionality != 0 && (0 == BEDrec->name.compare(0, 4, "dir/"))) || (directionality == 0 && (0 == BEDrec->name.compare(0, 3, "nd/")))) {
+          try {
+            unsigned int intronStart;
+            unsigned int intronEnd;
+            unsigned int exclBases;
+            double intronTrimmedMean;
+            double coverage;
+            bool measureDir;
+            unsigned int JCleft;
+            unsigned int JCright;
+            unsigned int JCexact;
+            unsigned int SPleft;
+            unsigned int SPright;
+
+            double depth25;
+            double depth50;
+            double depth75;
+            double depthFirst50;
+            double depthLast50;
+
+            std::string s_name;
+            std::string s_ID;
+            std::string s_clean;
+
+            parseIntronName(BEDrec->name, s_name, s_ID, s_clean, intronStart, intronEnd, exclBases);
+
+      //1       860574  861258  nd/SAMD11/ENSG00000187634/+/2/860569/861301/732/121/anti-over   0       +       860574  861258  255,0,0 2       538,73  0,611
+      //1       860574  861296  dir/SAMD11/ENSG00000187634/+/2/860569/861301/732/83/clean       0       +       860574  861296  255,0,0 2       538,111 0,611
+
+            if(0 != BEDrec->chrName.compare(0, BEDrec->chrName.size(), cur_chr)) {
+              cur_chr = BEDrec->chrName;
+              auto it = find_if(chrs.begin(), chrs.end(), 
+                [&cur_chr](const chr_entry& obj) {return obj.chr_name == cur_chr;});
+              if(it != chrs.end()) {
+                refID = it->refID;
+              } else {
+                refID = chrs.size();
+              }
             }
-          }
 
-          //eg: PHF13/ENSG00000116273/+/3/6676918/6679862/2944/10/clean
-          oss.at(i) << BEDrec->chrName << "\t" << intronStart << "\t" << intronEnd << "\t" << s_name << "/" << s_ID << "/" << s_clean << "\t0\t" << ((BEDrec->direction) ?  "+" : "-" ) << "\t";
+            //eg: PHF13/ENSG00000116273/+/3/6676918/6679862/2944/10/clean
+            oss << BEDrec->chrName << "\t" << intronStart << "\t" << intronEnd << "\t" << s_name << "/" << s_ID << "/" << s_clean << "\t0\t" << ((BEDrec->direction) ?  "+" : "-" ) << "\t";
 
-          measureDir = BEDrec->direction;
-          if (directionality == -1) {
-            measureDir = !BEDrec->direction;
-          }
-          bool debug = false;
-          // bool debug = (0 == s_ID.compare(0, 23, "ENST00000269305_Intron6"));
-          std::map<unsigned int,unsigned int> hist;
-          if (directionality == 0) {
-            fillHist(hist, refID, BEDrec->blocks, FM, debug);
-          }else{
-            fillHist(hist, refID, BEDrec->blocks, measureDir, FM, debug);
-          }
-          intronTrimmedMean = trimmedMeanFromHist(hist, 40, debug);
-          coverage = coverageFromHist(hist);
-          oss.at(i) << exclBases << "\t"
-            << coverage << "\t"
-            << intronTrimmedMean << "\t"
-            << percentileFromHist(hist, 25) << "\t"
-            << percentileFromHist(hist, 50) << "\t"
-            << percentileFromHist(hist, 75) << "\t";
-
-          if(s_clean.compare(0, 5, "clean") == 0) {
+            measureDir = BEDrec->direction;
+            if (directionality == -1) {
+              measureDir = !BEDrec->direction;
+            }
+            bool debug = false;
+            // bool debug = (0 == s_ID.compare(0, 23, "ENST00000269305_Intron6"));
+            if(use_sweep) {
+              const intron_depth_stats & stat = sweep_stats.at(j);
+              intronTrimmedMean = stat.depth;
+              coverage = stat.coverage;
+              depth25 = stat.depth25;
+              depth50 = stat.depth50;
+              depth75 = stat.depth75;
+              depthFirst50 = stat.depthFirst50;
+              depthLast50 = stat.depthLast50;
+            } else if (directionality == 0) {
+              hist.clear();
+              fillHist(hist, refID, BEDrec->blocks, FM, debug);
+              intronTrimmedMean = trimmedMeanFromHist(hist, 40, debug);
+              coverage = coverageFromHist(hist);
+              depth25 = percentileFromHist(hist, 25);
+              depth50 = percentileFromHist(hist, 50);
+              depth75 = percentileFromHist(hist, 75);
+              hist.clear();
+              fillHist(hist, refID, {{intronStart + 5, intronStart + 55}}, FM);
+              depthFirst50 = trimmedMeanFromHist(hist, 40);
+              hist.clear();
+              fillHist(hist, refID, {{intronEnd - 55, intronEnd - 5}}, FM);
+              depthLast50 = trimmedMeanFromHist(hist, 40);
+            }else{
+              hist.clear();
+              fillHist(hist, refID, BEDrec->blocks, measureDir, FM, debug);
+              intronTrimmedMean = trimmedMeanFromHist(hist, 40, debug);
+              coverage = coverageFromHist(hist);
+              depth25 = percentileFromHist(hist, 25);
+              depth50 = percentileFromHist(hist, 50);
+              depth75 = percentileFromHist(hist, 75);
+              hist.clear();
+              fillHist(hist, refID, {{intronStart + 5, intronStart + 55}}, measureDir, FM);
+              depthFirst50 = trimmedMeanFromHist(hist, 40);
+              hist.clear();
+              fillHist(hist, refID, {{intronEnd - 55, intronEnd - 5}}, measureDir, FM);
+              depthLast50 = trimmedMeanFromHist(hist, 40);
+            }
+            oss << exclBases << "\t"
+              << coverage << "\t"
+              << intronTrimmedMean << "\t"
+              << depth25 << "\t"
+              << depth50 << "\t"
+              << depth75 << "\t";
+
+            if(s_clean.compare(0, 5, "clean") == 0) {
 #ifdef _OPENMP
   #pragma omp atomic
 #endif  
-            ID_clean += intronTrimmedMean;				
-          } else if(s_clean.find(KE) != string::npos) {
+              ID_clean += intronTrimmedMean;				
+            } else if(s_clean.find(KE) != string::npos) {
 #ifdef _OPENMP
   #pragma omp atomic
 #endif  
-            ID_KE += intronTrimmedMean;				
-          } else if(directionality == 0) {
+              ID_KE += intronTrimmedMean;				
+            } else if(directionality == 0) {
 #ifdef _OPENMP
   #pragma omp atomic
 #endif  
-            ID_AS += intronTrimmedMean;				
-          }
+              ID_AS += intronTrimmedMean;				
+            }
 
-          if (directionality != 0) {
-            SPleft = SP.lookup(BEDrec->chrName, intronStart, measureDir);
-            SPright = SP.lookup(BEDrec->chrName, intronEnd, measureDir);
-            oss.at(i) << SPleft << "\t"
-              << SPright << "\t";
-
-            hist.clear();
-            fillHist(hist, refID, {{intronStart + 5, intronStart + 55}}, measureDir, FM);
-            oss.at(i) << trimmedMeanFromHist(hist, 40) << "\t";
-            hist.clear();
-            fillHist(hist, refID, {{intronEnd - 55, intronEnd - 5}}, measureDir, FM);
-            oss.at(i) << trimmedMeanFromHist(hist, 40) << "\t";
-            JCleft = JC.lookupLeft(BEDrec->chrName, intronStart, measureDir);
-            JCright = JC.lookupRight(BEDrec->chrName, intronEnd, measureDir);
-            JCexact = JC.lookup(BEDrec->chrName, intronStart, intronEnd, measureDir);
-            oss.at(i) << JCleft << "\t"
-              << JCright << "\t"
-              << JCexact << "\t";
-          }else{
-            SPleft = SP.lookup(BEDrec->chrName, intronStart);
-            SPright = SP.lookup(BEDrec->chrName, intronEnd);
-            oss.at(i) << SPleft << "\t"
-              << SPright << "\t";			
-
-            hist.clear();
-            fillHist(hist, refID, {{intronStart + 5, intronStart + 55}}, FM);
-            oss.at(i) << trimmedMeanFromHist(hist, 40) << "\t";
-            hist.clear();
-            fillHist(hist, refID, {{intronEnd - 55, intronEnd - 5}}, FM);
-            oss.at(i) << trimmedMeanFromHist(hist, 40) << "\t";
-            JCleft = JC.lookupLeft(BEDrec->chrName, intronStart);
-            JCright = JC.lookupRight(BEDrec->chrName, intronEnd);
-            JCexact = JC.lookup(BEDrec->chrName, intronStart, intronEnd);
-            oss.at(i) << JCleft << "\t"
-              << JCright << "\t"
-              << JCexact << "\t";
-          }
-          if (intronTrimmedMean == 0 && JCleft == 0 && JCright == 0) {
-            oss.at(i) << "0" << "\t";
-          }else if (intronTrimmedMean < 1) {
-            oss.at(i) << ( coverage / (coverage + max(JCleft, JCright)) ) << "\t";
-          }else{
-            oss.at(i) << ( intronTrimmedMean /(intronTrimmedMean + max(JCleft, JCright)) ) << "\t";
-          }
-          
-          // Final column -- don't try to be tri-state. Just say if it is "not ok".
-          // Not ok due to:
-          //	- insufficient spliced depth
-          //  - insufficient exact spliced compared to in-exact spliced depth
-          //  - too much variation between depths & crossings.  ... hmm, but at low depth, high probability of this failing.
-          
-          // Can only make a strong exclude call on spliced depth. Describe on the tool website ways to make a call for IR def true / IR def false.
-  //				if (JCexact < 10 || JCexact*1.33333333 < max(JCleft, JCright) ) {
-  //					oss.at(i) << "-" << "\n";
-  //				}else{
-  //					oss.at(i) << "ok" << "\n";
-  //				}
-
-          if (JCexact + intronTrimmedMean < 10) {
-            oss.at(i) << "LowCover" << "\n";
-          }else if (JCexact < 4) {
-            oss.at(i) << "LowSplicing" << "\n";
-          }else if (JCexact*1.33333333 < max(JCleft, JCright) ) {
-            oss.at(i) << "MinorIsoform" << "\n";
-          // TODO: check, logic below. Crossing should differ by more than 2 & more than 50% before a fault is called.
-          }else if (  (max(SPleft, SPright) > intronTrimmedMean+2 && max(SPleft, SPright) > intronTrimmedMean*1.5 )
-              || (min(SPleft, SPright)+2 < intronTrimmedMean && min(SPleft, SPright)*1.5 < intronTrimmedMean ) ){
-            oss.at(i) << "NonUniformIntronCover" << "\n";
-          }else{
-            oss.at(i) << "-" << "\n";
-          }
+            if (directionality != 0) {
+              SPleft = SP.lookup(refID, intronStart, measureDir);
+              SPright = SP.lookup(refID, intronEnd, measureDir);
+              oss << SPleft << "\t"
+                << SPright << "\t";
+
+              oss << depthFirst50 << "\t";
+              oss << depthLast50 << "\t";
+              JCleft = JC.lookupLeft(refID, intronStart, measureDir);
+              JCright = JC.lookupRight(refID, intronEnd, measureDir);
+              JCexact = JC.lookup(refID, intronStart, intronEnd, measureDir);
+              oss << JCleft << "\t"
+                << JCright << "\t"
+                << JCexact << "\t";
+            }else{
+              SPleft = SP.lookup(refID, intronStart);
+              SPright = SP.lookup(refID, intronEnd);
+              oss << SPleft << "\t"
+                << SPright << "\t";			
+
+              oss << depthFirst50 << "\t";
+              oss << depthLast50 << "\t";
+              JCleft = JC.lookupLeft(refID, intronStart);
+              JCright = JC.lookupRight(refID, intronEnd);
+              JCexact = JC.lookup(refID, intronStart, intronEnd);
+              oss << JCleft << "\t"
+                << JCright << "\t"
+                << JCexact << "\t";
+            }
+            if (intronTrimmedMean == 0 && JCleft == 0 && JCright == 0) {
+              oss << "0" << "\t";
+            }else if (intronTrimmedMean < 1) {
+              oss << ( coverage / (coverage + max(JCleft, JCright)) ) << "\t";
+            }else{
+              oss << ( intronTrimmedMean /(intronTrimmedMean + max(JCleft, JCright)) ) << "\t";
+            }
+            
+            // Final column -- don't try to be tri-state. Just say if it is "not ok".
+            // Not ok due to:
+            //	- insufficient spliced depth
+            //  - insufficient exact spliced compared to in-exact spliced depth
+            //  - too much variation between depths & crossings.  ... hmm, but at low depth, high probability of this failing.
+            
+            // Can only make a strong exclude call on spliced depth. Describe on the tool website ways to make a call for IR def true / IR def false.
+    //				if (JCexact < 10 || JCexact*1.33333333 < max(JCleft, JCright) ) {
+    //					oss << "-" << "\n";
+    //				}else{
+    //					oss << "ok" << "\n";
+    //				}
+
+            if (JCexact + intronTrimmedMean < 10) {
+              oss << "LowCover" << "\n";
+            }else if (JCexact < 4) {
+              oss << "LowSplicing" << "\n";
+            }else if (JCexact*1.33333333 < max(JCleft, JCright) ) {
+              oss << "MinorIsoform" << "\n";
+            // TODO: check, logic below. Crossing should differ by more than 2 & more than 50% before a fault is called.
+            }else if (  (max(SPleft, SPright) > intronTrimmedMean+2 && max(SPleft, SPright) > intronTrimmedMean*1.5 )
+                || (min(SPleft, SPright)+2 < intronTrimmedMean && min(SPleft, SPright)*1.5 < intronTrimmedMean ) ){
+              oss << "NonUniformIntronCover" << "\n";
+            }else{
+              oss << "-" << "\n";
+            }
 
-          
-        }catch (const std::out_of_range& e) {
+            
+          }catch (const std::out_of_range& e) {
           #ifdef RNXTIRF
-            cout << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
+              cout << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
           #else
-            std::cerr << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
+              std::cerr << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
           #endif
-        }catch (const std::invalid_argument& e) {
+          }catch (const std::invalid_argument& e) {
           #ifdef RNXTIRF
-            cout << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
+              cout << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
           #else
-            std::cerr << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
+              std::cerr << "Format error in name attribute - column 4 - of CoverageBlocks reference file. Record/line number: " << j << "\n";
           #endif
+          }
         }
-      }
 
+      }
+      oss.flush();
+    }
+    for(unsigned int i = 0; i < (unsigned int)n_threads; i++) {
+      output.write(thread_text.at(i));
     }
-    
   }
   
-  
 	// for (auto BEDrec : BEDrecords) {
 		// recordNumber++;
 		// if name indicates it is a Dir/Non-dir record of interest - output it.
@@ -505,11 +824,6 @@ int CoverageBlocksIRFinder::WriteOutput(std::string& output, std::string& QC,
 	}
 	
   
-  output.append(oss_title.str());
-  for(unsigned int i = 0; i < (unsigned int)n_threads; i++) {
-    output.append(oss.at(i).str());
-  }
-
 	QC.append(oss_qc.str());
 	
 	return 0;
@@ -517,16 +831,197 @@ int CoverageBlocksIRFinder::WriteOutput(std::string& output, std::string& QC,
 
 // ############################# FRAGMENTS MAP (COV) ###########################
 
+static inline void putVarint(std::vector<uint8_t> &bytes, uint32_t value) {
+  while(value >= 0x80) {
+    bytes.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  bytes.push_back((uint8_t)value);
+}
+
+static inline uint32_t getVarint(const uint8_t * &ptr) {
+  uint32_t value = 0;
+  unsigned int shift = 0;
+  while(*ptr & 0x80) {
+    value |= (uint32_t)(*ptr & 0x7F) << shift;
+    shift += 7;
+    ptr++;
+  }
+  value |= (uint32_t)(*ptr) << shift;
+  ptr++;
+  return value;
+}
+
+void PackedDiffTrack::appendSegment(const std::vector< std::pair<unsigned int, int> > &sorted_diffs) {
+  if(sorted_diffs.size() == 0) return;
+  segment_starts.push_back(bytes.size());
+  putVarint(bytes, sorted_diffs.size());
+  unsigned int last_pos = 0;
+  for(auto it = sorted_diffs.begin(); it != sorted_diffs.end(); it++) {
+    putVarint(bytes, it->first - last_pos);
+    // zigzag encoding
+    putVarint(bytes, ((uint32_t)it->second << 1) ^ (uint32_t)(it->second >> 31));
+    last_pos = it->first;
+  }
+  n_entries += sorted_diffs.size();
+}
+
+void PackedDiffTrack::append(const PackedDiffTrack &other) {
+  size_t offset = bytes.size();
+  bytes.insert(bytes.end(), other.bytes.begin(), other.bytes.end());
+  for(auto seg : other.segment_starts) {
+    segment_starts.push_back(seg + offset);
+  }
+  n_entries += other.n_entries;
+}
+
+// Appends all segments to dest, in order of storage
+void PackedDiffTrack::decode(std::vector< std::pair<unsigned int, int> > &dest) const {
+  dest.reserve(dest.size() + n_entries);
+  for(auto seg : segment_starts) {
+    const uint8_t * ptr = bytes.data() + seg;
+    uint32_t n = getVarint(ptr);
+    unsigned int pos = 0;
+    for(uint32_t k = 0; k < n; k++) {
+      pos += getVarint(ptr);
+      uint32_t zz = getVarint(ptr);
+      dest.push_back(std::make_pair(pos, (int)(zz >> 1) ^ -(int)(zz & 1)));
+    }
+  }
+}
+
+// Linear merge of two sorted diff runs; differences at the same position are summed
+static void mergeDiffRuns(
+    const std::vector< std::pair<unsigned int, int> > &a,
+    const std::vector< std::pair<unsigned int, int> > &b,
+    std::vector< std::pair<unsigned int, int> > &dest
+) {
+  dest.resize(0);
+  dest.reserve(a.size() + b.size());
+  auto it_a = a.begin();
+  auto it_b = b.begin();
+  while(it_a != a.end() || it_b != b.end()) {
+    std::pair<unsigned int, int> next;
+    if(it_b == b.end() || (it_a != a.end() && it_a->first < it_b->first)) {
+      next = *it_a++;
+    } else if(it_a == a.end() || it_b->first < it_a->first) {
+      next = *it_b++;
+    } else {
+      next = std::make_pair(it_a->first, it_a->second + it_b->second);
+      it_a++; it_b++;
+    }
+    if(dest.size() > 0 && dest.back().first == next.first) {
+      dest.back().second += next.second;
+    } else {
+      dest.push_back(next);
+    }
+  }
+}
+
+// Decodes all segments into a single sorted run, by pairwise merging of the sorted segments
+void PackedDiffTrack::decodeSorted(std::vector< std::pair<unsigned int, int> > &dest) const {
+  if(segment_starts.size() <= 1) {
+    decode(dest);
+    return;
+  }
+  std::vector< std::vector< std::pair<unsigned int, int> > > runs(segment_starts.size());
+  for(unsigned int k = 0; k < segment_starts.size(); k++) {
+    const uint8_t * ptr = bytes.data() + segment_starts.at(k);
+    uint32_t n = getVarint(ptr);
+    runs.at(k).reserve(n);
+    unsigned int pos = 0;
+    for(uint32_t m = 0; m < n; m++) {
+      pos += getVarint(ptr);
+      uint32_t zz = getVarint(ptr);
+      runs.at(k).push_back(std::make_pair(pos, (int)(zz >> 1) ^ -(int)(zz & 1)));
+    }
+  }
+  std::vector< std::pair<unsigned int, int> > merged;
+  while(runs.size() > 1) {
+    std::vector< std::vector< std::pair<unsigned int, int> > > next_runs;
+    for(unsigned int k = 0; k + 1 < runs.size(); k += 2) {
+      mergeDiffRuns(runs.at(k), runs.at(k+1), merged);
+      next_runs.push_back(std::vector< std::pair<unsigned int, int> >());
+      next_runs.back().swap(merged);
+    }
+    if(runs.size() % 2 == 1) {
+      next_runs.push_back(std::vector< std::pair<unsigned int, int> >());
+      next_runs.back().swap(runs.back());
+    }
+    runs.swap(next_runs);
+  }
+  if(dest.size() == 0) {
+    dest.swap(runs.at(0));
+  } else {
+    dest.insert(dest.end(), runs.at(0).begin(), runs.at(0).end());
+  }
+}
+
+// Re-encodes as a single sorted segment
+void PackedDiffTrack::compact() {
+  if(segment_starts.size() <= 1) return;
+  std::vector< std::pair<unsigned int, int> > sorted_diffs;
+  decodeSorted(sorted_diffs);
+  clear();
+  appendSegment(sorted_diffs);
+}
+
+// Takes over the segments of other, merging them with this track's
+void PackedDiffTrack::mergeWith(PackedDiffTrack &other) {
+  append(other);
+  other.clear();
+  compact();
+}
+
+void PackedDiffTrack::clear() {
+  std::vector<uint8_t>().swap(bytes);
+  std::vector<size_t>().swap(segment_starts);
+  n_entries = 0;
+}
+
+// Number of entries, segment offsets, then the encoded bytes
+void PackedDiffTrack::WriteBinary(std::string &buf) const {
+  std::vector<uint64_t> starts(segment_starts.begin(), segment_starts.end());
+  refBinaryWriter::Append(buf, (uint64_t)n_entries);
+  refBinaryWriter::Append(buf, (uint64_t)starts.size());
+  refBinaryWriter::AppendArray(buf, starts);
+  refBinaryWriter::Append(buf, (uint64_t)bytes.size());
+  refBinaryWriter::AppendArray(buf, bytes);
+}
+
+int PackedDiffTrack::ReadBinary(refBinarySection &sec) {
+  clear();
+  std::vector<uint64_t> starts;
+  uint64_t n = sec.Read<uint64_t>();
+  sec.ReadArray(starts, sec.Read<uint64_t>());
+  sec.ReadArray(bytes, sec.Read<uint64_t>());
+  bool valid = !sec.fail();
+  for(auto start : starts) {
+    if(start >= bytes.size()) valid = false;
+  }
+  if(!valid) {
+    clear();
+    return(-1);
+  }
+  segment_starts.assign(starts.begin(), starts.end());
+  n_entries = n;
+  return(0);
+}
+
 void FragmentsMap::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
   std::vector< std::pair<unsigned int, int> > empty_vector;
   empty_vector.push_back(std::make_pair (0,0));
   for(unsigned int j = 0; j < 3; j++) {   
     chrName_vec_final[j].resize(0);
+    for (unsigned int i = 0; i < chrmap.size(); i++) {
+      chrName_vec_final[j].push_back(empty_vector);
+    }
+  }
+  for(unsigned int j = 0; j < 2; j++) {   
     chrName_vec_new[j].resize(0);
     temp_chrName_vec_new[j].resize(0);
+    chrName_vec_new[j].resize(chrmap.size());
     for (unsigned int i = 0; i < chrmap.size(); i++) {
-      chrName_vec_final[j].push_back(empty_vector);
-      chrName_vec_new[j].push_back(empty_vector);
       temp_chrName_vec_new[j].push_back(empty_vector);
     }
   }
@@ -540,39 +1035,35 @@ void FragmentsMap::ProcessBlocks(const FragmentBlocks &blocks) {
   for (int index = 0; index < blocks.readCount; index ++) {
     //Walk each block within each read.
     for (unsigned int j = 0; j < blocks.rLens[index].size(); j++) {
-      // Stranded 
+      // Stranded only; unstranded is the sum of both strands
       (temp_chrName_vec_new[blocks.direction].at(blocks.chr_id)).push_back(std::make_pair( blocks.readStart[index] + blocks.rStarts[index][j], 1));
       (temp_chrName_vec_new[blocks.direction].at(blocks.chr_id)).push_back(std::make_pair( blocks.readStart[index] + blocks.rStarts[index][j] + blocks.rLens[index][j], -1));
-
-      // Unstranded 
-      (temp_chrName_vec_new[2].at(blocks.chr_id)).push_back(std::make_pair( blocks.readStart[index] + blocks.rStarts[index][j], 1));
-      (temp_chrName_vec_new[2].at(blocks.chr_id)).push_back(std::make_pair( blocks.readStart[index] + blocks.rStarts[index][j] + blocks.rLens[index][j], -1));
     }
   }
   frag_count += 1;
-  if(frag_count % 1000000 == 0) {
+  if(frag_count % collapse_interval == 0) {
     sort_and_collapse_temp();
   }
 }
 
-// Temporarily sorts the nested vector to reduce memory use; occurs every 1M reads
+// Temporarily sorts the nested vector to reduce memory use; occurs every collapse_interval reads
 int FragmentsMap::sort_and_collapse_temp() {
-  // Sort temp vectors and append to final:
-  for(unsigned int j = 0; j < 3; j++) {
+  // Sort temp vectors and append to packed tracks:
+  std::vector< std::pair<unsigned int, int> > collapsed;
+  for(unsigned int j = 0; j < 2; j++) {
     unsigned int refID = 0;
     for (auto itChr=temp_chrName_vec_new[j].begin(); itChr!=temp_chrName_vec_new[j].end(); itChr++) {
       // sort
       if(itChr->size() > 0) {
-        std::sort(
-          itChr->begin(),
-          itChr->end()
-        );
+        // Order of events at the same position does not matter as they are summed
+        radix_sort_events(*itChr);
 
+        collapsed.resize(0);
         unsigned int loci = 0;
         int accum = 0;
         for(auto it_pos = itChr->begin(); it_pos != itChr->end(); it_pos++) {
           if(it_pos->first != loci) {
-            if(accum != 0) chrName_vec_new[j].at(refID).push_back( std::make_pair(loci, accum) );
+            if(accum != 0) collapsed.push_back( std::make_pair(loci, accum) );
             loci = it_pos->first;
             accum = it_pos->second;
           } else {
@@ -580,7 +1071,8 @@ int FragmentsMap::sort_and_collapse_temp() {
           }
         }
         // final push
-        chrName_vec_new[j].at(refID).push_back( std::make_pair(loci, accum) );
+        collapsed.push_back( std::make_pair(loci, accum) );
+        chrName_vec_new[j].at(refID).appendSegment(collapsed);
 
         // Clear temporary vector by swap trick
         // empty swap vector
@@ -593,6 +1085,24 @@ int FragmentsMap::sort_and_collapse_temp() {
   return(0);
 }
 
+size_t FragmentsMap::MemoryUsage() const {
+  size_t bytes = 0;
+  for(unsigned int j = 0; j < 3; j++) {
+    for(auto it = chrName_vec_final[j].begin(); it != chrName_vec_final[j].end(); it++) {
+      bytes += it->capacity() * sizeof(std::pair<unsigned int, int>);
+    }
+  }
+  for(unsigned int j = 0; j < 2; j++) {
+    for(auto it = chrName_vec_new[j].begin(); it != chrName_vec_new[j].end(); it++) {
+      bytes += it->bytesHeld();
+    }
+    for(auto it = temp_chrName_vec_new[j].begin(); it != temp_chrName_vec_new[j].end(); it++) {
+      bytes += it->capacity() * sizeof(std::pair<unsigned int, int>);
+    }
+  }
+  return(bytes);
+}
+
 // Final sorting. Also converts from loci/diff to loci/depth
 int FragmentsMap::sort_and_collapse_final(bool verbose) {
   if(!final_is_sorted) {
@@ -602,18 +1112,17 @@ int FragmentsMap::sort_and_collapse_final(bool verbose) {
 #ifdef _OPENMP
       #pragma omp parallel for
 #endif
-    for(unsigned int k = 0; k < 3 * chrs.size(); k++) {
+    for(unsigned int k = 0; k < 2 * chrs.size(); k++) {
       unsigned int j = k / chrs.size();
       unsigned int i = k - (j * chrs.size());
       
-        auto itChr = &chrName_vec_new[j].at(i);
+        std::vector< std::pair<unsigned int, int> > diffs;
+        // Segments are individually sorted, so merge rather than sort
+        chrName_vec_new[j].at(i).decodeSorted(diffs);
+        chrName_vec_new[j].at(i).clear();
+        auto itChr = &diffs;
         auto itDest = &chrName_vec_final[j].at(i);
         itDest->resize(0);
-        // sort
-        std::sort(
-          itChr->begin(),
-          itChr->end()
-        );
         
         // Progressors
         unsigned int   loci = 0;       // Current genomic coordinate
@@ -641,8 +1150,42 @@ int FragmentsMap::sort_and_collapse_final(bool verbose) {
         if(depth != old_depth) {
           itDest->push_back( std::make_pair(loci, depth) );
         }
-        itChr->clear();
-        
+    }
+
+    // Unstranded depth is the sum of the two stranded depth runs
+#ifdef _OPENMP
+      #pragma omp parallel for
+#endif
+    for(unsigned int i = 0; i < chrs.size(); i++) {
+      const std::vector< std::pair<unsigned int, int> > & neg = chrName_vec_final[0].at(i);
+      const std::vector< std::pair<unsigned int, int> > & pos = chrName_vec_final[1].at(i);
+      auto itDest = &chrName_vec_final[2].at(i);
+      itDest->resize(0);
+      itDest->reserve(neg.size() + pos.size());
+      
+      auto it_neg = neg.begin();
+      auto it_pos = pos.begin();
+      int depth_neg = 0;
+      int depth_pos = 0;
+      while(it_neg != neg.end() || it_pos != pos.end()) {
+        unsigned int loci;
+        if(it_pos == pos.end() || (it_neg != neg.end() && it_neg->first < it_pos->first)) {
+          loci = it_neg->first;
+        } else {
+          loci = it_pos->first;
+        }
+        if(it_neg != neg.end() && it_neg->first == loci) {
+          depth_neg = it_neg->second;
+          it_neg++;
+        }
+        if(it_pos != pos.end() && it_pos->first == loci) {
+          depth_pos = it_pos->second;
+          it_pos++;
+        }
+        if(itDest->size() == 0 || itDest->back().second != depth_neg + depth_pos) {
+          itDest->push_back( std::make_pair(loci, depth_neg + depth_pos) );
+        }
+      }
     }
     final_is_sorted = true;
   }
@@ -653,10 +1196,10 @@ void FragmentsMap::Combine(FragmentsMap &child) {
   sort_and_collapse_temp();
   child.sort_and_collapse_temp();
   if(!final_is_sorted && !child.final_is_sorted) {
-    for(unsigned int j = 0; j < 3; j++) {
+    for(unsigned int j = 0; j < 2; j++) {
       for(unsigned int i = 0; i < chrs.size(); i++) {
-        chrName_vec_new[j].at(i).insert(chrName_vec_new[j].at(i).end(),
-          child.chrName_vec_new[j].at(i).begin(), child.chrName_vec_new[j].at(i).end());
+        chrName_vec_new[j].at(i).append(child.chrName_vec_new[j].at(i));
+        child.chrName_vec_new[j].at(i).clear();
       }
     }
   } else if(final_is_sorted && child.final_is_sorted) {
@@ -670,12 +1213,59 @@ void FragmentsMap::Combine(FragmentsMap &child) {
   }
 }
 
+// Tree-reduction combine: pairs of maps are merged in parallel, halving the number of maps each round
+void FragmentsMap::Combine(std::vector<FragmentsMap*> &FM_list, unsigned int n_threads) {
+  std::vector<FragmentsMap*> nodes;
+  nodes.push_back(this);
+  for(auto FM : FM_list) {
+    if(FM != this) nodes.push_back(FM);
+  }
+  if(n_threads < 1) n_threads = 1;
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+#endif
+  for(unsigned int k = 0; k < nodes.size(); k++) {
+    nodes.at(k)->sort_and_collapse_temp();
+  }
+  
+  for(auto FM : nodes) {
+    if(FM->final_is_sorted) {
+      // Not the incremental case; combine serially
+      for(unsigned int k = 1; k < nodes.size(); k++) {
+        Combine(*nodes.at(k));
+      }
+      return;
+    }
+  }
+
+  unsigned int n_chrs = chrs.size();
+  for(unsigned int step = 1; step < nodes.size(); step *= 2) {
+    std::vector<unsigned int> pairs;
+    for(unsigned int k = 0; k + step < nodes.size(); k += 2 * step) {
+      pairs.push_back(k);
+    }
+    // Merge every strand, every chromosome of every pair independently
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads) schedule(dynamic,1)
+#endif
+    for(unsigned int t = 0; t < pairs.size() * 2 * n_chrs; t++) {
+      unsigned int k = pairs.at(t / (2 * n_chrs));
+      unsigned int j = (t / n_chrs) % 2;
+      unsigned int i = t % n_chrs;
+      nodes.at(k)->chrName_vec_new[j].at(i).mergeWith(
+        nodes.at(k + step)->chrName_vec_new[j].at(i)
+      );
+    }
+  }
+}
+
 // updateCoverageHist from completed FragmentMap - directional:
-void FragmentsMap::updateCoverageHist(std::map<unsigned int,unsigned int> &hist, unsigned int start, unsigned int end, unsigned int dir, const unsigned int &refID, bool debug) const {
+void FragmentsMap::updateCoverageHist(CoverageHist &hist, unsigned int start, unsigned int end, unsigned int dir, const unsigned int &refID, bool debug) const {
   (void)(debug);
   
   if(refID >= chrName_vec_final[dir].size()) {
-    hist.insert({0,0});
+    hist.add(0, 0);
     return;
   }
   
@@ -688,29 +1278,14 @@ void FragmentsMap::updateCoverageHist(std::map<unsigned int,unsigned int> &hist,
         return a.first < b.first; 
       }
   );
-  
-  if(it_pos == it_chr->end()) {
-    // No coverage data
-    hist[0] += end - start;
-    return;
-  }
-  while(it_pos->first > start && it_pos != it_chr->begin()) {
-    it_pos--; // shouldn't matter as the first vector pair should be at coord zero
-  }
-  int depth = it_pos->second;
-  unsigned int cursor = start;
-  while(cursor < end) {
-    while(it_pos->first <= cursor && it_pos != it_chr->end()) {
-      it_pos++;
-    }
-    if(it_pos == it_chr->end()) {
-      hist[(unsigned int)depth] += end - cursor;
-      break;
-    }
-    hist[(unsigned int)depth] += min(it_pos->first, end) - cursor;
-    cursor = it_pos->first;
-    depth = it_pos->second;
-  }
+  walkDepthRuns(hist, *it_chr, it_pos, start, end);
+}
+
+const std::vector< std::pair<unsigned int, int> > * FragmentsMap::getDepthRuns(
+    unsigned int dir, const unsigned int &refID
+) const {
+  if(refID >= chrName_vec_final[dir].size()) return(NULL);
+  return(&chrName_vec_final[dir].at(refID));
 }
 
 int FragmentsMap::WriteBinary(
@@ -724,8 +1299,20 @@ int FragmentsMap::WriteBinary(
 
   os->InitializeCOV(chrs);
 
+  // Stream each batch of chromosomes to disk once compressed, so that only
+  //   a few chromosomes' compressed blocks are held in memory at a time
+  std::vector<size_t> rle_sizes;
+  for(unsigned int j = 0; j < 3; j++) {
+    for(unsigned int i = 0; i < chrs.size(); i++) {
+      rle_sizes.push_back(chrName_vec_final[j].at(chrs[i].refID).size());
+    }
+  }
+  os->BeginStream(rle_sizes, n_threads_to_use);   // stays buffered if not seekable
+
 #ifdef RNXTIRF
-  Progress p(3 * chrs.size(), verbose);
+  // Only create when displayed: RcppProgress uses a global monitor, which
+  //   is not safe to replace while other samples are running
+  Progress * p = verbose ? new Progress(3 * chrs.size(), verbose) : NULL;
 #endif
   for(unsigned int j = 0; j < 3; j++) {
     for(unsigned int i = 0; i < chrs.size(); i++) {
@@ -736,15 +1323,133 @@ int FragmentsMap::WriteBinary(
       
       os->WriteFragmentsMap(itDest, i, j, n_threads_to_use);
 #ifdef RNXTIRF
-      p.increment(1);
+      if(p) p->increment(1);
 #endif
     }
   }
+#ifdef RNXTIRF
+  delete p;
+#endif
   
   os->WriteToFile();
   return(0);
 }
 
+int FragmentsMap::LoadBinary(covReader *is, unsigned int n_threads_to_use) {
+  std::vector<chr_entry> cov_chrs;
+  is->GetChrs(cov_chrs);
+  if(cov_chrs.size() > chrs.size()) return(-1);
+
+  // One strand at a time, to limit the decoded runs held at once
+  for(unsigned int j = 0; j < 3; j++) {
+    std::vector<cov_region> regions;
+    for(unsigned int i = 0; i < cov_chrs.size(); i++) {
+      regions.push_back(cov_region(cov_chrs.at(i).chr_name, 0, cov_chrs.at(i).chr_len, j));
+    }
+    std::vector< std::vector<int> > values;
+    std::vector< std::vector<unsigned int> > lengths;
+    if(is->FetchRLEBatch(regions, values, lengths, n_threads_to_use) != 0) return(-1);
+
+    for(unsigned int i = 0; i < cov_chrs.size(); i++) {
+      std::vector< std::pair<unsigned int, int> > & dest = chrName_vec_final[j].at(chrs[i].refID);
+      dest.resize(0);
+      unsigned int loci = 0;
+      for(unsigned int k = 0; k < values.at(i).size(); k++) {
+        if(dest.size() == 0 || dest.back().second != values.at(i).at(k)) {
+          dest.push_back(std::make_pair(loci, values.at(i).at(k)));
+        }
+        loci += lengths.at(i).at(k);
+      }
+      if(dest.size() == 0) dest.push_back(std::make_pair(0, 0));
+    }
+  }
+  final_is_sorted = true;
+  return(0);
+}
+
+// ############################# SPAN DEPTH MAP #################################
+
+void SpanDepthMap::setSpanLength(unsigned int overhang_left, unsigned int overhang_right) {
+  overhangLeft = overhang_left;
+  overhangRight = overhang_right;
+}
+
+void SpanDepthMap::ProcessBlocks(const FragmentBlocks &blocks) {
+  for (int index = 0; index < blocks.readCount; index ++) {
+    for (unsigned int j = 0; j < blocks.rLens[index].size(); j++) {
+      // As in SpansPoint::ProcessBlocks, a block long enough to overhang a point
+      //   counts the points within [start + overhangLeft, end)
+      if(blocks.rLens[index][j] > (int)(overhangLeft + overhangRight)) {
+        unsigned int block_start = blocks.readStart[index] + blocks.rStarts[index][j];
+        unsigned int block_end = block_start + blocks.rLens[index][j];
+        (temp_chrName_vec_new[blocks.direction].at(blocks.chr_id)).push_back(std::make_pair( block_start + overhangLeft, 1));
+        (temp_chrName_vec_new[blocks.direction].at(blocks.chr_id)).push_back(std::make_pair( block_end, -1));
+      }
+    }
+  }
+  frag_count += 1;
+  if(frag_count % collapse_interval == 0) {
+    sort_and_collapse_temp();
+  }
+}
+
+// Must be run after sort_and_collapse_final. Each chromosome's depth runs are
+//   stored as a PackedDiffTrack of depth changes
+void SpanDepthMap::WriteSidecar(refBinaryWriter &out) const {
+  std::string & buf = out.NewSection(REF_SIDECAR_SPANS);
+  refBinaryWriter::Append(buf, (uint32_t)overhangLeft);
+  refBinaryWriter::Append(buf, (uint32_t)overhangRight);
+  refBinaryWriter::Append(buf, (uint64_t)chrs.size());
+  std::vector< std::pair<unsigned int, int> > diffs;
+  for(unsigned int i = 0; i < chrs.size(); i++) {
+    refBinaryWriter::Append(buf, out.AddString(chrs[i].chr_name));
+    for(unsigned int j = 0; j < 2; j++) {
+      diffs.resize(0);
+      int depth = 0;
+      for(auto & run : chrName_vec_final[j].at(chrs[i].refID)) {
+        if(run.second != depth) diffs.push_back(std::make_pair(run.first, run.second - depth));
+        depth = run.second;
+      }
+      PackedDiffTrack track;
+      track.appendSegment(diffs);
+      track.WriteBinary(buf);
+    }
+  }
+}
+
+int SpanDepthMap::LoadSidecar(const refBinaryReader &in, SpansPoint &SP) {
+  refBinarySection sec = in.GetSection(REF_SIDECAR_SPANS);
+  uint32_t overhang_left = sec.Read<uint32_t>();
+  uint32_t overhang_right = sec.Read<uint32_t>();
+  if(sec.fail()) return(-1);
+  if(overhang_left != SP.getOverhangLeft() || overhang_right != SP.getOverhangRight()) {
+    cout << "Sidecar span overhangs (" << overhang_left << ", " << overhang_right 
+      << ") do not match those of the reference\n";
+    return(-1);
+  }
+  uint64_t n_chr = sec.Read<uint64_t>();
+  std::vector< std::pair<unsigned int, int> > diffs;
+  std::vector< std::pair<unsigned int, int> > runs;
+  for(uint64_t i = 0; i < n_chr && !sec.fail(); i++) {
+    std::string chrName = in.GetString(sec.Read<uint32_t>());
+    for(unsigned int j = 0; j < 2; j++) {
+      PackedDiffTrack track;
+      if(track.ReadBinary(sec) != 0) return(-1);
+      diffs.resize(0);
+      track.decode(diffs);
+      runs.resize(0);
+      int depth = 0;
+      for(auto & diff : diffs) {
+        depth += diff.second;
+        runs.push_back(std::make_pair(diff.first, depth));
+      }
+      SP.SetCountsFromDepth(chrName, j, runs);
+    }
+  }
+  if(sec.fail()) return(-1);
+  return(0);
+}
+
 int FragmentsMap::WriteOutput(std::ostream *os, 
     int threshold, bool verbose)  {
 
@@ -803,3 +1508,72 @@ int FragmentsMap::WriteOutput(std::ostream *os,
   }
   return 0;
 }
+
+void MappabilityDepthMap::SetThreshold(int _threshold) {
+  threshold = _threshold;
+  cap = (uint8_t)std::max(0, std::min(threshold, max_threshold) + 1);
+}
+
+void MappabilityDepthMap::ChrMapUpdate(const std::vector<chr_entry> &chrmap) {
+  if(chrs.size() > 0) return;
+  for (unsigned int i = 0; i < chrmap.size(); i++) {
+    chrs.push_back(chrmap.at(i));
+  }
+  unsigned int max_refID = 0;
+  for(auto & chr : chrs) max_refID = std::max(max_refID, chr.refID + 1);
+  depth.resize(max_refID);
+  for(auto & chr : chrs) {
+    // Value-initialised, ie all zero
+    depth.at(chr.refID) = std::vector< std::atomic<uint8_t> >(
+      (size_t)std::max(chr.chr_len, (int32_t)0));
+  }
+}
+
+void MappabilityDepthMap::ProcessBlocks(const FragmentBlocks &blocks) {
+  if(blocks.chr_id >= depth.size()) return;
+  std::vector< std::atomic<uint8_t> > & chr_depth = depth[blocks.chr_id];
+  const size_t chr_len = chr_depth.size();
+  for (int index = 0; index < blocks.readCount; index ++) {
+    for (unsigned int j = 0; j < blocks.rLens[index].size(); j++) {
+      size_t start = (size_t)blocks.readStart[index] + blocks.rStarts[index][j];
+      size_t end = std::min(start + blocks.rLens[index][j], chr_len);
+      for(size_t pos = start; pos < end; pos++) {
+        // Saturated counters are only read, so heavily covered bases cost no writes
+        uint8_t d = chr_depth[pos].load(std::memory_order_relaxed);
+        while(d < cap && !chr_depth[pos].compare_exchange_weak(
+            d, (uint8_t)(d + 1), std::memory_order_relaxed)) {}
+      }
+    }
+  }
+}
+
+size_t MappabilityDepthMap::MemoryUsage() const {
+  size_t bytes = 0;
+  for(auto & chr_depth : depth) {
+    bytes += chr_depth.capacity() * sizeof(std::atomic<uint8_t>);
+  }
+  return(bytes);
+}
+
+int MappabilityDepthMap::WriteOutput(std::ostream *os, bool verbose) const {
+  if(verbose)  cout << "Writing Mappability Exclusions\n";
+#ifdef RNXTIRF
+  Progress p(chrs.size(), verbose);
+#endif
+  for(unsigned int i = 0; i < chrs.size(); i++) {
+    const std::vector< std::atomic<uint8_t> > & chr_depth = depth.at(chrs[i].refID);
+    const size_t chr_len = chr_depth.size();
+    size_t pos = 0;
+    while(pos < chr_len) {
+      while(pos < chr_len && chr_depth[pos].load(std::memory_order_relaxed) > threshold) pos++;
+      if(pos == chr_len) break;
+      size_t low_start = pos;
+      while(pos < chr_len && chr_depth[pos].load(std::memory_order_relaxed) <= threshold) pos++;
+      *os << chrs[i].chr_name << "\t" << low_start << "\t" << pos << "\n";
+    }
+#ifdef RNXTIRF
+    p.increment(1);
+#endif
+  }
+  return 0;
+}
@@ -32,6 +32,7 @@ SOFTWARE.  */
 #include "ReadBlockProcessor.h"
 #include "covTools.h"
 #include "FragmentBlocks.h"
+#include <atomic>     // MappabilityDepthMap counters
 
 #include "IRFinder_Rcpp.h"
 
@@ -49,15 +50,73 @@ struct BEDrecord {
 	std::vector<std::pair<unsigned int,unsigned int>> blocks;
 };
 
+// Depth histogram for coverage statistics. Low depths are counted in a dense
+// array; deeper positions go to an overflow list that is collapsed on finalize.
+// Reuse a single object per thread: clear() only resets the bins touched.
+class CoverageHist {
+private:
+  static const unsigned int dense_size = 1024;
+  std::vector<unsigned int> dense_count;
+  std::vector<char> dense_present;
+  std::vector<unsigned int> dense_touched;
+  std::vector< std::pair<unsigned int, unsigned int> > overflow;
+  
+  // Finalized sorted bins: depth, count
+  std::vector< std::pair<unsigned int, unsigned int> > bins;
+  unsigned int size = 0;
+  bool finalized = true;
+public:
+  CoverageHist() : dense_count(dense_size, 0), dense_present(dense_size, 0) {};
+  void clear();
+  void add(unsigned int depth, unsigned int count);
+  void finalize();
+
+  const std::vector< std::pair<unsigned int, unsigned int> > & Bins() const { return bins; };
+  unsigned int Size() const { return size; };
+  
+  double mean() const;
+  double coverage() const;
+  double percentile(unsigned int percentile) const;
+  double trimmedMean(unsigned int centerPercent, bool debug = false) const;
+};
+
+// Compact store of collapsed (position, depth difference) runs.
+// Each appended segment is sorted by position; positions are stored as varint
+// deltas and depth differences as zigzag varints (1 byte for |diff| < 64).
+class PackedDiffTrack {
+private:
+  std::vector<uint8_t> bytes;
+  std::vector<size_t> segment_starts;
+  size_t n_entries = 0;
+public:
+  void appendSegment(const std::vector< std::pair<unsigned int, int> > &sorted_diffs);
+  void append(const PackedDiffTrack &other);
+  void decode(std::vector< std::pair<unsigned int, int> > &dest) const;
+  void decodeSorted(std::vector< std::pair<unsigned int, int> > &dest) const;
+  void compact();
+  void mergeWith(PackedDiffTrack &other);
+  void clear();
+  // Appends the track to buf (as a refBinaryWriter section), or reads it back
+  void WriteBinary(std::string &buf) const;
+  int ReadBinary(refBinarySection &sec);
+
+  size_t size() const { return n_entries; };
+  size_t segments() const { return segment_starts.size(); };
+  size_t bytesUsed() const { return bytes.size(); };
+  size_t bytesHeld() const { return bytes.capacity() + segment_starts.capacity() * sizeof(size_t); };
+};
+
 class FragmentsMap : public ReadBlockProcessor {
   // Counts mappability.
-private:
+protected:
   // 0 = -, 1 = +, 2 = both
+  // Only final stores the unstranded track, derived from the stranded tracks during final sort
   std::vector< std::vector< std::pair<unsigned int, int> > > chrName_vec_final[3];
-  std::vector< std::vector< std::pair<unsigned int, int> > > chrName_vec_new[3];
-  std::vector< std::vector< std::pair<unsigned int, int> > > temp_chrName_vec_new[3];
+  std::vector< PackedDiffTrack > chrName_vec_new[2];
+  std::vector< std::vector< std::pair<unsigned int, int> > > temp_chrName_vec_new[2];
 
   uint32_t frag_count = 0;
+  uint32_t collapse_interval = 1000000;   // fragments between sort_and_collapse_temp()
 	int sort_and_collapse_temp();
 
 	bool final_is_sorted = false;
@@ -65,15 +124,67 @@ private:
   vector<chr_entry> chrs;
 public:
 	void Combine(FragmentsMap &child);
+	void Combine(std::vector<FragmentsMap*> &FM_list, unsigned int n_threads = 1);
 	
   int sort_and_collapse_final(bool verbose);
+  size_t MemoryUsage() const;   // Bytes allocated to coverage data
+  // Collapsing more often keeps fewer unsorted events (see IRF_memory_plan)
+  void SetCollapseInterval(uint32_t n_fragments) { collapse_interval = std::max(n_fragments, (uint32_t)1); };
 
   void ProcessBlocks(const FragmentBlocks &blocks);
   void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
   int WriteOutput(std::ostream *os, int threshold = 4, bool verbose = false) ;
   int WriteBinary(covWriter *os, bool verbose = false, unsigned int n_threads_to_use = 1) ;
+  // Reads the depth back from a COV file written by WriteBinary (after ChrMapUpdate,
+  //   whose refIDs must follow the order of the COV's chromosomes, as from IRF_MatchChrs)
+  int LoadBinary(covReader *is, unsigned int n_threads_to_use = 1);
   
-  void updateCoverageHist(std::map<unsigned int,unsigned int> &hist, unsigned int start, unsigned int end, unsigned int dir, const unsigned int &refID, bool debug = false) const;
+  const std::vector< std::pair<unsigned int, int> > * getDepthRuns(unsigned int dir, const unsigned int &refID) const;
+  void updateCoverageHist(CoverageHist &hist, unsigned int start, unsigned int end, unsigned int dir, const unsigned int &refID, bool debug = false) const;
+};
+
+// Depth of read blocks, each trimmed by the SpansPoint overhangs, so that the
+//   depth at a position is the count SpansPoint gives a point there.
+// Saved by IRF_core in the sidecar, from which the SpansPoint counts of any 
+//   reference can be rebuilt without the BAM file.
+class SpanDepthMap : public FragmentsMap {
+private:
+  unsigned int overhangLeft = 0;
+  unsigned int overhangRight = 0;
+public:
+  void setSpanLength(unsigned int overhang_left, unsigned int overhang_right);
+  void ProcessBlocks(const FragmentBlocks &blocks);
+
+  // Per stranded depth track: overhangs, then the depth runs of each chromosome
+  void WriteSidecar(refBinaryWriter &out) const;
+  // Sets the counts of SP from a sidecar; the overhangs must match those of SP
+  static int LoadSidecar(const refBinaryReader &in, SpansPoint &SP);
+};
+
+// Unstranded depth of every base, as dense per-chromosome arrays of 8-bit
+//   saturating counters, for mappability. Each counter stops at threshold + 1,
+//   which is all WriteOutput needs to find the low mappability regions.
+// Unlike FragmentsMap, one object is shared by all threads (counters are
+//   updated with relaxed atomics), so there is nothing to combine or sort, and
+//   memory use is one byte per base regardless of the number of reads.
+class MappabilityDepthMap : public ReadBlockProcessor {
+private:
+  std::vector< std::vector< std::atomic<uint8_t> > > depth;   // by refID
+  vector<chr_entry> chrs;
+  int threshold = 4;
+  uint8_t cap = 5;
+public:
+  // Thresholds above this need FragmentsMap
+  static const int max_threshold = 254;
+  // Must be set before processing
+  void SetThreshold(int _threshold);
+
+  void ProcessBlocks(const FragmentBlocks &blocks);
+  // Called by every BAM2blocks sharing this object; only the first call allocates
+  void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
+  size_t MemoryUsage() const;
+  // Writes regions of depth <= threshold in BED format, as FragmentsMap::WriteOutput
+  int WriteOutput(std::ostream *os, bool verbose = false) const;
 };
 
 class CoverageBlocks : public ReadBlockProcessor {
@@ -91,29 +202,53 @@ class CoverageBlocks : public ReadBlockProcessor {
 
   
 	protected:
-		std::vector<BEDrecord> BEDrecords;
+		// Read-only reference, shared between copies (eg: one per thread)
+		std::shared_ptr<const std::vector<BEDrecord>> BEDrecords = std::make_shared<const std::vector<BEDrecord>>();
 
 	public:
 		void ProcessBlocks(const FragmentBlocks &fragblock);
 		void ChrMapUpdate(const std::vector<chr_entry> &chrmap);
 		void loadRef(std::istringstream &IN);
+		void WriteRefBinary(refBinaryWriter &out) const;
+		int LoadRefBinary(const refBinaryReader &in);
 		int WriteOutput(std::string& output, const FragmentsMap &FM) const;
 		
-	  void fillHist(std::map<unsigned int,unsigned int> &hist, const unsigned int &refID, const std::vector<std::pair<unsigned int,unsigned int>> &blocks, const FragmentsMap &FM, bool debug = false) const;
-		void fillHist(std::map<unsigned int,unsigned int> &hist, const unsigned int &refID, const std::vector<std::pair<unsigned int,unsigned int>> &blocks, bool direction, const FragmentsMap &FM, bool debug = false) const;
+	  void fillHist(CoverageHist &hist, const unsigned int &refID, const std::vector<std::pair<unsigned int,unsigned int>> &blocks, const FragmentsMap &FM, bool debug = false) const;
+		void fillHist(CoverageHist &hist, const unsigned int &refID, const std::vector<std::pair<unsigned int,unsigned int>> &blocks, bool direction, const FragmentsMap &FM, bool debug = false) const;
 
-		double meanFromHist(const std::map<unsigned int,unsigned int> &hist) const;
-		double coverageFromHist(const std::map<unsigned int,unsigned int> &hist) const;
-		double percentileFromHist(const std::map<unsigned int,unsigned int> &hist, unsigned int percentile) const;
-		double trimmedMeanFromHist(const std::map<unsigned int,unsigned int> &hist, unsigned int centerPercent, bool debug = false) const;
+		double meanFromHist(const CoverageHist &hist) const;
+		double coverageFromHist(const CoverageHist &hist) const;
+		double percentileFromHist(const CoverageHist &hist, unsigned int percentile) const;
+		double trimmedMeanFromHist(const CoverageHist &hist, unsigned int centerPercent, bool debug = false) const;
 
     vector<chr_entry> chrs;
 };
 
+// A block of an intron depth query, used by the depth sweep
+struct depth_query_block {
+  unsigned int start;
+  unsigned int end;
+  unsigned int query;
+};
+
+struct intron_depth_stats {
+  bool valid = false;
+  double coverage;
+  double depth;
+  double depth25;
+  double depth50;
+  double depth75;
+  double depthFirst50;
+  double depthLast50;
+};
+
 class CoverageBlocksIRFinder : public CoverageBlocks {
+	private:
+		int sweepIntronStats(std::vector<intron_depth_stats> &stats, const FragmentsMap &FM, int n_threads, int directionality) const;
 	public:
 		void Combine(CoverageBlocksIRFinder &child);
-		int WriteOutput(std::string& output, std::string& QC, const JunctionCount &JC, const SpansPoint &SP, const FragmentsMap &FM, int n_threads = 1, int directionality = 0) const;
+		int WriteOutput(std::string& output, std::string& QC, const JunctionCount &JC, const SpansPoint &SP, const FragmentsMap &FM, int n_threads = 1, int directionality = 0, bool use_sweep = true) const;
+		int WriteOutput(TextSink& output, std::string& QC, const JunctionCount &JC, const SpansPoint &SP, const FragmentsMap &FM, int n_threads = 1, int directionality = 0, bool use_sweep = true) const;
 };
 
 
@@ -0,0 +1,194 @@
+/* RefTools.cpp Compiled (binary) IRFinder reference
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#include "RefTools.h"
+#include "IRFinder_Rcpp.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+uint32_t refBinaryWriter::AddString(const std::string &s) {
+  auto it = string_ids.find(s);
+  if(it != string_ids.end()) return(it->second);
+  uint32_t id = (uint32_t)strings.size();
+  strings.append(s);
+  strings.push_back('\0');
+  string_ids[s] = id;
+  return(id);
+}
+
+std::string & refBinaryWriter::NewSection(uint32_t id) {
+  std::string & buf = sections[id];
+  buf.clear();
+  return(buf);
+}
+
+int refBinaryWriter::WriteToFile(const std::string &filename) const {
+  std::map<uint32_t, const std::string*> all_sections;
+  all_sections[REF_STRINGS] = &strings;
+  for(auto it = sections.begin(); it != sections.end(); it++) {
+    if(it->first != REF_STRINGS) all_sections[it->first] = &(it->second);
+  }
+
+  std::string header;
+  header.append(ref_binary_magic, 8);
+  Append(header, ref_binary_version);
+  Append(header, (uint32_t)all_sections.size());
+
+  uint64_t offset = 16 + 24 * all_sections.size();
+  for(auto it = all_sections.begin(); it != all_sections.end(); it++) {
+    offset = (offset + 7) & ~(uint64_t)7;
+    Append(header, it->first);
+    Append(header, (uint32_t)0);
+    Append(header, offset);
+    Append(header, (uint64_t)it->second->size());
+    offset += it->second->size();
+  }
+
+  std::ofstream out;
+  out.open(filename, std::ofstream::binary);
+  if(!out.is_open()) {
+    cout << "Unable to write to " << filename << "\n";
+    return(-1);
+  }
+  out.write(header.data(), header.size());
+  uint64_t written = header.size();
+  const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  for(auto it = all_sections.begin(); it != all_sections.end(); it++) {
+    if(written % 8 != 0) {
+      out.write(padding, 8 - written % 8);
+      written += 8 - written % 8;
+    }
+    out.write(it->second->data(), it->second->size());
+    written += it->second->size();
+  }
+  out.close();
+  if(out.fail()) {
+    cout << "Error writing " << filename << "\n";
+    return(-1);
+  }
+  return(0);
+}
+
+refBinaryReader::~refBinaryReader() {
+#ifndef _WIN32
+  if(is_mapped) munmap((void *)data, data_size);
+#endif
+}
+
+bool refBinaryReader::IsBinaryRef(const std::string &filename) {
+  std::ifstream in;
+  in.open(filename, std::ifstream::binary);
+  if(!in.is_open()) return(false);
+  char magic[8];
+  in.read(magic, 8);
+  return(!in.fail() && memcmp(magic, ref_binary_magic, 8) == 0);
+}
+
+int refBinaryReader::Open(const std::string &filename) {
+#ifndef _WIN32
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0) {
+    cout << "Unable to open " << filename << "\n";
+    return(-1);
+  }
+  struct stat st;
+  if(fstat(fd, &st) == 0 && st.st_size > 0) {
+    void * map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(map != MAP_FAILED) {
+      data = (const char *)map;
+      data_size = (size_t)st.st_size;
+      is_mapped = true;
+    }
+  }
+  close(fd);
+#endif
+  if(!is_mapped) {
+    std::ifstream in;
+    in.open(filename, std::ifstream::binary);
+    if(!in.is_open()) {
+      cout << "Unable to open " << filename << "\n";
+      return(-1);
+    }
+    std::ostringstream oss;
+    oss << in.rdbuf();
+    buffer = oss.str();
+    data = buffer.data();
+    data_size = buffer.size();
+  }
+
+  refBinarySection header(data, data_size);
+  char magic[8];
+  for(unsigned int i = 0; i < 8; i++) magic[i] = header.Read<char>();
+  uint32_t version = header.Read<uint32_t>();
+  uint32_t n_sections = header.Read<uint32_t>();
+  if(header.fail() || memcmp(magic, ref_binary_magic, 8) != 0) {
+    cout << filename << " is not a compiled IRFinder reference\n";
+    return(-1);
+  }
+  if(version != ref_binary_version) {
+    cout << filename << " was compiled with an incompatible version, please rebuild it\n";
+    return(-1);
+  }
+  for(unsigned int i = 0; i < n_sections; i++) {
+    uint32_t id = header.Read<uint32_t>();
+    header.Read<uint32_t>();
+    uint64_t offset = header.Read<uint64_t>();
+    uint64_t length = header.Read<uint64_t>();
+    if(header.fail() || offset > data_size || length > data_size - offset) {
+      cout << filename << " is truncated or corrupt\n";
+      return(-1);
+    }
+    sections[id] = std::make_pair(offset, length);
+  }
+
+  // String table must be null-terminated for GetString
+  auto it = sections.find(REF_STRINGS);
+  if(it != sections.end() && it->second.second > 0) {
+    strings = data + it->second.first;
+    strings_size = it->second.second;
+    if(strings[strings_size - 1] != '\0') {
+      cout << filename << " is truncated or corrupt\n";
+      return(-1);
+    }
+  }
+  return(0);
+}
+
+bool refBinaryReader::HasSection(uint32_t id) const {
+  return(sections.find(id) != sections.end());
+}
+
+refBinarySection refBinaryReader::GetSection(uint32_t id) const {
+  auto it = sections.find(id);
+  if(it == sections.end()) return(refBinarySection(data, 0));
+  return(refBinarySection(data + it->second.first, it->second.second));
+}
+
+std::string refBinaryReader::GetString(uint32_t id) const {
+  if(id >= strings_size) return("");
+  return(std::string(strings + id));
+}
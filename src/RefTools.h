@@ -0,0 +1,134 @@
+/* RefTools.h Compiled (binary) IRFinder reference
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef CODE_REFTOOLS
+#define CODE_REFTOOLS
+
+#include "includedefine.h"
+#include <stdint.h>
+
+/*
+Binary reference layout (native byte order):
+  char[8]   magic "NXTIRFRB"
+  uint32_t  version
+  uint32_t  number of sections
+  { uint32_t id, uint32_t reserved, uint64_t offset, uint64_t length } per section
+  section data, each starting on an 8-byte boundary
+
+Names are stored once in the REF_STRINGS section (null-terminated) and
+referred to elsewhere by their uint32_t offset into it. Coordinate arrays
+are stored per chromosome, already sorted, so that they can be copied
+straight into the processors' vectors.
+
+The sidecar that IRF_core saves next to the COV file (sample.sj) uses the
+same layout, with the REF_SIDECAR_* sections.
+*/
+
+static const char ref_binary_magic[8] = {'N','X','T','I','R','F','R','B'};
+static const uint32_t ref_binary_version = 1;
+
+enum ref_binary_section {
+  REF_STRINGS = 1,
+  REF_COVER = 2,    // CoverageBlocks::WriteRefBinary
+  REF_SPANS = 3,    // SpansPoint::WriteRefBinary
+  REF_ROI = 4,      // FragmentsInROI::WriteRefBinary
+  REF_SJ = 5,       // JunctionCount::WriteRefBinary
+  REF_CHRS = 6,     // chromosome aliases (optional)
+
+  REF_SIDECAR_TEXT = 16,   // BAM_report, ROI and ChrCoverage text (and their QC lines)
+  REF_SIDECAR_JUNC = 17,   // JunctionCount::WriteCountsBinary
+  REF_SIDECAR_SPANS = 18   // SpanDepthMap::WriteSidecar
+};
+
+class refBinaryWriter {
+	private:
+		std::string strings;
+		std::map<std::string, uint32_t> string_ids;
+		std::map<uint32_t, std::string> sections;
+	public:
+		uint32_t AddString(const std::string &s);
+		// Returns the (empty) data buffer of a new section
+		std::string & NewSection(uint32_t id);
+		int WriteToFile(const std::string &filename) const;
+
+		template <typename T> static void Append(std::string &buf, const T &val) {
+			buf.append(reinterpret_cast<const char *>(&val), sizeof(T));
+		};
+		template <typename T> static void AppendArray(std::string &buf, const std::vector<T> &vals) {
+			if(vals.size() > 0) buf.append(reinterpret_cast<const char *>(vals.data()), sizeof(T) * vals.size());
+		};
+};
+
+// Sequential reader over one section. Reads past the end set fail() and return zeros.
+class refBinarySection {
+	private:
+		const char * pos;
+		const char * end;
+		bool is_fail = false;
+	public:
+		refBinarySection(const char * data, size_t len) : pos(data), end(data + len) {};
+
+		template <typename T> T Read() {
+			T val;
+			if((size_t)(end - pos) < sizeof(T)) {
+				is_fail = true;
+				memset(&val, 0, sizeof(T));
+				return(val);
+			}
+			memcpy(&val, pos, sizeof(T));
+			pos += sizeof(T);
+			return(val);
+		};
+		template <typename T> void ReadArray(std::vector<T> &dest, uint64_t n) {
+			if(n > (uint64_t)(end - pos) / sizeof(T)) {
+				is_fail = true;
+				dest.resize(0);
+				return;
+			}
+			dest.resize(n);
+			if(n > 0) memcpy(dest.data(), pos, sizeof(T) * n);
+			pos += sizeof(T) * n;
+		};
+		bool fail() const { return(is_fail); };
+};
+
+// Maps a binary reference into memory (read whole file where mmap is unavailable)
+class refBinaryReader {
+	private:
+		const char * data = NULL;
+		size_t data_size = 0;
+		bool is_mapped = false;
+		std::string buffer;
+
+		std::map<uint32_t, std::pair<uint64_t, uint64_t>> sections;   // id -> offset, length
+		const char * strings = NULL;
+		uint64_t strings_size = 0;
+	public:
+		~refBinaryReader();
+		static bool IsBinaryRef(const std::string &filename);
+		int Open(const std::string &filename);
+		bool HasSection(uint32_t id) const;
+		refBinarySection GetSection(uint32_t id) const;
+		std::string GetString(uint32_t id) const;
+};
+
+#endif
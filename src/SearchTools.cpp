@@ -0,0 +1,49 @@
+/* SearchTools.cpp Static search indexes over sorted reference coordinates
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#include "SearchTools.h"
+
+bool PositionIndex::Build(const std::vector<unsigned int> &positions) {
+  keys = positions.data();
+  n = positions.size();
+  bucket_first.clear();
+  is_sorted = std::is_sorted(positions.begin(), positions.end());
+  if(!is_sorted || n == 0) {
+    n = 0;
+    return(is_sorted);
+  }
+
+  // Smallest bucket width giving no more buckets than positions
+  unsigned int max_key = positions.back();
+  shift = min_shift;
+  while(shift < max_shift && (max_key >> shift) >= n) shift++;
+
+  size_t n_buckets = (size_t)(max_key >> shift) + 1;
+  bucket_first.resize(n_buckets + 1);
+  unsigned int i = 0;
+  for(size_t b = 0; b < n_buckets; b++) {
+    while(i < n && (keys[i] >> shift) < b) i++;
+    bucket_first[b] = i;
+  }
+  bucket_first[n_buckets] = n;
+  return(true);
+}
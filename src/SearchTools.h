@@ -0,0 +1,89 @@
+/* SearchTools.h Static search indexes over sorted reference coordinates
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef CODE_SEARCHTOOLS
+#define CODE_SEARCHTOOLS
+
+#include "includedefine.h"
+#include <stdint.h>
+
+/*
+  Search index over a sorted array of positions, e.g. the reference
+    coordinates of one chromosome. Positions are bucketed by their upper bits
+    (about one position per bucket on average); each bucket records the first
+    array index it covers. A search reads one bucket entry and then compares
+    the few positions in that bucket, rather than binary searching the whole
+    array, which for large references does not fit in cache.
+  Searches can also resume from a hint (e.g. the result of the last search),
+    as fragments arrive roughly sorted by position.
+  The index refers to, but does not own, the positions, which must outlive it.
+*/
+class PositionIndex {
+	private:
+		static const unsigned int min_shift = 6;
+		static const unsigned int max_shift = 24;
+		static const unsigned int max_scan = 16;    // Longer buckets are binary searched
+		static const unsigned int hint_steps = 4;
+
+		const unsigned int * keys = NULL;
+		unsigned int n = 0;
+		unsigned int shift = max_shift;
+		std::vector<unsigned int> bucket_first;     // n_buckets + 1 entries, the last being n
+		bool is_sorted = true;
+
+		// First index in [i, end) whose key is > x (or >= x, if !upper)
+		template <bool upper> unsigned int scan(unsigned int i, unsigned int end, const unsigned int x) const {
+			if(end - i > max_scan) {
+				return(upper ?
+					std::upper_bound(keys + i, keys + end, x) - keys :
+					std::lower_bound(keys + i, keys + end, x) - keys);
+			}
+			while(i < end && (upper ? keys[i] <= x : keys[i] < x)) i++;
+			return(i);
+		};
+		template <bool upper> unsigned int search(const unsigned int x) const {
+			unsigned int b = x >> shift;
+			if(b + 1 >= bucket_first.size()) return(n);
+			return(scan<upper>(bucket_first[b], bucket_first[b + 1], x));
+		};
+		template <bool upper> unsigned int search(const unsigned int x, unsigned int hint) const {
+			if(hint <= n && (hint == 0 || (upper ? keys[hint - 1] <= x : keys[hint - 1] < x))) {
+				unsigned int end = std::min(n, hint + hint_steps);
+				hint = scan<upper>(hint, end, x);
+				if(hint < end || hint == n) return(hint);
+			}
+			return(search<upper>(x));
+		};
+	public:
+		// Returns false (and builds an empty index) if positions are not sorted
+		bool Build(const std::vector<unsigned int> &positions);
+		bool sorted() const { return(is_sorted); };
+		unsigned int size() const { return(n); };
+
+		// As std::upper_bound / std::lower_bound, returning an index into the positions
+		unsigned int upper_bound(const unsigned int x) const { return(search<true>(x)); };
+		unsigned int lower_bound(const unsigned int x) const { return(search<false>(x)); };
+		unsigned int upper_bound(const unsigned int x, const unsigned int hint) const { return(search<true>(x, hint)); };
+		unsigned int lower_bound(const unsigned int x, const unsigned int hint) const { return(search<false>(x, hint)); };
+};
+
+#endif
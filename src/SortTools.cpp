@@ -0,0 +1,105 @@
+/* SortTools.cpp Integer radix sorts for position / event vectors
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#include "SortTools.h"
+#include "IRFinder_Rcpp.h"
+
+void radix_sort_u32(std::vector<unsigned int> &v) {
+  radix_sort(v, [](const unsigned int &a) { return(a); });
+}
+
+void radix_sort_u64(std::vector<uint64_t> &v) {
+  radix_sort(v, [](const uint64_t &a) { return(a); });
+}
+
+void radix_sort_events(std::vector< std::pair<unsigned int, int> > &v) {
+  radix_sort(v, [](const std::pair<unsigned int, int> &a) { return(a.first); });
+}
+
+#ifndef RNXTIRF
+#include <chrono>
+#include <random>
+
+// Compares std::sort with radix_sort_events on events resembling one
+// FragmentsMap batch: block start (+1) / end (-1) pairs over a 100 Mb
+// chromosome, with most reads piled up on a set of expressed genes.
+int Benchmark_Sort(size_t n_events, unsigned int n_reps) {
+  const unsigned int chr_len = 100000000;
+  const unsigned int read_len = 75;
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<unsigned int> uniform_pos(0, chr_len - read_len);
+  std::uniform_int_distribution<unsigned int> gene_pos(0, chr_len - 100000);
+  std::exponential_distribution<double> gene_weight(1.0);
+  
+  std::vector<unsigned int> genes(2000);
+  std::vector<double> weights(genes.size());
+  for(unsigned int i = 0; i < genes.size(); i++) {
+    genes[i] = gene_pos(rng);
+    weights[i] = gene_weight(rng);
+  }
+  std::discrete_distribution<unsigned int> pick_gene(weights.begin(), weights.end());
+  std::uniform_int_distribution<unsigned int> gene_offset(0, 20000);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+
+  std::vector< std::pair<unsigned int, int> > events;
+  events.reserve(n_events);
+  while(events.size() + 1 < n_events) {
+    unsigned int pos = (unif(rng) < 0.8) ? 
+      genes[pick_gene(rng)] + gene_offset(rng) : uniform_pos(rng);
+    events.push_back(std::make_pair(pos, 1));
+    events.push_back(std::make_pair(pos + read_len, -1));
+  }
+
+  double ms_std = 0;
+  double ms_radix = 0;
+  bool matches = true;
+  for(unsigned int r = 0; r < n_reps; r++) {
+    std::vector< std::pair<unsigned int, int> > a = events;
+    std::vector< std::pair<unsigned int, int> > b = events;
+    
+    auto t0 = std::chrono::steady_clock::now();
+    std::sort(a.begin(), a.end());
+    auto t1 = std::chrono::steady_clock::now();
+    radix_sort_events(b);
+    auto t2 = std::chrono::steady_clock::now();
+    
+    ms_std += std::chrono::duration<double, std::milli>(t1 - t0).count();
+    ms_radix += std::chrono::duration<double, std::milli>(t2 - t1).count();
+    for(size_t i = 0; i < a.size(); i++) {
+      if(a[i].first != b[i].first) {
+        matches = false;
+        break;
+      }
+    }
+  }
+  
+  cout << "Sorting " << events.size() << " events, " << n_reps << " repeats\n"
+    << "std::sort\t" << ms_std / n_reps << " ms\n"
+    << "radix_sort_events\t" << ms_radix / n_reps << " ms\n"
+    << "Speedup\t" << ms_std / ms_radix << "\n";
+  if(!matches) {
+    cout << "Error: radix sort order does not match std::sort\n";
+    return(1);
+  }
+  return(0);
+}
+#endif
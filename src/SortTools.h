@@ -0,0 +1,95 @@
+/* SortTools.h Integer radix sorts for position / event vectors
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef CODE_SORTTOOLS
+#define CODE_SORTTOOLS
+
+#include "includedefine.h"
+#include <stdint.h>
+
+// LSD radix sort by an unsigned integer key, with key_fn(element) returning the key.
+// Only as many bits as the largest key are sorted, split into passes of <= 16 bits;
+// passes where all elements share a digit are skipped. Sort is stable.
+template <typename T, typename KeyFn>
+void radix_sort(std::vector<T> &v, KeyFn key_fn) {
+  const size_t n = v.size();
+  if(n < 256) {
+    std::stable_sort(v.begin(), v.end(), 
+      [&key_fn](const T &a, const T &b) { return(key_fn(a) < key_fn(b)); }
+    );
+    return;
+  }
+  
+  uint64_t max_key = 0;
+  for(size_t i = 0; i < n; i++) {
+    max_key = std::max(max_key, (uint64_t)key_fn(v[i]));
+  }
+  unsigned int key_bits = 0;
+  while(key_bits < 64 && (max_key >> key_bits) != 0) key_bits++;
+  if(key_bits == 0) return;
+
+  const unsigned int passes = (key_bits + 15) / 16;
+  const unsigned int digit_bits = (key_bits + passes - 1) / passes;
+  const size_t buckets = (size_t)1 << digit_bits;
+  const uint64_t mask = buckets - 1;
+
+  // All histograms in one read of the input
+  std::vector<size_t> counts(buckets * passes, 0);
+  for(size_t i = 0; i < n; i++) {
+    uint64_t key = key_fn(v[i]);
+    for(unsigned int p = 0; p < passes; p++) {
+      counts[p * buckets + ((key >> (p * digit_bits)) & mask)]++;
+    }
+  }
+
+  std::vector<T> buffer(n);
+  std::vector<T> * src = &v;
+  std::vector<T> * dest = &buffer;
+  for(unsigned int p = 0; p < passes; p++) {
+    const unsigned int shift = p * digit_bits;
+    size_t * offsets = &counts[p * buckets];
+    if(offsets[((uint64_t)key_fn((*src)[0]) >> shift) & mask] == n) continue;
+    size_t total = 0;
+    for(size_t d = 0; d < buckets; d++) {
+      size_t count = offsets[d];
+      offsets[d] = total;
+      total += count;
+    }
+    for(size_t i = 0; i < n; i++) {
+      const T & elem = (*src)[i];
+      (*dest)[offsets[((uint64_t)key_fn(elem) >> shift) & mask]++] = elem;
+    }
+    std::swap(src, dest);
+  }
+  if(src != &v) v.swap(buffer);
+}
+
+void radix_sort_u32(std::vector<unsigned int> &v);
+void radix_sort_u64(std::vector<uint64_t> &v);
+// Sorts position / depth-difference events by position
+void radix_sort_events(std::vector< std::pair<unsigned int, int> > &v);
+
+#ifndef RNXTIRF
+int Benchmark_Sort(size_t n_events, unsigned int n_reps);
+#endif
+
+#endif
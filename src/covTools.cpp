@@ -22,29 +22,89 @@ SOFTWARE.  */
 
 #include "covTools.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // Constructor
 covReader::covReader() {
   bufferPos = 0;
   bufferMax = 0;
   index_begin = 0;
   body_begin = 0;
-
-  compressed_buffer = (char*)malloc(65536);
+  cache_capacity = 256;
+  zoom_loaded = 0;
+  zoom_bins_per_block = 0;
+
+  IN = NULL;
+  map_data = NULL;
+  map_size = 0;
+  map_pos = 0;
+  is_mapped = false;
+  own_stream = NULL;
+
+  // compressed_buffer is only needed for istream input
+  compressed_buffer = NULL;
   buffer = (char*)malloc(65536);
+  inflater = NULL;
 }
 
 // Destructor
 covReader::~covReader() {
+  CloseInput();
   free(buffer);
-  free(compressed_buffer);
+  if(compressed_buffer) free(compressed_buffer);
+  if(inflater) delete inflater;
+}
+
+void covReader::CloseInput() {
+#ifndef _WIN32
+  if(is_mapped) munmap((void *)map_data, map_size);
+#endif
+  map_data = NULL;
+  map_size = 0;
+  map_pos = 0;
+  is_mapped = false;
+  if(own_stream) {
+    own_stream->close();
+    delete own_stream;
+    own_stream = NULL;
+  }
+  IN = NULL;
+}
+
+void covReader::Seek(const size_t pos) {
+  if(is_mapped) {
+    map_pos = pos;
+  } else {
+    IN->clear();
+    IN->seekg(pos, std::ios_base::beg);
+  }
+}
+
+size_t covReader::Tell() {
+  if(is_mapped) return(map_pos);
+  return((size_t)IN->tellg());
 }
 
 void covReader::SetInputHandle(std::istream *in_stream) {
+  if(in_stream != own_stream) CloseInput();
+
   IS_EOF = 0;
   IS_FAIL = 0;
   IS_LENGTH = 0;
 
   IN = in_stream;
+  if(!compressed_buffer) compressed_buffer = (char*)malloc(65536);
+
+  block_coord_starts.clear();
+  block_offsets.clear();
+  zoom_loaded = 0;
+  cache.clear();
+  cache_order.clear();
 
   // Identify EOF
   IN->seekg (0, std::ios_base::end);
@@ -67,9 +127,62 @@ void covReader::SetInputHandle(std::istream *in_stream) {
   IN->seekg (0, std::ios_base::beg);
 }
 
+int covReader::SetInputFile(const std::string &filename) {
+  CloseInput();
+  IS_EOF = 0;
+  IS_FAIL = 0;
+  IS_LENGTH = 0;
+  block_coord_starts.clear();
+  block_offsets.clear();
+  zoom_loaded = 0;
+  cache.clear();
+  cache_order.clear();
+  
+#ifndef _WIN32
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd >= 0) {
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      void * map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(map != MAP_FAILED) {
+        map_data = (const char *)map;
+        map_size = (size_t)st.st_size;
+        is_mapped = true;
+      }
+    }
+    close(fd);
+  }
+#endif
+  if(!is_mapped) {
+    // Fallback: read through an ifstream owned by this reader
+    own_stream = new std::ifstream;
+    own_stream->open(filename, std::ifstream::binary);
+    if(!own_stream->is_open()) {
+      IS_EOF = 1;
+      IS_FAIL = 1;
+      return(-1);
+    }
+    SetInputHandle(own_stream);
+    return(fail() ? -1 : 0);
+  }
+
+  IS_LENGTH = map_size;
+  map_pos = 0;
+  if(map_size >= (size_t)bamEOFlength && 
+      memcmp(map_data + map_size - bamEOFlength, bamEOF, bamEOFlength) == 0) {
+    EOF_POS = map_size - bamEOFlength;
+  } else {
+    EOF_POS = 0;
+    IS_EOF = 1;
+    IS_FAIL = 1;
+    return(-1);
+  }
+  return(0);
+}
+
 int covReader::ReadBuffer() {
   // read compressed buffer
-  if((size_t)IN->tellg() >= EOF_POS) {
+  if(Tell() >= EOF_POS) {
     IS_EOF = 1;
     return(Z_STREAM_END);
   } else if(fail()) {
@@ -79,55 +192,58 @@ int covReader::ReadBuffer() {
   stream_uint16 u16;
   int ret = 0;
   
-  char GzipCheck[bamGzipHeadLength];
-  IN->read(GzipCheck, bamGzipHeadLength);
-
-   if(strncmp(bamGzipHead, GzipCheck, bamGzipHeadLength) != 0) {
-    cout << "Exception during BAM decompression - BGZF header corrupt: (at " 
-      << IN->tellg() << " bytes) ";
-    return(Z_BUF_ERROR);
-  }
+  const char * src = compressed_buffer;
+  if(is_mapped) {
+    // Inflate straight from the mapping
+    if(map_pos + bamGzipHeadLength + 2 > map_size) {
+      IS_FAIL = 1;
+      return(Z_BUF_ERROR);
+    }
+    if(strncmp(bamGzipHead, map_data + map_pos, bamGzipHeadLength) != 0) {
+      cout << "Exception during BAM decompression - BGZF header corrupt: (at " 
+        << map_pos << " bytes) ";
+      return(Z_BUF_ERROR);
+    }
+    memcpy(u16.c, map_data + map_pos + bamGzipHeadLength, 2);
+    if((size_t)u16.u + 1 < 2 + bamGzipHeadLength + 8 || map_pos + u16.u + 1 > map_size) {
+      IS_FAIL = 1;
+      return(Z_BUF_ERROR);
+    }
+    src = map_data + map_pos + bamGzipHeadLength + 2;
+    map_pos += u16.u + 1;
+  } else {
+    char GzipCheck[bamGzipHeadLength];
+    IN->read(GzipCheck, bamGzipHeadLength);
 
-  IN->read(u16.c, 2);
-  IN->read(compressed_buffer, u16.u + 1 - 2  - bamGzipHeadLength);
+     if(strncmp(bamGzipHead, GzipCheck, bamGzipHeadLength) != 0) {
+      cout << "Exception during BAM decompression - BGZF header corrupt: (at " 
+        << IN->tellg() << " bytes) ";
+      return(Z_BUF_ERROR);
+    }
 
-  bufferMax = 65536;
-  z_stream zs;
-  zs.zalloc = NULL;
-  zs.zfree = NULL;
-  zs.msg = NULL;
-  zs.next_in = (Bytef*)compressed_buffer;
-  zs.avail_in = u16.u + 1 - 2  - bamGzipHeadLength;
-  zs.next_out = (Bytef*)buffer;
-  zs.avail_out = bufferMax;
+    IN->read(u16.c, 2);
+    IN->read(compressed_buffer, u16.u + 1 - 2  - bamGzipHeadLength);
+  }
 
-  stream_uint32 u32;
-  memcpy(u32.c, &compressed_buffer[u16.u + 1 - 2 - bamGzipHeadLength - 8],4);
+  size_t src_len = u16.u + 1 - 2 - bamGzipHeadLength;
+  stream_uint32 crc;
+  stream_uint32 isize;
+  memcpy(crc.c, &src[src_len - 8], 4);
+  memcpy(isize.c, &src[src_len - 4], 4);
+  if(isize.u > 65536) {
+    cout << "Exception during BAM decompression - BGZF block corrupt: (at " 
+      << Tell() << " bytes) ";
+    return(Z_BUF_ERROR);
+  }
 
-  ret = inflateInit2(&zs, -15);
+  if(!inflater) inflater = new pbam_inflater;
+  ret = inflater->inflate_raw(src, src_len - 8, buffer, isize.u, crc.u);
   if(ret != Z_OK) {
-    cout << "Exception during BAM decompression - inflateInit2() fail: (" 
+    cout << "Exception during BAM decompression - inflate or CRC fail: (" 
       << ret << ") ";
     return(ret);
   }
-  ret = inflate(&zs, Z_FINISH);
-  if(ret != Z_OK && ret != Z_STREAM_END) {
-    cout << "Exception during BAM decompression - inflate() fail: (" 
-      << ret << ") ";
-    return(ret);
-  }
-  ret = inflateEnd(&zs);
-  
-  bufferMax -= zs.avail_out;
-  
-  // check CRC
-  uint32_t crc = crc32(crc32(0L, NULL, 0L), (Bytef*)buffer, bufferMax);
-  // CRC check:
-  if(u32.u != crc) {
-    std::ostringstream oss;
-    oss << "CRC fail during BAM decompression: (at " << IN->tellg() << " bytes) ";
-    return(ret);
-  }
+  bufferMax = isize.u;
   bufferPos = 0;
   
   return(ret);
@@ -207,6 +323,8 @@ int covReader::ignore(unsigned int len) {
 bool covReader::eof() {
   if(IS_EOF == 1) {
     return (true);
+  } else if(is_mapped) {
+    return (false);
   } else {
     if(IN->eof()) {
       IS_EOF = 1;
@@ -220,6 +338,8 @@ bool covReader::eof() {
 bool covReader::fail() {
   if(IS_FAIL == 1) {
     return (true);
+  } else if(is_mapped) {
+    return (false);
   } else {
     if(IN->fail()) {
       IS_FAIL = 1;
@@ -231,9 +351,12 @@ bool covReader::fail() {
 }
 
 int covReader::ReadHeader() {
-  IN->seekg (0, std::ios_base::beg);    
+  Seek(0);
   chr_names.clear();
   chr_lens.clear();
+  block_coord_starts.clear();
+  block_offsets.clear();
+  zoom_loaded = 0;
   bufferPos = 0;
   bufferMax = 0;    
   
@@ -270,7 +393,7 @@ int covReader::ReadHeader() {
   }
   
   // should be the start point of bgzf block containing index
-  index_begin = IN->tellg();      
+  index_begin = Tell();      
   
   bufferPos = 0;
   bufferMax = 0;    
@@ -283,7 +406,7 @@ int covReader::ReadHeader() {
       ignore(u32.u);            
     }
   }
-  body_begin = IN->tellg();
+  body_begin = Tell();
 
   return(n_ref.u);
 }
@@ -330,7 +453,7 @@ int covReader::FetchPos(
 
   int i = 0;
   stream_uint32 u32;
-  IN->seekg(index_begin, std::ios_base::beg);    
+  Seek(index_begin);
   bufferPos = 0;
   bufferMax = 0;    
 
@@ -397,7 +520,7 @@ int covReader::FetchRLE(
     return -1;
   }
   
-  IN->seekg(file_offset, std::ios_base::beg);
+  Seek(file_offset);
   bufferPos = 0;
   bufferMax = 0;    
   
@@ -436,12 +559,429 @@ int covReader::FetchRLE(
 }
 
 
+// ######################### COV BATCH READER ##################################
+
+void covReader::SetCacheSize(const size_t n_blocks) {
+  cache_capacity = n_blocks > 0 ? n_blocks : 1;
+  while(cache.size() > cache_capacity) {
+    cache.erase(cache_order.back());
+    cache_order.pop_back();
+  }
+}
+
+int covReader::LoadIndex() {
+  // Reads the whole COV index into memory, so that regions can be mapped
+  // to their body blocks without re-reading the index for every query
+  if(index_begin == 0) {
+    ReadHeader();
+    if(index_begin == 0) return(-1);
+  }
+  unsigned int n_refID = 3 * chr_names.size();
+  block_coord_starts.assign(n_refID, std::vector<uint32_t>());
+  block_offsets.assign(n_refID, std::vector<uint64_t>());
+  
+  Seek(index_begin);
+  bufferPos = 0;
+  bufferMax = 0;
+
+  stream_uint32 u32;
+  stream_uint64 u64;
+  for(unsigned int i = 0; i < n_refID; i++) {
+    stream_uint32 chr_block_size;
+    if(read(chr_block_size.c, 4) != Z_OK) return(-1);
+    block_coord_starts.at(i).reserve(chr_block_size.u / 12);
+    block_offsets.at(i).reserve(chr_block_size.u / 12);
+    for(uint32_t j = 0; j + 12 <= chr_block_size.u; j += 12) {
+      if(read(u32.c, 4) != Z_OK) return(-1);
+      if(read(u64.c, 8) != Z_OK) return(-1);
+      block_coord_starts.at(i).push_back(u32.u);
+      block_offsets.at(i).push_back(u64.u + body_begin);
+    }
+  }
+  return(0);
+}
+
+int covReader::FetchBlocks(const std::vector<uint64_t> &offsets, const unsigned int n_threads) {
+  // Locates the compressed blocks in file order (a single forward pass), then
+  // inflates them in parallel, each thread with its own inflater.
+  // Mapped files are inflated in place; istreams are first copied to memory
+  std::vector<std::string> compressed;
+  std::vector<const char *> block_src(offsets.size());
+  std::vector<size_t> block_len(offsets.size());
+  std::vector<std::string> decompressed(offsets.size());
+  std::vector<int> rets(offsets.size(), Z_OK);
+  
+  if(!is_mapped) {
+    compressed.resize(offsets.size());
+    IN->clear();
+  }
+  for(unsigned int i = 0; i < offsets.size(); i++) {
+    stream_uint16 u16;
+    if(is_mapped) {
+      if(offsets.at(i) + 18 > map_size) return(-1);
+      memcpy(u16.c, map_data + offsets.at(i) + 16, 2);
+      if((size_t)u16.u + 1 < 18 + 8 || offsets.at(i) + u16.u + 1 > map_size) return(-1);
+      block_src.at(i) = map_data + offsets.at(i);
+    } else {
+      char head[18];
+      IN->seekg(offsets.at(i), std::ios_base::beg);
+      IN->read(head, 18);
+      if(IN->fail()) return(-1);
+      memcpy(u16.c, head + 16, 2);
+      if((size_t)u16.u + 1 < 18 + 8) return(-1);
+      compressed.at(i).resize((size_t)u16.u + 1);
+      memcpy(&compressed.at(i)[0], head, 18);
+      IN->read(&compressed.at(i)[18], (size_t)u16.u + 1 - 18);
+      if(IN->fail()) return(-1);
+      block_src.at(i) = compressed.at(i).data();
+    }
+    block_len.at(i) = (size_t)u16.u + 1;
+  }
+
+  unsigned int n_threads_to_use = n_threads;
+  if(n_threads_to_use > offsets.size()) n_threads_to_use = offsets.size();
+  if(n_threads_to_use < 1) n_threads_to_use = 1;
+  
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads_to_use)
+#endif
+  {
+    pbam_inflater thread_inflater;
+
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic, 1)
+#endif
+    for(unsigned int i = 0; i < offsets.size(); i++) {
+      rets.at(i) = thread_inflater.inflate_block(block_src.at(i), block_len.at(i), decompressed.at(i));
+      if(!is_mapped) std::string().swap(compressed.at(i));
+    }
+  }
+
+  for(unsigned int i = 0; i < offsets.size(); i++) {
+    if(rets.at(i) != Z_OK) {
+      cout << "Exception during COV decompression - block corrupt: (at " 
+        << offsets.at(i) << " bytes)\n";
+      return(-1);
+    }
+    auto it = cache.find(offsets.at(i));
+    if(it != cache.end()) {
+      cache_order.erase(it->second.first);
+      cache.erase(it);
+    }
+    cache_order.push_front(offsets.at(i));
+    std::pair< std::list<uint64_t>::iterator, std::string > & entry = cache[offsets.at(i)];
+    entry.first = cache_order.begin();
+    entry.second.swap(decompressed.at(i));
+    
+    while(cache.size() > cache_capacity) {
+      cache.erase(cache_order.back());
+      cache_order.pop_back();
+    }
+  }
+  return(0);
+}
+
+const std::string * covReader::GetBlock(const uint64_t offset) {
+  auto it = cache.find(offset);
+  if(it == cache.end()) {
+    std::vector<uint64_t> single(1, offset);
+    if(FetchBlocks(single, 1) != 0) return(NULL);
+    it = cache.find(offset);
+    if(it == cache.end()) return(NULL);
+  } else if(it->second.first != cache_order.begin()) {
+    cache_order.splice(cache_order.begin(), cache_order, it->second.first);
+  }
+  return(&(it->second.second));
+}
+
+int covReader::FetchRLEBatch(const std::vector<cov_region> &regions,
+    std::vector< std::vector<int> > &values,
+    std::vector< std::vector<unsigned int> > &lengths,
+    const unsigned int n_threads
+) {
+  values.assign(regions.size(), std::vector<int>());
+  lengths.assign(regions.size(), std::vector<unsigned int>());
+  if(block_offsets.size() == 0) {
+    if(LoadIndex() != 0) return(-1);
+  }
+
+  std::map<std::string, unsigned int> chr_index;
+  for(unsigned int i = 0; i < chr_names.size(); i++) {
+    chr_index.insert(std::make_pair(chr_names.at(i), i));
+  }
+
+  // Map each valid region to its refID and the range of body blocks it touches
+  struct region_job {
+    size_t id;
+    unsigned int refID;
+    unsigned int first_block;
+    unsigned int last_block;
+  };
+  std::vector<region_job> jobs;
+  jobs.reserve(regions.size());
+  for(size_t i = 0; i < regions.size(); i++) {
+    const cov_region & region = regions.at(i);
+    auto it_chr = chr_index.find(region.seqname);
+    if(it_chr == chr_index.end()) continue;
+    if(region.strand < 0 || region.strand > 2) continue;
+    if(region.end > chr_lens.at(it_chr->second)) continue;
+    
+    region_job job;
+    job.id = i;
+    job.refID = it_chr->second + region.strand * chr_names.size();
+    const std::vector<uint32_t> & starts = block_coord_starts.at(job.refID);
+    if(starts.size() == 0) continue;
+
+    // Same block as FetchPos: the last block starting at or before start
+    unsigned int first = std::upper_bound(starts.begin(), starts.end(), region.start) - starts.begin();
+    job.first_block = first > 0 ? first - 1 : 0;
+    unsigned int last = std::lower_bound(starts.begin(), starts.end(), region.end) - starts.begin();
+    job.last_block = last > job.first_block + 1 ? last - 1 : job.first_block;
+    jobs.push_back(job);
+  }
+  std::sort(jobs.begin(), jobs.end(), [&](const region_job &a, const region_job &b) {
+    if(a.refID != b.refID) return(a.refID < b.refID);
+    return(regions.at(a.id).start < regions.at(b.id).start);
+  });
+
+  // Unique blocks in file order
+  std::vector<uint64_t> needed;
+  for(unsigned int j = 0; j < jobs.size(); j++) {
+    const std::vector<uint64_t> & offsets = block_offsets.at(jobs.at(j).refID);
+    for(unsigned int b = jobs.at(j).first_block; b <= jobs.at(j).last_block; b++) {
+      if(cache.find(offsets.at(b)) == cache.end()) needed.push_back(offsets.at(b));
+    }
+  }
+  std::sort(needed.begin(), needed.end());
+  needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+  // Blocks are fetched in rounds of half the cache as the walk reaches them, so
+  //   that long regions are walked before their blocks are evicted, and the
+  //   blocks of the previous round stay cached for overlapping regions
+  size_t round_size = cache_capacity / 2 > 0 ? cache_capacity / 2 : 1;
+  size_t next_fetch = 0;
+  bool fetch_failed = false;
+  auto fetch_block = [&](const uint64_t offset) -> const std::string * {
+    if(cache.find(offset) == cache.end()) {
+      while(next_fetch < needed.size() && needed.at(next_fetch) < offset) next_fetch++;
+      if(next_fetch < needed.size() && needed.at(next_fetch) == offset) {
+        size_t n = std::min(round_size, needed.size() - next_fetch);
+        std::vector<uint64_t> round(needed.begin() + next_fetch, needed.begin() + next_fetch + n);
+        if(FetchBlocks(round, n_threads) != 0) {
+          fetch_failed = true;
+          return(NULL);
+        }
+        next_fetch += n;
+      }
+    }
+    return(GetBlock(offset));
+  };
+
+  for(unsigned int j = 0; j < jobs.size(); j++) {
+    const region_job & job = jobs.at(j);
+    const cov_region & region = regions.at(job.id);
+    const std::vector<uint64_t> & offsets = block_offsets.at(job.refID);
+
+    // Walk the (depth, length) pairs across consecutive blocks of this refID
+    unsigned int cur_block = job.first_block;
+    const std::string * block = fetch_block(offsets.at(cur_block));
+    size_t block_pos = 0;
+    stream_int32 i32;
+    stream_uint32 u32;
+    i32.i = 0;
+    u32.u = 0;
+    auto next_pair = [&]() -> bool {
+      while(block && block_pos + 8 > block->size()) {
+        cur_block++;
+        if(cur_block >= offsets.size()) return(false);
+        block = fetch_block(offsets.at(cur_block));
+        block_pos = 0;
+      }
+      if(!block) return(false);
+      memcpy(i32.c, block->data() + block_pos, 4);
+      memcpy(u32.c, block->data() + block_pos + 4, 4);
+      block_pos += 8;
+      return(true);
+    };
+    
+    // Same decoding as FetchRLE
+    std::vector<int> & region_values = values.at(job.id);
+    std::vector<unsigned int> & region_lengths = lengths.at(job.id);
+    uint32_t prev_start = block_coord_starts.at(job.refID).at(job.first_block);
+    bool is_ok = true;
+    do {
+      is_ok = next_pair();
+      prev_start += u32.u;
+    } while(is_ok && prev_start < region.start);
+    if(fetch_failed) return(-1);
+    if(!is_ok) continue;
+
+    if(prev_start > region.start) {
+      region_values.push_back(i32.i);
+      if(prev_start >= region.end) {
+        region_lengths.push_back((unsigned int)(region.end - region.start));
+      } else {
+        region_lengths.push_back((unsigned int)(prev_start - region.start));
+      }
+    }
+    while(prev_start < region.end) {
+      if(!next_pair()) break;
+      region_values.push_back(i32.i);
+      if(prev_start + u32.u >= region.end) {
+        region_lengths.push_back((unsigned int)(region.end - prev_start));
+        break;
+      } else {
+        region_lengths.push_back(u32.u);
+      }
+      prev_start += u32.u;
+    }
+    if(fetch_failed) return(-1);
+  }
+  return(0);
+}
+
+
+int covReader::LoadZoom() {
+  // Locates the zoom trailer just before the BGZF EOF block and reads the zoom index
+  if(zoom_loaded != 0) return(zoom_loaded == 1 ? 0 : -1);
+  zoom_loaded = -1;
+  zoom_bin_sizes.clear();
+  zoom_offsets.clear();
+  if(index_begin == 0) {
+    ReadHeader();
+    if(index_begin == 0) return(-1);
+  }
+  if(EOF_POS < (size_t)body_begin + cov_zoom_trailer_size) return(-1);
+
+  size_t trailer_pos = EOF_POS - cov_zoom_trailer_size;
+  std::string trailer(cov_zoom_trailer_size, '\0');
+  if(is_mapped) {
+    memcpy(&trailer[0], map_data + trailer_pos, cov_zoom_trailer_size);
+  } else {
+    Seek(trailer_pos);
+    IN->read(&trailer[0], cov_zoom_trailer_size);
+    if(IN->fail()) {
+      IN->clear();
+      return(-1);
+    }
+  }
+  stream_uint16 u16;
+  memcpy(u16.c, trailer.data() + bamGzipHeadLength, 2);
+  if(memcmp(trailer.data(), bamGzipHead, bamGzipHeadLength) != 0 || 
+      u16.u != cov_zoom_trailer_size - 1) {
+    return(-1);
+  }
+  
+  pbam_inflater trailer_inflater;
+  std::string trailer_data;
+  int ret = trailer_inflater.inflate_block(trailer.data(), trailer.size(), trailer_data);
+  if(ret != Z_OK || trailer_data.size() != cov_zoom_trailer_data ||
+      memcmp(trailer_data.data(), cov_zoom_magic, 4) != 0) {
+    return(-1);
+  }
+  stream_uint32 u32;
+  stream_uint64 zoom_body_size;
+  stream_uint64 zoom_index_size;
+  memcpy(u32.c, trailer_data.data() + 4, 4);
+  memcpy(zoom_body_size.c, trailer_data.data() + 8, 8);
+  memcpy(zoom_index_size.c, trailer_data.data() + 16, 8);
+  if(u32.u != cov_zoom_version) {
+    cout << "COV zoom levels were written with an unsupported version\n";
+    return(-1);
+  }
+  if(zoom_index_size.u + zoom_body_size.u > trailer_pos - body_begin) return(-1);
+  size_t zoom_index_begin = trailer_pos - zoom_index_size.u;
+  size_t zoom_body_begin = zoom_index_begin - zoom_body_size.u;
+
+  Seek(zoom_index_begin);
+  bufferPos = 0;
+  bufferMax = 0;
+
+  stream_uint32 n_levels;
+  stream_uint32 bins_per_block;
+  if(read(n_levels.c, 4) != Z_OK || read(bins_per_block.c, 4) != Z_OK) return(-1);
+  if(bins_per_block.u == 0 || bins_per_block.u > BGZF_max / 8) return(-1);
+
+  unsigned int n_refID = 3 * chr_names.size();
+  std::vector<uint32_t> bin_sizes;
+  std::vector< std::vector< std::vector<uint64_t> > > offsets(n_levels.u);
+  stream_uint64 u64;
+  for(unsigned int l = 0; l < n_levels.u; l++) {
+    if(read(u32.c, 4) != Z_OK || u32.u == 0) return(-1);
+    bin_sizes.push_back(u32.u);
+    offsets.at(l).resize(n_refID);
+    for(unsigned int i = 0; i < n_refID; i++) {
+      stream_uint32 n_blocks;
+      if(read(n_blocks.c, 4) != Z_OK) return(-1);
+      for(unsigned int j = 0; j < n_blocks.u; j++) {
+        if(read(u64.c, 8) != Z_OK || u64.u >= zoom_body_size.u) return(-1);
+        offsets.at(l).at(i).push_back(u64.u + zoom_body_begin);
+      }
+    }
+  }
+  
+  zoom_bin_sizes = bin_sizes;
+  zoom_offsets.swap(offsets);
+  zoom_bins_per_block = bins_per_block.u;
+  zoom_loaded = 1;
+  return(0);
+}
+
+int covReader::GetZoomLevels(std::vector<uint32_t> &bin_sizes) {
+  bin_sizes.clear();
+  if(LoadZoom() != 0) return(0);
+  bin_sizes = zoom_bin_sizes;
+  return(bin_sizes.size());
+}
+
+int covReader::FetchZoom(const std::string seqname, 
+    const uint32_t start, const uint32_t end, const int strand,
+    const uint32_t resolution, uint32_t * bin_size,
+    std::vector<float> * means, std::vector<int> * maxes
+) {
+  if(strand < 0 || strand > 2) return(-1);
+  if(LoadZoom() != 0) return(-1);
+  
+  auto it_chr = std::find(chr_names.begin(), chr_names.end(), seqname);
+  if(it_chr == chr_names.end()) return(-1);
+  unsigned int chrID = distance(chr_names.begin(), it_chr);
+  if(end > chr_lens.at(chrID)) return(-1);
+  unsigned int refID = chrID + strand * chr_names.size();
+
+  // Coarsest level that still resolves the requested resolution
+  int level = -1;
+  for(unsigned int l = 0; l < zoom_bin_sizes.size(); l++) {
+    if(zoom_bin_sizes.at(l) <= resolution) level = l;
+  }
+  if(level < 0) return(-1);
+  *bin_size = zoom_bin_sizes.at(level);
+  if(end <= start) return(0);
+
+  const std::vector<uint64_t> & offsets = zoom_offsets.at(level).at(refID);
+  stream_int32 i32;
+  union { char c[4]; float f; } f32;
+  for(uint32_t b = start / *bin_size; b <= (end - 1) / *bin_size; b++) {
+    uint32_t block_num = b / zoom_bins_per_block;
+    if(block_num >= offsets.size()) return(-1);
+    const std::string * block = GetBlock(offsets.at(block_num));
+    size_t block_pos = (size_t)(b % zoom_bins_per_block) * 8;
+    if(!block || block_pos + 8 > block->size()) return(-1);
+    memcpy(f32.c, block->data() + block_pos, 4);
+    memcpy(i32.c, block->data() + block_pos + 4, 4);
+    means->push_back(f32.f);
+    maxes->push_back(i32.i);
+  }
+  return(0);
+}
+
+
 // ######################### COV WRITER ########################################
 
 
 buffer_out_chunk::buffer_out_chunk() {
   buffer = (char*)malloc(65536);
-  // leave compressed buffer uninitialized until needed
+  // leave compressed buffer unallocated until needed
+  compressed_buffer = NULL;
 }
 
 // Destructor
@@ -542,7 +1082,11 @@ int buffer_out_chunk::Compress() {
 }
 
 covWriter::covWriter() {
-  // do nothing for now
+  OUT = NULL;
+  is_streaming = false;
+  next_refID = 0;
+  pending_blocks = 0;
+  stream_threads = 1;
 }
 
 covWriter::~covWriter() {
@@ -708,10 +1252,28 @@ int covWriter::InitializeCOV(std::vector<chr_entry> chrs_to_copy) {
     block_coord_starts.at(i).resize(0);
     body.at(i).resize(0);
   }
+
+  zoom_body.clear();
+  zoom_body.resize(zoom_bin_sizes.size());
+  for(unsigned int l = 0; l < zoom_bin_sizes.size(); l++) {
+    zoom_body.at(l).resize(chrs.size() * 3);
+  }
+  zoom_written.assign(chrs.size() * 3, false);
   
   return 0;
 }
 
+void covWriter::SetZoomLevels(const std::vector<uint32_t> &bin_sizes) {
+  zoom_bin_sizes.clear();
+  for(auto bin_size : bin_sizes) {
+    if(bin_size > 0) zoom_bin_sizes.push_back(bin_size);
+  }
+  std::sort(zoom_bin_sizes.begin(), zoom_bin_sizes.end());
+  zoom_bin_sizes.erase(
+    std::unique(zoom_bin_sizes.begin(), zoom_bin_sizes.end()), zoom_bin_sizes.end()
+  );
+}
+
 // Given a vector of pairs, chrID, and strand, write these to COV body
 // - Called from FragmentsMap::WriteBinary(covWriter *os, bool verbose)
 // - vec is an RLE of loci and depth
@@ -738,6 +1300,25 @@ int covWriter::WriteFragmentsMap(
   // job_size is the number of BGZF blocks this refID will occupy
   
   unsigned int refID = chrID + chrs.size() * strand;
+
+  if(is_streaming) {
+    // Queue this refID; compress and write once enough blocks are pending
+    if(refID != next_refID) {
+      cout << "ERROR: COV stream must be written in refID order\n";
+      return(-1);
+    }
+    pending_entry entry;
+    entry.vec = vec;
+    entry.chrID = chrID;
+    entry.refID = refID;
+    pending.push_back(entry);
+    pending_blocks += (job_size > 0 ? job_size : 1);
+    next_refID++;
+    stream_threads = n_threads_to_use;
+    if(pending_blocks >= 16 * stream_threads) return(FlushStream());
+    return(0);
+  }
+
   body.at(refID).resize(job_size);
   block_coord_starts.at(refID).resize(job_size);
   
@@ -745,39 +1326,309 @@ int covWriter::WriteFragmentsMap(
   #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
 #endif
   for(unsigned int i = 0; i < job_size; i++) {
-    stream_int32 i32;
-    stream_uint32 u32;
-    // Start coordinate for this bgzf block
-    block_coord_starts.at(refID).at(i) = (uint32_t)vec->at(i * vec_cap).first;
+    FillBodyBlock(vec, chrID, refID, i);
+  }
+  if(zoom_bin_sizes.size() > 0) {
+    WriteZoomEntry(vec, chrID, strand, n_threads_to_use);
+  }
+  return(0);
+}
+
+// Fills and compresses one body block of a refID. Internal
+void covWriter::FillBodyBlock(
+    std::vector< std::pair<unsigned int, int> > * vec,
+    unsigned int chrID, unsigned int refID, unsigned int block
+) {
+  unsigned int vec_cap = (BGZF_max / 8);
+  unsigned int vec_size = vec->size();
+  unsigned int i = block;
+  stream_int32 i32;
+  stream_uint32 u32;
+  // Start coordinate for this bgzf block
+  block_coord_starts.at(refID).at(i) = (uint32_t)vec->at(i * vec_cap).first;
+  
+  unsigned int cur_coord = vec->at(i * vec_cap).first;
+  
+  for(unsigned int j = i * vec_cap; j < (i+1) * vec_cap && j < vec_size; j++) {
     
-    unsigned int cur_coord = vec->at(i * vec_cap).first;
+    // if last entry, assume it extends till end of chromosome
+    if(j == vec_size - 1) {
+      if((unsigned int)chrs.at(chrID).chr_len > cur_coord) {
+        i32.i = vec->at(j).second;
+        body.at(refID).at(i).write(i32.c, 4);
+        
+        u32.u = (unsigned int)chrs.at(chrID).chr_len - cur_coord;
+        body.at(refID).at(i).write(u32.c, 4);
+      }
+      cur_coord = chrs.at(chrID).chr_len;   // This step is probably pointless
+    } else {
+      // Avoid writing zero-length RLE entries
+      if(vec->at(j + 1).first > cur_coord) {
+        i32.i = vec->at(j).second;
+        body.at(refID).at(i).write(i32.c, 4);
+        
+        u32.u = vec->at(j + 1).first - cur_coord;
+        body.at(refID).at(i).write(u32.c, 4);
+        cur_coord = vec->at(j + 1).first;
+      }
+    }
+  }
+  body.at(refID).at(i).Compress();
+}
+
+// Appends data as a single stored (uncompressed) BGZF block, whose size
+// (18 + 5 + len + 8) depends only on len
+static void append_stored_bgzf(std::string &dest, const char * data, const unsigned int len) {
+  stream_uint16 u16;
+  stream_uint32 u32;
+  dest.append(bamGzipHead, bamGzipHeadLength);
+  u16.u = 18 + 5 + len + 8 - 1;
+  dest.append(u16.c, 2);
+  dest.push_back((char)1);     // final stored deflate block
+  u16.u = len;
+  dest.append(u16.c, 2);
+  u16.u = ~u16.u;
+  dest.append(u16.c, 2);
+  dest.append(data, len);
+  u32.u = crc32(crc32(0L, NULL, 0L), (Bytef*)data, len);
+  dest.append(u32.c, 4);
+  u32.u = len;
+  dest.append(u32.c, 4);
+}
+
+static const unsigned int stored_bgzf_max = 65536 - 18 - 5 - 8;
+
+int covWriter::BeginStream(const std::vector<size_t> &rle_sizes, unsigned int n_threads_to_use) {
+  if(!OUT) {
+    cout << "No COV file set to write to";
+    return(-1);
+  }
+  if(chrs.size() == 0) {
+    cout << "ERROR: COV header missing\n";
+    return(-1);
+  }
+  if(rle_sizes.size() != 3 * chrs.size()) return(-1);
+  if(OUT->tellp() == std::streampos(-1)) return(-1);
+  
+  // The index size is known from the number of body blocks of each refID,
+  // so reserve it now and fill in the offsets once the body is written
+  unsigned int vec_cap = (BGZF_max / 8);
+  block_sizes.assign(3 * chrs.size(), std::vector<uint32_t>());
+  for(unsigned int i = 0; i < 3 * chrs.size(); i++) {
+    size_t n_blocks = (rle_sizes.at(i) + vec_cap - 1) / vec_cap;
+    if(n_blocks == 0) n_blocks = 1;    // WriteEmptyEntry
+    block_coord_starts.at(i).assign(n_blocks, 0);
+    block_sizes.at(i).assign(n_blocks, 0);
+  }
+
+  WriteHeaderToFile();
+  index_pos = OUT->tellp();
+  WriteStoredIndex();
+
+  is_streaming = true;
+  next_refID = 0;
+  pending.clear();
+  pending_blocks = 0;
+  stream_threads = n_threads_to_use;
+  return(0);
+}
+
+// Compresses all blocks of the pending refIDs in parallel, then writes them in order
+int covWriter::FlushStream() {
+  std::vector< std::pair<unsigned int, unsigned int> > jobs;  // pending entry, block
+  unsigned int vec_cap = (BGZF_max / 8);
+  for(unsigned int p = 0; p < pending.size(); p++) {
+    unsigned int refID = pending.at(p).refID;
+    size_t vec_size = pending.at(p).vec->size();
+    if(vec_size == 0) {
+      WriteEmptyEntry(refID);
+    } else {
+      unsigned int job_size = (vec_size + vec_cap - 1) / vec_cap;
+      body.at(refID).resize(job_size);
+      block_coord_starts.at(refID).resize(job_size);
+      for(unsigned int b = 0; b < job_size; b++) {
+        jobs.push_back(std::make_pair(p, b));
+      }
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for num_threads(stream_threads) schedule(dynamic,1)
+#endif
+  for(unsigned int k = 0; k < jobs.size(); k++) {
+    const pending_entry & entry = pending.at(jobs.at(k).first);
+    FillBodyBlock(entry.vec, entry.chrID, entry.refID, jobs.at(k).second);
+  }
+  
+  for(unsigned int p = 0; p < pending.size(); p++) {
+    const pending_entry & entry = pending.at(p);
+    unsigned int refID = entry.refID;
+    if(body.at(refID).size() != block_sizes.at(refID).size()) {
+      cout << "ERROR: COV stream was given a different RLE size than reserved\n";
+      return(-1);
+    }
+    for(unsigned int j = 0; j < body.at(refID).size(); j++) {
+      block_sizes.at(refID).at(j) = body.at(refID).at(j).getBGZFSize();
+      body.at(refID).at(j).WriteToFile(OUT);
+    }
+    std::vector<buffer_out_chunk>().swap(body.at(refID));
+    if(zoom_bin_sizes.size() > 0) {
+      WriteZoomEntry(entry.vec, entry.chrID, refID / chrs.size(), stream_threads);
+    }
+  }
+  pending.clear();
+  pending_blocks = 0;
+  return(0);
+}
+
+// Writes the index as stored BGZF blocks, whose total size does not depend on
+// the offsets, so the placeholder written by BeginStream can be overwritten in place
+int covWriter::WriteStoredIndex() {
+  stream_uint32 u32;
+  stream_uint64 u64;
+  std::string index_out;
+  uint64_t body_pos = 0;
+
+  for(unsigned int i = 0; i < 3 * chrs.size(); i++) {
+    std::string payload;
+    u32.u = 12 * block_sizes.at(i).size();
+    payload.append(u32.c, 4);
+    for(unsigned int j = 0; j < block_sizes.at(i).size(); j++) {
+      u32.u = block_coord_starts.at(i).at(j);
+      payload.append(u32.c, 4);
+      u64.u = body_pos;
+      payload.append(u64.c, 8);
+      body_pos += block_sizes.at(i).at(j);
+    }
+    for(size_t pos = 0; pos < payload.size(); pos += stored_bgzf_max) {
+      append_stored_bgzf(index_out, payload.data() + pos, 
+        std::min((size_t)stored_bgzf_max, payload.size() - pos));
+    }
+  }
+  OUT->write(index_out.data(), index_out.size());
+  return(0);
+}
+
+// Summarises the RLE of one refID into mean / max depth bins for each zoom level
+int covWriter::WriteZoomEntry(
+    std::vector< std::pair<unsigned int, int> > * vec, 
+    unsigned int chrID, unsigned int strand,
+    unsigned int n_threads_to_use
+) {
+  unsigned int refID = chrID + chrs.size() * strand;
+  uint32_t chr_len = (uint32_t)chrs.at(chrID).chr_len;
+  unsigned int bins_per_block = (BGZF_max / 8);
+
+  for(unsigned int l = 0; l < zoom_bin_sizes.size(); l++) {
+    uint64_t bin_size = zoom_bin_sizes.at(l);
+    size_t n_bins = (size_t)((chr_len + bin_size - 1) / bin_size);
+    std::vector<double> sums(n_bins, 0);
+    std::vector<int> maxes(n_bins, std::numeric_limits<int>::min());
     
-    for(unsigned int j = i * vec_cap; j < (i+1) * vec_cap && j < vec_size; j++) {
-      
-      // if last entry, assume it extends till end of chromosome
-      if(j == vec_size - 1) {
-        if((unsigned int)chrs.at(chrID).chr_len > cur_coord) {
-          i32.i = vec->at(j).second;
-          body.at(refID).at(i).write(i32.c, 4);
-          
-          u32.u = (unsigned int)chrs.at(chrID).chr_len - cur_coord;
-          body.at(refID).at(i).write(u32.c, 4);
-        }
-        cur_coord = chrs.at(chrID).chr_len;   // This step is probably pointless
-      } else {
-        // Avoid writing zero-length RLE entries
-        if(vec->at(j + 1).first > cur_coord) {
-          i32.i = vec->at(j).second;
-          body.at(refID).at(i).write(i32.c, 4);
-          
-          u32.u = vec->at(j + 1).first - cur_coord;
-          body.at(refID).at(i).write(u32.c, 4);
-          cur_coord = vec->at(j + 1).first;
-        }
+    // Depth is zero for any region not covered by vec
+    auto add_run = [&](uint64_t run_start, uint64_t run_end, int depth) {
+      if(run_end > chr_len) run_end = chr_len;
+      if(run_end <= run_start) return;
+      for(size_t b = run_start / bin_size; b <= (run_end - 1) / bin_size; b++) {
+        uint64_t overlap = std::min(run_end, (b + 1) * bin_size) - 
+          std::max(run_start, b * bin_size);
+        sums.at(b) += (double)depth * overlap;
+        if(depth > maxes.at(b)) maxes.at(b) = depth;
+      }
+    };
+    if(vec->size() == 0) {
+      add_run(0, chr_len, 0);
+    } else {
+      add_run(0, vec->at(0).first, 0);
+      for(unsigned int j = 0; j < vec->size(); j++) {
+        add_run(vec->at(j).first, 
+          j + 1 < vec->size() ? vec->at(j + 1).first : chr_len, vec->at(j).second);
       }
     }
-    body.at(refID).at(i).Compress();
+
+    unsigned int job_size = (n_bins + bins_per_block - 1) / bins_per_block;
+    zoom_body.at(l).at(refID).resize(job_size);
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(n_threads_to_use) schedule(static,1)
+#endif
+    for(unsigned int i = 0; i < job_size; i++) {
+      union { char c[4]; float f; } f32;
+      stream_int32 i32;
+      for(size_t b = (size_t)i * bins_per_block; 
+          b < (size_t)(i + 1) * bins_per_block && b < n_bins; b++) {
+        uint64_t bin_len = std::min((uint64_t)chr_len, (b + 1) * bin_size) - b * bin_size;
+        f32.f = (float)(sums.at(b) / bin_len);
+        zoom_body.at(l).at(refID).at(i).write(f32.c, 4);
+        i32.i = maxes.at(b);
+        zoom_body.at(l).at(refID).at(i).write(i32.c, 4);
+      }
+      zoom_body.at(l).at(refID).at(i).Compress();
+    }
   }
+  zoom_written.at(refID) = true;
+  return(0);
+}
+
+// Writes zoom body, zoom index and zoom trailer. Internal
+int covWriter::WriteZoomToFile() {
+  stream_uint32 u32;
+  stream_uint64 u64;
+  
+  for(unsigned int i = 0; i < 3 * chrs.size(); i++) {
+    if(!zoom_written.at(i)) {
+      std::vector< std::pair<unsigned int, int> > empty;
+      WriteZoomEntry(&empty, i % chrs.size(), i / chrs.size());
+    }
+  }
+
+  // Zoom body, building its index as it is written
+  std::string index;
+  u32.u = zoom_bin_sizes.size();
+  index.append(u32.c, 4);
+  u32.u = BGZF_max / 8;
+  index.append(u32.c, 4);
+
+  uint64_t zoom_body_size = 0;
+  for(unsigned int l = 0; l < zoom_bin_sizes.size(); l++) {
+    u32.u = zoom_bin_sizes.at(l);
+    index.append(u32.c, 4);
+    for(unsigned int i = 0; i < 3 * chrs.size(); i++) {
+      u32.u = zoom_body.at(l).at(i).size();
+      index.append(u32.c, 4);
+      for(unsigned int j = 0; j < zoom_body.at(l).at(i).size(); j++) {
+        u64.u = zoom_body_size;
+        index.append(u64.c, 8);
+        zoom_body_size += zoom_body.at(l).at(i).at(j).getBGZFSize();
+        zoom_body.at(l).at(i).at(j).WriteToFile(OUT);
+      }
+    }
+  }
+
+  // Zoom index
+  uint64_t zoom_index_size = 0;
+  for(size_t pos = 0; pos < index.size(); pos += BGZF_max) {
+    buffer_out_chunk index_chunk;
+    index_chunk.write(&index[pos], std::min((size_t)BGZF_max, index.size() - pos));
+    index_chunk.Compress();
+    zoom_index_size += index_chunk.getBGZFSize();
+    index_chunk.WriteToFile(OUT);
+  }
+
+  // Trailer: fixed-size stored block so readers can find it from the EOF block
+  char trailer_data[cov_zoom_trailer_data];
+  memcpy(trailer_data, cov_zoom_magic, 4);
+  u32.u = cov_zoom_version;
+  memcpy(trailer_data + 4, u32.c, 4);
+  u64.u = zoom_body_size;
+  memcpy(trailer_data + 8, u64.c, 8);
+  u64.u = zoom_index_size;
+  memcpy(trailer_data + 16, u64.c, 8);
+
+  std::string trailer;
+  append_stored_bgzf(trailer, trailer_data, cov_zoom_trailer_data);
+  OUT->write(trailer.data(), trailer.size());
+  
+  zoom_body.clear();
   return(0);
 }
 
@@ -792,6 +1643,30 @@ int covWriter::WriteToFile() {
     return(-1);
   }
   
+  if(is_streaming) {
+    // Any refIDs not given are written as empty entries
+    while(next_refID < 3 * chrs.size()) {
+      pending_entry entry;
+      entry.vec = &empty_vec;
+      entry.chrID = next_refID % chrs.size();
+      entry.refID = next_refID;
+      pending.push_back(entry);
+      next_refID++;
+    }
+    if(FlushStream() != 0) return(-1);
+    if(zoom_bin_sizes.size() > 0) WriteZoomToFile();
+    OUT->write(bamEOF, bamEOFlength);
+
+    // Back-patch the index now that all block sizes are known
+    std::streampos end_pos = OUT->tellp();
+    OUT->seekp(index_pos);
+    WriteStoredIndex();
+    OUT->seekp(end_pos);
+    OUT->flush();
+    is_streaming = false;
+    return(0);
+  }
+  
   WriteHeaderToFile();
   WriteIndexToFile();
   for(unsigned int i = 0; i < 3 * chrs.size(); i++) {
@@ -799,6 +1674,7 @@ int covWriter::WriteToFile() {
       body.at(i).at(j).WriteToFile(OUT);
     }
   }
+  if(zoom_bin_sizes.size() > 0) WriteZoomToFile();
 
   OUT->write(bamEOF, bamEOFlength);
   OUT->flush();
@@ -31,6 +31,9 @@ SOFTWARE.  */
 #include <zconf.h>
 
 #include "pbam_defs.hpp"
+#include "pbam_inflate.hpp"
+
+#include <list>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -55,11 +58,40 @@ union stream_uint16 {
 
 static const unsigned int BGZF_max = 65536 - 18 - 8;
 
+/*
+Optional zoom levels (covWriter::SetZoomLevels) are appended after the COV body,
+so readers that only use the index never see them:
+  [header][index][body][zoom body][zoom index][zoom trailer][BGZF EOF]
+Zoom body: per level, per refID, BGZF blocks of {float mean, int32 max} bins
+Zoom index: uint32 n_levels, uint32 bins_per_block, then per level:
+  uint32 bin_size, then per refID: uint32 n_blocks, n_blocks x uint64 offset
+  (relative to the start of the zoom body)
+Zoom trailer: a single stored (uncompressed) BGZF block of cov_zoom_trailer_size
+  bytes holding "COVZ", uint32 version, uint64 zoom body size, uint64 zoom index size
+*/
+static const char cov_zoom_magic[4] = {'C','O','V','Z'};
+static const uint32_t cov_zoom_version = 1;
+static const unsigned int cov_zoom_trailer_data = 4 + 4 + 8 + 8;
+static const unsigned int cov_zoom_trailer_size = 18 + 5 + cov_zoom_trailer_data + 8;
+static const uint32_t cov_zoom_default_bins[3] = {1000, 10000, 100000};
+
+// A single query for covReader::FetchRLEBatch. strand: 0 = -, 1 = +, 2 = *
+struct cov_region {
+  std::string seqname;
+  uint32_t start;
+  uint32_t end;
+  int strand;
+  
+  cov_region(std::string seq, uint32_t s, uint32_t e, int str) :
+    seqname(seq), start(s), end(e), strand(str) {};
+};
+
 class covReader {
 	private:
     // Buffers
     char * compressed_buffer;
     char * buffer;
+    pbam_inflater * inflater; // Inflates blocks for ReadBuffer(); created on first use
 
     unsigned long bufferPos;  // Position of decompressed buffer
     unsigned long bufferMax;  // Size of decompressed buffer
@@ -68,6 +100,13 @@ class covReader {
     uint32_t body_begin;      // File position of first byte of COV body
     
     istream * IN;
+
+    // Memory-mapped input (SetInputFile); compressed bytes are inflated in place
+    const char * map_data;
+    size_t map_size;
+    size_t map_pos;           // Read position within map_data
+    bool is_mapped;
+    std::ifstream * own_stream; // Used by SetInputFile where mmap is unavailable
     
     int IS_EOF;               // Set to 1 if istream hits eof()
     int IS_FAIL;              // Set to 1 if istream hits fail()
@@ -78,10 +117,36 @@ class covReader {
     std::vector<std::string> chr_names;   // seqnames
     std::vector<uint32_t> chr_lens;       // chromosome lengths
 
+    // Full index, loaded on first batch query. Per refID:
+    std::vector< std::vector<uint32_t> > block_coord_starts;  // start coord of each body block
+    std::vector< std::vector<uint64_t> > block_offsets;       // absolute file offset of each body block
+
+    // LRU cache of decompressed body blocks, keyed by file offset
+    size_t cache_capacity;
+    std::list<uint64_t> cache_order;      // most recently used at front
+    std::map< uint64_t, std::pair< std::list<uint64_t>::iterator, std::string > > cache;
+
+    void CloseInput();
+    void Seek(const size_t pos);
+    size_t Tell();
+
+    int LoadIndex();
+
+    // Zoom levels, loaded on first zoom query
+    int zoom_loaded;          // 0 = not checked, 1 = present, -1 = absent
+    std::vector<uint32_t> zoom_bin_sizes;
+    uint32_t zoom_bins_per_block;
+    std::vector< std::vector< std::vector<uint64_t> > > zoom_offsets;  // level, refID, block
+    int LoadZoom();
+    int FetchBlocks(const std::vector<uint64_t> &offsets, const unsigned int n_threads);
+    const std::string * GetBlock(const uint64_t offset);
+
   public:
     covReader();
     ~covReader();
     void SetInputHandle(std::istream *in_stream);
+    // Maps the file into memory (falls back to an owned ifstream). Returns 0 on success
+    int SetInputFile(const std::string &filename);
     
     int ReadBuffer();
     int read(char * dest, unsigned int len);
@@ -99,6 +164,26 @@ class covReader {
       const uint32_t start, const uint32_t end, const int strand,
       std::vector<int> * values, std::vector<unsigned int> * lengths
     );
+
+    // Batch queries: regions are sorted internally, the body blocks they touch are
+    // decompressed in parallel and kept in the LRU cache across calls.
+    // Results are returned in the order of regions; invalid regions give empty vectors.
+    void SetCacheSize(const size_t n_blocks);
+    int FetchRLEBatch(const std::vector<cov_region> &regions,
+      std::vector< std::vector<int> > &values,
+      std::vector< std::vector<unsigned int> > &lengths,
+      const unsigned int n_threads = 1
+    );
+
+    // Zoom levels: bin sizes in ascending order (empty if the file has none)
+    int GetZoomLevels(std::vector<uint32_t> &bin_sizes);
+    // Fetches the bins overlapping [start, end) at the coarsest level whose bin size
+    // is at most resolution. Returns -1 if no level fits (use FetchRLE instead)
+    int FetchZoom(const std::string seqname, 
+      const uint32_t start, const uint32_t end, const int strand,
+      const uint32_t resolution, uint32_t * bin_size,
+      std::vector<float> * means, std::vector<int> * maxes
+    );
 };
 
 
@@ -161,16 +246,54 @@ class covWriter {
     // The start coords of each bgzf
     std::vector< std::vector<uint32_t> > block_coord_starts;    
 
+    // Optional zoom levels (none by default)
+    std::vector<uint32_t> zoom_bin_sizes;
+    std::vector< std::vector< std::vector<buffer_out_chunk> > > zoom_body;   // level, refID
+    std::vector<bool> zoom_written;
+
+    // Streaming mode (BeginStream): body blocks are written as each batch of
+    // refIDs is compressed, and the index is back-patched by WriteToFile
+    struct pending_entry {
+      std::vector< std::pair<unsigned int, int> > * vec;
+      unsigned int chrID;
+      unsigned int refID;
+    };
+    bool is_streaming;
+    std::streampos index_pos;       // Position of the placeholder index
+    unsigned int next_refID;
+    std::vector<pending_entry> pending;
+    size_t pending_blocks;
+    unsigned int stream_threads;
+    std::vector< std::vector<uint32_t> > block_sizes;   // Compressed size of each body block
+    std::vector< std::pair<unsigned int, int> > empty_vec;
+
+    void FillBodyBlock(std::vector< std::pair<unsigned int, int> > * vec,
+      unsigned int chrID, unsigned int refID, unsigned int block);
+    int FlushStream();
+    int WriteStoredIndex();
+
     int WriteEmptyEntry(unsigned int refID);
     int WriteHeaderToFile();
     int WriteIndexToFile();
+    int WriteZoomEntry(
+      std::vector< std::pair<unsigned int, int> > * vec, 
+      unsigned int chrID, unsigned int strand,
+      unsigned int n_threads_to_use = 1
+    );
+    int WriteZoomToFile();
   public:
     covWriter();
     ~covWriter();
     
     void SetOutputHandle(std::ostream *out_stream);
+    // Call before InitializeCOV to store mean / max depth at these bin sizes
+    void SetZoomLevels(const std::vector<uint32_t> &bin_sizes);
     
     int InitializeCOV(std::vector<chr_entry> chrs_to_copy);
+    // Optional, after InitializeCOV: rle_sizes is the size of the vec that will be
+    // given to WriteFragmentsMap for each refID, which must then be called in refID
+    // order. Returns -1 (and stays in buffered mode) if the output is not seekable
+    int BeginStream(const std::vector<size_t> &rle_sizes, unsigned int n_threads_to_use = 1);
   
     int WriteFragmentsMap(
       std::vector< std::pair<unsigned int, int> > * vec, 
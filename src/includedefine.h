@@ -34,6 +34,7 @@ SOFTWARE.  */
 #include <map>        // std::map
 #include <algorithm>  // std::sort std::min std::max
 #include <functional> // std::function
+#include <memory>     // std::shared_ptr
 
 #include <math.h>
 
@@ -33,12 +33,16 @@ SOFTWARE.  */
 #include <cstring>    // To compare between strings
 #include <vector>     // For vector types
 #include <iostream>   // For cout
+#include <atomic>     // For dynamic read dispatch
+#include <algorithm>  // For sorting index regions
+#include <chrono>     // For decompression timing
 
 #ifdef _OPENMP
   #include <omp.h>    // For OpenMP
 #endif
 
 #include "pbam_defs.hpp"
+#include "pbam_inflate.hpp"
 #include "pbam1_t.hpp"
 #include "pbam_in.hpp"
 
@@ -126,6 +126,7 @@ class pbam1_t{
       - Be careful not to use these pointers to write to the read buffer
           otherwise you may corrupt the data.
     */
+    char * data();                          // Direct char pointer to record (from block_size)
     char * read_name();                     // Direct char pointer
     uint32_t * cigar();                     // Direct uint32_t pointer
     uint8_t * seq();                        // Direct uint8_t pointer       
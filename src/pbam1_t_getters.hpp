@@ -102,6 +102,11 @@ inline uint32_t pbam1_t::cigar_size() {
       otherwise you may corrupt the data.
 */
 
+inline char * pbam1_t::data() {
+  if(validate()) return(read_buffer);
+  return(NULL);
+}
+
 inline char * pbam1_t::read_name() {
   if(validate()) return((char*)(read_buffer + 36));
   return(NULL);
@@ -40,8 +40,12 @@ class pbam_in {
       // Size of data buffer for decompressed data (default 1 Gb)
       const unsigned int chunks_per_file_buffer, 
       // How many chunks per file buffer (default 5)
-      const bool read_file_using_multiple_threads = true  
+      const bool read_file_using_multiple_threads = true,
       // Whether to read threads in multi-threaded way (default true)
+      const bool pipeline_decompression = false
+      // Whether to decompress the next data buffer while reads from the
+      //   current buffer are being supplied (default false). Uses a second
+      //   data buffer of size data_buffer_cap. See decompressNext()
     );
     
     ~pbam_in();
@@ -110,12 +114,87 @@ class pbam_in {
     pbam1_t supplyRead(const unsigned int thread_id = 0);
     
     size_t remainingThreadReadsBuffer(const unsigned int thread_id = 0);
+
+    /*
+      Sets how fillReads() assigns reads to threads:
+      - chunk_bytes = 0 (default): the buffer is divided into n_threads
+          contiguous ranges, thread i being supplied the reads of range i
+      - chunk_bytes > 0: the buffer is divided into many read-aligned chunks
+          of about chunk_bytes each. When a thread has supplied all reads of
+          its current chunk, supplyRead() claims the next unclaimed chunk, so
+          threads with fast-to-process reads take on more of the buffer.
+          Each thread still receives its reads in file order. Chunks are not
+          cut between consecutive reads of the same name (i.e. paired reads
+          of name-sorted BAMs)
+      supplyRead(thread_id) is used in the same way for both modes.
+    */
+    void SetDispatchChunkSize(const size_t chunk_bytes) {
+      dispatch_chunk_size = chunk_bytes;
+    };
+
+    /*
+      Pipelined mode only (see constructor): runs the job_id-th share of the
+        decompression of the next data buffer, where job_id is between
+        [0, n_threads - 1].
+      This function is designed to be called within the same OpenMP parallel
+        loop that calls supplyRead(), so that threads that have finished
+        supplying their reads go on to decompress the next buffer, e.g.:
+        
+        #pragma omp parallel for num_threads(n) schedule(dynamic,1)
+        for(unsigned int i = 0; i < 2 * n; i++) {
+          if(i < n) { ...call supplyRead(i) until it returns an invalid read }
+          else decompressNext(i - n);
+        }
+        
+      Jobs not run by the time of the next fillReads() are run by fillReads()
+        itself; therefore calling this function is optional.
+    */
+    void decompressNext(const unsigned int job_id);
     
+    /*
+      Loads the BAM index (.bai or .csi) of the opened (coordinate-sorted) BAM.
+      If index_file is empty, looks for [bam].bai, [bam].csi, then 
+        [bam without .bam].bai
+      Must be called after openFile()
+      Returns 0 if success, or -1 if no index is found or it is corrupt
+    */
+    int LoadIndex(const std::string & index_file = "");
+    
+    bool HasIndex() {return(index_loaded);};
+    
+    // Returns the compressed size of the reads of a chromosome, as given by
+    //   the index. Returns 0 if the chromosome has no reads, or no index is loaded
+    size_t GetIndexedSize(const unsigned int refID);
+    
+    /*
+      Restricts reading to the reads of the given chromosomes (in refID order).
+      fillReads() will then only decompress the ranges of the file given by
+        the index, skipping all other data. Reads without a chromosome 
+        (unmapped reads) are skipped.
+      Must be called after LoadIndex(), and before the first call to fillReads()
+      Returns 0 if success, or -1 if error
+    */
+    int SetRegions(const std::vector<unsigned int> & refIDs);
+    
+    // Returns the sort order given by the SO tag of the @HD header line,
+    //   e.g. "coordinate", "queryname" or "unsorted"
+    // Returns an empty string if the header does not specify a sort order
+    std::string GetSortOrder() {return(sort_order);};
+
     // Returns the size of the opened BAM
     size_t GetFileSize() { return(IS_LENGTH); };
 
+    // Returns the number of compressed bytes to be read: the file size,
+    //   or the total size of the regions given by SetRegions()
+    size_t GetReadSize() { return(region_beg.size() > 0 ? regions_size : IS_LENGTH); };
+
     // Returns the number of bytes decompressed
     size_t GetProgress() {return(prog_tellg());};
+
+    // Returns the number of bytes inflated so far, and the time spent
+    //   inflating them (in seconds, summed over threads)
+    size_t GetBytesInflated() {return(bytes_inflated);};
+    double GetInflateTime() {return(inflate_secs);};
     
     int GetErrorState() {return(error_state);};
     /* 
@@ -135,6 +214,7 @@ class pbam_in {
     unsigned int    chunks_per_file_buf   = 5;    // Divide file buffer into n segments
     unsigned int    threads_to_use        = 1;
     bool            multiFileRead         = true;
+    bool            pipelined             = false;
     std::string     FILENAME;
 // File particulars
     std::ifstream    * IN;    
@@ -144,6 +224,7 @@ class pbam_in {
     char                        * magic_header;  // Always of size = 8
     uint32_t                    l_text;      // sizeof *headertext
     char                        * headertext;
+    std::string                 sort_order;  // SO tag of @HD line
     
 // Chromosomes:
     uint32_t                    n_ref;    
@@ -162,6 +243,9 @@ class pbam_in {
     char *          data_buf; 
     size_t          data_buf_cap; 
     size_t          data_buf_cursor;
+
+    char *          next_data_buf;    // Pipelined mode: buffer swapped with data_buf
+    char *          supply_buf;       // Buffer from which supplyRead() returns reads
 /* 
   Thread-specific read cursor positions and boundaries
   Thread returns a null read if cursor read_cursors >= read_ptr_ends
@@ -169,14 +253,63 @@ class pbam_in {
     std::vector<size_t>         read_cursors;     // Cursor(s) of start of next read in each thread
     std::vector<size_t>         read_ptr_ends;    // Boundaries of read positions in each thread
 
+// Dynamic dispatch: read-aligned chunks of the buffer, claimed in order by supplyRead()
+    size_t                      dispatch_chunk_size = 0;
+    std::vector<size_t>         chunk_starts;
+    std::vector<size_t>         chunk_ends;
+    std::atomic<size_t>         next_chunk;       // Index of next unclaimed chunk
+
 // Error state of decompression
     int error_state = 0;
 
+// Decompression plan: bgzf blocks from file_buf assigned to each job
+    std::vector<size_t>         src_bgzf_pos;     // source cursors
+    std::vector<size_t>         dest_bgzf_pos;    // dest cursors
+    std::vector<size_t>         src_bgzf_cap;     // source cap: when job should stop reading
+    std::vector<size_t>         dest_bgzf_cap;    // dest cap
+    unsigned int                decomp_threads = 1;
+    size_t                      spare_bytes_to_fill = 0;
+    bool                        decomp_error = false;
+    std::vector<double>         decomp_job_secs;  // Time taken by each job
+
+// Decompression statistics
+    size_t                      bytes_inflated = 0;
+    double                      inflate_secs = 0;
+
+// Pipelined mode: whether a decompression plan is pending, and which jobs are done
+    bool                        pipeline_pending = false;
+    std::vector<char>           decomp_jobs_done;
+
+
+// BAM index: virtual offsets of the first read and end of the last read of each chromosome
+    bool                        index_loaded = false;
+    std::vector<uint64_t>       index_beg;
+    std::vector<uint64_t>       index_end;
+
+// Region-restricted reading: merged ranges of virtual offsets to read
+    std::vector<uint64_t>       region_beg;
+    std::vector<uint64_t>       region_end;
+    std::vector<size_t>         region_stop;    // file offset after the last bgzf block to read
+    std::vector<size_t>         region_trim;    // bytes to discard from the end of that block
+    unsigned int                region_next = 0;
+    size_t                      regions_size = 0;   // Total compressed bytes of regions
+    size_t                      regions_done = 0;   // Compressed bytes of regions already read
+    
+    size_t                      read_start = 0;  // File offset where the current region starts
+    size_t                      read_end = 0;    // File offset where reading stops (IS_LENGTH if no regions)
+    size_t                      head_skip = 0;   // Decompressed bytes to skip at start of region
+    size_t                      tail_trim = 0;   // Decompressed bytes to discard at end of region
 
 // Internal functions
 
     void            check_threads(unsigned int n_threads_to_check);
     int             check_file();
+    
+    // Dynamic dispatch: divides the buffer into read-aligned chunks
+    void            assign_read_chunks();
+    // Dynamic dispatch: points a thread's cursors to the next unclaimed chunk
+    //   Returns false if all chunks have been claimed
+    bool            claim_read_chunk(const unsigned int thread_id);
 
 // *** Initialisers ***
     void            initialize_buffers();         // Initialises a pbam_in
@@ -219,6 +352,22 @@ class pbam_in {
     */
     size_t          decompress(const size_t n_bytes_to_decompress);
 
+    // The three stages of decompress(): plan the jobs, run each job, then commit
+    int             plan_decompress(const size_t n_bytes_to_decompress);
+    void            decompress_job(const unsigned int k);
+    size_t          finish_decompress();
+
+    // Pipelined mode: swaps data buffers and plans the next decompression
+    void            prime_pipeline();
+    // Pipelined mode: completes and commits the pending decompression
+    size_t          finish_pipeline();
+
+// *** Region-restricted reading ***
+    // Discards all buffered data, and moves the file cursor to the k-th region
+    int             start_region(const unsigned int k);
+    // Reads the BSIZE and ISIZE of the bgzf block at file offset coffset
+    int             read_bgzf_sizes(const size_t coffset, uint32_t & bsize, uint32_t & isize);
+
 // *** Internal functions used by readHeader() ***
     unsigned int read(char * dest, const unsigned int len);  // returns the number of bytes actually read
     unsigned int ignore(unsigned const int len);
@@ -230,13 +379,17 @@ class pbam_in {
 // *** File specific functions ***
     size_t tellg() {return((size_t)IN->tellg());};    // Returns position of file cursor
     
-    size_t prog_tellg() {                             // Returns the number of bytes decompressed
+    size_t buf_tellg() {                              // Returns file position of the next bgzf block to decompress
       return((size_t)IN->tellg()
         - (file_buf_cap-file_buf_cursor)
         - next_file_buf_cap
     ); };
     
-    bool eof() {return(IS_LENGTH <= tellg());};       // Returns whether end of file is reached
+    size_t prog_tellg() {                             // Returns the number of bytes decompressed
+      return(regions_done + buf_tellg() - read_start);
+    };
+    
+    bool eof() {return(read_end <= tellg());};        // Returns whether end of file (or region) is reached
     bool fail() {return(IN->fail());};                // Returns any ifstream errors
     
     size_t PROGRESS = 0;    // Value of prog_tellg() when IncProgress() is last called
@@ -248,6 +401,7 @@ class pbam_in {
 
 #include "pbam_in_constructors.hpp"
 #include "pbam_in_IO.hpp"
+#include "pbam_in_index.hpp"
 #include "pbam_in_decompress.hpp"
 #include "pbam_in_fillReads.hpp"
 #include "pbam_in_supplyRead.hpp"
@@ -74,6 +74,7 @@ inline int pbam_in::check_file() {
     // Assign IS_LENGTH
     IN->seekg(0, std::ios_base::end);
     IS_LENGTH = tellg();
+    read_end = IS_LENGTH;
     
     // Check valid BAM EOF:
     IN->seekg(IS_LENGTH-bamEOFlength, std::ios_base::beg);
@@ -118,6 +119,22 @@ inline int pbam_in::readHeader() {
   l_text = *u32;
   headertext = (char*)malloc(l_text + 1);
   read(headertext, l_text);
+  headertext[l_text] = '\0';
+  
+  // Sort order is given by the SO tag of the @HD line, which must be first
+  sort_order.clear();
+  if(l_text >= 3 && strncmp(headertext, "@HD", 3) == 0) {
+    const char * hd_end = (const char *)memchr(headertext, '\n', l_text);
+    std::string hd_line(headertext, 
+      hd_end ? (size_t)(hd_end - headertext) : (size_t)l_text);
+    size_t so_pos = hd_line.find("\tSO:");
+    if(so_pos != std::string::npos) {
+      so_pos += 4;
+      size_t so_end = hd_line.find_first_of("\t\r", so_pos);
+      if(so_end == std::string::npos) so_end = hd_line.size();
+      sort_order = hd_line.substr(so_pos, so_end - so_pos);
+    }
+  }
   
   char * u32c = (char*)malloc(5);
   read(u32c, 4);
@@ -34,7 +34,8 @@ inline pbam_in::pbam_in(
   const size_t data_buffer_cap,   // Default 1 Gb
   const unsigned int chunks_per_file_buffer,    // Default 5 - i.e. 40 Mb file chunks
   // File read triggers after each 40 Mb decompressed
-  const bool read_file_using_multiple_threads   // default true
+  const bool read_file_using_multiple_threads,  // default true
+  const bool pipeline_decompression             // default false
 ) {
   initialize_buffers();
   
@@ -54,6 +55,7 @@ inline pbam_in::pbam_in(
   chunks_per_file_buf = chunks_per_file_buffer;
   threads_to_use = 1;
   multiFileRead = read_file_using_multiple_threads;
+  pipelined = pipeline_decompression;
 }
 
 inline pbam_in::~pbam_in() {
@@ -37,8 +37,26 @@ SOFTWARE.  */
   Decompresses any data in file_buf to fill up to n_bytes_to_decompress in data_buf
 */
 inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
+  if(plan_decompress(n_bytes_to_decompress) != 0) return(0);
+  
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(threads_to_use) schedule(static,1)
+  #endif
+  for(unsigned int k = 0; k < threads_to_use; k++) {
+    decompress_job(k);
+  }
+  
+  return(finish_decompress());
+}
+
+/*
+  Prepares file buffers and divides the bgzf blocks to be decompressed into
+    threads_to_use jobs, stored in src/dest_bgzf_pos and src/dest_bgzf_cap.
+  Returns 0 if there is something to decompress, or 1 otherwise
+*/
+inline int pbam_in::plan_decompress(const size_t n_bytes_to_decompress) {
   clean_data_buffer(n_bytes_to_decompress);
-  if(n_bytes_to_decompress < data_buf_cap) return(0);
+  if(n_bytes_to_decompress < data_buf_cap) return(1);
   
   // The cursor to the data buffer to begin adding data
   size_t decomp_cursor = data_buf_cap;  
@@ -48,7 +66,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
   size_t chunk_size = (size_t)(FILE_BUFFER_CAP / chunks_per_file_buf);
 
   // Store an order to fill this maximum bytes to next_file_buf
-  size_t spare_bytes_to_fill = 0;   
+  spare_bytes_to_fill = 0;   
   if(!eof()) {
     if(next_file_buf_cap == 0) {
       // If secondary buffer is not yet in play, fill primary buffer first:
@@ -57,7 +75,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
         fill_file_buffer();
 
         // Ask to fill chunk_size amount to next_file_buf
-        spare_bytes_to_fill = std::min(chunk_size, IS_LENGTH - (size_t)tellg());
+        spare_bytes_to_fill = std::min(chunk_size, read_end - (size_t)tellg());
       } else {
         // If only asking for small amount of data, do not use full buffer
         // This is typically only called when header is read
@@ -87,7 +105,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
     // If EOF, only check when buffer needs to be swapped
     swap_file_buffer_if_needed();
     spare_bytes_to_fill = 0;
-    if(file_buf_cap == file_buf_cursor) return(0);  // Finished reading file buffer
+    if(file_buf_cap == file_buf_cursor) return(1);  // Finished reading file buffer
   }
 
   // No point asking for filling if next_file_buf is already at that level
@@ -95,7 +113,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
 
   // Set decomp_threads = threads_to_use - 1 to use asynchronous file reading
   //   using the remaining thread
-  unsigned int decomp_threads = threads_to_use;
+  decomp_threads = threads_to_use;
   if(spare_bytes_to_fill > 0) {
     if(decomp_threads > 1 && !multiFileRead) {
         decomp_threads--;
@@ -146,7 +164,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
 
   if(check_gzip_head) {
     cout << "BGZF blocks corrupt\n";
-    return(0);
+    return(1);
   }
 
   // Stores how much data to decompress,
@@ -156,10 +174,10 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
 
 // Divide the bgzf blocks among the number of decompression threads
 
-  std::vector<size_t> src_bgzf_pos;   // source cursors
-  std::vector<size_t> dest_bgzf_pos;  // dest cursors    
-  std::vector<size_t> src_bgzf_cap;   // source cap: when thread should stop reading
-  std::vector<size_t> dest_bgzf_cap;  // dest cap    
+  src_bgzf_pos.resize(0);   // source cursors
+  dest_bgzf_pos.resize(0);  // dest cursors    
+  src_bgzf_cap.resize(0);   // source cap: when thread should stop reading
+  dest_bgzf_cap.resize(0);  // dest cap    
 
   // Ensures src_divider * decomp_threads > src_max
   size_t src_divider = 1 + (src_max / decomp_threads);
@@ -192,7 +210,7 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
   if(src_cursor != src_max || dest_cursor != dest_max) {
     cout << "Error occurred during BGZF block counting\n"
       << "This should not have occurred. Please report to mod author\n";
-    return(0);
+    return(1);
   }
   
   // threads_accounted_for == (decomp_threads - 1)
@@ -209,91 +227,132 @@ inline size_t pbam_in::decompress(const size_t n_bytes_to_decompress) {
   src_bgzf_cap.push_back(file_buf_cursor + src_max);   
   dest_bgzf_cap.push_back(decomp_cursor + dest_max);
    
-  // Here, vector.size() == decomp_cursor
-   
-  // Now comes the multi-threaded decompression:
-  bool error_occurred = false;
-  
-  std::vector<z_stream> thread_streams(decomp_threads);
+  // Here, vector.size() == decomp_threads
+  decomp_error = false;
+  decomp_job_secs.assign(threads_to_use, 0);
+  return(0);
+}
+
+/*
+  Runs the k-th job of the current decompression plan, where k is between
+    [0, threads_to_use - 1]. Jobs touch disjoint parts of data_buf, and may
+    be run concurrently.
+  In asynchronous read, decomp_threads == threads_to_use - 1; the last job
+    primes the spare file buffer instead
+*/
+inline void pbam_in::decompress_job(const unsigned int k) {
+  if(k == decomp_threads) {
+    read_file_chunk_to_spare_buffer(spare_bytes_to_fill);
+    spare_bytes_to_fill = 0;
+    return;
+  }
+  if(k > decomp_threads) return;
+
+  size_t thread_src_cursor = src_bgzf_pos.at(k);
+  size_t thread_dest_cursor = dest_bgzf_pos.at(k);
   
-  #ifdef _OPENMP
-  #pragma omp parallel for num_threads(threads_to_use) schedule(static,1)
-  #endif
-  for(unsigned int k = 0; k < threads_to_use; k++) {
-    if(k == decomp_threads) {
-      // In asynchronous read, decomp_threads == threads_to_use - 1
-      // Therefore, this last thread is used to prime spare file buffer
-      read_file_chunk_to_spare_buffer(spare_bytes_to_fill);
-      spare_bytes_to_fill = 0;
-    } else {
-      size_t thread_src_cursor = src_bgzf_pos.at(k);
-      size_t thread_dest_cursor = dest_bgzf_pos.at(k);
-      
-      uint32_t crc = 0;
-      uint32_t * crc_check;
-      uint16_t * src_size;
-      uint32_t * dest_size;
-
-      z_stream * zs = &(thread_streams.at(k));
-      while(thread_src_cursor < src_bgzf_cap.at(k) && !error_occurred) {
-        src_size = (uint16_t *)(file_buf + thread_src_cursor + 16);
-        crc_check = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 8);
-        dest_size = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 4);
-
-        if(*dest_size > 0) {
-          // zs = new z_stream;
-          zs->zalloc = NULL; zs->zfree = NULL; zs->msg = NULL;
-          zs->next_in = (Bytef*)(file_buf + thread_src_cursor + 18);
-          zs->avail_in = *src_size + 1 - 18;
-          zs->next_out = (Bytef*)(data_buf + thread_dest_cursor);
-          zs->avail_out = *dest_size;
-
-          int ret = inflateInit2(zs, -15);
-          if(ret != Z_OK) {
-            cout << "Exception during BAM decompression - inflateInit2() fail: (" << ret << ") \n";
-            #ifdef _OPENMP
-            #pragma omp critical
-            #endif
-            error_occurred = true;
-          }
-          if(!error_occurred) {
-            ret = inflate(zs, Z_FINISH);
-            if(ret != Z_OK && ret != Z_STREAM_END) {
-              cout << "Exception during BAM decompression - inflate() fail: (" << ret << ") \n";
-              #ifdef _OPENMP
-              #pragma omp critical
-              #endif
-              error_occurred = true;
-            }
-          }
-          if(!error_occurred) {
-            ret = inflateEnd(zs);
-            crc = crc32(crc32(0L, NULL, 0L), (Bytef*)(data_buf + thread_dest_cursor), *dest_size);
-            if(*crc_check != crc) {
-              cout << "CRC fail during BAM decompression\n";
-              #ifdef _OPENMP
-              #pragma omp critical
-              #endif
-              error_occurred = true;
-            }
-          }
-          // delete zs;
-        }
-        thread_src_cursor += *src_size + 1;
-        thread_dest_cursor += *dest_size;
+  uint32_t * crc_check;
+  uint16_t * src_size;
+  uint32_t * dest_size;
+
+  auto job_start = std::chrono::steady_clock::now();
+  pbam_inflater inflater;
+  while(thread_src_cursor < src_bgzf_cap.at(k) && !decomp_error) {
+    src_size = (uint16_t *)(file_buf + thread_src_cursor + 16);
+    crc_check = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 8);
+    dest_size = (uint32_t *)(file_buf + thread_src_cursor + *src_size+1 - 4);
+
+    if(*dest_size > 0) {
+      int ret = inflater.inflate_raw(
+        file_buf + thread_src_cursor + 18, *src_size + 1 - 18 - 8,
+        data_buf + thread_dest_cursor, *dest_size, *crc_check
+      );
+      if(ret != Z_OK) {
+        cout << "Exception during BAM decompression - inflate or CRC fail: (" << ret << ") \n";
+        #ifdef _OPENMP
+        #pragma omp critical
+        #endif
+        decomp_error = true;
       }
     }
-    
+    thread_src_cursor += *src_size + 1;
+    thread_dest_cursor += *dest_size;
   }
-  
-  if(error_occurred) {
+  decomp_job_secs.at(k) = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - job_start).count();
+}
+
+// Commits the completed decompression plan to the file and data buffers
+// Returns the number of bytes decompressed, or 0 if error
+inline size_t pbam_in::finish_decompress() {
+  if(decomp_error) {
     cout << "Decompression failed at " << GetProgress() << " bytes\n";
     return(0);
   }
+  size_t dest_added = dest_bgzf_cap.at(dest_bgzf_cap.size() - 1) - 
+    dest_bgzf_pos.at(0);
   file_buf_cursor = src_bgzf_cap.at(src_bgzf_cap.size() - 1);
   data_buf_cap = dest_bgzf_cap.at(dest_bgzf_cap.size() - 1);
+  bytes_inflated += dest_added;
+  for(unsigned int k = 0; k < decomp_job_secs.size(); k++) {
+    inflate_secs += decomp_job_secs.at(k);
+  }
+
+  // Region-restricted reading: the last block of the region has been
+  //   decompressed; discard the data after the region's last read
+  if(tail_trim > 0 && eof() && next_file_buf_cap == 0 && 
+      file_buf_cursor == file_buf_cap) {
+    data_buf_cap -= tail_trim;
+    dest_added -= tail_trim;
+    tail_trim = 0;
+  }
 
-  return(dest_cursor);
+  return(dest_added);
+}
+
+/*
+  Pipelined mode: called by fillReads() once reads have been assigned to
+    threads. The buffer holding the assigned reads becomes supply_buf, and
+    the residual data (the incomplete read at its end) is copied to the
+    spare data buffer, which becomes data_buf. The next chunk is then
+    planned so that decompressNext() can fill data_buf while reads are
+    being supplied from supply_buf.
+*/
+inline void pbam_in::prime_pipeline() {
+  size_t residual = data_buf_cap - data_buf_cursor;
+  
+  char * data_tmp = data_buf;
+  data_buf = next_data_buf;
+  next_data_buf = data_tmp;
+  supply_buf = next_data_buf;
+  
+  data_buf = (char*)realloc(data_tmp = data_buf, DATA_BUFFER_CAP + 1);
+  if(residual > 0) {
+    memcpy(data_buf, supply_buf + data_buf_cursor, residual);
+  }
+  data_buf_cap = residual;
+  data_buf_cursor = 0;
+
+  pipeline_pending = (plan_decompress(DATA_BUFFER_CAP) == 0);
+  decomp_jobs_done.assign(threads_to_use, 0);
+}
+
+/*
+  Pipelined mode: runs any decompression jobs not already run by
+    decompressNext(), then commits the pending decompression.
+  Returns the number of bytes decompressed, or 0 if error
+*/
+inline size_t pbam_in::finish_pipeline() {
+  pipeline_pending = false;
+  
+  #ifdef _OPENMP
+  #pragma omp parallel for num_threads(threads_to_use) schedule(static,1)
+  #endif
+  for(unsigned int k = 0; k < threads_to_use; k++) {
+    if(decomp_jobs_done.at(k) == 0) decompress_job(k);
+  }
+  
+  return(finish_decompress());
 }
 
 // *************** Internal functions run by decompress() *********************
@@ -458,7 +517,7 @@ inline size_t pbam_in::load_from_file(const size_t n_bytes) {
   size_t residual = file_buf_cap-file_buf_cursor;
 
   size_t n_bytes_to_load =  std::min( std::max(n_bytes, residual) , FILE_BUFFER_CAP);  // Cap at file buffer
-  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, IS_LENGTH - tellg());
+  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, read_end - tellg());
   if(n_bytes_to_read == 0) return(0);
   // cout << "\nload_from file: n_bytes_to_read = " << n_bytes_to_read << '\n';
   // Remove residual bytes to beginning of buffer:
@@ -499,7 +558,7 @@ inline size_t pbam_in::read_file_chunk_to_spare_buffer(const size_t n_bytes) {
   if(FILE_BUFFER_CAP <= residual) return(0);
   
   size_t n_bytes_to_load =  std::min( std::max(n_bytes, residual) , FILE_BUFFER_CAP);  // Cap at file buffer
-  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, IS_LENGTH - tellg());  
+  size_t n_bytes_to_read = std::min(n_bytes_to_load - residual, read_end - tellg());  
   if(n_bytes_to_read == 0) return(0);
   
   // Initialize next_file_buf here:
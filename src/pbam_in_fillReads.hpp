@@ -47,20 +47,46 @@ inline int pbam_in::fillReads() {
       }
     }
   }
+  if(next_chunk < chunk_starts.size()) {
+    cout << "Read chunks remain unclaimed. Please debug your code "
+      << "and make sure all threads clear their reads before filling any more reads\n";
+    error_state = -1;
+    return(-1);
+  }
   
   // Clear read pointers:
   read_cursors.resize(0);
   read_ptr_ends.resize(0);
+  chunk_starts.resize(0);
+  chunk_ends.resize(0);
+  next_chunk = 0;
   
-  // Call decompress
-  size_t bytes_decompressed = decompress(DATA_BUFFER_CAP);
-  if(bytes_decompressed == 0) {
-    if(GetProgress() != GetFileSize()) {
+  // Call decompress, or complete the decompression started in pipelined mode
+  // In region-restricted mode, move on to the next region once the current
+  //   region has been read
+  size_t bytes_decompressed = 0;
+  while(bytes_decompressed == 0) {
+    if(pipeline_pending) {
+      bytes_decompressed = finish_pipeline();
+    } else {
+      bytes_decompressed = decompress(DATA_BUFFER_CAP);
+    }
+    if(bytes_decompressed > 0) break;
+    if(buf_tellg() != read_end) {
       cout << "Error occurred during decompression\n";
       error_state = -1;
       return(-1);
     }
-    return(1);
+    if(region_next >= region_beg.size()) return(1);
+    if(start_region(region_next++) != 0) {
+      error_state = -1;
+      return(-1);
+    }
+  }
+  // First decompression of a region: skip to its first read
+  if(head_skip > 0) {
+    data_buf_cursor += std::min(head_skip, data_buf_cap - data_buf_cursor);
+    head_skip = 0;
   }
   
   // Check decompressed data contains at least 1 full read  
@@ -69,6 +95,16 @@ inline int pbam_in::fillReads() {
   u32p = (uint32_t *)(data_buf + data_buf_cursor);
   if(*u32p + 4 > data_buf_cap - data_buf_cursor) return(1);
 
+  if(dispatch_chunk_size > 0) {
+    assign_read_chunks();
+    if(pipelined) {
+      prime_pipeline();
+    } else {
+      supply_buf = data_buf;
+    }
+    return(0);
+  }
+
   // Roughly divide the buffer into N regions:
   size_t data_divider = 1 + ((data_buf_cap - data_buf_cursor) / threads_to_use);
   size_t next_divider = std::min(data_buf_cursor + data_divider, data_buf_cap);
@@ -102,9 +138,66 @@ inline int pbam_in::fillReads() {
   }
   read_ptr_ends.push_back(data_buf_cursor);
 
+  if(pipelined) {
+    prime_pipeline();
+  } else {
+    supply_buf = data_buf;
+  }
   return(0);
 }
 
+// Dynamic dispatch: divides the buffer into chunks of whole reads, each at least
+//   dispatch_chunk_size bytes (except the last). Threads start with no reads;
+//   supplyRead() claims chunks for them
+inline void pbam_in::assign_read_chunks() {
+  uint32_t *u32p;
+  size_t prev_read = data_buf_cursor;
+  size_t next_divider = data_buf_cursor + dispatch_chunk_size;
+  chunk_starts.push_back(data_buf_cursor);
+  while(1) {
+    // Checks remaining data contains at least 1 full read; breaks otherwise
+    if(data_buf_cap - data_buf_cursor < 4) break;
+    u32p = (uint32_t *)(data_buf + data_buf_cursor);
+    if(*u32p + 4 > data_buf_cap - data_buf_cursor) break;
+    
+    if(data_buf_cursor >= next_divider) {
+      // Keeps reads of the same name in the same chunk
+      pbam1_t prev(data_buf + prev_read, false);
+      pbam1_t cur(data_buf + data_buf_cursor, false);
+      if(prev.l_read_name() != cur.l_read_name() ||
+          0 != strncmp(prev.read_name(), cur.read_name(), cur.l_read_name())) {
+        chunk_ends.push_back(data_buf_cursor);
+        chunk_starts.push_back(data_buf_cursor);
+        next_divider = data_buf_cursor + dispatch_chunk_size;
+      }
+    }
+    prev_read = data_buf_cursor;
+    data_buf_cursor += *u32p + 4;
+  }
+  chunk_ends.push_back(data_buf_cursor);
+  
+  read_cursors.assign(threads_to_use, data_buf_cursor);
+  read_ptr_ends.assign(threads_to_use, data_buf_cursor);
+  next_chunk = 0;
+}
+
+inline bool pbam_in::claim_read_chunk(const unsigned int thread_id) {
+  if(next_chunk >= chunk_starts.size()) return(false);
+  size_t k = next_chunk.fetch_add(1);
+  if(k >= chunk_starts.size()) return(false);
+  read_cursors.at(thread_id) = chunk_starts.at(k);
+  read_ptr_ends.at(thread_id) = chunk_ends.at(k);
+  return(true);
+}
+
+inline void pbam_in::decompressNext(const unsigned int job_id) {
+  if(!pipeline_pending) return;
+  if(job_id >= decomp_jobs_done.size()) return;
+  if(decomp_jobs_done.at(job_id) != 0) return;
+  decompress_job(job_id);
+  decomp_jobs_done.at(job_id) = 1;
+}
+
 // Internal
 inline size_t pbam_in::remainingThreadReadsBuffer(const unsigned int thread_id) {
   if(thread_id > threads_to_use) {
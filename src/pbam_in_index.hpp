@@ -0,0 +1,274 @@
+/* pbam_in_index.hpp pbam_in BAM index and region-restricted reading
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_in_index
+#define _pbam_in_index
+
+/*
+  BAM indices (.bai / .csi) give, for each chromosome, the virtual offsets
+    of its first read and the end of its last read (the "pseudo-bin"), or
+    else the chunks of each bin, from which these are derived.
+  A virtual offset is (coffset << 16 | uoffset), where coffset is the file
+    offset of a bgzf block, and uoffset the offset within its decompressed data.
+  .bai files are uncompressed and .csi files are BGZF-compressed; both are
+    read using gzread, which reads uncompressed files as is.
+*/
+
+// Public functions:
+
+inline int pbam_in::LoadIndex(const std::string & index_file) {
+  if(!magic_header) {
+    cout << "Header is not yet read\n";
+    return(-1);
+  }
+  
+  std::vector<std::string> candidates;
+  if(index_file.size() > 0) {
+    candidates.push_back(index_file);
+  } else {
+    candidates.push_back(FILENAME + ".bai");
+    candidates.push_back(FILENAME + ".csi");
+    if(FILENAME.size() > 4 && FILENAME.substr(FILENAME.size() - 4) == ".bam") {
+      candidates.push_back(FILENAME.substr(0, FILENAME.size() - 4) + ".bai");
+    }
+  }
+  
+  gzFile gz = NULL;
+  for(unsigned int i = 0; i < candidates.size() && !gz; i++) {
+    gz = gzopen(candidates.at(i).c_str(), "rb");
+  }
+  if(!gz) return(-1);
+  
+  bool ok = true;
+  auto gz_read = [&](void * dest, const unsigned int len) {
+    if(ok && gzread(gz, dest, len) != (int)len) ok = false;
+    return(ok);
+  };
+  
+  char magic[4];
+  gz_read(magic, 4);
+  bool is_csi = ok && memcmp(magic, "CSI\1", 4) == 0;
+  if(!ok || (!is_csi && memcmp(magic, "BAI\1", 4) != 0)) {
+    cout << "Invalid BAM index magic string\n";
+    gzclose(gz);
+    return(-1);
+  }
+  
+  // The pseudo-bin is one past the last bin of the binning scheme
+  uint32_t pseudo_bin = 37450;
+  if(is_csi) {
+    int32_t min_shift = 0; int32_t depth = 0; int32_t l_aux = 0;
+    gz_read(&min_shift, 4); gz_read(&depth, 4); gz_read(&l_aux, 4);
+    if(!ok || depth < 0 || depth > 9 || l_aux < 0) {
+      cout << "BAM index is corrupt\n";
+      gzclose(gz);
+      return(-1);
+    }
+    pseudo_bin = ((1u << ((depth + 1) * 3)) - 1) / 7 + 1;
+    std::vector<char> aux(l_aux + 1);
+    if(l_aux > 0) gz_read(aux.data(), (unsigned int)l_aux);
+  }
+  
+  int32_t n_ref_index = 0;
+  gz_read(&n_ref_index, 4);
+  if(!ok || n_ref_index != (int32_t)n_ref) {
+    cout << "BAM index does not match the BAM header\n";
+    gzclose(gz);
+    return(-1);
+  }
+
+  index_beg.assign(n_ref, 0);
+  index_end.assign(n_ref, 0);
+  for(unsigned int i = 0; i < n_ref && ok; i++) {
+    int32_t n_bin = 0;
+    gz_read(&n_bin, 4);
+    uint64_t min_beg = (uint64_t)-1; uint64_t max_end = 0;
+    bool has_pseudo = false;
+    for(int32_t j = 0; j < n_bin && ok; j++) {
+      uint32_t bin = 0; uint64_t loffset = 0; int32_t n_chunk = 0;
+      gz_read(&bin, 4);
+      if(is_csi) gz_read(&loffset, 8);
+      gz_read(&n_chunk, 4);
+      for(int32_t k = 0; k < n_chunk && ok; k++) {
+        uint64_t chunk[2];
+        gz_read(chunk, 16);
+        if(bin == pseudo_bin) {
+          // First pseudo-chunk: offsets of first and last reads; second: read counts
+          if(k == 0) {
+            index_beg.at(i) = chunk[0];
+            index_end.at(i) = chunk[1];
+            has_pseudo = true;
+          }
+          continue;
+        }
+        min_beg = std::min(min_beg, chunk[0]);
+        max_end = std::max(max_end, chunk[1]);
+      }
+    }
+    if(!has_pseudo && max_end > 0) {
+      index_beg.at(i) = min_beg;
+      index_end.at(i) = max_end;
+    }
+    if(!is_csi) {
+      // Linear index is not used
+      int32_t n_intv = 0;
+      gz_read(&n_intv, 4);
+      for(int32_t k = 0; k < n_intv && ok; k++) {
+        uint64_t ioffset;
+        gz_read(&ioffset, 8);
+      }
+    }
+  }
+  gzclose(gz);
+  
+  if(!ok) {
+    cout << "BAM index is truncated or corrupt\n";
+    index_beg.resize(0);
+    index_end.resize(0);
+    return(-1);
+  }
+  index_loaded = true;
+  return(0);
+}
+
+inline size_t pbam_in::GetIndexedSize(const unsigned int refID) {
+  if(!index_loaded || refID >= n_ref) return(0);
+  if(index_end.at(refID) <= index_beg.at(refID)) return(0);
+  // Count at least one block for chromosomes whose reads lie within one block
+  return((size_t)(index_end.at(refID) >> 16) - (size_t)(index_beg.at(refID) >> 16) + 1);
+}
+
+inline int pbam_in::SetRegions(const std::vector<unsigned int> & refIDs) {
+  if(!index_loaded) {
+    cout << "BAM index is not loaded\n";
+    return(-1);
+  }
+  if(read_cursors.size() > 0) {
+    cout << "Regions must be set before reads are filled\n";
+    return(-1);
+  }
+  
+  std::vector< std::pair<uint64_t, uint64_t> > ranges;
+  for(auto refID : refIDs) {
+    if(refID >= n_ref) {
+      cout << "Chromosome " << refID << " is not in the BAM header\n";
+      return(-1);
+    }
+    if(index_end.at(refID) > index_beg.at(refID)) {
+      ranges.push_back(std::make_pair(index_beg.at(refID), index_end.at(refID)));
+    }
+  }
+  std::sort(ranges.begin(), ranges.end());
+
+  // Merge contiguous ranges, so they are read without seeking
+  region_beg.resize(0); region_end.resize(0);
+  region_stop.resize(0); region_trim.resize(0);
+  for(auto & range : ranges) {
+    if(region_end.size() > 0 && range.first <= region_end.back()) {
+      region_end.back() = std::max(region_end.back(), range.second);
+    } else {
+      region_beg.push_back(range.first);
+      region_end.push_back(range.second);
+    }
+  }
+  
+  // Work out where reading stops: if the last read ends within a block,
+  //   that block is read, and the data after the read is discarded
+  regions_size = 0;
+  for(unsigned int k = 0; k < region_beg.size(); k++) {
+    size_t end_coffset = (size_t)(region_end.at(k) >> 16);
+    size_t end_uoffset = (size_t)(region_end.at(k) & 0xFFFF);
+    size_t stop = end_coffset;
+    size_t trim = 0;
+    if(end_uoffset > 0) {
+      uint32_t bsize = 0; uint32_t isize = 0;
+      if(read_bgzf_sizes(end_coffset, bsize, isize) != 0 || end_uoffset > isize) {
+        cout << "BAM index does not match the BAM file\n";
+        return(-1);
+      }
+      stop += bsize;
+      trim = isize - end_uoffset;
+    }
+    region_stop.push_back(stop);
+    region_trim.push_back(trim);
+    regions_size += stop - (size_t)(region_beg.at(k) >> 16);
+  }
+
+  regions_done = 0;
+  region_next = 0;
+  int ret = 0;
+  if(region_beg.size() > 0) {
+    ret = start_region(region_next++);
+  } else {
+    // No reads to read: stop reading right here
+    file_buf_cap = 0; file_buf_cursor = 0;
+    next_file_buf_cap = 0;
+    data_buf_cap = 0; data_buf_cursor = 0;
+    read_start = tellg();
+    read_end = read_start;
+    tail_trim = 0; head_skip = 0;
+  }
+  PROGRESS = prog_tellg();
+  return(ret);
+}
+
+// Internals
+
+inline int pbam_in::read_bgzf_sizes(const size_t coffset, uint32_t & bsize, uint32_t & isize) {
+  char head[18];
+  IN->clear();
+  IN->seekg(coffset, std::ios_base::beg);
+  IN->read(head, 18);
+  if(IN->fail() || strncmp(bamGzipHead, head, bamGzipHeadLength) != 0) return(-1);
+  bsize = (uint32_t)(*(uint16_t*)(head + 16)) + 1;
+  IN->seekg(coffset + bsize - 4, std::ios_base::beg);
+  IN->read(head, 4);
+  if(IN->fail()) return(-1);
+  isize = *(uint32_t*)head;
+  return(0);
+}
+
+inline int pbam_in::start_region(const unsigned int k) {
+  if(k >= region_beg.size()) return(-1);
+  if(k > 0) regions_done += read_end - read_start;
+  
+  // Discard buffered data from the previous region
+  file_buf_cap = 0; file_buf_cursor = 0;
+  next_file_buf_cap = 0;
+  data_buf_cap = 0; data_buf_cursor = 0;
+  pipeline_pending = false;
+  
+  read_start = (size_t)(region_beg.at(k) >> 16);
+  read_end = region_stop.at(k);
+  head_skip = (size_t)(region_beg.at(k) & 0xFFFF);
+  tail_trim = region_trim.at(k);
+  
+  IN->clear();
+  IN->seekg(read_start, std::ios_base::beg);
+  if(IN->fail()) {
+    cout << "Unable to seek to " << read_start << " in BAM file\n";
+    return(-1);
+  }
+  return(0);
+}
+
+#endif
@@ -28,18 +28,30 @@ SOFTWARE.  */
 inline void pbam_in::initialize_buffers() {
   // Empty buffer pointers
   file_buf = NULL;  data_buf = NULL;  next_file_buf = NULL;
+  next_data_buf = NULL; supply_buf = NULL;
   // Empty capacities and cursors
   file_buf_cap = 0; file_buf_cursor = 0;
   data_buf_cap = 0; data_buf_cursor = 0;
   next_file_buf_cap = 0; next_file_buf_cursor = 0;
   // Empty BAM header info
   magic_header = NULL; l_text = 0; headertext = NULL; n_ref = 0;
+  sort_order.clear();
   chr_names.resize(0); chr_lens.resize(0);
   // Clears file name string
   FILENAME.clear();
 
   // Empties cursors for thread-specific reads
   read_cursors.resize(0); read_ptr_ends.resize(0);
+  chunk_starts.resize(0); chunk_ends.resize(0); next_chunk = 0;
+  pipeline_pending = false; decomp_jobs_done.resize(0);
+  decomp_job_secs.resize(0); bytes_inflated = 0; inflate_secs = 0;
+
+  // Clears index and regions
+  index_loaded = false; index_beg.resize(0); index_end.resize(0);
+  region_beg.resize(0); region_end.resize(0);
+  region_stop.resize(0); region_trim.resize(0);
+  region_next = 0; regions_size = 0; regions_done = 0;
+  read_start = 0; read_end = 0; head_skip = 0; tail_trim = 0;
 
   // Clears handle to ifstream
   IN = NULL;
@@ -60,6 +72,9 @@ inline void pbam_in::clear_buffers() {
   data_buf = NULL;
   if(next_file_buf) free(next_file_buf); 
   next_file_buf = NULL;
+  if(next_data_buf) free(next_data_buf); 
+  next_data_buf = NULL;
+  supply_buf = NULL;
   file_buf_cap = 0; file_buf_cursor = 0;
   data_buf_cap = 0; data_buf_cursor = 0;
   next_file_buf_cap = 0; next_file_buf_cursor = 0;
@@ -69,12 +84,27 @@ inline void pbam_in::clear_buffers() {
   magic_header = NULL;
   if(headertext) free(headertext); 
   headertext = NULL;  
-  l_text = 0; n_ref = 0;
+  l_text = 0; n_ref = 0; sort_order.clear();
   chr_names.resize(0); chr_lens.resize(0);
 
   // Empties cursors for thread-specific reads
   read_cursors.resize(0);
   read_ptr_ends.resize(0);
+  chunk_starts.resize(0);
+  chunk_ends.resize(0);
+  next_chunk = 0;
+  pipeline_pending = false;
+  decomp_jobs_done.resize(0);
+  decomp_job_secs.resize(0);
+  bytes_inflated = 0;
+  inflate_secs = 0;
+
+  // Clears index and regions
+  index_loaded = false; index_beg.resize(0); index_end.resize(0);
+  region_beg.resize(0); region_end.resize(0);
+  region_stop.resize(0); region_trim.resize(0);
+  region_next = 0; regions_size = 0; regions_done = 0;
+  read_start = 0; read_end = 0; head_skip = 0; tail_trim = 0;
 
   // Clears handle to ifstream
   IN = NULL;
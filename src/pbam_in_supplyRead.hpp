@@ -30,9 +30,10 @@ inline pbam1_t pbam_in::supplyRead(const unsigned int thread_id) {
     return(read);
   }
   if(read_cursors.at(thread_id) >= read_ptr_ends.at(thread_id)) {
-    return(read);
+    // Dynamic dispatch: moves on to the next unclaimed chunk
+    if(!claim_read_chunk(thread_id)) return(read);
   }
-  read = pbam1_t(data_buf + read_cursors.at(thread_id), false);
+  read = pbam1_t(supply_buf + read_cursors.at(thread_id), false);
   if(read.validate()) {
     read_cursors.at(thread_id) += read.block_size() + 4;
   } else {
@@ -0,0 +1,256 @@
+/* pbam_inflate.hpp ompBAM BGZF block inflate backends
+
+Copyright (C) 2021 Alex Chit Hei Wong
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.  */
+
+#ifndef _pbam_inflate
+#define _pbam_inflate
+
+/*
+  BGZF blocks are at most 64 kb, and their uncompressed size (ISIZE) is known
+    before they are inflated, so they can be decoded in one shot by
+    whole-buffer decoders that are faster than zlib's streaming inflate().
+
+  Backends are detected at compile time (see configure), by defining:
+  - PBAM_HAVE_LIBDEFLATE  (links -ldeflate; skipped if NXTIRF_USE_LIBDEFLATE=no)
+  - PBAM_HAVE_ISAL        (links -lisal; only tried if NXTIRF_USE_ISAL=yes)
+  zlib is always available. libdeflate is the default where present; ISA-L is
+    experimental and is never picked by default, only through an explicit
+    call to pbam_set_inflate_backend(), which selects the backend used by
+    pbam_inflater objects created afterwards.
+
+  CRC32 checks use the fastest implementation compiled in (libdeflate and
+    ISA-L both use carry-less multiply instructions where the CPU has them),
+    or can be skipped altogether.
+*/
+
+#include <zlib.h>
+#include <stdint.h>
+#include <cstring>
+#include <string>
+
+#include "pbam_defs.hpp"
+
+#ifdef PBAM_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#ifdef PBAM_HAVE_ISAL
+#include <isa-l/igzip_lib.h>
+#include <isa-l/crc.h>
+#endif
+
+enum pbam_inflate_backend {
+  PBAM_INFLATE_ZLIB = 0,
+  PBAM_INFLATE_LIBDEFLATE = 1,
+  PBAM_INFLATE_ISAL = 2
+};
+static const int pbam_inflate_n_backends = 3;
+
+inline const char * pbam_inflate_backend_name(const int backend) {
+  switch(backend) {
+    case PBAM_INFLATE_ZLIB: return("zlib");
+    case PBAM_INFLATE_LIBDEFLATE: return("libdeflate");
+    case PBAM_INFLATE_ISAL: return("isa-l");
+  }
+  return("unknown");
+}
+
+inline bool pbam_inflate_available(const int backend) {
+  switch(backend) {
+    case PBAM_INFLATE_ZLIB: return(true);
+#ifdef PBAM_HAVE_LIBDEFLATE
+    case PBAM_INFLATE_LIBDEFLATE: return(true);
+#endif
+#ifdef PBAM_HAVE_ISAL
+    case PBAM_INFLATE_ISAL: return(true);
+#endif
+  }
+  return(false);
+}
+
+// libdeflate if compiled in, otherwise zlib. ISA-L must be selected explicitly
+inline int pbam_inflate_default_backend() {
+#if defined(PBAM_HAVE_LIBDEFLATE)
+  return(PBAM_INFLATE_LIBDEFLATE);
+#else
+  return(PBAM_INFLATE_ZLIB);
+#endif
+}
+
+// Process-wide settings, used by pbam_inflater objects as they are created
+struct pbam_inflate_settings {
+  int backend;
+  bool verify_crc;
+};
+
+inline pbam_inflate_settings & pbam_inflate_global() {
+  static pbam_inflate_settings settings = {pbam_inflate_default_backend(), true};
+  return(settings);
+}
+
+// Selects the inflate backend; backends not compiled in fall back to the default.
+//   Returns the backend that will be used
+inline int pbam_set_inflate_backend(const int backend, const bool verify_crc = true) {
+  pbam_inflate_settings & settings = pbam_inflate_global();
+  settings.backend = pbam_inflate_available(backend) ?
+    backend : pbam_inflate_default_backend();
+  settings.verify_crc = verify_crc;
+  return(settings.backend);
+}
+
+// CRC32 (as used by gzip) of len bytes of src
+inline uint32_t pbam_crc32(const char * src, const size_t len) {
+#if defined(PBAM_HAVE_LIBDEFLATE)
+  return(libdeflate_crc32(0, src, len));
+#elif defined(PBAM_HAVE_ISAL)
+  return(crc32_gzip_refl(0, (const unsigned char *)src, len));
+#else
+  return(crc32(crc32(0L, NULL, 0L), (const Bytef*)src, len));
+#endif
+}
+
+/*
+  Inflates BGZF blocks using the selected backend.
+  Each object keeps its own decoder state, so use one per thread.
+*/
+class pbam_inflater {
+  private:
+    int backend;
+    bool verify_crc;
+    bool zs_init = false;
+    z_stream zs;
+#ifdef PBAM_HAVE_LIBDEFLATE
+    struct libdeflate_decompressor * ld = NULL;
+#endif
+#ifdef PBAM_HAVE_ISAL
+    struct inflate_state * isal_state = NULL;
+#endif
+
+    int inflate_zlib(const char * src, const size_t src_len, char * dest, const size_t dest_len) {
+      if(!zs_init) {
+        zs.zalloc = NULL; zs.zfree = NULL; zs.opaque = NULL;
+        zs.next_in = NULL; zs.avail_in = 0;
+        int ret = inflateInit2(&zs, -15);
+        if(ret != Z_OK) return(ret);
+        zs_init = true;
+      } else {
+        int ret = inflateReset(&zs);
+        if(ret != Z_OK) return(ret);
+      }
+      zs.next_in = (Bytef*)src;
+      zs.avail_in = src_len;
+      zs.next_out = (Bytef*)dest;
+      zs.avail_out = dest_len;
+      int ret = inflate(&zs, Z_FINISH);
+      if(ret != Z_STREAM_END || zs.avail_out != 0) return(Z_DATA_ERROR);
+      return(Z_OK);
+    };
+
+// Disable copy construction / assignment (doing so triggers compile errors)
+    pbam_inflater(const pbam_inflater &t);
+    pbam_inflater & operator = (const pbam_inflater &t);
+  public:
+    pbam_inflater() {
+      backend = pbam_inflate_global().backend;
+      verify_crc = pbam_inflate_global().verify_crc;
+    };
+    pbam_inflater(const int use_backend, const bool use_verify_crc) {
+      backend = pbam_inflate_available(use_backend) ?
+        use_backend : pbam_inflate_default_backend();
+      verify_crc = use_verify_crc;
+    };
+    ~pbam_inflater() {
+      if(zs_init) inflateEnd(&zs);
+#ifdef PBAM_HAVE_LIBDEFLATE
+      if(ld) libdeflate_free_decompressor(ld);
+#endif
+#ifdef PBAM_HAVE_ISAL
+      if(isal_state) delete isal_state;
+#endif
+    };
+
+    int GetBackend() const { return(backend); };
+
+    /*
+      Inflates src_len bytes of raw deflate data into dest, which must decode
+        to exactly dest_len bytes (the BGZF ISIZE). If CRC checking is on,
+        the result is checked against expected_crc.
+      Returns Z_OK, or a zlib error code if the data is corrupt
+    */
+    int inflate_raw(const char * src, const size_t src_len,
+        char * dest, const size_t dest_len, const uint32_t expected_crc) {
+      int ret = Z_OK;
+      if(dest_len > 0) {
+        switch(backend) {
+#ifdef PBAM_HAVE_LIBDEFLATE
+          case PBAM_INFLATE_LIBDEFLATE: {
+            if(!ld) ld = libdeflate_alloc_decompressor();
+            if(!ld) return(Z_MEM_ERROR);
+            enum libdeflate_result ld_ret = libdeflate_deflate_decompress(
+              ld, src, src_len, dest, dest_len, NULL);
+            if(ld_ret != LIBDEFLATE_SUCCESS) ret = Z_DATA_ERROR;
+            break;
+          }
+#endif
+#ifdef PBAM_HAVE_ISAL
+          case PBAM_INFLATE_ISAL: {
+            if(!isal_state) isal_state = new struct inflate_state;
+            isal_inflate_init(isal_state);
+            isal_state->next_in = (uint8_t *)src;
+            isal_state->avail_in = (uint32_t)src_len;
+            isal_state->next_out = (uint8_t *)dest;
+            isal_state->avail_out = (uint32_t)dest_len;
+            isal_state->crc_flag = ISAL_DEFLATE;
+            int isal_ret = isal_inflate_stateless(isal_state);
+            if(isal_ret != ISAL_DECOMP_OK || isal_state->avail_out != 0) ret = Z_DATA_ERROR;
+            break;
+          }
+#endif
+          default:
+            ret = inflate_zlib(src, src_len, dest, dest_len);
+        }
+        if(ret != Z_OK) return(ret);
+      }
+      if(verify_crc && pbam_crc32(dest, dest_len) != expected_crc) return(Z_DATA_ERROR);
+      return(Z_OK);
+    };
+
+    /*
+      Inflates a whole BGZF block (header, deflate data and footer) of
+        block_len bytes into dest, resizing it to the block's ISIZE.
+      Returns Z_OK, or a zlib error code if the block is corrupt
+    */
+    int inflate_block(const char * block, const size_t block_len, std::string &dest) {
+      if(block_len < 18 + 8 ||
+          memcmp(bamGzipHead, block, bamGzipHeadLength) != 0) {
+        return(Z_BUF_ERROR);
+      }
+      uint32_t crc;
+      uint32_t isize;
+      memcpy(&crc, block + block_len - 8, 4);
+      memcpy(&isize, block + block_len - 4, 4);
+      if(isize > 65536) return(Z_BUF_ERROR);
+      dest.resize(isize);
+      if(isize == 0) return(Z_OK);
+      return(inflate_raw(block + 18, block_len - 18 - 8, &dest[0], isize, crc));
+    };
+};
+
+#endif